@@ -0,0 +1,148 @@
+// Typed alerts posted by sessions and drained in batches by the host.
+#pragma once
+
+#include "endpoint.h"
+#include "include/mpsc.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+enum class AlertType : uint8_t {
+    PieceFinished,
+    FileCompleted,
+    TorrentFinished,
+    PeerConnected,
+    PeerDisconnected,
+    TrackerReply,
+    TrackerError,
+};
+
+// Fixed-size and trivially copyable so posting never allocates.
+struct Alert {
+    AlertType type{};
+    std::chrono::system_clock::time_point when{};
+    std::array<uint8_t, 20> info_hash{};
+    // piece index for PieceFinished, file index for FileCompleted
+    uint32_t index{0};
+    // peers returned for TrackerReply
+    int64_t count{0};
+    // seeds reported for TrackerReply
+    int64_t seeds{-1};
+    // PeerConnected / PeerDisconnected
+    Endpoint peer{};
+    // tracker URL or error text, truncated
+    char message[96]{};
+
+    void set_message(std::string_view text) {
+        std::size_t n = std::min(text.size(), sizeof(message) - 1);
+        std::memcpy(message, text.data(), n);
+        message[n] = '\0';
+    }
+};
+
+inline const char* alert_name(AlertType type) {
+    switch (type) {
+        case AlertType::PieceFinished:
+            return "piece_finished";
+        case AlertType::FileCompleted:
+            return "file_completed";
+        case AlertType::TorrentFinished:
+            return "torrent_finished";
+        case AlertType::PeerConnected:
+            return "peer_connected";
+        case AlertType::PeerDisconnected:
+            return "peer_disconnected";
+        case AlertType::TrackerReply:
+            return "tracker_reply";
+        case AlertType::TrackerError:
+            return "tracker_error";
+    }
+    return "unknown";
+}
+
+// Any number of session and tracker threads post; one host thread drains.
+// Posting is a CAS on the ring plus one counter increment; the eventfd is
+// only written when the queue goes from empty to non-empty, so a burst of
+// alerts costs the host a single wakeup. A full ring drops the alert and
+// counts it rather than stalling the network thread.
+class AlertQueue {
+public:
+    static constexpr std::size_t kCapacity = 8192;
+
+    AlertQueue() : notify_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+    ~AlertQueue() {
+        if (notify_fd_ >= 0) {
+            ::close(notify_fd_);
+        }
+    }
+
+    AlertQueue(const AlertQueue&) = delete;
+    AlertQueue& operator=(const AlertQueue&) = delete;
+
+    // Bit (1 << AlertType) set means that type is posted; all are by default.
+    void set_mask(uint32_t mask) { mask_.store(mask, std::memory_order_relaxed); }
+    bool wants(AlertType type) const {
+        return (mask_.load(std::memory_order_relaxed) & (1u << static_cast<uint32_t>(type))) != 0;
+    }
+
+    void post(Alert alert) {
+        if (!wants(alert.type)) {
+            return;
+        }
+        alert.when = std::chrono::system_clock::now();
+        if (!ring_.enqueue(alert)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (pending_.fetch_add(1, std::memory_order_acq_rel) == 0 && notify_fd_ >= 0) {
+            uint64_t one = 1;
+            ssize_t n = ::write(notify_fd_, &one, sizeof(one));
+            (void)n;
+        }
+    }
+
+    // Consumer only: appends up to max alerts and returns how many.
+    std::size_t pop(std::vector<Alert>& out, std::size_t max = kCapacity) {
+        if (notify_fd_ >= 0) {
+            uint64_t count = 0;
+            ssize_t n = ::read(notify_fd_, &count, sizeof(count));
+            (void)n;
+        }
+        std::size_t popped = 0;
+        while (popped < max) {
+            auto alert = ring_.dequeue();
+            if (!alert) {
+                break;
+            }
+            out.push_back(*alert);
+            ++popped;
+        }
+        if (popped > 0 &&
+            pending_.fetch_sub(popped, std::memory_order_acq_rel) != popped && notify_fd_ >= 0) {
+            // more arrived (or were left behind by max); stay readable
+            uint64_t one = 1;
+            ssize_t n = ::write(notify_fd_, &one, sizeof(one));
+            (void)n;
+        }
+        return popped;
+    }
+
+    // Readable while alerts are pending; for poll/epoll in the host loop.
+    int notify_fd() const { return notify_fd_; }
+    std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    MpscQueue<Alert, kCapacity> ring_;
+    std::atomic<std::size_t> pending_{0};
+    std::atomic<std::uint64_t> dropped_{0};
+    std::atomic<uint32_t> mask_{~0u};
+    int notify_fd_{-1};
+};
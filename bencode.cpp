@@ -1,5 +1,6 @@
 #include "bencode.h"
 
+#include <algorithm>
 #include <cctype>
 #include <charconv>
 #include <sstream>
@@ -27,6 +28,11 @@ Value Parser::parse() {
     return v;
 }
 
+Value Parser::parse_prefix(size_t& end) {
+    end = 0;
+    return parse_value(end);
+}
+
 char Parser::peek(size_t pos) const {
     if (pos >= input_.size()) {
         fail("Unexpected end of input", pos);
@@ -124,6 +130,386 @@ Value Parser::parse_dict(size_t& pos) {
     return Value{out};
 }
 
+Document::Document(std::string_view input) : input_(input) {
+    size_t pos = 0;
+    parse_value(pos, 0);
+    if (pos != input_.size()) {
+        fail("Trailing data after valid bencode", pos);
+    }
+    item_stack_ = {};
+    member_stack_ = {};
+}
+
+Document::Document(std::string_view input, size_t& end) : input_(input) {
+    end = 0;
+    parse_value(end, 0);
+    item_stack_ = {};
+    member_stack_ = {};
+}
+
+char Document::peek(size_t pos) const {
+    if (pos >= input_.size()) {
+        fail("Unexpected end of input", pos);
+    }
+    return input_[pos];
+}
+
+[[noreturn]] void Document::fail(std::string_view message, size_t pos) const {
+    std::ostringstream oss;
+    oss << "Bencode parse error at offset " << pos << ": " << message;
+    throw std::runtime_error(oss.str());
+}
+
+size_t Document::parse_string(size_t& pos) {
+    size_t len_start = pos;
+    while (std::isdigit(static_cast<unsigned char>(peek(pos)))) {
+        ++pos;
+    }
+    if (pos == len_start) {
+        fail("String length expected", pos);
+    }
+    if (peek(pos) != ':') {
+        fail("Missing ':' after string length", pos);
+    }
+    int64_t len = parse_int64(input_.substr(len_start, pos - len_start));
+    ++pos;
+    if (len < 0 || static_cast<uint64_t>(len) > input_.size() - pos) {
+        fail("String extends past end of input", pos);
+    }
+    size_t start = pos;
+    pos += static_cast<size_t>(len);
+    return start;
+}
+
+// Children are parsed before their container's range is known, so they
+// collect on a stack and are copied out contiguously when it closes.
+uint32_t Document::parse_value(size_t& pos, unsigned depth) {
+    if (depth > kMaxDepth) {
+        fail("Nesting too deep", pos);
+    }
+    auto index = static_cast<uint32_t>(nodes_.size());
+    nodes_.emplace_back();
+    Node node;
+    node.begin = pos;
+    char c = peek(pos);
+    if (c == 'i') {
+        size_t start = ++pos;
+        if (peek(pos) == '-') ++pos;
+        if (!std::isdigit(static_cast<unsigned char>(peek(pos)))) {
+            fail("Integer must have digits", pos);
+        }
+        while (std::isdigit(static_cast<unsigned char>(peek(pos)))) ++pos;
+        if (peek(pos) != 'e') {
+            fail("Expected 'e'", pos);
+        }
+        node.integer = parse_int64(input_.substr(start, pos - start));
+        ++pos;
+    } else if (std::isdigit(static_cast<unsigned char>(c))) {
+        node.kind = Kind::String;
+        node.integer = static_cast<int64_t>(parse_string(pos));
+    } else if (c == 'l') {
+        node.kind = Kind::List;
+        ++pos;
+        size_t mark = item_stack_.size();
+        while (peek(pos) != 'e') {
+            uint32_t child = parse_value(pos, depth + 1);
+            item_stack_.push_back(child);
+        }
+        ++pos;
+        node.first = static_cast<uint32_t>(items_.size());
+        node.count = static_cast<uint32_t>(item_stack_.size() - mark);
+        items_.insert(items_.end(), item_stack_.begin() + static_cast<std::ptrdiff_t>(mark),
+                      item_stack_.end());
+        item_stack_.resize(mark);
+    } else if (c == 'd') {
+        node.kind = Kind::Dict;
+        ++pos;
+        size_t mark = member_stack_.size();
+        while (peek(pos) != 'e') {
+            size_t key_start = parse_string(pos);
+            std::string_view key = input_.substr(key_start, pos - key_start);
+            uint32_t value = parse_value(pos, depth + 1);
+            member_stack_.push_back(Member{key, value});
+        }
+        ++pos;
+        auto first = member_stack_.begin() + static_cast<std::ptrdiff_t>(mark);
+        auto by_key = [](const Member& a, const Member& b) { return a.key < b.key; };
+        // canonical input is sorted already; on duplicates the first wins,
+        // as with Parser
+        if (!std::is_sorted(first, member_stack_.end(), by_key)) {
+            std::stable_sort(first, member_stack_.end(), by_key);
+        }
+        node.first = static_cast<uint32_t>(members_.size());
+        node.count = static_cast<uint32_t>(member_stack_.size() - mark);
+        members_.insert(members_.end(), first, member_stack_.end());
+        member_stack_.resize(mark);
+    } else {
+        fail("Unexpected token", pos);
+    }
+    node.end = pos;
+    nodes_[index] = node;
+    return index;
+}
+
+bool View::is_int() const {
+    return doc_ && doc_->nodes_[node_].kind == Document::Kind::Int;
+}
+
+bool View::is_string() const {
+    return doc_ && doc_->nodes_[node_].kind == Document::Kind::String;
+}
+
+bool View::is_list() const {
+    return doc_ && doc_->nodes_[node_].kind == Document::Kind::List;
+}
+
+bool View::is_dict() const {
+    return doc_ && doc_->nodes_[node_].kind == Document::Kind::Dict;
+}
+
+int64_t View::as_int() const {
+    if (!is_int()) throw std::runtime_error("Value is not an integer");
+    return doc_->nodes_[node_].integer;
+}
+
+std::string_view View::as_string() const {
+    if (!is_string()) throw std::runtime_error("Value is not a string");
+    const auto& n = doc_->nodes_[node_];
+    auto start = static_cast<size_t>(n.integer);
+    return doc_->input_.substr(start, n.end - start);
+}
+
+size_t View::size() const {
+    if (!is_list() && !is_dict()) throw std::runtime_error("Value is not a list or dict");
+    return doc_->nodes_[node_].count;
+}
+
+View View::at(size_t i) const {
+    if (!is_list()) throw std::runtime_error("Value is not a list");
+    const auto& n = doc_->nodes_[node_];
+    if (i >= n.count) throw std::out_of_range("List index out of range");
+    return View(doc_, doc_->items_[n.first + i]);
+}
+
+std::string_view View::key_at(size_t i) const {
+    if (!is_dict()) throw std::runtime_error("Value is not a dict");
+    const auto& n = doc_->nodes_[node_];
+    if (i >= n.count) throw std::out_of_range("Dict index out of range");
+    return doc_->members_[n.first + i].key;
+}
+
+View View::value_at(size_t i) const {
+    if (!is_dict()) throw std::runtime_error("Value is not a dict");
+    const auto& n = doc_->nodes_[node_];
+    if (i >= n.count) throw std::out_of_range("Dict index out of range");
+    return View(doc_, doc_->members_[n.first + i].value);
+}
+
+View View::find(std::string_view key) const {
+    if (!is_dict()) throw std::runtime_error("Value is not a dict");
+    const auto& n = doc_->nodes_[node_];
+    auto first = doc_->members_.begin() + n.first;
+    auto last = first + n.count;
+    auto it = std::lower_bound(first, last, key, [](const Document::Member& m,
+                                                    std::string_view k) { return m.key < k; });
+    if (it == last || it->key != key) {
+        return {};
+    }
+    return View(doc_, it->value);
+}
+
+View View::require(std::string_view key) const {
+    if (View v = find(key)) {
+        return v;
+    }
+    throw std::runtime_error("Missing required field: " + std::string(key));
+}
+
+std::string_view View::raw() const {
+    if (!doc_) {
+        return {};
+    }
+    const auto& n = doc_->nodes_[node_];
+    return doc_->input_.substr(n.begin, n.end - n.begin);
+}
+
+[[noreturn]] void Reader::fail(std::string_view message, size_t pos) const {
+    std::ostringstream oss;
+    oss << "Bencode parse error at offset " << pos << ": " << message;
+    throw std::runtime_error(oss.str());
+}
+
+// A completed value flips its dict between key and value.
+void Reader::end_value() {
+    if (depth_ == 0) {
+        return;
+    }
+    Frame& f = frames_[depth_ - 1];
+    if (f == kDictKey) {
+        f = kDictValue;
+    } else if (f == kDictValue) {
+        f = kDictKey;
+    }
+}
+
+// Nothing is consumed until a whole token is there, so after NeedMore the
+// same call picks up where it left off.
+Reader::Token Reader::next() {
+    if (done()) {
+        return Token::Done;
+    }
+    if (pos_ >= input_.size()) {
+        return Token::NeedMore;
+    }
+    char c = input_[pos_];
+    bool is_digit = std::isdigit(static_cast<unsigned char>(c));
+    if (depth_ > 0 && frames_[depth_ - 1] == kDictKey && !is_digit && c != 'e') {
+        fail("Dict key must be a string", pos_);
+    }
+    if (c == 'e') {
+        if (depth_ == 0) {
+            fail("Unexpected token", pos_);
+        }
+        if (frames_[depth_ - 1] == kDictValue) {
+            fail("Dict key without a value", pos_);
+        }
+        ++pos_;
+        --depth_;
+        end_value();
+        return Token::End;
+    }
+    if (c == 'l' || c == 'd') {
+        if (depth_ == kMaxDepth) {
+            fail("Nesting too deep", pos_);
+        }
+        frames_[depth_++] = c == 'l' ? kList : kDictKey;
+        ++pos_;
+        started_ = true;
+        return c == 'l' ? Token::List : Token::Dict;
+    }
+    size_t p = pos_;
+    if (c == 'i') {
+        size_t start = ++p;
+        if (p < input_.size() && input_[p] == '-') ++p;
+        while (p < input_.size() && std::isdigit(static_cast<unsigned char>(input_[p]))) ++p;
+        if (p >= input_.size()) {
+            return Token::NeedMore;
+        }
+        if (input_[p] != 'e') {
+            fail("Expected 'e'", p);
+        }
+        integer_ = parse_int64(input_.substr(start, p - start));
+        pos_ = p + 1;
+        started_ = true;
+        end_value();
+        return Token::Int;
+    }
+    if (!is_digit) {
+        fail("Unexpected token", pos_);
+    }
+    while (p < input_.size() && std::isdigit(static_cast<unsigned char>(input_[p]))) ++p;
+    if (p >= input_.size()) {
+        return Token::NeedMore;
+    }
+    if (input_[p] != ':') {
+        fail("Missing ':' after string length", p);
+    }
+    int64_t len = parse_int64(input_.substr(pos_, p - pos_));
+    ++p;
+    if (static_cast<uint64_t>(len) > input_.size() - p) {
+        return Token::NeedMore;
+    }
+    string_begin_ = p;
+    string_len_ = static_cast<size_t>(len);
+    pos_ = p + string_len_;
+    started_ = true;
+    end_value();
+    return Token::String;
+}
+
+Reader::Token Reader::next_value() {
+    Token t = next();
+    if (t == Token::NeedMore || t == Token::Done) {
+        fail("Unexpected end of input", pos_);
+    }
+    if (t == Token::End) {
+        fail("Expected a value", pos_ - 1);
+    }
+    return t;
+}
+
+void Reader::skip(Token t) {
+    if (t != Token::List && t != Token::Dict) {
+        return;
+    }
+    size_t depth = depth_ - 1;
+    while (depth_ > depth) {
+        Token n = next();
+        if (n == Token::NeedMore) {
+            fail("Unexpected end of input", pos_);
+        }
+    }
+}
+
+bool Reader::next_key(std::string_view& key) {
+    Token t = next();
+    if (t == Token::End) {
+        return false;
+    }
+    if (t != Token::String || depth_ == 0 || frames_[depth_ - 1] != kDictValue) {
+        fail("Expected a dict key", pos_);
+    }
+    key = string();
+    return true;
+}
+
+bool Reader::next_item() {
+    if (pos_ >= input_.size()) {
+        fail("Unexpected end of input", pos_);
+    }
+    if (input_[pos_] != 'e') {
+        return true;
+    }
+    next();
+    return false;
+}
+
+std::optional<int64_t> Reader::read_int() {
+    Token t = next_value();
+    if (t == Token::Int) {
+        return integer_;
+    }
+    skip(t);
+    return std::nullopt;
+}
+
+std::optional<std::string_view> Reader::read_string() {
+    Token t = next_value();
+    if (t == Token::String) {
+        return string();
+    }
+    skip(t);
+    return std::nullopt;
+}
+
+bool Reader::enter_dict() {
+    Token t = next_value();
+    if (t == Token::Dict) {
+        return true;
+    }
+    skip(t);
+    return false;
+}
+
+bool Reader::enter_list() {
+    Token t = next_value();
+    if (t == Token::List) {
+        return true;
+    }
+    skip(t);
+    return false;
+}
+
 int64_t as_int(const Value& v) {
     if (auto p = std::get_if<int64_t>(&v.data)) return *p;
     throw std::runtime_error("Value is not an integer");
@@ -156,4 +542,39 @@ const Value* find_field(const Dict& dict, std::string_view key) {
     return nullptr;
 }
 
+static void encode_string(std::string& out, std::string_view s) {
+    out += std::to_string(s.size());
+    out.push_back(':');
+    out.append(s);
+}
+
+void encode_to(std::string& out, const Value& v) {
+    if (auto p = std::get_if<int64_t>(&v.data)) {
+        out.push_back('i');
+        out += std::to_string(*p);
+        out.push_back('e');
+    } else if (auto p = std::get_if<std::string>(&v.data)) {
+        encode_string(out, *p);
+    } else if (auto p = std::get_if<List>(&v.data)) {
+        out.push_back('l');
+        for (const auto& item : *p) {
+            encode_to(out, item);
+        }
+        out.push_back('e');
+    } else {
+        out.push_back('d');
+        for (const auto& [key, value] : std::get<Dict>(v.data)) {
+            encode_string(out, key);
+            encode_to(out, value);
+        }
+        out.push_back('e');
+    }
+}
+
+std::string encode(const Value& v) {
+    std::string out;
+    encode_to(out, v);
+    return out;
+}
+
 }  // namespace bencode
@@ -1,6 +1,9 @@
 // Simple bencode representation and parser.
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <map>
 #include <optional>
 #include <stdexcept>
@@ -25,6 +28,9 @@ namespace bencode {
         explicit Parser(std::string input, std::optional<std::string> track_key = std::nullopt);
 
         Value parse();
+        // Parses the value at the start of the input and sets end to the
+        // offset just past it; whatever follows is left to the caller.
+        Value parse_prefix(size_t& end);
 
         std::optional<std::pair<size_t, size_t>> tracked_span() const { return tracked_span_; }
 
@@ -44,10 +50,160 @@ namespace bencode {
         std::optional<std::pair<size_t, size_t>> tracked_span_;
     };
 
+    class Document;
+
+    // A value inside a Document: a pointer and an index, cheap to copy.
+    // Default-constructed, or returned by find for a missing key, it is
+    // empty and tests false.
+    class View {
+    public:
+        View() = default;
+
+        explicit operator bool() const { return doc_ != nullptr; }
+        bool is_int() const;
+        bool is_string() const;
+        bool is_list() const;
+        bool is_dict() const;
+
+        // Throw like the Value accessors when the type is wrong.
+        int64_t as_int() const;
+        std::string_view as_string() const;
+        // Items of a list or entries of a dict.
+        size_t size() const;
+        View at(size_t i) const;
+        std::string_view key_at(size_t i) const;
+        View value_at(size_t i) const;
+        // Dict lookup; empty when the key is absent.
+        View find(std::string_view key) const;
+        View require(std::string_view key) const;
+        // The value's own encoding, e.g. the info dict for hashing.
+        std::string_view raw() const;
+
+    private:
+        friend class Document;
+        View(const Document* doc, uint32_t node) : doc_(doc), node_(node) {}
+
+        const Document* doc_{nullptr};
+        uint32_t node_{0};
+    };
+
+    // Zero-copy counterpart of Parser: strings are views into the input and
+    // lists and dicts are ranges of flat arrays, so a parse makes a handful
+    // of allocations however large the input. The input must outlive the
+    // Document and every View taken from it.
+    class Document {
+    public:
+        explicit Document(std::string_view input);
+        // Like Parser::parse_prefix: end is set just past the first value.
+        Document(std::string_view input, size_t& end);
+
+        Document(const Document&) = delete;
+        Document& operator=(const Document&) = delete;
+
+        View root() const { return View(this, 0); }
+
+    private:
+        friend class View;
+
+        enum class Kind : uint8_t { Int, String, List, Dict };
+
+        struct Node {
+            Kind kind{Kind::Int};
+            // List: items_ range. Dict: members_ range.
+            uint32_t first{0};
+            uint32_t count{0};
+            // Int: the value. String: where its bytes start.
+            int64_t integer{0};
+            // the whole encoding
+            size_t begin{0};
+            size_t end{0};
+        };
+
+        struct Member {
+            std::string_view key;
+            uint32_t value{0};
+        };
+
+        uint32_t parse_value(size_t& pos, unsigned depth);
+        // Leaves pos past the string and returns where its bytes start.
+        size_t parse_string(size_t& pos);
+        char peek(size_t pos) const;
+        [[noreturn]] void fail(std::string_view message, size_t pos) const;
+
+        static constexpr unsigned kMaxDepth = 256;
+
+        std::string_view input_;
+        std::vector<Node> nodes_;
+        std::vector<uint32_t> items_;
+        // sorted by key within each dict
+        std::vector<Member> members_;
+        // open containers' children, moved into items_ / members_ on close
+        // so each container's range is contiguous
+        std::vector<uint32_t> item_stack_;
+        std::vector<Member> member_stack_;
+    };
+
+    // Pull reader for bencode that may still be arriving: next() yields one
+    // token at a time, never allocates, and returns NeedMore instead of
+    // failing when the input stops mid-token. Malformed input throws.
+    class Reader {
+    public:
+        enum class Token : uint8_t { Int, String, List, Dict, End, Done, NeedMore };
+
+        explicit Reader(std::string_view input) : input_(input) {}
+        // The bytes seen so far plus those that arrived since; the buffer
+        // may have moved.
+        void set_input(std::string_view input) { input_ = input; }
+
+        Token next();
+        // The last Int or String token; the string views the input.
+        int64_t integer() const { return integer_; }
+        std::string_view string() const { return input_.substr(string_begin_, string_len_); }
+        // Just past the last token, or the whole value once done().
+        size_t offset() const { return pos_; }
+        bool done() const { return started_ && depth_ == 0; }
+
+        // Helpers for input that is all there: running out throws.
+        Token next_value();
+        // Consumes the rest of a value whose first token was t.
+        void skip(Token t);
+        void skip() { skip(next_value()); }
+        // The next key of the dict being read, false past its end.
+        bool next_key(std::string_view& key);
+        // Whether the list being read has another item; consumes its end.
+        bool next_item();
+        // Read the next value when it has the type, otherwise skip it.
+        std::optional<int64_t> read_int();
+        std::optional<std::string_view> read_string();
+        bool enter_dict();
+        bool enter_list();
+
+    private:
+        enum Frame : uint8_t { kList, kDictKey, kDictValue };
+
+        void end_value();
+        [[noreturn]] void fail(std::string_view message, size_t pos) const;
+
+        static constexpr size_t kMaxDepth = 256;
+
+        std::string_view input_;
+        size_t pos_{0};
+        bool started_{false};
+        size_t depth_{0};
+        std::array<Frame, kMaxDepth> frames_{};
+        int64_t integer_{0};
+        size_t string_begin_{0};
+        size_t string_len_{0};
+    };
+
     int64_t as_int(const Value& v);
     const std::string& as_string(const Value& v);
     const List& as_list(const Value& v);
     const Dict& as_dict(const Value& v);
     const Value& require_field(const Dict& dict, std::string_view key);
     const Value* find_field(const Dict& dict, std::string_view key);
+
+    // Dict keys come out in byte order, so the result is canonical.
+    std::string encode(const Value& v);
+    void encode_to(std::string& out, const Value& v);
 } // namespace bencode
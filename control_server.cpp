@@ -0,0 +1,596 @@
+#include "control_server.h"
+
+#include "memory_governor.h"
+#include "torrent_file.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+constexpr std::size_t kMaxRequestLine = 64 * 1024;
+
+// Flat objects only: {"key": "string" | number | true | false | null, ...}.
+// Values come back as their text, strings unescaped.
+std::optional<std::map<std::string, std::string>> parse_object(const std::string& s) {
+    std::map<std::string, std::string> out;
+    std::size_t i = 0;
+    auto skip_ws = [&] {
+        while (i < s.size() && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' || s[i] == '\n')) {
+            ++i;
+        }
+    };
+    auto parse_string = [&](std::string& str) -> bool {
+        if (i >= s.size() || s[i] != '"') {
+            return false;
+        }
+        ++i;
+        while (i < s.size() && s[i] != '"') {
+            char c = s[i++];
+            if (c == '\\') {
+                if (i >= s.size()) {
+                    return false;
+                }
+                char e = s[i++];
+                switch (e) {
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case 'r': c = '\r'; break;
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'u': return false;
+                    default: c = e; break;
+                }
+            }
+            str.push_back(c);
+        }
+        if (i >= s.size()) {
+            return false;
+        }
+        ++i;
+        return true;
+    };
+
+    skip_ws();
+    if (i >= s.size() || s[i] != '{') {
+        return std::nullopt;
+    }
+    ++i;
+    skip_ws();
+    if (i < s.size() && s[i] == '}') {
+        return out;
+    }
+    for (;;) {
+        skip_ws();
+        std::string key;
+        if (!parse_string(key)) {
+            return std::nullopt;
+        }
+        skip_ws();
+        if (i >= s.size() || s[i] != ':') {
+            return std::nullopt;
+        }
+        ++i;
+        skip_ws();
+        std::string value;
+        if (i < s.size() && s[i] == '"') {
+            if (!parse_string(value)) {
+                return std::nullopt;
+            }
+        } else {
+            while (i < s.size() && s[i] != ',' && s[i] != '}' && s[i] != ' ') {
+                value.push_back(s[i++]);
+            }
+            if (value.empty()) {
+                return std::nullopt;
+            }
+        }
+        out[key] = std::move(value);
+        skip_ws();
+        if (i < s.size() && s[i] == ',') {
+            ++i;
+            continue;
+        }
+        if (i < s.size() && s[i] == '}') {
+            return out;
+        }
+        return std::nullopt;
+    }
+}
+
+std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out.push_back(c);
+                }
+        }
+    }
+    out.push_back('"');
+    return out;
+}
+
+std::string error_json(const std::string& msg) {
+    return "{\"ok\":false,\"error\":" + json_string(msg) + "}";
+}
+
+std::optional<std::size_t> get_size(const std::map<std::string, std::string>& req,
+                                    const std::string& key) {
+    auto it = req.find(key);
+    if (it == req.end()) {
+        return std::nullopt;
+    }
+    try {
+        std::size_t pos = 0;
+        unsigned long long v = std::stoull(it->second, &pos);
+        if (pos != it->second.size()) {
+            return std::nullopt;
+        }
+        return static_cast<std::size_t>(v);
+    } catch (...) {
+        return std::nullopt;
+    }
+}
+
+bool get_bool(const std::map<std::string, std::string>& req, const std::string& key,
+              bool fallback) {
+    auto it = req.find(key);
+    if (it == req.end()) {
+        return fallback;
+    }
+    return it->second == "true" || it->second == "1";
+}
+
+bool has_torrent_extension(const std::filesystem::path& p) {
+    return p.extension() == ".torrent";
+}
+
+} // namespace
+
+ControlServer::ControlServer(TorrentQueue& queue, TorrentQueue::AddOptions defaults,
+                             AlertQueue* alerts)
+    : queue_(queue), defaults_(std::move(defaults)), alerts_(alerts) {
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd_ < 0) {
+        throw std::runtime_error("eventfd failed for control server");
+    }
+}
+
+ControlServer::~ControlServer() {
+    stop();
+    for (auto& kv : clients_) {
+        ::close(kv.first);
+    }
+    if (listen_fd_ >= 0) {
+        ::close(listen_fd_);
+        // after a hot restart the path belongs to our successor's socket
+        struct stat st {};
+        if (::stat(socket_path_.c_str(), &st) == 0 && st.st_ino == socket_inode_) {
+            ::unlink(socket_path_.c_str());
+        }
+    }
+    if (inotify_fd_ >= 0) {
+        ::close(inotify_fd_);
+    }
+    ::close(wake_fd_);
+}
+
+void ControlServer::listen(const std::filesystem::path& socket_path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::string path = socket_path.string();
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("control socket path too long: " + path);
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error("failed to create control socket");
+    }
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        ::listen(fd, 16) < 0) {
+        ::close(fd);
+        throw std::runtime_error("failed to bind control socket " + path + ": " +
+                                 std::strerror(errno));
+    }
+    listen_fd_ = fd;
+    socket_path_ = socket_path;
+    struct stat st {};
+    if (::stat(path.c_str(), &st) == 0) {
+        socket_inode_ = st.st_ino;
+    }
+}
+
+void ControlServer::watch_directory(const std::filesystem::path& dir) {
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0 ||
+        inotify_add_watch(inotify_fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        throw std::runtime_error("failed to watch directory " + dir.string());
+    }
+    watch_dir_ = dir;
+    // inotify only reports what happens from here on
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.is_regular_file() && has_torrent_extension(entry.path())) {
+            add_watched(entry.path());
+        }
+    }
+}
+
+void ControlServer::start() {
+    if (running_.exchange(true)) {
+        return;
+    }
+    logger_.start();
+    worker_ = std::thread([this] { run(); });
+}
+
+void ControlServer::stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t n = ::write(wake_fd_, &one, sizeof(one));
+    (void)n;
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+    logger_.stop();
+}
+
+void ControlServer::run() {
+    std::vector<pollfd> fds;
+    while (running_.load()) {
+        fds.clear();
+        fds.push_back({wake_fd_, POLLIN, 0});
+        if (listen_fd_ >= 0) {
+            fds.push_back({listen_fd_, POLLIN, 0});
+        }
+        if (inotify_fd_ >= 0) {
+            fds.push_back({inotify_fd_, POLLIN, 0});
+        }
+        for (const auto& [fd, client] : clients_) {
+            short events = POLLIN;
+            if (!client.out.empty()) {
+                events |= POLLOUT;
+            }
+            fds.push_back({fd, events, 0});
+        }
+
+        int n = ::poll(fds.data(), fds.size(), -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger_.error("control server poll failed");
+            return;
+        }
+
+        for (const auto& p : fds) {
+            if (p.revents == 0) {
+                continue;
+            }
+            if (p.fd == wake_fd_) {
+                continue;
+            }
+            if (p.fd == listen_fd_) {
+                accept_clients();
+                continue;
+            }
+            if (p.fd == inotify_fd_) {
+                drain_inotify();
+                continue;
+            }
+            auto it = clients_.find(p.fd);
+            if (it == clients_.end()) {
+                continue;
+            }
+            if (p.revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_client(p.fd, it->second);
+            }
+            it = clients_.find(p.fd);
+            if (it != clients_.end() && !it->second.out.empty()) {
+                write_client(p.fd, it->second);
+            }
+        }
+    }
+}
+
+void ControlServer::accept_clients() {
+    for (;;) {
+        int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        clients_.emplace(fd, Client{});
+    }
+}
+
+void ControlServer::read_client(int fd, Client& client) {
+    char buf[4096];
+    for (;;) {
+        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            ::close(fd);
+            clients_.erase(fd);
+            return;
+        }
+        client.in.append(buf, static_cast<std::size_t>(n));
+    }
+
+    std::size_t start = 0;
+    for (;;) {
+        std::size_t nl = client.in.find('\n', start);
+        if (nl == std::string::npos) {
+            break;
+        }
+        std::string line = client.in.substr(start, nl - start);
+        start = nl + 1;
+        if (line.empty() || line == "\r") {
+            continue;
+        }
+        if (handoff_handler_) {
+            auto req = parse_object(line);
+            if (req && (*req)["cmd"] == "handoff") {
+                int flags = fcntl(fd, F_GETFL, 0);
+                fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+                handoff_handler_(fd);
+                ::close(fd);
+                clients_.erase(fd);
+                return;
+            }
+        }
+        client.out += handle(line);
+        client.out.push_back('\n');
+    }
+    client.in.erase(0, start);
+    if (client.in.size() > kMaxRequestLine) {
+        ::close(fd);
+        clients_.erase(fd);
+    }
+}
+
+void ControlServer::write_client(int fd, Client& client) {
+    while (!client.out.empty()) {
+        ssize_t n = ::send(fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            ::close(fd);
+            clients_.erase(fd);
+            return;
+        }
+        client.out.erase(0, static_cast<std::size_t>(n));
+    }
+}
+
+void ControlServer::drain_inotify() {
+    alignas(inotify_event) char buf[4096];
+    for (;;) {
+        ssize_t n = ::read(inotify_fd_, buf, sizeof(buf));
+        if (n <= 0) {
+            return;
+        }
+        for (char* p = buf; p < buf + n;) {
+            auto* ev = reinterpret_cast<inotify_event*>(p);
+            if (ev->len > 0) {
+                std::filesystem::path path = watch_dir_ / ev->name;
+                if (has_torrent_extension(path)) {
+                    add_watched(path);
+                }
+            }
+            p += sizeof(inotify_event) + ev->len;
+        }
+    }
+}
+
+void ControlServer::add_watched(const std::filesystem::path& path) {
+    if (!watched_.insert(path).second) {
+        return;
+    }
+    try {
+        std::size_t id = queue_.add(TorrentFile::load(path), defaults_);
+        logger_.info("watch folder added torrent " + std::to_string(id) + ": " + path.string());
+    } catch (const std::exception& ex) {
+        // a half-written file is retried on its next close
+        watched_.erase(path);
+        logger_.warn("watch folder skipped " + path.string() + ": " + ex.what());
+    }
+}
+
+std::string ControlServer::handle(const std::string& line) {
+    auto req = parse_object(line);
+    if (!req) {
+        return error_json("malformed request");
+    }
+    auto cmd_it = req->find("cmd");
+    if (cmd_it == req->end()) {
+        return error_json("missing cmd");
+    }
+    const std::string& cmd = cmd_it->second;
+
+    if (cmd == "stats") {
+        return stats_json();
+    }
+    if (cmd == "alerts") {
+        return alerts_json(get_size(*req, "max").value_or(256));
+    }
+    if (cmd == "add") {
+        auto path = req->find("path");
+        auto magnet = req->find("magnet");
+        if (path == req->end() && magnet == req->end()) {
+            return error_json("missing path or magnet");
+        }
+        TorrentQueue::AddOptions options = defaults_;
+        options.recheck = get_bool(*req, "recheck", options.recheck);
+        options.super_seed = get_bool(*req, "super_seed", options.super_seed);
+        try {
+            std::size_t id = path != req->end()
+                                 ? queue_.add(TorrentFile::load(path->second), options)
+                                 : queue_.add_magnet(MagnetLink::parse(magnet->second), options);
+            return "{\"ok\":true,\"id\":" + std::to_string(id) + "}";
+        } catch (const std::exception& ex) {
+            return error_json(ex.what());
+        }
+    }
+    if (cmd == "remove" || cmd == "pause" || cmd == "resume" || cmd == "move") {
+        auto id = get_size(*req, "id");
+        if (!id) {
+            return error_json("missing id");
+        }
+        bool ok = false;
+        if (cmd == "remove") {
+            ok = queue_.remove(*id);
+        } else if (cmd == "pause") {
+            ok = queue_.pause(*id);
+        } else if (cmd == "resume") {
+            ok = queue_.resume(*id);
+        } else {
+            auto position = get_size(*req, "position");
+            if (!position) {
+                return error_json("missing position");
+            }
+            ok = queue_.set_queue_position(*id, *position);
+        }
+        return ok ? "{\"ok\":true}" : error_json("no such torrent");
+    }
+    if (cmd == "limits") {
+        TorrentQueue::Limits limits = queue_.limits();
+        if (auto v = get_size(*req, "active_downloads")) {
+            limits.active_downloads = *v;
+        }
+        if (auto v = get_size(*req, "active_seeds")) {
+            limits.active_seeds = *v;
+        }
+        if (auto v = get_size(*req, "stall_timeout")) {
+            limits.stall_timeout = std::chrono::seconds(*v);
+        }
+        if (auto v = get_size(*req, "download_rate")) {
+            limits.download_rate = *v;
+        }
+        if (auto v = get_size(*req, "upload_rate")) {
+            limits.upload_rate = *v;
+        }
+        if (auto v = get_size(*req, "memory_limit")) {
+            memory_governor().set_total_budget(*v);
+        }
+        queue_.set_limits(limits);
+        return "{\"ok\":true,\"limits\":{\"active_downloads\":" +
+               std::to_string(limits.active_downloads) +
+               ",\"active_seeds\":" + std::to_string(limits.active_seeds) +
+               ",\"stall_timeout\":" + std::to_string(limits.stall_timeout.count()) +
+               ",\"download_rate\":" + std::to_string(limits.download_rate) +
+               ",\"upload_rate\":" + std::to_string(limits.upload_rate) +
+               ",\"memory_limit\":" + std::to_string(memory_governor().total_budget()) + "}}";
+    }
+    return error_json("unknown cmd: " + cmd);
+}
+
+std::string ControlServer::alerts_json(std::size_t max) {
+    if (!alerts_) {
+        return error_json("alerts are not enabled");
+    }
+    alert_batch_.clear();
+    alerts_->pop(alert_batch_, max);
+    std::string out = "{\"ok\":true,\"alerts\":[";
+    for (std::size_t i = 0; i < alert_batch_.size(); ++i) {
+        const Alert& a = alert_batch_[i];
+        if (i > 0) {
+            out.push_back(',');
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      a.when.time_since_epoch())
+                      .count();
+        char hash[41];
+        for (std::size_t b = 0; b < a.info_hash.size(); ++b) {
+            std::snprintf(hash + 2 * b, 3, "%02x", a.info_hash[b]);
+        }
+        out += "{\"type\":" + json_string(alert_name(a.type)) +
+               ",\"time_ms\":" + std::to_string(ms) +
+               ",\"info_hash\":" + json_string(hash);
+        switch (a.type) {
+            case AlertType::PieceFinished:
+            case AlertType::FileCompleted:
+                out += ",\"index\":" + std::to_string(a.index);
+                break;
+            case AlertType::PeerConnected:
+            case AlertType::PeerDisconnected:
+                out += ",\"peer\":" +
+                       json_string(a.peer.ip_string() + ":" + std::to_string(a.peer.port));
+                break;
+            case AlertType::TrackerReply:
+                out += ",\"peers\":" + std::to_string(a.count) +
+                       ",\"seeds\":" + std::to_string(a.seeds) +
+                       ",\"url\":" + json_string(a.message);
+                break;
+            case AlertType::TrackerError:
+                out += ",\"error\":" + json_string(a.message);
+                break;
+            case AlertType::TorrentFinished:
+                break;
+        }
+        out.push_back('}');
+    }
+    out += "],\"dropped\":" + std::to_string(alerts_->dropped()) + "}";
+    return out;
+}
+
+std::string ControlServer::stats_json() const {
+    auto snap = queue_.snapshot();
+    std::string out = "{\"ok\":true,\"torrents\":[";
+    bool first = true;
+    for (const auto& st : *snap) {
+        if (!first) {
+            out.push_back(',');
+        }
+        first = false;
+        out += "{\"id\":" + std::to_string(st.id) +
+               ",\"position\":" + std::to_string(st.position) +
+               ",\"name\":" + json_string(st.name) +
+               ",\"info_hash\":" + json_string(st.info_hash) +
+               ",\"state\":" + json_string(st.state) +
+               ",\"pieces_done\":" + std::to_string(st.pieces_done) +
+               ",\"pieces_total\":" + std::to_string(st.pieces_total) +
+               ",\"size\":" + std::to_string(st.size) +
+               ",\"downloaded\":" + std::to_string(st.downloaded) +
+               ",\"uploaded\":" + std::to_string(st.uploaded) +
+               ",\"peers\":" + std::to_string(st.peers) +
+               ",\"swarm_seeds\":" + std::to_string(st.swarm_seeds);
+        if (!st.error.empty()) {
+            out += ",\"error\":" + json_string(st.error);
+        }
+        out.push_back('}');
+    }
+    out += "],\"memory_used\":" + std::to_string(memory_governor().total_usage()) +
+           ",\"memory_limit\":" + std::to_string(memory_governor().total_budget()) + "}";
+    return out;
+}
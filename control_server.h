@@ -0,0 +1,86 @@
+// ControlServer exposes a TorrentQueue over a Unix socket and a watch folder.
+#pragma once
+
+#include "alerts.h"
+#include "logger.h"
+#include "torrent_queue.h"
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One JSON object per line in each direction. Requests carry "cmd":
+//   {"cmd":"add","path":"/x.torrent"}             -> {"ok":true,"id":3}
+//   {"cmd":"add","magnet":"magnet:?xt=..."}       -> {"ok":true,"id":3}
+//   {"cmd":"remove"|"pause"|"resume","id":3}      -> {"ok":true}
+//   {"cmd":"move","id":3,"position":0}            -> {"ok":true}
+//   {"cmd":"limits","active_downloads":2,...}     -> {"ok":true,"limits":{...}}
+//   {"cmd":"stats"}                               -> {"ok":true,"torrents":[...],...}
+//   {"cmd":"alerts","max":100}                    -> {"ok":true,"alerts":[...],...}
+//   {"cmd":"handoff"}                             -> handoff protocol, see handoff.h
+// Failures answer {"ok":false,"error":"..."}. Stats come from the queue's
+// published snapshot, so no query waits on a session or the queue lock.
+class ControlServer {
+public:
+    // When alerts is set this server becomes its only consumer.
+    ControlServer(TorrentQueue& queue, TorrentQueue::AddOptions defaults,
+                  AlertQueue* alerts);
+    ~ControlServer();
+
+    ControlServer(const ControlServer&) = delete;
+    ControlServer& operator=(const ControlServer&) = delete;
+
+    // Replaces any stale socket file at path.
+    void listen(const std::filesystem::path& socket_path);
+    // .torrent files present now or written later are added once each.
+    void watch_directory(const std::filesystem::path& dir);
+
+    // Runs on the server thread with the requesting client's socket (now
+    // blocking) when a successor asks for a hot restart; the connection is
+    // closed afterwards.
+    using HandoffHandler = std::function<void(int fd)>;
+    void set_handoff_handler(HandoffHandler handler) { handoff_handler_ = std::move(handler); }
+
+    void start();
+    void stop();
+
+private:
+    struct Client {
+        std::string in;
+        std::string out;
+    };
+
+    void run();
+    void accept_clients();
+    void read_client(int fd, Client& client);
+    void write_client(int fd, Client& client);
+    void drain_inotify();
+    void add_watched(const std::filesystem::path& path);
+    std::string handle(const std::string& line);
+    std::string stats_json() const;
+    std::string alerts_json(std::size_t max);
+
+    TorrentQueue& queue_;
+    TorrentQueue::AddOptions defaults_;
+    AlertQueue* alerts_;
+    std::vector<Alert> alert_batch_;
+    std::filesystem::path socket_path_;
+    ino_t socket_inode_{0};
+    std::filesystem::path watch_dir_;
+    int listen_fd_{-1};
+    int inotify_fd_{-1};
+    int wake_fd_{-1};
+    std::map<int, Client> clients_;
+    std::set<std::filesystem::path> watched_;
+    HandoffHandler handoff_handler_;
+    std::thread worker_;
+    std::atomic<bool> running_{false};
+    AsyncLogger logger_;
+};
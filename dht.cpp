@@ -0,0 +1,1069 @@
+#include "dht.h"
+
+#include <openssl/sha.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <system_error>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t kCompactNode4 = 26;
+constexpr std::size_t kCompactNode6 = 38;
+constexpr std::size_t kMaxValues = 50;
+constexpr std::size_t kMaxSavedNodes = 200;
+constexpr auto kBootstrapInterval = std::chrono::seconds(30);
+constexpr auto kRefreshInterval = std::chrono::minutes(15);
+constexpr auto kSaveInterval = std::chrono::minutes(10);
+constexpr auto kSocketRetry = std::chrono::seconds(5);
+constexpr char kClientVersion[] = "DJ01";
+
+std::mt19937_64& rng() {
+    static thread_local std::mt19937_64 gen([] {
+        std::random_device rd;
+        return (static_cast<uint64_t>(rd()) << 32) ^ rd();
+    }());
+    return gen;
+}
+
+DhtId random_id() {
+    DhtId id{};
+    for (auto& b : id) {
+        b = static_cast<uint8_t>(rng()());
+    }
+    return id;
+}
+
+// true when a is strictly closer to target than b in XOR distance
+bool closer(const DhtId& target, const DhtId& a, const DhtId& b) {
+    for (std::size_t i = 0; i < target.size(); ++i) {
+        uint8_t da = a[i] ^ target[i];
+        uint8_t db = b[i] ^ target[i];
+        if (da != db) {
+            return da < db;
+        }
+    }
+    return false;
+}
+
+// a placeholder id for endpoints we have not heard from, as far from
+// target as possible so known nodes are always asked first
+DhtId farthest_from(const DhtId& target) {
+    DhtId id{};
+    for (std::size_t i = 0; i < id.size(); ++i) {
+        id[i] = static_cast<uint8_t>(~target[i]);
+    }
+    return id;
+}
+
+std::string id_bytes(const DhtId& id) {
+    return std::string(reinterpret_cast<const char*>(id.data()), id.size());
+}
+
+std::optional<DhtId> id_from(const bencode::Value* v) {
+    if (!v || !std::holds_alternative<std::string>(v->data)) {
+        return std::nullopt;
+    }
+    const auto& s = std::get<std::string>(v->data);
+    if (s.size() != 20) {
+        return std::nullopt;
+    }
+    DhtId id{};
+    std::memcpy(id.data(), s.data(), id.size());
+    return id;
+}
+
+std::string to_hex(const uint8_t* data, std::size_t len) {
+    static constexpr char kHexDigits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(len * 2);
+    for (std::size_t i = 0; i < len; ++i) {
+        out.push_back(kHexDigits[data[i] >> 4]);
+        out.push_back(kHexDigits[data[i] & 0x0F]);
+    }
+    return out;
+}
+
+std::optional<DhtId> id_from_hex(const std::string& hex) {
+    if (hex.size() != 40) {
+        return std::nullopt;
+    }
+    DhtId id{};
+    for (std::size_t i = 0; i < id.size(); ++i) {
+        unsigned byte = 0;
+        if (std::sscanf(hex.c_str() + 2 * i, "%2x", &byte) != 1) {
+            return std::nullopt;
+        }
+        id[i] = static_cast<uint8_t>(byte);
+    }
+    return id;
+}
+
+// BEP 5 compact form: 4 (or 16, BEP 32) address bytes then the port
+std::string compact_endpoint(const Endpoint& ep) {
+    std::string out;
+    if (ep.is_v4()) {
+        out.append(reinterpret_cast<const char*>(ep.addr.data() + 12), 4);
+    } else {
+        out.append(reinterpret_cast<const char*>(ep.addr.data()), 16);
+    }
+    out.push_back(static_cast<char>(ep.port >> 8));
+    out.push_back(static_cast<char>(ep.port & 0xFF));
+    return out;
+}
+
+std::optional<Endpoint> parse_compact_endpoint(const uint8_t* p, std::size_t len) {
+    if (len != 6 && len != 18) {
+        return std::nullopt;
+    }
+    uint16_t port = static_cast<uint16_t>((p[len - 2] << 8) | p[len - 1]);
+    if (port == 0) {
+        return std::nullopt;
+    }
+    return len == 6 ? Endpoint::from_v4(p, port) : Endpoint::from_v6(p, port);
+}
+
+bencode::Value str_value(std::string s) { return bencode::Value{std::move(s)}; }
+
+const char* query_name(int kind) {
+    static constexpr const char* kNames[] = {"ping", "find_node", "get_peers", "announce_peer"};
+    return kNames[kind];
+}
+
+DhtId load_or_create_id(const std::filesystem::path& path) {
+    std::ifstream in(path);
+    std::string tag;
+    std::string hex;
+    if (in >> tag >> hex && tag == "id") {
+        if (auto id = id_from_hex(hex)) {
+            return *id;
+        }
+    }
+    return random_id();
+}
+
+} // namespace
+
+std::size_t DhtRoutingTable::bucket_for(const DhtId& id) const {
+    std::size_t bits = 0;
+    for (std::size_t i = 0; i < id.size(); ++i) {
+        uint8_t x = id[i] ^ self_[i];
+        if (x == 0) {
+            bits += 8;
+            continue;
+        }
+        while ((x & 0x80) == 0) {
+            ++bits;
+            x = static_cast<uint8_t>(x << 1);
+        }
+        break;
+    }
+    return std::min<std::size_t>(bits, buckets_.size() - 1);
+}
+
+std::optional<DhtRoutingTable::Node> DhtRoutingTable::heard_from(const DhtId& id,
+                                                                 const Endpoint& endpoint,
+                                                                 Clock::time_point now) {
+    if (id == self_) {
+        return std::nullopt;
+    }
+    auto& bucket = buckets_[bucket_for(id)];
+    for (auto& node : bucket) {
+        if (node.id == id) {
+            // an id that moves address is more likely spoofed than roaming
+            if (node.endpoint == endpoint) {
+                node.last_seen = now;
+                node.failures = 0;
+                node.ping_pending = false;
+            }
+            return std::nullopt;
+        }
+    }
+    if (bucket.size() < kBucketSize) {
+        bucket.push_back(Node{id, endpoint, now, 0, false});
+        ++size_;
+        return std::nullopt;
+    }
+    auto oldest = std::min_element(bucket.begin(), bucket.end(), [](const Node& a, const Node& b) {
+        return a.last_seen < b.last_seen;
+    });
+    if (!oldest->ping_pending && now - oldest->last_seen > kStaleAfter) {
+        oldest->ping_pending = true;
+        return *oldest;
+    }
+    return std::nullopt;
+}
+
+void DhtRoutingTable::failed(const Endpoint& endpoint) {
+    for (auto& bucket : buckets_) {
+        for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+            if (it->endpoint != endpoint) {
+                continue;
+            }
+            it->ping_pending = false;
+            if (++it->failures >= kBadFailures) {
+                bucket.erase(it);
+                --size_;
+            }
+            return;
+        }
+    }
+}
+
+std::vector<DhtRoutingTable::Node> DhtRoutingTable::closest(const DhtId& target,
+                                                            std::size_t count) const {
+    std::vector<Node> out = all();
+    std::size_t n = std::min(count, out.size());
+    std::partial_sort(out.begin(), out.begin() + static_cast<std::ptrdiff_t>(n), out.end(),
+                      [&target](const Node& a, const Node& b) {
+                          return closer(target, a.id, b.id);
+                      });
+    out.resize(n);
+    return out;
+}
+
+std::vector<DhtRoutingTable::Node> DhtRoutingTable::stale(Clock::time_point now, std::size_t max) {
+    std::vector<Node> out;
+    for (auto& bucket : buckets_) {
+        for (auto& node : bucket) {
+            if (out.size() >= max) {
+                return out;
+            }
+            if (!node.ping_pending && now - node.last_seen > kStaleAfter) {
+                node.ping_pending = true;
+                out.push_back(node);
+            }
+        }
+    }
+    return out;
+}
+
+std::vector<DhtRoutingTable::Node> DhtRoutingTable::all() const {
+    std::vector<Node> out;
+    out.reserve(size_);
+    for (const auto& bucket : buckets_) {
+        out.insert(out.end(), bucket.begin(), bucket.end());
+    }
+    return out;
+}
+
+Dht::Dht(uint16_t port, std::filesystem::path state_file)
+    : port_(port),
+      state_file_(std::move(state_file)),
+      self_id_(load_or_create_id(state_file_)),
+      loop_(PeerEventLoop::EventCallback{}),
+      table4_(self_id_),
+      table6_(self_id_) {}
+
+Dht::~Dht() { stop(); }
+
+void Dht::add_bootstrap_node(std::string host, uint16_t port) {
+    bootstrap_nodes_.emplace_back(std::move(host), port);
+}
+
+void Dht::start() {
+    if (worker_.joinable()) {
+        return;
+    }
+    logger_.start();
+    load_state();
+    rotate_secrets();
+    rotate_secrets();
+    auto now = Clock::now();
+    last_refresh_ = now;
+    last_save_ = now;
+    running_.store(true, std::memory_order_relaxed);
+    worker_ = std::thread([this]() { run(); });
+}
+
+void Dht::stop() {
+    if (!worker_.joinable()) {
+        return;
+    }
+    running_.store(false, std::memory_order_relaxed);
+    loop_.wake();
+    worker_.join();
+    save_state();
+    close_socket();
+    logger_.stop();
+}
+
+void Dht::add_torrent(const std::array<uint8_t, 20>& info_hash, uint16_t listen_port,
+                      PeersCallback on_peers) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Torrent& t = torrents_[id_bytes(info_hash)];
+        t.port = listen_port;
+        t.on_peers = std::move(on_peers);
+        t.next_announce = Clock::time_point{};
+    }
+    loop_.wake();
+}
+
+void Dht::remove_torrent(const std::array<uint8_t, 20>& info_hash) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    torrents_.erase(id_bytes(info_hash));
+}
+
+void Dht::run() {
+    while (running_.load(std::memory_order_relaxed)) {
+        auto now = Clock::now();
+        if (sock_ < 0 && now - last_socket_attempt_ >= kSocketRetry) {
+            last_socket_attempt_ = now;
+            open_socket();
+        }
+        refresh_ip_filter();
+        loop_.run_once(250);
+        tick(Clock::now());
+    }
+}
+
+void Dht::refresh_ip_filter() {
+    if (!shared_ip_filter_ || shared_ip_filter_->generation() == ip_filter_generation_) {
+        return;
+    }
+    ip_filter_generation_ = shared_ip_filter_->generation();
+    ip_filter_ = shared_ip_filter_->current();
+    loop_.set_ip_filter(ip_filter_.get());
+}
+
+bool Dht::open_socket() {
+    int fd = ::socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    // one dual-stack socket; IPv4 nodes show up as mapped addresses
+    int no = 0;
+    ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+    sockaddr_in6 addr{};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port_);
+    // fails while a previous process still holds the port across a hot
+    // restart; run() retries until it is released
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        if (!bind_warned_) {
+            logger_.warn("dht: cannot bind udp port " + std::to_string(port_) + ": " +
+                         std::strerror(errno) + ", retrying");
+            bind_warned_ = true;
+        }
+        ::close(fd);
+        return false;
+    }
+    if (!loop_.add_datagram_socket(
+            fd, [this](const uint8_t* data, std::size_t len, const Endpoint& from) {
+                handle_datagram(data, len, from);
+            })) {
+        ::close(fd);
+        return false;
+    }
+    sock_ = fd;
+    logger_.info("dht: listening on udp port " + std::to_string(port_) + " as " +
+                 to_hex(self_id_.data(), self_id_.size()));
+    return true;
+}
+
+void Dht::close_socket() {
+    if (sock_ < 0) {
+        return;
+    }
+    loop_.remove_datagram_socket(sock_);
+    ::close(sock_);
+    sock_ = -1;
+}
+
+void Dht::tick(Clock::time_point now) {
+    expire_transactions(now);
+    if (now - last_secret_rotation_ >= kSecretLifetime) {
+        rotate_secrets();
+        expire_peers(now);
+    }
+    if (sock_ >= 0) {
+        maybe_bootstrap(now);
+        maybe_refresh(now);
+        maybe_announce(now);
+    }
+    if (now - last_save_ >= kSaveInterval) {
+        last_save_ = now;
+        save_state();
+    }
+    node_count_.store(table4_.size() + table6_.size(), std::memory_order_relaxed);
+}
+
+void Dht::maybe_bootstrap(Clock::time_point now) {
+    if (table4_.size() + table6_.size() >= DhtRoutingTable::kBucketSize ||
+        now - last_bootstrap_ < kBootstrapInterval) {
+        return;
+    }
+    last_bootstrap_ = now;
+
+    std::vector<Endpoint> seeds;
+    seeds.swap(saved_nodes_);
+    for (const auto& [host, port] : bootstrap_nodes_) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo* res = nullptr;
+        std::string service = std::to_string(port);
+        if (::getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0) {
+            logger_.warn("dht: cannot resolve bootstrap node " + host);
+            continue;
+        }
+        for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+            if (ai->ai_family == AF_INET) {
+                auto* sin = reinterpret_cast<sockaddr_in*>(ai->ai_addr);
+                seeds.push_back(Endpoint::from_v4(reinterpret_cast<const uint8_t*>(&sin->sin_addr),
+                                                  port));
+            } else if (ai->ai_family == AF_INET6) {
+                auto* sin6 = reinterpret_cast<sockaddr_in6*>(ai->ai_addr);
+                seeds.push_back(Endpoint::from_v6(sin6->sin6_addr.s6_addr, port));
+            }
+        }
+        ::freeaddrinfo(res);
+    }
+
+    bool any_v4 = table4_.size() > 0;
+    bool any_v6 = table6_.size() > 0;
+    for (const auto& ep : seeds) {
+        (ep.is_v4() ? any_v4 : any_v6) = true;
+    }
+    if (!any_v4 && !any_v6) {
+        return;
+    }
+    logger_.info("dht: bootstrapping from " + std::to_string(seeds.size()) + " nodes");
+    // walking towards our own id fills the buckets nearest to us
+    if (any_v4) {
+        start_lookup(self_id_, false, false, 0, seeds);
+    }
+    if (any_v6) {
+        start_lookup(self_id_, false, true, 0, seeds);
+    }
+}
+
+void Dht::maybe_refresh(Clock::time_point now) {
+    for (auto* table : {&table4_, &table6_}) {
+        for (const auto& node : table->stale(now, 4)) {
+            send_ping(node.endpoint);
+        }
+    }
+    if (now - last_refresh_ < kRefreshInterval) {
+        return;
+    }
+    last_refresh_ = now;
+    // a random target refreshes the far buckets, our own id the near ones
+    for (bool v6 : {false, true}) {
+        if ((v6 ? table6_ : table4_).size() == 0) {
+            continue;
+        }
+        start_lookup(random_id(), false, v6, 0, {});
+        start_lookup(self_id_, false, v6, 0, {});
+    }
+}
+
+void Dht::maybe_announce(Clock::time_point now) {
+    if (table4_.size() + table6_.size() == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& [key, torrent] : torrents_) {
+        if (now < torrent.next_announce) {
+            continue;
+        }
+        torrent.next_announce = now + kAnnounceInterval;
+        DhtId target{};
+        std::memcpy(target.data(), key.data(), target.size());
+        for (bool v6 : {false, true}) {
+            if ((v6 ? table6_ : table4_).size() > 0) {
+                start_lookup(target, true, v6, torrent.port, {});
+            }
+        }
+    }
+}
+
+void Dht::expire_transactions(Clock::time_point now) {
+    std::vector<Transaction> expired;
+    for (auto it = transactions_.begin(); it != transactions_.end();) {
+        if (now - it->second.sent_at >= kQueryTimeout) {
+            expired.push_back(it->second);
+            it = transactions_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (const auto& tx : expired) {
+        table_for(tx.to).failed(tx.to);
+        auto lit = lookups_.find(tx.lookup);
+        if (lit == lookups_.end()) {
+            continue;
+        }
+        for (auto& c : lit->second.candidates) {
+            if (c.endpoint == tx.to && c.state == Lookup::State::InFlight) {
+                c.state = Lookup::State::Failed;
+                --lit->second.in_flight;
+                break;
+            }
+        }
+        advance(tx.lookup);
+    }
+}
+
+void Dht::expire_peers(Clock::time_point now) {
+    for (auto it = stored_peers_.begin(); it != stored_peers_.end();) {
+        auto& peers = it->second;
+        peers.erase(std::remove_if(peers.begin(), peers.end(),
+                                   [now](const StoredPeer& p) {
+                                       return now - p.added > kPeerLifetime;
+                                   }),
+                    peers.end());
+        if (peers.empty()) {
+            it = stored_peers_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void Dht::rotate_secrets() {
+    // tokens stay valid for one full rotation after they are handed out
+    secrets_[1] = secrets_[0];
+    for (auto& b : secrets_[0]) {
+        b = static_cast<uint8_t>(rng()());
+    }
+    last_secret_rotation_ = Clock::now();
+}
+
+std::string Dht::make_token(const Endpoint& from, int generation) const {
+    uint8_t input[32];
+    std::memcpy(input, secrets_[static_cast<std::size_t>(generation)].data(), 16);
+    std::memcpy(input + 16, from.addr.data(), 16);
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(input, sizeof(input), digest);
+    return std::string(reinterpret_cast<const char*>(digest), 8);
+}
+
+bool Dht::valid_token(const Endpoint& from, const std::string& token) const {
+    return token == make_token(from, 0) || token == make_token(from, 1);
+}
+
+DhtRoutingTable& Dht::table_for(const Endpoint& endpoint) {
+    return endpoint.is_v4() ? table4_ : table6_;
+}
+
+void Dht::node_seen(const DhtId& id, const Endpoint& from) {
+    if (auto stale = table_for(from).heard_from(id, from, Clock::now())) {
+        send_ping(stale->endpoint);
+    }
+}
+
+void Dht::handle_datagram(const uint8_t* data, std::size_t len, const Endpoint& from) {
+    if (len == 0 || data[0] != 'd' || from.port == 0) {
+        return;
+    }
+    try {
+        bencode::Parser parser(std::string(reinterpret_cast<const char*>(data), len));
+        bencode::Value root_v = parser.parse();
+        const auto& root = bencode::as_dict(root_v);
+        const auto& tid = bencode::as_string(bencode::require_field(root, "t"));
+        const auto& type = bencode::as_string(bencode::require_field(root, "y"));
+        if (type == "q") {
+            const auto& method = bencode::as_string(bencode::require_field(root, "q"));
+            const auto* args = bencode::find_field(root, "a");
+            if (!args || !std::holds_alternative<bencode::Dict>(args->data)) {
+                send_error(tid, 203, "missing arguments", from);
+                return;
+            }
+            handle_query(tid, method, bencode::as_dict(*args), from);
+        } else if (type == "r") {
+            handle_response(tid, bencode::as_dict(bencode::require_field(root, "r")), from);
+        } else if (type == "e") {
+            handle_error(tid, from);
+        }
+    } catch (const std::exception&) {
+        // malformed packets are common on the open DHT; drop them
+    }
+}
+
+void Dht::handle_query(const std::string& tid, const std::string& method,
+                       const bencode::Dict& args, const Endpoint& from) {
+    auto id = id_from(bencode::find_field(args, "id"));
+    if (!id) {
+        send_error(tid, 203, "missing id", from);
+        return;
+    }
+    node_seen(*id, from);
+
+    bencode::Dict reply;
+    reply["id"] = str_value(id_bytes(self_id_));
+    if (method == "ping") {
+        // the id is the whole answer
+    } else if (method == "find_node") {
+        auto target = id_from(bencode::find_field(args, "target"));
+        if (!target) {
+            send_error(tid, 203, "missing target", from);
+            return;
+        }
+        add_compact_nodes(reply, *target, args, from);
+    } else if (method == "get_peers") {
+        auto info_hash = id_from(bencode::find_field(args, "info_hash"));
+        if (!info_hash) {
+            send_error(tid, 203, "missing info_hash", from);
+            return;
+        }
+        reply["token"] = str_value(make_token(from, 0));
+        auto it = stored_peers_.find(id_bytes(*info_hash));
+        if (it != stored_peers_.end()) {
+            bencode::List values;
+            // newest first, in the querier's address family
+            for (auto p = it->second.rbegin(); p != it->second.rend() && values.size() < kMaxValues;
+                 ++p) {
+                if (p->endpoint.is_v4() == from.is_v4()) {
+                    values.push_back(str_value(compact_endpoint(p->endpoint)));
+                }
+            }
+            if (!values.empty()) {
+                reply["values"] = bencode::Value{std::move(values)};
+            }
+        }
+        add_compact_nodes(reply, *info_hash, args, from);
+    } else if (method == "announce_peer") {
+        auto info_hash = id_from(bencode::find_field(args, "info_hash"));
+        const auto* token = bencode::find_field(args, "token");
+        const auto* port_v = bencode::find_field(args, "port");
+        if (!info_hash || !token || !port_v) {
+            send_error(tid, 203, "missing announce arguments", from);
+            return;
+        }
+        if (!valid_token(from, bencode::as_string(*token))) {
+            send_error(tid, 203, "bad token", from);
+            return;
+        }
+        int64_t port = bencode::as_int(*port_v);
+        const auto* implied = bencode::find_field(args, "implied_port");
+        if (implied && bencode::as_int(*implied) != 0) {
+            port = from.port;
+        }
+        if (port <= 0 || port > 65535) {
+            send_error(tid, 203, "bad port", from);
+            return;
+        }
+        std::string key = id_bytes(*info_hash);
+        if (stored_peers_.size() < kMaxStoredTorrents || stored_peers_.count(key) > 0) {
+            Endpoint peer = from;
+            peer.port = static_cast<uint16_t>(port);
+            auto& peers = stored_peers_[key];
+            peers.erase(std::remove_if(peers.begin(), peers.end(),
+                                       [&peer](const StoredPeer& p) { return p.endpoint == peer; }),
+                        peers.end());
+            if (peers.size() >= kMaxPeersPerTorrent) {
+                peers.erase(peers.begin());
+            }
+            peers.push_back(StoredPeer{peer, Clock::now()});
+        }
+    } else {
+        send_error(tid, 204, "method unknown", from);
+        return;
+    }
+    send_reply(tid, std::move(reply), from);
+}
+
+void Dht::add_compact_nodes(bencode::Dict& reply, const DhtId& target, const bencode::Dict& args,
+                            const Endpoint& from) const {
+    // BEP 32: "want" picks the families; without it, the querier's own
+    bool want4 = from.is_v4();
+    bool want6 = !from.is_v4();
+    if (const auto* want = bencode::find_field(args, "want");
+        want && std::holds_alternative<bencode::List>(want->data)) {
+        want4 = want6 = false;
+        for (const auto& w : bencode::as_list(*want)) {
+            if (!std::holds_alternative<std::string>(w.data)) {
+                continue;
+            }
+            const auto& s = std::get<std::string>(w.data);
+            want4 = want4 || s == "n4";
+            want6 = want6 || s == "n6";
+        }
+    }
+    if (want4) {
+        reply["nodes"] = str_value(compact_nodes(target, false));
+    }
+    if (want6) {
+        reply["nodes6"] = str_value(compact_nodes(target, true));
+    }
+}
+
+std::string Dht::compact_nodes(const DhtId& target, bool v6) const {
+    std::string out;
+    const auto& table = v6 ? table6_ : table4_;
+    for (const auto& node : table.closest(target, DhtRoutingTable::kBucketSize)) {
+        out += id_bytes(node.id);
+        out += compact_endpoint(node.endpoint);
+    }
+    return out;
+}
+
+void Dht::handle_response(const std::string& tid, const bencode::Dict& reply,
+                          const Endpoint& from) {
+    if (tid.size() != 2) {
+        return;
+    }
+    uint16_t key = static_cast<uint16_t>((static_cast<uint8_t>(tid[0]) << 8) |
+                                         static_cast<uint8_t>(tid[1]));
+    auto it = transactions_.find(key);
+    // replies must come from where the query went
+    if (it == transactions_.end() || it->second.to != from) {
+        return;
+    }
+    Transaction tx = it->second;
+    transactions_.erase(it);
+
+    auto id = id_from(bencode::find_field(reply, "id"));
+    if (!id) {
+        return;
+    }
+    node_seen(*id, from);
+
+    auto lit = lookups_.find(tx.lookup);
+    if (lit == lookups_.end()) {
+        return;
+    }
+    Lookup& lookup = lit->second;
+    for (auto& c : lookup.candidates) {
+        if (c.endpoint == from && c.state == Lookup::State::InFlight) {
+            c.state = Lookup::State::Responded;
+            c.id = *id;
+            if (const auto* token = bencode::find_field(reply, "token");
+                token && std::holds_alternative<std::string>(token->data)) {
+                c.token = std::get<std::string>(token->data);
+            }
+            --lookup.in_flight;
+            ++lookup.responses;
+            break;
+        }
+    }
+    const char* nodes_key = lookup.v6 ? "nodes6" : "nodes";
+    if (const auto* nodes = bencode::find_field(reply, nodes_key);
+        nodes && std::holds_alternative<std::string>(nodes->data)) {
+        add_candidates(lookup, std::get<std::string>(nodes->data), lookup.v6);
+    }
+
+    if (lookup.get_peers) {
+        std::vector<PeerAddress> peers;
+        if (const auto* values = bencode::find_field(reply, "values");
+            values && std::holds_alternative<bencode::List>(values->data)) {
+            for (const auto& v : bencode::as_list(*values)) {
+                if (!std::holds_alternative<std::string>(v.data)) {
+                    continue;
+                }
+                const auto& s = std::get<std::string>(v.data);
+                auto ep = parse_compact_endpoint(reinterpret_cast<const uint8_t*>(s.data()),
+                                                 s.size());
+                if (ep) {
+                    peers.push_back(ep->to_address());
+                }
+            }
+        }
+        if (!peers.empty()) {
+            lookup.peers_found += peers.size();
+            deliver_peers(lookup.target, peers);
+        }
+    }
+    advance(tx.lookup);
+}
+
+void Dht::handle_error(const std::string& tid, const Endpoint& from) {
+    if (tid.size() != 2) {
+        return;
+    }
+    uint16_t key = static_cast<uint16_t>((static_cast<uint8_t>(tid[0]) << 8) |
+                                         static_cast<uint8_t>(tid[1]));
+    auto it = transactions_.find(key);
+    if (it == transactions_.end() || it->second.to != from) {
+        return;
+    }
+    std::uint64_t lookup_id = it->second.lookup;
+    transactions_.erase(it);
+    auto lit = lookups_.find(lookup_id);
+    if (lit == lookups_.end()) {
+        return;
+    }
+    // the node is alive but no use to this walk
+    for (auto& c : lit->second.candidates) {
+        if (c.endpoint == from && c.state == Lookup::State::InFlight) {
+            c.state = Lookup::State::Failed;
+            --lit->second.in_flight;
+            break;
+        }
+    }
+    advance(lookup_id);
+}
+
+void Dht::deliver_peers(const DhtId& info_hash, const std::vector<PeerAddress>& peers) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = torrents_.find(id_bytes(info_hash));
+    if (it != torrents_.end() && it->second.on_peers) {
+        it->second.on_peers(peers);
+    }
+}
+
+std::uint64_t Dht::start_lookup(const DhtId& target, bool get_peers, bool v6,
+                                uint16_t announce_port, const std::vector<Endpoint>& seeds) {
+    std::uint64_t id = next_lookup_++;
+    Lookup& lookup = lookups_[id];
+    lookup.target = target;
+    lookup.get_peers = get_peers;
+    lookup.v6 = v6;
+    lookup.announce_port = announce_port;
+    for (const auto& node : (v6 ? table6_ : table4_).closest(target, kMaxCandidates)) {
+        lookup.candidates.push_back(
+            Lookup::Candidate{node.id, node.endpoint, Lookup::State::Fresh, {}});
+    }
+    DhtId far = farthest_from(target);
+    for (const auto& ep : seeds) {
+        if (ep.is_v4() == v6) {
+            continue;
+        }
+        bool known = std::any_of(lookup.candidates.begin(), lookup.candidates.end(),
+                                 [&ep](const Lookup::Candidate& c) { return c.endpoint == ep; });
+        if (!known) {
+            lookup.candidates.push_back(Lookup::Candidate{far, ep, Lookup::State::Fresh, {}});
+        }
+    }
+    advance(id);
+    return id;
+}
+
+void Dht::add_candidates(Lookup& lookup, const std::string& compact, bool v6) {
+    const std::size_t stride = v6 ? kCompactNode6 : kCompactNode4;
+    const auto* p = reinterpret_cast<const uint8_t*>(compact.data());
+    for (std::size_t off = 0; off + stride <= compact.size(); off += stride) {
+        DhtId id{};
+        std::memcpy(id.data(), p + off, id.size());
+        auto ep = parse_compact_endpoint(p + off + 20, stride - 20);
+        if (!ep || id == self_id_) {
+            continue;
+        }
+        bool known = std::any_of(lookup.candidates.begin(), lookup.candidates.end(),
+                                 [&](const Lookup::Candidate& c) {
+                                     return c.endpoint == *ep || c.id == id;
+                                 });
+        if (!known) {
+            lookup.candidates.push_back(Lookup::Candidate{id, *ep, Lookup::State::Fresh, {}});
+        }
+    }
+    std::stable_sort(lookup.candidates.begin(), lookup.candidates.end(),
+                     [&lookup](const Lookup::Candidate& a, const Lookup::Candidate& b) {
+                         return closer(lookup.target, a.id, b.id);
+                     });
+    // trim from the far end, but never a node we are still waiting on
+    for (std::size_t i = lookup.candidates.size();
+         i > 0 && lookup.candidates.size() > kMaxCandidates; --i) {
+        auto state = lookup.candidates[i - 1].state;
+        if (state == Lookup::State::Fresh || state == Lookup::State::Failed) {
+            lookup.candidates.erase(lookup.candidates.begin() + static_cast<std::ptrdiff_t>(i - 1));
+        }
+    }
+}
+
+void Dht::advance(std::uint64_t id) {
+    auto it = lookups_.find(id);
+    if (it == lookups_.end()) {
+        return;
+    }
+    Lookup& lookup = it->second;
+    std::stable_sort(lookup.candidates.begin(), lookup.candidates.end(),
+                     [&lookup](const Lookup::Candidate& a, const Lookup::Candidate& b) {
+                         return closer(lookup.target, a.id, b.id);
+                     });
+    // converged once the k closest live candidates have all answered
+    std::size_t considered = 0;
+    bool pending = false;
+    for (auto& c : lookup.candidates) {
+        if (c.state == Lookup::State::Failed) {
+            continue;
+        }
+        if (considered++ >= DhtRoutingTable::kBucketSize) {
+            break;
+        }
+        if (c.state == Lookup::State::Fresh && lookup.in_flight < kAlpha) {
+            bencode::Dict args;
+            args["id"] = str_value(id_bytes(self_id_));
+            if (lookup.get_peers) {
+                args["info_hash"] = str_value(id_bytes(lookup.target));
+            } else {
+                args["target"] = str_value(id_bytes(lookup.target));
+            }
+            c.state = Lookup::State::InFlight;
+            ++lookup.in_flight;
+            send_query(lookup.get_peers ? QueryKind::GetPeers : QueryKind::FindNode, c.endpoint,
+                       std::move(args), id);
+        }
+        if (c.state != Lookup::State::Responded) {
+            pending = true;
+        }
+    }
+    if (!pending) {
+        finish(id, lookup);
+    }
+}
+
+void Dht::finish(std::uint64_t id, Lookup& lookup) {
+    if (lookup.get_peers) {
+        std::size_t announced = 0;
+        if (lookup.announce_port != 0) {
+            for (const auto& c : lookup.candidates) {
+                if (announced >= DhtRoutingTable::kBucketSize) {
+                    break;
+                }
+                if (c.state != Lookup::State::Responded || c.token.empty()) {
+                    continue;
+                }
+                bencode::Dict args;
+                args["id"] = str_value(id_bytes(self_id_));
+                args["info_hash"] = str_value(id_bytes(lookup.target));
+                args["port"] = bencode::Value{static_cast<int64_t>(lookup.announce_port)};
+                args["token"] = str_value(c.token);
+                args["implied_port"] = bencode::Value{int64_t{0}};
+                send_query(QueryKind::AnnouncePeer, c.endpoint, std::move(args), 0);
+                ++announced;
+            }
+        }
+        logger_.info("dht: get_peers " + to_hex(lookup.target.data(), 4) +
+                     (lookup.v6 ? " (v6)" : "") + " done: " + std::to_string(lookup.responses) +
+                     " responses, " + std::to_string(lookup.peers_found) + " peers, announced to " +
+                     std::to_string(announced));
+    } else if (lookup.target == self_id_) {
+        logger_.info("dht: " + std::to_string(table4_.size()) + " ipv4 and " +
+                     std::to_string(table6_.size()) + " ipv6 nodes after " +
+                     std::to_string(lookup.responses) + " responses");
+    }
+    lookups_.erase(id);
+}
+
+void Dht::send_query(QueryKind kind, const Endpoint& to, bencode::Dict args,
+                     std::uint64_t lookup) {
+    // skip ids still in use; 65536 outstanding queries never happen
+    while (transactions_.count(next_tid_) > 0) {
+        ++next_tid_;
+    }
+    uint16_t key = next_tid_++;
+    transactions_[key] = Transaction{kind, to, lookup, Clock::now()};
+
+    if (kind == QueryKind::FindNode || kind == QueryKind::GetPeers) {
+        // BEP 32: collect nodes of both families from either side
+        bencode::List want;
+        want.push_back(str_value("n4"));
+        want.push_back(str_value("n6"));
+        args["want"] = bencode::Value{std::move(want)};
+    }
+    bencode::Dict msg;
+    msg["a"] = bencode::Value{std::move(args)};
+    msg["q"] = str_value(query_name(static_cast<int>(kind)));
+    msg["t"] = str_value(std::string{static_cast<char>(key >> 8), static_cast<char>(key & 0xFF)});
+    msg["v"] = str_value(kClientVersion);
+    msg["y"] = str_value("q");
+    send_raw(to, bencode::encode(bencode::Value{std::move(msg)}));
+}
+
+void Dht::send_ping(const Endpoint& to) {
+    bencode::Dict args;
+    args["id"] = str_value(id_bytes(self_id_));
+    send_query(QueryKind::Ping, to, std::move(args), 0);
+}
+
+void Dht::send_reply(const std::string& tid, bencode::Dict reply, const Endpoint& to) {
+    bencode::Dict msg;
+    msg["r"] = bencode::Value{std::move(reply)};
+    msg["t"] = str_value(tid);
+    msg["v"] = str_value(kClientVersion);
+    msg["y"] = str_value("r");
+    send_raw(to, bencode::encode(bencode::Value{std::move(msg)}));
+}
+
+void Dht::send_error(const std::string& tid, int64_t code, std::string message,
+                     const Endpoint& to) {
+    bencode::List error;
+    error.push_back(bencode::Value{code});
+    error.push_back(str_value(std::move(message)));
+    bencode::Dict msg;
+    msg["e"] = bencode::Value{std::move(error)};
+    msg["t"] = str_value(tid);
+    msg["y"] = str_value("e");
+    send_raw(to, bencode::encode(bencode::Value{std::move(msg)}));
+}
+
+void Dht::send_raw(const Endpoint& to, const std::string& packet) {
+    if (sock_ < 0 || (ip_filter_ && ip_filter_->is_blocked(to))) {
+        return;
+    }
+    // IPv4 endpoints are already in mapped form, which the dual-stack
+    // socket accepts as is
+    sockaddr_in6 addr{};
+    addr.sin6_family = AF_INET6;
+    std::memcpy(&addr.sin6_addr, to.addr.data(), 16);
+    addr.sin6_port = htons(to.port);
+    ssize_t n = ::sendto(sock_, packet.data(), packet.size(), MSG_DONTWAIT | MSG_NOSIGNAL,
+                         reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    (void)n;
+}
+
+// "id <hex>" on the first line, then "<ip> <port> <id hex>" per node.
+void Dht::load_state() {
+    std::ifstream in(state_file_);
+    if (!in) {
+        return;
+    }
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        std::istringstream iss(line);
+        std::string ip;
+        unsigned port = 0;
+        if (!(iss >> ip >> port) || port == 0 || port > 65535) {
+            continue;
+        }
+        if (auto ep = Endpoint::parse(ip.c_str(), static_cast<uint16_t>(port))) {
+            saved_nodes_.push_back(*ep);
+        }
+    }
+}
+
+void Dht::save_state() const {
+    std::error_code ec;
+    std::filesystem::create_directories(state_file_.parent_path(), ec);
+    std::filesystem::path tmp = state_file_;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        if (!out) {
+            return;
+        }
+        out << "id " << to_hex(self_id_.data(), self_id_.size()) << '\n';
+        std::size_t written = 0;
+        for (const auto* table : {&table4_, &table6_}) {
+            for (const auto& node : table->all()) {
+                if (written++ >= kMaxSavedNodes) {
+                    break;
+                }
+                out << node.endpoint.ip_string() << ' ' << node.endpoint.port << ' '
+                    << to_hex(node.id.data(), node.id.size()) << '\n';
+            }
+        }
+        if (!out) {
+            return;
+        }
+    }
+    std::filesystem::rename(tmp, state_file_, ec);
+}
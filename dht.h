@@ -0,0 +1,226 @@
+// Dht is a mainline DHT node (BEP 5, IPv6 per BEP 32) shared by all torrents.
+#pragma once
+
+#include "bencode.h"
+#include "endpoint.h"
+#include "ip_filter.h"
+#include "logger.h"
+#include "peer_event_loop.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using DhtId = std::array<uint8_t, 20>;
+
+// Kademlia routing table for one address family. Bucket i holds nodes whose
+// id shares exactly i leading bits with ours, which is the fully split form
+// of the BEP 5 tree.
+class DhtRoutingTable {
+public:
+    static constexpr std::size_t kBucketSize = 8;
+
+    struct Node {
+        DhtId id{};
+        Endpoint endpoint;
+        std::chrono::steady_clock::time_point last_seen{};
+        int failures{0};
+        bool ping_pending{false};
+    };
+
+    explicit DhtRoutingTable(const DhtId& self) : self_(self) {}
+
+    // Records a node we heard from. A full bucket evicts a node that keeps
+    // failing; otherwise the newcomer is dropped and, when the bucket has a
+    // stale node, that node is returned so the caller can ping it.
+    std::optional<Node> heard_from(const DhtId& id, const Endpoint& endpoint,
+                                   std::chrono::steady_clock::time_point now);
+    void failed(const Endpoint& endpoint);
+    std::vector<Node> closest(const DhtId& target, std::size_t count) const;
+    // Good nodes not heard from for a while, for periodic pings.
+    std::vector<Node> stale(std::chrono::steady_clock::time_point now, std::size_t max);
+    std::vector<Node> all() const;
+    std::size_t size() const { return size_; }
+
+    static constexpr int kBadFailures = 2;
+    static constexpr std::chrono::minutes kStaleAfter{15};
+
+private:
+    std::size_t bucket_for(const DhtId& id) const;
+
+    DhtId self_;
+    std::array<std::vector<Node>, 160> buckets_;
+    std::size_t size_{0};
+};
+
+class Dht {
+public:
+    using PeersCallback = std::function<void(const std::vector<PeerAddress>&)>;
+
+    // state_file keeps our node id and the routing table across restarts.
+    Dht(uint16_t port, std::filesystem::path state_file);
+    ~Dht();
+
+    Dht(const Dht&) = delete;
+    Dht& operator=(const Dht&) = delete;
+
+    // Bootstrap routers, resolved whenever the routing table is empty.
+    void add_bootstrap_node(std::string host, uint16_t port);
+    // Call before start(). Blocked nodes are neither heard nor queried.
+    void set_ip_filter(std::shared_ptr<SharedIpFilter> filter) {
+        shared_ip_filter_ = std::move(filter);
+    }
+    void start();
+    void stop();
+
+    // Thread-safe. Looks up and announces listen_port for info_hash now and
+    // every 15 minutes, handing discovered peers to on_peers on the DHT
+    // thread until the torrent is removed.
+    void add_torrent(const std::array<uint8_t, 20>& info_hash, uint16_t listen_port,
+                     PeersCallback on_peers);
+    // Thread-safe; once this returns on_peers is neither running nor called.
+    void remove_torrent(const std::array<uint8_t, 20>& info_hash);
+
+    std::size_t node_count() const { return node_count_.load(std::memory_order_relaxed); }
+    uint16_t port() const { return port_; }
+
+private:
+    enum class QueryKind : uint8_t { Ping, FindNode, GetPeers, AnnouncePeer };
+
+    struct Transaction {
+        QueryKind kind{QueryKind::Ping};
+        Endpoint to;
+        std::uint64_t lookup{0};
+        std::chrono::steady_clock::time_point sent_at{};
+    };
+
+    // One iterative find_node or get_peers walk in one address family.
+    struct Lookup {
+        enum class State : uint8_t { Fresh, InFlight, Responded, Failed };
+        struct Candidate {
+            DhtId id{};
+            Endpoint endpoint;
+            State state{State::Fresh};
+            std::string token;
+        };
+        DhtId target{};
+        bool get_peers{false};
+        bool v6{false};
+        // announce_peer to the closest responders once the walk converges
+        uint16_t announce_port{0};
+        std::vector<Candidate> candidates;
+        std::size_t in_flight{0};
+        std::size_t peers_found{0};
+        std::size_t responses{0};
+    };
+
+    struct Torrent {
+        uint16_t port{0};
+        PeersCallback on_peers;
+        std::chrono::steady_clock::time_point next_announce{};
+    };
+
+    struct StoredPeer {
+        Endpoint endpoint;
+        std::chrono::steady_clock::time_point added{};
+    };
+
+    void run();
+    void refresh_ip_filter();
+    bool open_socket();
+    void close_socket();
+    void tick(std::chrono::steady_clock::time_point now);
+    void maybe_bootstrap(std::chrono::steady_clock::time_point now);
+    void maybe_announce(std::chrono::steady_clock::time_point now);
+    void maybe_refresh(std::chrono::steady_clock::time_point now);
+    void expire_transactions(std::chrono::steady_clock::time_point now);
+    void expire_peers(std::chrono::steady_clock::time_point now);
+    void rotate_secrets();
+
+    void handle_datagram(const uint8_t* data, std::size_t len, const Endpoint& from);
+    void handle_query(const std::string& tid, const std::string& method,
+                      const bencode::Dict& args, const Endpoint& from);
+    void handle_response(const std::string& tid, const bencode::Dict& reply,
+                         const Endpoint& from);
+    void handle_error(const std::string& tid, const Endpoint& from);
+    void node_seen(const DhtId& id, const Endpoint& from);
+
+    std::uint64_t start_lookup(const DhtId& target, bool get_peers, bool v6,
+                               uint16_t announce_port, const std::vector<Endpoint>& seeds);
+    void advance(std::uint64_t id);
+    void finish(std::uint64_t id, Lookup& lookup);
+    void add_candidates(Lookup& lookup, const std::string& compact, bool v6);
+
+    void send_query(QueryKind kind, const Endpoint& to, bencode::Dict args,
+                    std::uint64_t lookup);
+    void send_ping(const Endpoint& to);
+    void send_reply(const std::string& tid, bencode::Dict reply, const Endpoint& to);
+    void send_error(const std::string& tid, int64_t code, std::string message,
+                    const Endpoint& to);
+    void send_raw(const Endpoint& to, const std::string& packet);
+    void deliver_peers(const DhtId& info_hash, const std::vector<PeerAddress>& peers);
+
+    std::string make_token(const Endpoint& from, int generation) const;
+    bool valid_token(const Endpoint& from, const std::string& token) const;
+    std::string compact_nodes(const DhtId& target, bool v6) const;
+    void add_compact_nodes(bencode::Dict& reply, const DhtId& target,
+                           const bencode::Dict& args, const Endpoint& from) const;
+    DhtRoutingTable& table_for(const Endpoint& endpoint);
+
+    void load_state();
+    void save_state() const;
+
+    static constexpr std::size_t kAlpha = 3;
+    static constexpr std::size_t kMaxCandidates = 64;
+    static constexpr std::size_t kMaxStoredTorrents = 2000;
+    static constexpr std::size_t kMaxPeersPerTorrent = 100;
+    static constexpr std::chrono::seconds kQueryTimeout{4};
+    static constexpr std::chrono::minutes kAnnounceInterval{15};
+    static constexpr std::chrono::minutes kPeerLifetime{30};
+    static constexpr std::chrono::minutes kSecretLifetime{5};
+
+    uint16_t port_;
+    std::filesystem::path state_file_;
+    DhtId self_id_{};
+    int sock_{-1};
+    PeerEventLoop loop_;
+    DhtRoutingTable table4_;
+    DhtRoutingTable table6_;
+    std::vector<std::pair<std::string, uint16_t>> bootstrap_nodes_;
+    // endpoints from the state file, tried before the routers
+    std::vector<Endpoint> saved_nodes_;
+    std::unordered_map<uint16_t, Transaction> transactions_;
+    uint16_t next_tid_{0};
+    std::unordered_map<std::uint64_t, Lookup> lookups_;
+    std::uint64_t next_lookup_{1};
+    std::unordered_map<std::string, std::vector<StoredPeer>> stored_peers_;
+    std::array<std::array<uint8_t, 16>, 2> secrets_{};
+    std::chrono::steady_clock::time_point last_secret_rotation_{};
+    std::chrono::steady_clock::time_point last_bootstrap_{};
+    std::chrono::steady_clock::time_point last_refresh_{};
+    std::chrono::steady_clock::time_point last_save_{};
+    std::chrono::steady_clock::time_point last_socket_attempt_{};
+    bool bind_warned_{false};
+    std::shared_ptr<SharedIpFilter> shared_ip_filter_;
+    uint64_t ip_filter_generation_{0};
+    std::shared_ptr<const IpFilter> ip_filter_;
+
+    // torrents_ is shared with other threads
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Torrent> torrents_;
+
+    std::atomic<std::size_t> node_count_{0};
+    std::atomic<bool> running_{false};
+    std::thread worker_;
+    AsyncLogger logger_;
+};
@@ -0,0 +1,13 @@
+// Public API for embedding dj-torrent: link the djtorrent library and include this.
+#pragma once
+
+#include "alerts.h"
+#include "dht.h"
+#include "ip_filter.h"
+#include "lsd.h"
+#include "magnet.h"
+#include "memory_governor.h"
+#include "rate_limiter.h"
+#include "topology.h"
+#include "torrent_file.h"
+#include "torrent_queue.h"
@@ -0,0 +1,96 @@
+// Endpoint is a fixed-size binary IP:port, IPv4 kept in IPv4-mapped form.
+#pragma once
+
+#include "peer.h"
+
+#include <arpa/inet.h>
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+
+struct Endpoint {
+    std::array<uint8_t, 16> addr{};
+    uint16_t port{};
+
+    static std::optional<Endpoint> from_address(const PeerAddress& address) {
+        return parse(address.ip.c_str(), address.port);
+    }
+
+    static std::optional<Endpoint> parse(const char* ip, uint16_t port) {
+        Endpoint ep;
+        ep.port = port;
+        in_addr v4{};
+        if (inet_pton(AF_INET, ip, &v4) == 1) {
+            ep.addr[10] = 0xFF;
+            ep.addr[11] = 0xFF;
+            std::memcpy(ep.addr.data() + 12, &v4, 4);
+            return ep;
+        }
+        in6_addr v6{};
+        if (inet_pton(AF_INET6, ip, &v6) == 1) {
+            std::memcpy(ep.addr.data(), &v6, 16);
+            return ep;
+        }
+        return std::nullopt;
+    }
+
+    static Endpoint from_v4(const uint8_t* bytes, uint16_t port) {
+        Endpoint ep;
+        ep.addr[10] = 0xFF;
+        ep.addr[11] = 0xFF;
+        std::memcpy(ep.addr.data() + 12, bytes, 4);
+        ep.port = port;
+        return ep;
+    }
+
+    static Endpoint from_v6(const uint8_t* bytes, uint16_t port) {
+        Endpoint ep;
+        std::memcpy(ep.addr.data(), bytes, 16);
+        ep.port = port;
+        return ep;
+    }
+
+    bool is_v4() const {
+        static constexpr uint8_t kMapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+        return std::memcmp(addr.data(), kMapped, sizeof(kMapped)) == 0;
+    }
+
+    std::string ip_string() const {
+        char buf[INET6_ADDRSTRLEN]{};
+        if (is_v4()) {
+            inet_ntop(AF_INET, addr.data() + 12, buf, sizeof(buf));
+        } else {
+            inet_ntop(AF_INET6, addr.data(), buf, sizeof(buf));
+        }
+        return buf;
+    }
+
+    PeerAddress to_address() const {
+        PeerAddress out;
+        out.ip = ip_string();
+        out.port = port;
+        return out;
+    }
+
+    uint64_t hash() const {
+        // FNV-1a over the 18 significant bytes, then a final avalanche
+        uint64_t h = 1469598103934665603ULL;
+        for (uint8_t b : addr) {
+            h = (h ^ b) * 1099511628211ULL;
+        }
+        h = (h ^ (port & 0xFF)) * 1099511628211ULL;
+        h = (h ^ (port >> 8)) * 1099511628211ULL;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    bool operator==(const Endpoint& other) const {
+        return port == other.port && addr == other.addr;
+    }
+    bool operator!=(const Endpoint& other) const { return !(*this == other); }
+};
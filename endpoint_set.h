@@ -0,0 +1,154 @@
+// Fixed-memory sets of endpoints for swarms far larger than we can track.
+#pragma once
+
+#include "endpoint.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+// Open-addressing set of binary endpoints with linear probing. The table is
+// sized once and never grows: when every slot in an endpoint's probe window
+// is taken, the oldest entry in that window is overwritten, so the set
+// degrades into a recency cache instead of using more memory.
+class EndpointSet {
+public:
+    explicit EndpointSet(std::size_t capacity) {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+            throw std::invalid_argument("EndpointSet capacity must be a power of 2");
+        }
+        slots_ = std::make_unique<Slot[]>(capacity);
+        mask_ = capacity - 1;
+    }
+
+    // True if the endpoint was not present before.
+    bool insert(const Endpoint& ep) {
+        std::size_t home = static_cast<std::size_t>(ep.hash()) & mask_;
+        Slot* victim = nullptr;
+        for (std::size_t i = 0; i < kProbeWindow; ++i) {
+            Slot& s = slots_[(home + i) & mask_];
+            if (s.stamp == 0) {
+                victim = &s;
+                break;
+            }
+            if (s.ep == ep) {
+                return false;
+            }
+            if (!victim || s.stamp < victim->stamp) {
+                victim = &s;
+            }
+        }
+        if (victim->stamp == 0) {
+            ++size_;
+        } else {
+            ++evictions_;
+        }
+        victim->ep = ep;
+        victim->stamp = ++clock_;
+        return true;
+    }
+
+    bool contains(const Endpoint& ep) const {
+        std::size_t home = static_cast<std::size_t>(ep.hash()) & mask_;
+        for (std::size_t i = 0; i < kProbeWindow; ++i) {
+            const Slot& s = slots_[(home + i) & mask_];
+            if (s.stamp != 0 && s.ep == ep) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void clear() {
+        std::fill(slots_.get(), slots_.get() + mask_ + 1, Slot{});
+        size_ = 0;
+    }
+
+    std::size_t size() const { return size_; }
+    std::size_t capacity() const { return mask_ + 1; }
+    std::size_t memory_bytes() const { return capacity() * sizeof(Slot); }
+    std::uint64_t evictions() const { return evictions_; }
+
+private:
+    static constexpr std::size_t kProbeWindow = 16;
+
+    struct Slot {
+        Endpoint ep;
+        uint32_t stamp{0};
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    std::size_t mask_{0};
+    std::size_t size_{0};
+    uint32_t clock_{0};
+    std::uint64_t evictions_{0};
+};
+
+// Counting Bloom filter over endpoints. add()/remove() adjust k counters;
+// age() decrements every counter so entries fade out after a few rounds.
+class CountingBloomFilter {
+public:
+    explicit CountingBloomFilter(std::size_t counters) {
+        if (counters == 0 || (counters & (counters - 1)) != 0) {
+            throw std::invalid_argument("CountingBloomFilter size must be a power of 2");
+        }
+        counters_ = std::make_unique<uint8_t[]>(counters);
+        mask_ = counters - 1;
+    }
+
+    void add(const Endpoint& ep) {
+        for_each_index(ep, [](uint8_t& c) {
+            if (c < kMaxCount) {
+                ++c;
+            }
+        });
+    }
+
+    void remove(const Endpoint& ep) {
+        for_each_index(ep, [](uint8_t& c) {
+            if (c > 0 && c < kMaxCount) {
+                --c;
+            }
+        });
+    }
+
+    bool maybe_contains(const Endpoint& ep) const {
+        uint64_t h = ep.hash();
+        uint64_t step = (h >> 32) | 1;
+        for (std::size_t i = 0; i < kHashes; ++i) {
+            if (counters_[(h + i * step) & mask_] == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void age() {
+        for (std::size_t i = 0; i <= mask_; ++i) {
+            if (counters_[i] > 0) {
+                --counters_[i];
+            }
+        }
+    }
+
+    void clear() { std::fill(counters_.get(), counters_.get() + mask_ + 1, uint8_t{0}); }
+
+    std::size_t memory_bytes() const { return mask_ + 1; }
+
+private:
+    static constexpr std::size_t kHashes = 3;
+    static constexpr uint8_t kMaxCount = 15;
+
+    template <typename Fn>
+    void for_each_index(const Endpoint& ep, Fn&& fn) {
+        uint64_t h = ep.hash();
+        uint64_t step = (h >> 32) | 1;
+        for (std::size_t i = 0; i < kHashes; ++i) {
+            fn(counters_[(h + i * step) & mask_]);
+        }
+    }
+
+    std::unique_ptr<uint8_t[]> counters_;
+    std::size_t mask_{0};
+};
@@ -0,0 +1,392 @@
+#include "handoff.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+constexpr uint32_t kMagic = 0x444a484f; // "DJHO"
+constexpr uint32_t kVersion = 6;
+// stays well below the kernel's SCM_MAX_FD (253) per message
+constexpr std::size_t kFdsPerMessage = 200;
+
+class Writer {
+public:
+    void u8(uint8_t v) { out_.push_back(static_cast<char>(v)); }
+    void u16(uint16_t v) { be(v, 2); }
+    void u32(uint32_t v) { be(v, 4); }
+    void u64(uint64_t v) { be(v, 8); }
+    void i32(int32_t v) { u32(static_cast<uint32_t>(v)); }
+    void boolean(bool v) { u8(v ? 1 : 0); }
+    void bytes(const void* p, std::size_t n) {
+        u32(static_cast<uint32_t>(n));
+        out_.append(static_cast<const char*>(p), n);
+    }
+    void str(const std::string& s) { bytes(s.data(), s.size()); }
+    void vec(const std::vector<uint8_t>& v) { bytes(v.data(), v.size()); }
+    std::string take() { return std::move(out_); }
+
+private:
+    void be(uint64_t v, int n) {
+        for (int i = n - 1; i >= 0; --i) {
+            out_.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+        }
+    }
+    std::string out_;
+};
+
+class Reader {
+public:
+    explicit Reader(std::string_view in) : in_(in) {}
+
+    uint8_t u8() { return static_cast<uint8_t>(be(1)); }
+    uint16_t u16() { return static_cast<uint16_t>(be(2)); }
+    uint32_t u32() { return static_cast<uint32_t>(be(4)); }
+    uint64_t u64() { return be(8); }
+    int32_t i32() { return static_cast<int32_t>(u32()); }
+    bool boolean() { return u8() != 0; }
+    std::string_view bytes() {
+        uint32_t n = u32();
+        need(n);
+        std::string_view out = in_.substr(pos_, n);
+        pos_ += n;
+        return out;
+    }
+    std::string str() { return std::string(bytes()); }
+    std::vector<uint8_t> vec() {
+        auto b = bytes();
+        return std::vector<uint8_t>(b.begin(), b.end());
+    }
+    // element counts are bounded by the bytes left, so a corrupt count
+    // cannot make us reserve gigabytes
+    uint32_t count() {
+        uint32_t n = u32();
+        if (n > in_.size() - pos_) {
+            throw std::runtime_error("handoff snapshot truncated");
+        }
+        return n;
+    }
+
+private:
+    void need(std::size_t n) const {
+        if (in_.size() - pos_ < n) {
+            throw std::runtime_error("handoff snapshot truncated");
+        }
+    }
+    uint64_t be(int n) {
+        need(static_cast<std::size_t>(n));
+        uint64_t v = 0;
+        for (int i = 0; i < n; ++i) {
+            v = (v << 8) | static_cast<uint8_t>(in_[pos_++]);
+        }
+        return v;
+    }
+    std::string_view in_;
+    std::size_t pos_{0};
+};
+
+bool write_all(int fd, const char* p, std::size_t n) {
+    while (n > 0) {
+        ssize_t w = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += w;
+        n -= static_cast<std::size_t>(w);
+    }
+    return true;
+}
+
+void read_all(int fd, char* p, std::size_t n) {
+    while (n > 0) {
+        ssize_t r = ::recv(fd, p, n, 0);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            throw std::runtime_error("handoff connection closed early");
+        }
+        p += r;
+        n -= static_cast<std::size_t>(r);
+    }
+}
+
+void write_requests(Writer& w, const std::vector<PieceManager::Request>& requests) {
+    w.u32(static_cast<uint32_t>(requests.size()));
+    for (const auto& req : requests) {
+        w.u32(req.piece_index);
+        w.u32(req.begin);
+        w.u32(req.length);
+    }
+}
+
+std::vector<PieceManager::Request> read_requests(Reader& r) {
+    std::vector<PieceManager::Request> out;
+    for (uint32_t n = r.count(); n > 0; --n) {
+        PieceManager::Request req{};
+        req.piece_index = r.u32();
+        req.begin = r.u32();
+        req.length = r.u32();
+        out.push_back(req);
+    }
+    return out;
+}
+
+void write_peer(Writer& w, const HandoffPeer& hp) {
+    const Peer::Detached& d = hp.peer;
+    w.i32(d.fd);
+    w.str(d.remote.ip);
+    w.u16(d.remote.port);
+    w.boolean(d.remote.seed);
+    w.boolean(d.initiated);
+    w.str(d.remote_peer_id);
+    w.u8(d.remote_ut_pex_id);
+    w.u8(d.remote_ut_metadata_id);
+    w.boolean(d.remote_upload_only);
+    w.u32(d.remote_request_queue);
+    w.u16(d.remote_listen_port);
+    w.boolean(d.remote_fast);
+    w.boolean(d.remote_v2);
+    w.vec(d.incoming);
+    w.vec(d.outgoing);
+    w.vec(hp.bitfield);
+    w.boolean(hp.choked);
+    w.boolean(hp.interested);
+    w.boolean(hp.am_choking);
+    w.boolean(hp.peer_interested);
+    w.boolean(hp.upload_only);
+    w.u64(hp.bytes_from_peer);
+    write_requests(w, hp.outstanding);
+    write_requests(w, hp.upload_queue);
+}
+
+HandoffPeer read_peer(Reader& r) {
+    HandoffPeer hp;
+    Peer::Detached& d = hp.peer;
+    d.fd = r.i32();
+    d.remote.ip = r.str();
+    d.remote.port = r.u16();
+    d.remote.seed = r.boolean();
+    d.initiated = r.boolean();
+    d.remote_peer_id = r.str();
+    d.remote_ut_pex_id = r.u8();
+    d.remote_ut_metadata_id = r.u8();
+    d.remote_upload_only = r.boolean();
+    d.remote_request_queue = r.u32();
+    d.remote_listen_port = r.u16();
+    d.remote_fast = r.boolean();
+    d.remote_v2 = r.boolean();
+    d.incoming = r.vec();
+    d.outgoing = r.vec();
+    hp.bitfield = r.vec();
+    hp.choked = r.boolean();
+    hp.interested = r.boolean();
+    hp.am_choking = r.boolean();
+    hp.peer_interested = r.boolean();
+    hp.upload_only = r.boolean();
+    hp.bytes_from_peer = r.u64();
+    hp.outstanding = read_requests(r);
+    hp.upload_queue = read_requests(r);
+    return hp;
+}
+
+} // namespace
+
+std::string encode_handoff(const HandoffSnapshot& snapshot) {
+    Writer w;
+    w.str(snapshot.peer_id);
+    w.u32(static_cast<uint32_t>(snapshot.torrents.size()));
+    for (const auto& t : snapshot.torrents) {
+        w.u64(t.id);
+        w.u16(t.port);
+        w.boolean(t.active);
+        w.boolean(t.paused);
+        w.boolean(t.super_seed);
+        w.str(t.info_bencoded);
+        w.boolean(t.announce_url.has_value());
+        w.str(t.announce_url.value_or(""));
+        w.u32(static_cast<uint32_t>(t.announce_list.size()));
+        for (const auto& url : t.announce_list) {
+            w.str(url);
+        }
+        w.u32(static_cast<uint32_t>(t.web_seeds.size()));
+        for (const auto& url : t.web_seeds) {
+            w.str(url);
+        }
+        w.str(t.magnet);
+        w.boolean(t.has_session);
+        w.vec(t.have);
+        w.u32(static_cast<uint32_t>(t.partials.size()));
+        for (const auto& p : t.partials) {
+            w.u32(p.piece_index);
+            w.u32(static_cast<uint32_t>(p.blocks.size()));
+            for (uint32_t b : p.blocks) {
+                w.u32(b);
+            }
+            w.vec(p.data);
+        }
+        w.u64(t.downloaded);
+        w.u64(t.uploaded);
+        w.i32(t.listen_fd);
+        w.u32(static_cast<uint32_t>(t.peers.size()));
+        for (const auto& hp : t.peers) {
+            write_peer(w, hp);
+        }
+    }
+    return w.take();
+}
+
+HandoffSnapshot decode_handoff(std::string_view bytes) {
+    Reader r(bytes);
+    HandoffSnapshot snapshot;
+    snapshot.peer_id = r.str();
+    uint32_t torrents = r.count();
+    for (uint32_t i = 0; i < torrents; ++i) {
+        HandoffTorrent t;
+        t.id = r.u64();
+        t.port = r.u16();
+        t.active = r.boolean();
+        t.paused = r.boolean();
+        t.super_seed = r.boolean();
+        t.info_bencoded = r.str();
+        bool has_announce = r.boolean();
+        std::string announce = r.str();
+        if (has_announce) {
+            t.announce_url = std::move(announce);
+        }
+        for (uint32_t n = r.count(); n > 0; --n) {
+            t.announce_list.push_back(r.str());
+        }
+        for (uint32_t n = r.count(); n > 0; --n) {
+            t.web_seeds.push_back(r.str());
+        }
+        t.magnet = r.str();
+        t.has_session = r.boolean();
+        t.have = r.vec();
+        for (uint32_t n = r.count(); n > 0; --n) {
+            PieceManager::PartialPiece p;
+            p.piece_index = r.u32();
+            for (uint32_t b = r.count(); b > 0; --b) {
+                p.blocks.push_back(r.u32());
+            }
+            p.data = r.vec();
+            t.partials.push_back(std::move(p));
+        }
+        t.downloaded = r.u64();
+        t.uploaded = r.u64();
+        t.listen_fd = r.i32();
+        for (uint32_t n = r.count(); n > 0; --n) {
+            t.peers.push_back(read_peer(r));
+        }
+        snapshot.torrents.push_back(std::move(t));
+    }
+    return snapshot;
+}
+
+bool send_handoff(int sock, const HandoffSnapshot& snapshot, const std::vector<int>& fds) {
+    std::string body = encode_handoff(snapshot);
+    Writer header;
+    header.u32(kMagic);
+    header.u32(kVersion);
+    header.u64(body.size());
+    header.u32(static_cast<uint32_t>(fds.size()));
+    std::string head = header.take();
+    if (!write_all(sock, head.data(), head.size()) || !write_all(sock, body.data(), body.size())) {
+        return false;
+    }
+
+    for (std::size_t sent = 0; sent < fds.size();) {
+        std::size_t n = std::min(kFdsPerMessage, fds.size() - sent);
+        std::vector<char> control(CMSG_SPACE(n * sizeof(int)), 0);
+        char marker = 'F';
+        iovec iov{&marker, 1};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), fds.data() + sent, n * sizeof(int));
+        ssize_t w;
+        do {
+            w = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (w < 0 && errno == EINTR);
+        if (w != 1) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+HandoffSnapshot receive_handoff(int sock) {
+    char head[20];
+    read_all(sock, head, sizeof(head));
+    Reader header(std::string_view(head, sizeof(head)));
+    if (header.u32() != kMagic || header.u32() != kVersion) {
+        throw std::runtime_error("handoff peer speaks a different protocol");
+    }
+    uint64_t body_len = header.u64();
+    uint32_t fd_count = header.u32();
+    std::string body(body_len, '\0');
+    read_all(sock, body.data(), body.size());
+    HandoffSnapshot snapshot = decode_handoff(body);
+
+    std::vector<int> fds;
+    fds.reserve(fd_count);
+    while (fds.size() < fd_count) {
+        std::vector<char> control(CMSG_SPACE(kFdsPerMessage * sizeof(int)), 0);
+        char marker = 0;
+        iovec iov{&marker, 1};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        ssize_t r;
+        do {
+            r = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (r < 0 && errno == EINTR);
+        if (r <= 0) {
+            for (int fd : fds) {
+                ::close(fd);
+            }
+            throw std::runtime_error("handoff connection closed before all sockets arrived");
+        }
+        for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            std::size_t n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const auto* data = reinterpret_cast<const int*>(CMSG_DATA(c));
+            fds.insert(fds.end(), data, data + n);
+        }
+    }
+
+    resolve_handoff_fds(snapshot, fds);
+    return snapshot;
+}
+
+void resolve_handoff_fds(HandoffSnapshot& snapshot, const std::vector<int>& fds) {
+    auto resolve = [&fds](int index) {
+        return index >= 0 && static_cast<std::size_t>(index) < fds.size()
+                   ? fds[static_cast<std::size_t>(index)]
+                   : -1;
+    };
+    for (auto& t : snapshot.torrents) {
+        t.listen_fd = resolve(t.listen_fd);
+        for (auto& hp : t.peers) {
+            hp.peer.fd = resolve(hp.peer.fd);
+        }
+    }
+}
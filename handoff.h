@@ -0,0 +1,71 @@
+// Hot restart: the state and sockets one process hands to its replacement.
+#pragma once
+
+#include "peer.h"
+#include "piece_manager.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A connected peer: the socket-level state plus what the session knew.
+// While in transit, peer.fd is an index into the handed-over fd list.
+struct HandoffPeer {
+    Peer::Detached peer;
+    std::vector<uint8_t> bitfield;
+    bool choked{true};
+    bool interested{false};
+    bool am_choking{true};
+    bool peer_interested{false};
+    bool upload_only{false};
+    std::uint64_t bytes_from_peer{0};
+    // requests we sent and it has not answered, and requests it sent that
+    // we have not served; both carry on in the new process
+    std::vector<PieceManager::Request> outstanding;
+    std::vector<PieceManager::Request> upload_queue;
+};
+
+struct HandoffTorrent {
+    std::uint64_t id{0};
+    uint16_t port{0};
+    bool active{false};
+    bool paused{false};
+    bool super_seed{false};
+    std::string info_bencoded;
+    std::optional<std::string> announce_url;
+    std::vector<std::string> announce_list;
+    std::vector<std::string> web_seeds;
+    // a magnet still waiting for metadata; info_bencoded is empty then
+    std::string magnet;
+
+    // everything below is only meaningful when the session existed
+    bool has_session{false};
+    std::vector<uint8_t> have;
+    std::vector<PieceManager::PartialPiece> partials;
+    std::uint64_t downloaded{0};
+    std::uint64_t uploaded{0};
+    // index into the fd list, -1 for none
+    int listen_fd{-1};
+    std::vector<HandoffPeer> peers;
+};
+
+struct HandoffSnapshot {
+    std::string peer_id;
+    std::vector<HandoffTorrent> torrents;
+};
+
+std::string encode_handoff(const HandoffSnapshot& snapshot);
+// Throws std::runtime_error on truncated or foreign input.
+HandoffSnapshot decode_handoff(std::string_view bytes);
+
+// Blocking. Writes the snapshot and then passes fds with SCM_RIGHTS; the
+// caller still owns (and should close) its copies afterwards.
+bool send_handoff(int sock, const HandoffSnapshot& snapshot, const std::vector<int>& fds);
+// Blocking. Returns the snapshot with fd indices replaced by the received
+// descriptors. Throws std::runtime_error on any protocol failure.
+HandoffSnapshot receive_handoff(int sock);
+// Replaces the in-transit fd indices with descriptors from fds; indices
+// out of range become -1.
+void resolve_handoff_fds(HandoffSnapshot& snapshot, const std::vector<int>& fds);
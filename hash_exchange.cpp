@@ -0,0 +1,213 @@
+#include "session.h"
+
+#include <algorithm>
+
+namespace {
+
+constexpr auto kBlockHashTimeout = std::chrono::seconds(10);
+// peers asked about one piece before it is fetched again whole
+constexpr std::size_t kMaxBlockHashAttempts = 4;
+// BEP 52 lets a request ask for at most 512 hashes
+constexpr uint32_t kMaxHashesPerRequest = 512;
+// leaf hashes cost a whole piece read and hashed; one peer gets that at
+// most this often, which is plenty for the odd failed piece
+constexpr auto kMinLeafRebuildGap = std::chrono::seconds(2);
+
+Sha256Hash root_of(const Peer::Event& ev) {
+    Sha256Hash root{};
+    std::copy_n(ev.payload.begin(), root.size(), root.begin());
+    return root;
+}
+
+} // namespace
+
+// Asks one v2 peer that has the piece, and that was not asked before, for
+// the piece's 16 KiB leaf hashes; when nobody is left the piece starts over.
+void Session::request_block_hashes(uint32_t piece_index) {
+    auto info = torrent_.v2_piece(piece_index);
+    BlockHashRequest& request = block_hash_requests_[piece_index];
+    request.fd = -1;
+    if (info && request.tried.size() < kMaxBlockHashAttempts) {
+        for (const auto& [fd, state] : peers_) {
+            Peer* peer = event_loop_.peer_by_fd(fd);
+            if (!peer || peer->is_closed() || !peer->supports_v2() ||
+                !bitfield_test(state.bitfield, piece_index) ||
+                std::find(request.tried.begin(), request.tried.end(), fd) !=
+                    request.tried.end()) {
+                continue;
+            }
+            auto leaves = static_cast<uint32_t>(info->leaves);
+            peer->send_hash_request(torrent_.files[info->file].pieces_root, 0,
+                                    info->index_in_file * leaves, leaves, 0);
+            request.fd = fd;
+            request.sent_at = std::chrono::steady_clock::now();
+            request.tried.push_back(fd);
+            return;
+        }
+    }
+    block_hash_requests_.erase(piece_index);
+    piece_manager_.give_up_block_hashes(piece_index);
+    logger_.info("piece " + std::to_string(piece_index) +
+                 " failed its hash check; fetching it again");
+}
+
+void Session::maybe_expire_block_hash_requests() {
+    if (block_hash_requests_.empty()) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    std::vector<uint32_t> retry;
+    for (auto it = block_hash_requests_.begin(); it != block_hash_requests_.end();) {
+        if (!piece_manager_.awaiting_block_hashes(it->first)) {
+            it = block_hash_requests_.erase(it);
+            continue;
+        }
+        Peer* peer = event_loop_.peer_by_fd(it->second.fd);
+        if (!peer || peer->is_closed() || now - it->second.sent_at >= kBlockHashTimeout) {
+            retry.push_back(it->first);
+        }
+        ++it;
+    }
+    for (uint32_t piece_index : retry) {
+        request_block_hashes(piece_index);
+    }
+}
+
+// Only answers to our own base-layer requests are accepted; the leaves are
+// checked against the piece hash, so a peer cannot poison the piece.
+void Session::handle_hashes(Peer& peer, const Peer::Event& ev) {
+    Sha256Hash root = root_of(ev);
+    for (auto& [piece_index, request] : block_hash_requests_) {
+        auto info = torrent_.v2_piece(piece_index);
+        if (request.fd != peer.fd() || !info || ev.piece_index != 0 ||
+            ev.length != info->leaves || ev.begin != info->index_in_file * info->leaves ||
+            torrent_.files[info->file].pieces_root != root) {
+            continue;
+        }
+        std::vector<Sha256Hash> leaves;
+        // proof hashes, if it sent any, follow the leaves and are not needed
+        if ((ev.payload.size() - root.size()) / 32 >= ev.length) {
+            leaves.resize(ev.length);
+            for (std::size_t i = 0; i < leaves.size(); ++i) {
+                std::copy_n(ev.payload.begin() + static_cast<std::ptrdiff_t>(32 + 32 * i), 32,
+                            leaves[i].begin());
+            }
+        }
+        uint32_t piece = piece_index;
+        if (!leaves.empty() && piece_manager_.add_block_hashes(piece, std::move(leaves))) {
+            block_hash_requests_.erase(piece);
+        } else {
+            logger_.warn("peer " + peer.remote().ip + " sent bad hashes for piece " +
+                         std::to_string(piece));
+            request_block_hashes(piece);
+        }
+        return;
+    }
+}
+
+void Session::handle_hash_reject(Peer& peer, const Peer::Event& ev) {
+    Sha256Hash root = root_of(ev);
+    for (const auto& [piece_index, request] : block_hash_requests_) {
+        auto info = torrent_.v2_piece(piece_index);
+        if (request.fd == peer.fd() && info && torrent_.files[info->file].pieces_root == root &&
+            ev.begin == info->index_in_file * info->leaves) {
+            request_block_hashes(piece_index);
+            return;
+        }
+    }
+}
+
+// Serves leaf hashes from within one piece we have, rebuilt from the data
+// on disk, and ranges of a file's piece layer. The proof climbs the piece
+// subtree first and then the file's piece-layer tree.
+void Session::serve_hash_request(Peer& peer, PeerState& state, const Peer::Event& ev) {
+    Sha256Hash root = root_of(ev);
+    auto reject = [&]() {
+        peer.send_hash_reject(root, ev.piece_index, ev.begin, ev.length, ev.proof_layers);
+    };
+    auto file_it = std::find_if(torrent_.files.begin(), torrent_.files.end(),
+                                [&root](const TorrentFile::FileEntry& f) {
+                                    return !f.pad && f.length > 0 && f.pieces_root == root;
+                                });
+    if (file_it == torrent_.files.end() || ev.length < 1 || ev.length > kMaxHashesPerRequest ||
+        (ev.length & (ev.length - 1)) != 0 || ev.begin % ev.length != 0) {
+        reject();
+        return;
+    }
+    const TorrentFile::FileEntry& file = *file_it;
+    auto file_index = static_cast<std::size_t>(file_it - torrent_.files.begin());
+    auto first_piece = static_cast<uint32_t>(torrent_.file_offsets[file_index] /
+                                             torrent_.piece_length);
+    unsigned piece_level =
+        merkle_log2(static_cast<std::size_t>(torrent_.piece_length) / kMerkleBlockSize);
+    bool multi_piece = file.length > torrent_.piece_length;
+    unsigned below = merkle_log2(ev.length);
+
+    std::vector<Sha256Hash> out;
+    uint32_t layer_index = 0;
+    unsigned proof_left = ev.proof_layers;
+    if (ev.piece_index == 0) {
+        auto info = torrent_.v2_piece(first_piece);
+        std::size_t per_piece = info ? info->leaves : 0;
+        auto now = std::chrono::steady_clock::now();
+        if (!info || ev.length > per_piece ||
+            (state.last_leaf_rebuild.time_since_epoch().count() != 0 &&
+             now - state.last_leaf_rebuild < kMinLeafRebuildGap)) {
+            reject();
+            return;
+        }
+        layer_index = static_cast<uint32_t>(ev.begin / per_piece);
+        uint32_t piece_index = first_piece + layer_index;
+        info = torrent_.v2_piece(piece_index);
+        if (!info || info->file != file_index || !piece_manager_.have_piece(piece_index)) {
+            reject();
+            return;
+        }
+        state.last_leaf_rebuild = now;
+        auto data = storage_.read_block(piece_index, 0, static_cast<uint32_t>(info->data_length));
+        if (!data) {
+            reject();
+            return;
+        }
+        std::vector<Sha256Hash> leaves;
+        for (std::size_t begin = 0; begin < data->size(); begin += kMerkleBlockSize) {
+            std::size_t len = std::min(kMerkleBlockSize, data->size() - begin);
+            leaves.push_back(sha256(data->data() + begin, len));
+        }
+        MerkleTree tree(std::move(leaves), info->leaves);
+        std::size_t offset = ev.begin % info->leaves;
+        const auto& level = tree.level(0);
+        out.assign(level.begin() + static_cast<std::ptrdiff_t>(offset),
+                   level.begin() + static_cast<std::ptrdiff_t>(offset + ev.length));
+        auto proof = tree.uncles(below, offset / ev.length, proof_left);
+        proof_left -= static_cast<unsigned>(proof.size());
+        out.insert(out.end(), proof.begin(), proof.end());
+        below = 0;
+    } else if (ev.piece_index == piece_level && multi_piece && !file.piece_layer.empty() &&
+               static_cast<uint64_t>(ev.begin) + ev.length <=
+                   merkle_width(file.piece_layer.size())) {
+        layer_index = ev.begin;
+    } else {
+        reject();
+        return;
+    }
+
+    if (multi_piece && !file.piece_layer.empty()) {
+        auto tree_it = piece_layer_trees_.find(file_index);
+        if (tree_it == piece_layer_trees_.end()) {
+            tree_it = piece_layer_trees_
+                          .emplace(file_index, MerkleTree(file.piece_layer, 0, piece_level))
+                          .first;
+        }
+        const MerkleTree& layer = tree_it->second;
+        if (ev.piece_index != 0) {
+            const auto& level = layer.level(0);
+            out.assign(level.begin() + ev.begin, level.begin() + ev.begin + ev.length);
+        }
+        if (proof_left > 0) {
+            auto proof = layer.uncles(below, layer_index >> below, proof_left);
+            out.insert(out.end(), proof.begin(), proof.end());
+        }
+    }
+    peer.send_hashes(root, ev.piece_index, ev.begin, ev.length, ev.proof_layers, out);
+}
@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <charconv>
 #include <cctype>
+#include <climits>
 #include <cstring>
 #include <netdb.h>
 #include <openssl/err.h>
@@ -134,26 +135,31 @@ struct Connection {
         }
     }
 
+    // 0 once the server has closed the connection
+    std::size_t read_some(char* out, std::size_t len) {
+        if (tls) {
+            int n = SSL_read(ssl, out, static_cast<int>(std::min<std::size_t>(len, INT_MAX)));
+            if (n <= 0) {
+                int err = SSL_get_error(ssl, n);
+                if (err == SSL_ERROR_ZERO_RETURN) return 0;
+                throw std::runtime_error("Failed to read TLS response");
+            }
+            return static_cast<std::size_t>(n);
+        }
+        ssize_t n = ::recv(fd, out, len, 0);
+        if (n < 0) {
+            throw std::runtime_error("Failed to read response");
+        }
+        return static_cast<std::size_t>(n);
+    }
+
     std::string read_all(std::size_t max_bytes) {
         std::string buf;
         char tmp[4096];
         for (;;) {
-            int n = 0;
-            if (tls) {
-                n = SSL_read(ssl, tmp, sizeof(tmp));
-                if (n <= 0) {
-                    int err = SSL_get_error(ssl, n);
-                    if (err == SSL_ERROR_ZERO_RETURN) break;
-                    throw std::runtime_error("Failed to read TLS response");
-                }
-            } else {
-                n = static_cast<int>(::recv(fd, tmp, sizeof(tmp), 0));
-                if (n < 0) {
-                    throw std::runtime_error("Failed to read response");
-                }
-                if (n == 0) break;
-            }
-            if (buf.size() + static_cast<std::size_t>(n) > max_bytes) {
+            std::size_t n = read_some(tmp, sizeof(tmp));
+            if (n == 0) break;
+            if (buf.size() + n > max_bytes) {
                 throw std::runtime_error("HTTP response exceeded safety limit");
             }
             buf.append(tmp, tmp + n);
@@ -381,3 +387,95 @@ HttpResponse http_get(const HttpUrl& url,
                       std::size_t max_response_bytes) {
     return http_get(url, path, headers, max_response_bytes, -1);
 }
+
+HttpConnection::HttpConnection(HttpUrl url, int timeout_ms)
+    : url_(std::move(url)), timeout_ms_(timeout_ms) {}
+
+HttpConnection::~HttpConnection() = default;
+
+void HttpConnection::get_range(const std::string& path, uint64_t offset, std::size_t length,
+                               uint8_t* out) {
+    // a kept-alive connection the server has meanwhile closed fails before
+    // any response; that earns one retry on a fresh one
+    bool fresh = !conn_;
+    bool responded = false;
+    try {
+        request_range(path, offset, length, out, responded);
+    } catch (const std::exception&) {
+        conn_.reset();
+        if (fresh || responded) {
+            throw;
+        }
+        request_range(path, offset, length, out, responded);
+    }
+}
+
+void HttpConnection::request_range(const std::string& path, uint64_t offset, std::size_t length,
+                                   uint8_t* out, bool& responded) {
+    if (!conn_) {
+        conn_ = std::make_unique<Connection>(make_connection(url_, timeout_ms_));
+    }
+    std::ostringstream req;
+    req << "GET " << path << " HTTP/1.1\r\n";
+    req << "Host: " << url_.host;
+    bool default_port = (!url_.use_tls && url_.port == 80) || (url_.use_tls && url_.port == 443);
+    if (!default_port) req << ":" << url_.port;
+    req << "\r\n";
+    req << "User-Agent: dj-torrent/0.1\r\n";
+    req << "Range: bytes=" << offset << "-" << offset + length - 1 << "\r\n";
+    req << "\r\n";
+    conn_->write_all(req.str());
+
+    // headers first; whatever body bytes came with them are copied out
+    constexpr std::size_t kMaxHeaderBytes = 16 * 1024;
+    std::string head;
+    std::size_t header_end = std::string::npos;
+    char tmp[4096];
+    while (header_end == std::string::npos) {
+        std::size_t n = conn_->read_some(tmp, sizeof(tmp));
+        if (n == 0) {
+            throw std::runtime_error("Connection closed before HTTP response");
+        }
+        responded = true;
+        head.append(tmp, n);
+        header_end = head.find("\r\n\r\n");
+        if (header_end == std::string::npos && head.size() > kMaxHeaderBytes) {
+            throw std::runtime_error("HTTP response headers too long");
+        }
+    }
+    std::string headers_lower = to_lower(std::string_view(head).substr(0, header_end));
+
+    int status_code = 0;
+    auto first_space = headers_lower.find(' ');
+    if (first_space != std::string::npos) {
+        (void)std::from_chars(headers_lower.data() + first_space + 1,
+                              headers_lower.data() + headers_lower.size(), status_code);
+    }
+    std::size_t content_length = 0;
+    auto cl = headers_lower.find("\r\ncontent-length:");
+    if (cl == std::string::npos) {
+        throw std::runtime_error("HTTP response without Content-Length");
+    }
+    const char* cl_begin = headers_lower.data() + cl + 17;
+    while (*cl_begin == ' ') ++cl_begin;
+    (void)std::from_chars(cl_begin, headers_lower.data() + headers_lower.size(), content_length);
+    // a 200 carries the whole file, which only fits when that is the range
+    bool whole_file = status_code == 200 && offset == 0;
+    if ((status_code != 206 && !whole_file) || content_length != length) {
+        throw std::runtime_error("Unexpected HTTP response: " +
+                                 head.substr(0, head.find("\r\n")));
+    }
+
+    std::size_t got = std::min(head.size() - header_end - 4, length);
+    std::memcpy(out, head.data() + header_end + 4, got);
+    while (got < length) {
+        std::size_t n = conn_->read_some(reinterpret_cast<char*>(out) + got, length - got);
+        if (n == 0) {
+            throw std::runtime_error("Short HTTP response body");
+        }
+        got += n;
+    }
+    if (headers_lower.find("\r\nconnection: close") != std::string::npos) {
+        conn_.reset();
+    }
+}
@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <limits>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <utility>
@@ -38,3 +39,28 @@ HttpResponse http_get(const HttpUrl& url,
                       const std::vector<std::pair<std::string, std::string>>& headers,
                       std::size_t max_response_bytes,
                       int timeout_ms);
+
+struct Connection;
+
+// One kept-alive HTTP/1.1 connection to url's host, reopened whenever the
+// server drops it; web seeds fetch many ranges of the same files this way.
+class HttpConnection {
+public:
+    HttpConnection(HttpUrl url, int timeout_ms);
+    ~HttpConnection();
+
+    HttpConnection(const HttpConnection&) = delete;
+    HttpConnection& operator=(const HttpConnection&) = delete;
+
+    // Reads bytes [offset, offset + length) of path straight into out.
+    // Throws unless the server sends exactly that range.
+    void get_range(const std::string& path, uint64_t offset, std::size_t length, uint8_t* out);
+
+private:
+    void request_range(const std::string& path, uint64_t offset, std::size_t length,
+                       uint8_t* out, bool& responded);
+
+    HttpUrl url_;
+    int timeout_ms_;
+    std::unique_ptr<Connection> conn_;
+};
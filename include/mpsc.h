@@ -0,0 +1,88 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+// Bounded multi-producer / single-consumer ring (Vyukov's sequence-numbered
+// cells). Producers claim a slot with one CAS on the tail; the consumer owns
+// the head outright. enqueue() fails instead of blocking when the ring is full.
+template <typename T, size_t SIZE>
+class MpscQueue {
+    static_assert((SIZE & (SIZE - 1)) == 0, "size must be power of 2");
+    static constexpr size_t MASK = SIZE - 1;
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail_{0};
+    alignas(CACHE_LINE_SIZE) size_t head_{0};
+    std::unique_ptr<Cell[]> cells_;
+
+    static T* item(Cell& c) noexcept { return std::launder(reinterpret_cast<T*>(c.storage)); }
+
+public:
+    MpscQueue() : cells_(new Cell[SIZE]) {
+        for (size_t i = 0; i < SIZE; ++i) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~MpscQueue() {
+        while (dequeue()) {
+        }
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    template <typename U>
+    bool enqueue(U&& value) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& c = cells_[pos & MASK];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    new (c.storage) T(std::forward<U>(value));
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer thread only.
+    std::optional<T> dequeue() {
+        Cell& c = cells_[head_ & MASK];
+        size_t seq = c.seq.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(head_ + 1) < 0) {
+            return std::nullopt;
+        }
+        T* p = item(c);
+        std::optional<T> result(std::move(*p));
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            p->~T();
+        }
+        c.seq.store(head_ + SIZE, std::memory_order_release);
+        ++head_;
+        return result;
+    }
+
+    size_t capacity() const { return SIZE; }
+};
@@ -0,0 +1,292 @@
+#include "ip_filter.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace {
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && std::isspace(static_cast<unsigned char>(s.front()))) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && std::isspace(static_cast<unsigned char>(s.back()))) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// eMule and PeerGuardian lists pad octets to three digits (001.002.003.004),
+// which inet_pton rejects.
+std::string strip_octet_padding(std::string_view ip) {
+    if (ip.find_first_not_of("0123456789.") != std::string_view::npos) {
+        return std::string(ip);
+    }
+    std::string out;
+    out.reserve(ip.size());
+    std::size_t start = 0;
+    while (start <= ip.size()) {
+        std::size_t dot = std::min(ip.find('.', start), ip.size());
+        std::string_view octet = ip.substr(start, dot - start);
+        while (octet.size() > 1 && octet.front() == '0') {
+            octet.remove_prefix(1);
+        }
+        if (start > 0) {
+            out.push_back('.');
+        }
+        out.append(octet);
+        start = dot + 1;
+    }
+    return out;
+}
+
+bool parse_ip(std::string_view text, IpBytes& out, bool& is_v4) {
+    std::string ip = strip_octet_padding(trim(text));
+    auto ep = Endpoint::parse(ip.c_str(), 0);
+    if (!ep) {
+        return false;
+    }
+    out = ep->addr;
+    is_v4 = ip.find(':') == std::string::npos;
+    return true;
+}
+
+bool increment(IpBytes& a) {
+    for (int i = 15; i >= 0; --i) {
+        if (++a[static_cast<std::size_t>(i)] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+IpBytes decrement(IpBytes a) {
+    for (int i = 15; i >= 0; --i) {
+        if (a[static_cast<std::size_t>(i)]-- != 0) {
+            break;
+        }
+    }
+    return a;
+}
+
+// Paints [first, last] with `blocked` over a boundary map where each key
+// starts a run that lasts until the next key.
+void paint(std::map<IpBytes, bool>& runs, const IpRange& r, bool blocked) {
+    IpBytes after = r.last;
+    bool has_after = increment(after);
+    bool after_value = false;
+    if (has_after) {
+        auto it = runs.upper_bound(after);
+        after_value = std::prev(it)->second;
+    }
+    auto begin = runs.lower_bound(r.first);
+    auto end = has_after ? runs.upper_bound(after) : runs.end();
+    runs.erase(begin, end);
+    runs[r.first] = blocked;
+    if (has_after) {
+        runs[after] = after_value;
+    }
+}
+
+} // namespace
+
+bool parse_ip_range(std::string_view text, IpRange& out) {
+    text = trim(text);
+    if (text.empty()) {
+        return false;
+    }
+    bool v4 = false;
+    if (auto dash = text.find('-'); dash != std::string_view::npos) {
+        bool v4_last = false;
+        if (!parse_ip(text.substr(0, dash), out.first, v4) ||
+            !parse_ip(text.substr(dash + 1), out.last, v4_last) || v4 != v4_last) {
+            return false;
+        }
+        return out.first <= out.last;
+    }
+    if (auto slash = text.find('/'); slash != std::string_view::npos) {
+        if (!parse_ip(text.substr(0, slash), out.first, v4)) {
+            return false;
+        }
+        std::string_view bits_text = trim(text.substr(slash + 1));
+        int bits = -1;
+        auto [ptr, ec] = std::from_chars(bits_text.data(), bits_text.data() + bits_text.size(), bits);
+        if (ec != std::errc() || ptr != bits_text.data() + bits_text.size()) {
+            return false;
+        }
+        int max_bits = v4 ? 32 : 128;
+        if (bits < 0 || bits > max_bits) {
+            return false;
+        }
+        int prefix = v4 ? bits + 96 : bits;
+        out.last = out.first;
+        for (int i = prefix; i < 128; ++i) {
+            auto byte = static_cast<std::size_t>(i / 8);
+            auto mask = static_cast<uint8_t>(0x80u >> (i % 8));
+            out.first[byte] = static_cast<uint8_t>(out.first[byte] & ~mask);
+            out.last[byte] = static_cast<uint8_t>(out.last[byte] | mask);
+        }
+        return true;
+    }
+    if (!parse_ip(text, out.first, v4)) {
+        return false;
+    }
+    out.last = out.first;
+    return true;
+}
+
+IpFilter IpFilter::load(const std::filesystem::path& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Failed to open ip filter: " + path.string());
+    }
+
+    // "default block" may sit anywhere in the file, so the rules are
+    // painted only once the default under them is known
+    bool default_blocked = false;
+    std::vector<std::pair<IpRange, bool>> rules;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::string_view view = trim(line);
+        if (view.empty() || view.front() == '#') {
+            continue;
+        }
+        if (view == "default block") {
+            default_blocked = true;
+            continue;
+        }
+        bool blocked = true;
+        if (view.rfind("allow ", 0) == 0) {
+            blocked = false;
+            view.remove_prefix(6);
+        } else if (view.rfind("block ", 0) == 0) {
+            view.remove_prefix(6);
+        } else if (view.rfind("deny ", 0) == 0) {
+            view.remove_prefix(5);
+        } else if (auto comma = view.find(','); comma != std::string_view::npos) {
+            std::string_view rest = trim(view.substr(comma + 1));
+            int level = 0;
+            std::from_chars(rest.data(), rest.data() + rest.size(), level);
+            blocked = level < 128;
+            view = view.substr(0, comma);
+        }
+        IpRange range;
+        if (!parse_ip_range(view, range)) {
+            continue;
+        }
+        rules.emplace_back(range, blocked);
+    }
+
+    std::map<IpBytes, bool> runs;
+    runs[IpBytes{}] = default_blocked;
+    for (const auto& [range, blocked] : rules) {
+        paint(runs, range, blocked);
+    }
+
+    IpFilter filter;
+    for (auto it = runs.begin(); it != runs.end(); ++it) {
+        if (!it->second) {
+            continue;
+        }
+        auto next = std::next(it);
+        IpRange r;
+        r.first = it->first;
+        if (next == runs.end()) {
+            r.last.fill(0xFF);
+        } else {
+            r.last = decrement(next->first);
+        }
+        if (!filter.blocked_.empty()) {
+            IpBytes joined = filter.blocked_.back().last;
+            if (increment(joined) && joined == r.first) {
+                filter.blocked_.back().last = r.last;
+                continue;
+            }
+        }
+        filter.blocked_.push_back(r);
+    }
+    return filter;
+}
+
+bool IpFilter::is_blocked(const IpBytes& addr) const {
+    auto it = std::upper_bound(blocked_.begin(), blocked_.end(), addr,
+                               [](const IpBytes& a, const IpRange& r) { return a < r.first; });
+    if (it == blocked_.begin()) {
+        return false;
+    }
+    return addr <= std::prev(it)->last;
+}
+
+SharedIpFilter::SharedIpFilter(std::filesystem::path path)
+    : path_(std::move(path)),
+      filter_(std::make_shared<const IpFilter>(IpFilter::load(path_))) {
+    std::error_code ec;
+    mtime_ = std::filesystem::last_write_time(path_, ec);
+}
+
+SharedIpFilter::~SharedIpFilter() { stop(); }
+
+void SharedIpFilter::start() {
+    if (watcher_.joinable()) {
+        return;
+    }
+    logger_.start();
+    logger_.info("ip filter loaded: " + std::to_string(current()->range_count()) +
+                 " blocked ranges");
+    watcher_ = std::thread([this]() { watch(); });
+}
+
+void SharedIpFilter::stop() {
+    if (!watcher_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    watcher_.join();
+    logger_.stop();
+}
+
+std::shared_ptr<const IpFilter> SharedIpFilter::current() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return filter_;
+}
+
+void SharedIpFilter::watch() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cv_.wait_for(lock, kPollInterval, [this]() { return stopping_; })) {
+        lock.unlock();
+        maybe_reload();
+        lock.lock();
+    }
+}
+
+// Parsing runs here, off every loop; a file that fails to parse leaves the
+// last good table in place.
+void SharedIpFilter::maybe_reload() {
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(path_, ec);
+    if (ec || mtime == mtime_) {
+        return;
+    }
+    mtime_ = mtime;
+    try {
+        auto filter = std::make_shared<const IpFilter>(IpFilter::load(path_));
+        std::size_t ranges = filter->range_count();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            filter_ = std::move(filter);
+        }
+        generation_.fetch_add(1, std::memory_order_acq_rel);
+        logger_.info("ip filter reloaded: " + std::to_string(ranges) + " blocked ranges");
+    } catch (const std::exception& ex) {
+        logger_.warn(std::string("ip filter reload failed: ") + ex.what());
+    }
+}
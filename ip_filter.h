@@ -0,0 +1,84 @@
+// IpFilter answers "is this address blocked" against large range lists.
+#pragma once
+
+#include "endpoint.h"
+#include "logger.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using IpBytes = std::array<uint8_t, 16>;
+
+// Inclusive address range in the 16-byte space of Endpoint (IPv4-mapped).
+struct IpRange {
+    IpBytes first{};
+    IpBytes last{};
+};
+
+// Accepts "a.b.c.d", "a.b.c.d/n", "a.b.c.d - e.f.g.h" and the IPv6 forms.
+bool parse_ip_range(std::string_view text, IpRange& out);
+
+class IpFilter {
+public:
+    // One rule per line, later lines override earlier ones where they overlap:
+    //   [block|allow] <range>      (a bare range is a block)
+    //   <range> , <level> , <desc> (eMule/PeerGuardian .dat, level < 128 blocks)
+    //   default block              (everything not allowed is blocked, on any line)
+    // Lines starting with '#' and blank lines are skipped.
+    static IpFilter load(const std::filesystem::path& path);
+
+    bool is_blocked(const IpBytes& addr) const;
+    bool is_blocked(const Endpoint& ep) const { return is_blocked(ep.addr); }
+
+    std::size_t range_count() const { return blocked_.size(); }
+
+private:
+    // sorted, non-overlapping blocked ranges
+    std::vector<IpRange> blocked_;
+};
+
+// The one filter every session, the DHT and LSD consult. The file is read
+// in the constructor, so the table is there before anything is dialled;
+// after start() a thread of its own polls the file and swaps in a new
+// table when it changes. Readers keep the table they took and notice a
+// swap through generation().
+class SharedIpFilter {
+public:
+    // Throws when the file cannot be read.
+    explicit SharedIpFilter(std::filesystem::path path);
+    ~SharedIpFilter();
+
+    SharedIpFilter(const SharedIpFilter&) = delete;
+    SharedIpFilter& operator=(const SharedIpFilter&) = delete;
+
+    void start();
+    void stop();
+
+    std::shared_ptr<const IpFilter> current() const;
+    uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
+
+private:
+    void watch();
+    void maybe_reload();
+
+    static constexpr std::chrono::seconds kPollInterval{10};
+
+    std::filesystem::path path_;
+    std::filesystem::file_time_type mtime_{};
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_{false};
+    std::shared_ptr<const IpFilter> filter_;
+    std::atomic<uint64_t> generation_{1};
+    std::thread watcher_;
+    AsyncLogger logger_;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "include/spsc.h"
+#include "memory_governor.h"
 
 #include <atomic>
 #include <string_view>
@@ -34,6 +35,8 @@ private:
     void run();
 
     LockFreeQueue<Record, 1024> queue_;
+    // the ring itself lives on the heap, sized once
+    MemoryCharge queue_charge_{MemorySubsystem::Logger, 1024 * sizeof(Record)};
     std::thread worker_;
     std::atomic<bool> running_{false};
 };
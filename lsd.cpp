@@ -0,0 +1,324 @@
+#include "lsd.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <random>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr char kGroup4[] = "239.192.152.143";
+constexpr char kGroup6[] = "ff15::efc0:988f";
+
+std::string to_hex(const uint8_t* data, std::size_t len) {
+    static constexpr char kHexDigits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(len * 2);
+    for (std::size_t i = 0; i < len; ++i) {
+        out.push_back(kHexDigits[data[i] >> 4]);
+        out.push_back(kHexDigits[data[i] & 0x0F]);
+    }
+    return out;
+}
+
+std::string random_cookie() {
+    std::random_device rd;
+    uint8_t bytes[8];
+    for (auto& b : bytes) {
+        b = static_cast<uint8_t>(rd());
+    }
+    return to_hex(bytes, sizeof(bytes));
+}
+
+std::string lowercase(std::string_view s) {
+    std::string out(s);
+    std::transform(out.begin(), out.end(), out.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return out;
+}
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+} // namespace
+
+Lsd::Lsd(std::string interface)
+    : interface_(std::move(interface)),
+      cookie_(random_cookie()),
+      loop_(PeerEventLoop::EventCallback{}) {}
+
+Lsd::~Lsd() { stop(); }
+
+void Lsd::start() {
+    if (worker_.joinable()) {
+        return;
+    }
+    logger_.start();
+    running_.store(true, std::memory_order_relaxed);
+    worker_ = std::thread([this]() { run(); });
+}
+
+void Lsd::stop() {
+    if (!worker_.joinable()) {
+        return;
+    }
+    running_.store(false, std::memory_order_relaxed);
+    loop_.wake();
+    worker_.join();
+    close_sockets();
+    logger_.stop();
+}
+
+void Lsd::add_torrent(const std::array<uint8_t, 20>& info_hash, uint16_t listen_port,
+                      PeersCallback on_peers) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Torrent& t = torrents_[to_hex(info_hash.data(), info_hash.size())];
+        t.port = listen_port;
+        t.on_peers = std::move(on_peers);
+        // pausing and resuming in a loop must not turn into a multicast storm
+        t.next_announce = t.last_announce + kMinAnnounceGap;
+    }
+    loop_.wake();
+}
+
+void Lsd::remove_torrent(const std::array<uint8_t, 20>& info_hash) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    torrents_.erase(to_hex(info_hash.data(), info_hash.size()));
+}
+
+void Lsd::run() {
+    while (running_.load(std::memory_order_relaxed)) {
+        auto now = Clock::now();
+        if ((sock4_ < 0 || sock6_ < 0) && now - last_socket_attempt_ >= kSocketRetry) {
+            last_socket_attempt_ = now;
+            open_sockets();
+        }
+        refresh_ip_filter();
+        loop_.run_once(500);
+        maybe_announce(Clock::now());
+    }
+}
+
+void Lsd::refresh_ip_filter() {
+    if (!shared_ip_filter_ || shared_ip_filter_->generation() == ip_filter_generation_) {
+        return;
+    }
+    ip_filter_generation_ = shared_ip_filter_->generation();
+    ip_filter_ = shared_ip_filter_->current();
+    // drain_datagrams drops blocked senders before handle_datagram runs
+    loop_.set_ip_filter(ip_filter_.get());
+}
+
+void Lsd::open_sockets() {
+    if (sock4_ < 0) {
+        sock4_ = open_socket(false);
+    }
+    if (sock6_ < 0) {
+        sock6_ = open_socket(true);
+    }
+}
+
+// Every client on the host binds the same port, so SO_REUSEADDR and
+// SO_REUSEPORT are both needed for the kernel to hand each one a copy.
+int Lsd::open_socket(bool v6) {
+    int fd = ::socket(v6 ? AF_INET6 : AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int yes = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+    bool ok;
+    if (v6) {
+        ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes));
+        sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(kPort);
+        ipv6_mreq mreq{};
+        ::inet_pton(AF_INET6, kGroup6, &mreq.ipv6mr_multiaddr);
+        ok = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+             ::setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) == 0;
+        ::setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &yes, sizeof(yes));
+    } else {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(kPort);
+        ip_mreq mreq{};
+        ::inet_pton(AF_INET, kGroup4, &mreq.imr_multiaddr);
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (!interface_.empty() && ::inet_pton(AF_INET, interface_.c_str(),
+                                               &mreq.imr_interface) == 1) {
+            ::setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq.imr_interface,
+                         sizeof(mreq.imr_interface));
+        }
+        ok = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+             ::setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0;
+        unsigned char loop = 1;
+        ::setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    }
+    if (!ok) {
+        logger_.warn(std::string("lsd: cannot join the ") + (v6 ? "IPv6" : "IPv4") +
+                     " group: " + std::strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    if (!loop_.add_datagram_socket(
+            fd, [this](const uint8_t* data, std::size_t len, const Endpoint& from) {
+                handle_datagram(data, len, from);
+            })) {
+        ::close(fd);
+        return -1;
+    }
+    logger_.info(std::string("lsd: listening on ") + (v6 ? kGroup6 : kGroup4) + " port " +
+                 std::to_string(kPort));
+    return fd;
+}
+
+void Lsd::close_sockets() {
+    for (int* fd : {&sock4_, &sock6_}) {
+        if (*fd >= 0) {
+            loop_.remove_datagram_socket(*fd);
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+// Due torrents sharing a listen port go out together, several hashes to a
+// message.
+void Lsd::maybe_announce(Clock::time_point now) {
+    if (sock4_ < 0 && sock6_ < 0) {
+        return;
+    }
+    std::map<uint16_t, std::vector<std::string>> due;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& [hex, t] : torrents_) {
+            if (now < t.next_announce) {
+                continue;
+            }
+            t.last_announce = now;
+            t.next_announce = now + kAnnounceInterval;
+            due[t.port].push_back(hex);
+        }
+    }
+    for (const auto& [port, hashes] : due) {
+        for (std::size_t i = 0; i < hashes.size(); i += kMaxHashesPerMessage) {
+            std::size_t end = std::min(hashes.size(), i + kMaxHashesPerMessage);
+            send_announce(port,
+                          std::vector<std::string>(hashes.begin() + i, hashes.begin() + end));
+        }
+    }
+}
+
+void Lsd::send_announce(uint16_t port, const std::vector<std::string>& hashes) {
+    auto build = [&](const std::string& host) {
+        std::string msg = "BT-SEARCH * HTTP/1.1\r\nHost: " + host + "\r\nPort: " +
+                          std::to_string(port) + "\r\n";
+        for (const auto& hex : hashes) {
+            msg += "Infohash: " + hex + "\r\n";
+        }
+        msg += "cookie: " + cookie_ + "\r\n\r\n\r\n";
+        return msg;
+    };
+    if (sock4_ >= 0) {
+        std::string msg = build(std::string(kGroup4) + ":" + std::to_string(kPort));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(kPort);
+        ::inet_pton(AF_INET, kGroup4, &addr.sin_addr);
+        ssize_t n = ::sendto(sock4_, msg.data(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL,
+                             reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        (void)n;
+    }
+    if (sock6_ >= 0) {
+        std::string msg = build("[" + std::string(kGroup6) + "]:" + std::to_string(kPort));
+        sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(kPort);
+        ::inet_pton(AF_INET6, kGroup6, &addr.sin6_addr);
+        ssize_t n = ::sendto(sock6_, msg.data(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL,
+                             reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        (void)n;
+    }
+}
+
+// An HTTP-style request line and headers; Infohash may repeat.
+void Lsd::handle_datagram(const uint8_t* data, std::size_t len, const Endpoint& from) {
+    std::string_view text(reinterpret_cast<const char*>(data), len);
+    static constexpr std::string_view kRequestLine = "BT-SEARCH * HTTP/1.1";
+    if (text.substr(0, kRequestLine.size()) != kRequestLine) {
+        return;
+    }
+    unsigned long port = 0;
+    std::string cookie;
+    std::vector<std::string> hashes;
+    std::size_t pos = text.find('\n');
+    while (pos != std::string_view::npos && pos + 1 < text.size()) {
+        std::size_t end = text.find('\n', pos + 1);
+        std::string_view line = text.substr(pos + 1, end == std::string_view::npos
+                                                         ? std::string_view::npos
+                                                         : end - pos - 1);
+        pos = end;
+        std::size_t colon = line.find(':');
+        if (colon == std::string_view::npos) {
+            continue;
+        }
+        std::string key = lowercase(trim(line.substr(0, colon)));
+        std::string_view value = trim(line.substr(colon + 1));
+        if (key == "port") {
+            port = 0;
+            for (char c : value) {
+                if (!std::isdigit(static_cast<unsigned char>(c)) || port > 65535) {
+                    port = 0;
+                    break;
+                }
+                port = port * 10 + static_cast<unsigned long>(c - '0');
+            }
+        } else if (key == "infohash" && value.size() == 40) {
+            hashes.push_back(lowercase(value));
+        } else if (key == "cookie") {
+            cookie = std::string(value);
+        }
+    }
+    if (cookie == cookie_ || port == 0 || port > 65535 || hashes.empty()) {
+        return;
+    }
+
+    PeerAddress address = from.to_address();
+    address.port = static_cast<uint16_t>(port);
+    address.local = true;
+    const std::vector<PeerAddress> peers{address};
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& hex : hashes) {
+        auto it = torrents_.find(hex);
+        if (it == torrents_.end()) {
+            continue;
+        }
+        // answer a newcomer with our own announce, at most once a minute,
+        // instead of leaving it to wait for the next round
+        Torrent& t = it->second;
+        t.next_announce = std::min(t.next_announce, t.last_announce + kMinAnnounceGap);
+        if (t.on_peers) {
+            t.on_peers(peers);
+        }
+    }
+}
@@ -0,0 +1,96 @@
+// Lsd finds peers on the local network over multicast (BEP 14), shared by all torrents.
+#pragma once
+
+#include "endpoint.h"
+#include "ip_filter.h"
+#include "logger.h"
+#include "peer_event_loop.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Announces every added torrent to the IPv4 and IPv6 LSD groups when it is
+// added and every five minutes after, and hands the senders of matching
+// announces to the torrent as local peers. Our own announces come back
+// through multicast loopback and are recognised by their cookie, so two
+// clients on one host find each other as well.
+class Lsd {
+public:
+    using PeersCallback = std::function<void(const std::vector<PeerAddress>&)>;
+
+    // interface is the IPv4 address of the NIC to announce on; empty lets
+    // the routing table pick one.
+    explicit Lsd(std::string interface = {});
+    ~Lsd();
+
+    Lsd(const Lsd&) = delete;
+    Lsd& operator=(const Lsd&) = delete;
+
+    // Call before start(). Announces from blocked senders are ignored.
+    void set_ip_filter(std::shared_ptr<SharedIpFilter> filter) {
+        shared_ip_filter_ = std::move(filter);
+    }
+    void start();
+    void stop();
+
+    // Thread-safe. Announces listen_port for info_hash and hands local peers
+    // to on_peers on the LSD thread until the torrent is removed.
+    void add_torrent(const std::array<uint8_t, 20>& info_hash, uint16_t listen_port,
+                     PeersCallback on_peers);
+    // Thread-safe; once this returns on_peers is neither running nor called.
+    void remove_torrent(const std::array<uint8_t, 20>& info_hash);
+
+    static constexpr uint16_t kPort = 6771;
+
+private:
+    struct Torrent {
+        uint16_t port{0};
+        PeersCallback on_peers;
+        std::chrono::steady_clock::time_point next_announce{};
+        std::chrono::steady_clock::time_point last_announce{};
+    };
+
+    void run();
+    void refresh_ip_filter();
+    void open_sockets();
+    void close_sockets();
+    int open_socket(bool v6);
+    void maybe_announce(std::chrono::steady_clock::time_point now);
+    void send_announce(uint16_t port, const std::vector<std::string>& hashes);
+    void handle_datagram(const uint8_t* data, std::size_t len, const Endpoint& from);
+
+    // at most this many Infohash headers per message, to stay well under
+    // the MTU
+    static constexpr std::size_t kMaxHashesPerMessage = 8;
+    static constexpr std::chrono::minutes kAnnounceInterval{5};
+    // a torrent re-added sooner than this waits for its next round
+    static constexpr std::chrono::minutes kMinAnnounceGap{1};
+    static constexpr std::chrono::seconds kSocketRetry{30};
+
+    std::string interface_;
+    std::string cookie_;
+    int sock4_{-1};
+    int sock6_{-1};
+    PeerEventLoop loop_;
+    std::chrono::steady_clock::time_point last_socket_attempt_{};
+    std::shared_ptr<SharedIpFilter> shared_ip_filter_;
+    uint64_t ip_filter_generation_{0};
+    std::shared_ptr<const IpFilter> ip_filter_;
+
+    // torrents_ is shared with other threads, keyed by lowercase hex
+    std::mutex mutex_;
+    std::unordered_map<std::string, Torrent> torrents_;
+
+    std::atomic<bool> running_{false};
+    std::thread worker_;
+    AsyncLogger logger_;
+};
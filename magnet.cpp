@@ -0,0 +1,179 @@
+#include "magnet.h"
+
+#include <cctype>
+#include <stdexcept>
+
+namespace {
+    int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    std::string percent_decode(std::string_view in) {
+        std::string out;
+        out.reserve(in.size());
+        for (std::size_t i = 0; i < in.size(); ++i) {
+            if (in[i] == '+') {
+                out.push_back(' ');
+            } else if (in[i] == '%' && i + 2 < in.size() && hex_value(in[i + 1]) >= 0 &&
+                       hex_value(in[i + 2]) >= 0) {
+                out.push_back(static_cast<char>(hex_value(in[i + 1]) * 16 + hex_value(in[i + 2])));
+                i += 2;
+            } else {
+                out.push_back(in[i]);
+            }
+        }
+        return out;
+    }
+
+    bool decode_hex_hash(std::string_view text, std::array<uint8_t, 20>& out) {
+        if (text.size() != 40) {
+            return false;
+        }
+        for (std::size_t i = 0; i < 20; ++i) {
+            int hi = hex_value(text[2 * i]);
+            int lo = hex_value(text[2 * i + 1]);
+            if (hi < 0 || lo < 0) {
+                return false;
+            }
+            out[i] = static_cast<uint8_t>(hi * 16 + lo);
+        }
+        return true;
+    }
+
+    // RFC 4648 alphabet, as older clients still emit it
+    bool decode_base32_hash(std::string_view text, std::array<uint8_t, 20>& out) {
+        if (text.size() != 32) {
+            return false;
+        }
+        uint64_t buffer = 0;
+        int bits = 0;
+        std::size_t pos = 0;
+        for (char c : text) {
+            int v;
+            char u = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+            if (u >= 'A' && u <= 'Z') {
+                v = u - 'A';
+            } else if (u >= '2' && u <= '7') {
+                v = u - '2' + 26;
+            } else {
+                return false;
+            }
+            buffer = (buffer << 5) | static_cast<uint64_t>(v);
+            bits += 5;
+            if (bits >= 8) {
+                bits -= 8;
+                out[pos++] = static_cast<uint8_t>((buffer >> bits) & 0xFF);
+            }
+        }
+        return pos == 20;
+    }
+
+    // host:port or [v6]:port
+    bool parse_host_port(const std::string& text, PeerAddress& out) {
+        std::size_t colon = text.rfind(':');
+        if (colon == std::string::npos || colon + 1 == text.size()) {
+            return false;
+        }
+        std::string host = text.substr(0, colon);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        unsigned long port = 0;
+        for (std::size_t i = colon + 1; i < text.size(); ++i) {
+            if (!std::isdigit(static_cast<unsigned char>(text[i]))) {
+                return false;
+            }
+            port = port * 10 + static_cast<unsigned long>(text[i] - '0');
+            if (port > 65535) {
+                return false;
+            }
+        }
+        if (host.empty() || port == 0) {
+            return false;
+        }
+        out.ip = std::move(host);
+        out.port = static_cast<uint16_t>(port);
+        return true;
+    }
+} // namespace
+
+bool MagnetLink::is_magnet(std::string_view text) {
+    static constexpr std::string_view kScheme = "magnet:?";
+    if (text.size() < kScheme.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < kScheme.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(text[i])) != kScheme[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+MagnetLink MagnetLink::parse(std::string_view uri) {
+    if (!is_magnet(uri)) {
+        throw std::runtime_error("not a magnet link");
+    }
+    MagnetLink link;
+    link.uri = std::string(uri);
+    bool have_hash = false;
+    std::string_view query = uri.substr(8);
+    while (!query.empty()) {
+        std::size_t amp = query.find('&');
+        std::string_view param = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view{} : query.substr(amp + 1);
+        std::size_t eq = param.find('=');
+        if (eq == std::string_view::npos) {
+            continue;
+        }
+        std::string key(param.substr(0, eq));
+        std::string value = percent_decode(param.substr(eq + 1));
+        // numbered forms (xt.1, tr.2) are the same key
+        if (std::size_t dot = key.find('.'); dot != std::string::npos && key != "x.pe") {
+            key.resize(dot);
+        }
+
+        if (key == "xt") {
+            static constexpr std::string_view kBtih = "urn:btih:";
+            if (value.compare(0, kBtih.size(), kBtih) != 0) {
+                // v2 (btmh) and other namespaces are not supported
+                continue;
+            }
+            std::string_view hash = std::string_view(value).substr(kBtih.size());
+            if (!decode_hex_hash(hash, link.info_hash) &&
+                !decode_base32_hash(hash, link.info_hash)) {
+                throw std::runtime_error("magnet link has a malformed btih info hash");
+            }
+            have_hash = true;
+        } else if (key == "dn") {
+            link.display_name = std::move(value);
+        } else if (key == "tr") {
+            link.trackers.push_back(std::move(value));
+        } else if (key == "ws") {
+            link.web_seeds.push_back(std::move(value));
+        } else if (key == "x.pe") {
+            PeerAddress address;
+            if (parse_host_port(value, address)) {
+                link.peers.push_back(std::move(address));
+            }
+        }
+    }
+    if (!have_hash) {
+        throw std::runtime_error("magnet link has no urn:btih info hash");
+    }
+    return link;
+}
+
+std::string MagnetLink::info_hash_hex() const {
+    static constexpr char kHex[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(40);
+    for (uint8_t b : info_hash) {
+        out.push_back(kHex[b >> 4]);
+        out.push_back(kHex[b & 0xF]);
+    }
+    return out;
+}
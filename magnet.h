@@ -0,0 +1,28 @@
+// MagnetLink parses magnet URIs (BEP 9) into an info hash plus peer sources.
+#pragma once
+
+#include "peer.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct MagnetLink {
+    std::array<uint8_t, 20> info_hash{};
+    // dn, for display until the metadata arrives
+    std::string display_name;
+    // tr, ws and x.pe in the order given
+    std::vector<std::string> trackers;
+    std::vector<std::string> web_seeds;
+    std::vector<PeerAddress> peers;
+    std::string uri;
+
+    // Accepts xt=urn:btih: as 40 hex or 32 base32 characters and
+    // percent-decodes every value; throws on anything else.
+    static MagnetLink parse(std::string_view uri);
+    static bool is_magnet(std::string_view text);
+
+    std::string info_hash_hex() const;
+};
@@ -1,27 +1,271 @@
-#include "session.h"
+#include "control_server.h"
+#include "dht.h"
+#include "handoff.h"
+#include "lsd.h"
+#include "magnet.h"
+#include "memory_governor.h"
+#include "topology.h"
 #include "torrent_file.h"
+#include "torrent_queue.h"
 #include "tracker_client.h"
 
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+// set by signals and by a completed hand-off on the control thread
+std::atomic<bool> g_stop{false};
+void on_signal(int) { g_stop = true; }
+
+// Connects to a running daemon's control socket and asks it to hand over.
+int connect_control(const std::filesystem::path& socket_path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::string path = socket_path.string();
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("control socket path too long: " + path);
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        throw std::runtime_error("failed to connect to " + path + ": " + std::strerror(errno));
+    }
+    const char request[] = "{\"cmd\":\"handoff\"}\n";
+    if (::send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) < 0) {
+        ::close(fd);
+        throw std::runtime_error("failed to request handoff from " + path);
+    }
+    return fd;
+}
+
+// Old side: give everything to the successor, then wait (bounded) for its
+// ack so our copies of the sockets outlive the transfer. Without the ack the
+// successor never took over, so the exported state comes back and we keep
+// serving.
+void serve_handoff(TorrentQueue& queue, const TorrentQueue::AddOptions& options, int fd) {
+    HandoffSnapshot snapshot;
+    std::vector<int> fds;
+    queue.export_handoff(snapshot, fds);
+    bool acked = false;
+    if (send_handoff(fd, snapshot, fds)) {
+        pollfd pfd{fd, POLLIN, 0};
+        char ack = 0;
+        if (::poll(&pfd, 1, 10000) > 0) {
+            acked = ::recv(fd, &ack, 1, 0) == 1 && ack == 'k';
+        }
+    }
+    if (!acked) {
+        resolve_handoff_fds(snapshot, fds);
+        queue.import_handoff(snapshot, options);
+        std::cout << "Hand-off failed; resumed " << snapshot.torrents.size()
+                  << " torrents\n";
+        return;
+    }
+    for (int socket_fd : fds) {
+        ::close(socket_fd);
+    }
+    std::cout << "Handed off " << snapshot.torrents.size() << " torrents and " << fds.size()
+              << " sockets\n";
+    g_stop = true;
+}
+}
 
 int main(int argc, char** argv) {
     try {
-        std::filesystem::path torrent_path;
-        if (argc < 2) {
-            torrent_path = "../data/1059680EA3988805BA59A4E2D24C7CDA4FD942DD.torrent";
-        } else {
-            torrent_path = argv[1];
+        std::vector<std::filesystem::path> torrent_paths;
+        std::vector<std::string> magnets;
+        TorrentQueue::AddOptions options;
+        TorrentQueue::Limits limits;
+        bool keep_seeding = false;
+        std::filesystem::path control_socket;
+        std::filesystem::path watch_dir;
+        std::filesystem::path takeover_socket;
+        bool use_dht = false;
+        uint16_t dht_port = 6881;
+        std::vector<std::pair<std::string, uint16_t>> dht_bootstrap;
+        bool use_lsd = false;
+        std::string lsd_interface;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--super-seed") {
+                options.super_seed = true;
+                options.recheck = true;
+            } else if (arg == "--recheck") {
+                options.recheck = true;
+            } else if (arg == "--ip-filter" && i + 1 < argc) {
+                // read here, so it is in force before the first dial
+                options.ip_filter = std::make_shared<SharedIpFilter>(argv[++i]);
+                options.ip_filter->start();
+            } else if (arg == "--topology" && i + 1 < argc) {
+                auto topology = std::make_shared<Topology>(Topology::load(argv[++i]));
+                topology->detect_local_subnets();
+                options.topology = std::move(topology);
+            } else if (arg == "--cross-rack-limit" && i + 1 < argc) {
+                uint64_t limit = std::stoull(argv[++i]);
+                options.cross_rack_limiter =
+                    limit > 0 ? std::make_shared<SharedRateLimiter>(limit) : nullptr;
+            } else if (arg == "--memory-limit" && i + 1 < argc) {
+                memory_governor().set_total_budget(std::stoull(argv[++i]));
+            } else if (arg == "--daemon" && i + 1 < argc) {
+                control_socket = argv[++i];
+            } else if (arg == "--takeover" && i + 1 < argc) {
+                takeover_socket = argv[++i];
+            } else if (arg == "--watch" && i + 1 < argc) {
+                watch_dir = argv[++i];
+            } else if (arg == "--dht") {
+                use_dht = true;
+            } else if (arg == "--dht-port" && i + 1 < argc) {
+                use_dht = true;
+                dht_port = static_cast<uint16_t>(std::stoul(argv[++i]));
+            } else if (arg == "--dht-bootstrap" && i + 1 < argc) {
+                // host:port, with IPv6 literals in brackets
+                use_dht = true;
+                std::string spec = argv[++i];
+                auto colon = spec.rfind(':');
+                if (colon == std::string::npos) {
+                    throw std::runtime_error("--dht-bootstrap expects host:port");
+                }
+                std::string host = spec.substr(0, colon);
+                if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+                    host = host.substr(1, host.size() - 2);
+                }
+                dht_bootstrap.emplace_back(
+                    host, static_cast<uint16_t>(std::stoul(spec.substr(colon + 1))));
+            } else if (arg == "--lsd") {
+                use_lsd = true;
+            } else if (arg == "--lsd-interface" && i + 1 < argc) {
+                use_lsd = true;
+                lsd_interface = argv[++i];
+            } else if (arg == "--seed") {
+                keep_seeding = true;
+            } else if (arg == "--active-downloads" && i + 1 < argc) {
+                limits.active_downloads = std::stoul(argv[++i]);
+            } else if (arg == "--active-seeds" && i + 1 < argc) {
+                limits.active_seeds = std::stoul(argv[++i]);
+            } else if (arg == "--download-limit" && i + 1 < argc) {
+                limits.download_rate = std::stoull(argv[++i]);
+            } else if (arg == "--upload-limit" && i + 1 < argc) {
+                limits.upload_rate = std::stoull(argv[++i]);
+            } else if (MagnetLink::is_magnet(arg)) {
+                magnets.push_back(arg);
+            } else {
+                torrent_paths.emplace_back(arg);
+            }
+        }
+        // racks come from the topology file; without it every peer is remote
+        if (options.cross_rack_limiter && !options.topology) {
+            throw std::runtime_error("--cross-rack-limit requires --topology");
+        }
+        bool daemon = !control_socket.empty() || !watch_dir.empty() || !takeover_socket.empty();
+        if (torrent_paths.empty() && magnets.empty() && !daemon) {
+            torrent_paths.emplace_back("../data/1059680EA3988805BA59A4E2D24C7CDA4FD942DD.torrent");
         }
-        TorrentFile torrent = TorrentFile::load(torrent_path);
-        std::cout << "Loaded torrent: " << torrent.name << "\n";
-        std::cout << "Pieces: " << torrent.piece_hashes.size()
-                  << " piece length: " << torrent.piece_length << "\n";
 
         std::filesystem::path download_root = "../Downloads/";
-        Session session(std::move(torrent), generate_peer_id(), 6881, 16 * 1024, download_root);
-        session.start();
-        session.run(500);
+        // declared before the queue so every session is gone before it is
+        AlertQueue alerts;
+        std::unique_ptr<Dht> dht;
+        if (use_dht) {
+            dht = std::make_unique<Dht>(dht_port, download_root / ".dj-torrent" / "dht.state");
+            if (dht_bootstrap.empty()) {
+                dht_bootstrap = {{"router.bittorrent.com", 6881},
+                                 {"dht.transmissionbt.com", 6881},
+                                 {"router.utorrent.com", 6881}};
+            }
+            for (auto& [host, port] : dht_bootstrap) {
+                dht->add_bootstrap_node(std::move(host), port);
+            }
+            dht->set_ip_filter(options.ip_filter);
+            dht->start();
+        }
+        std::unique_ptr<Lsd> lsd;
+        if (use_lsd) {
+            lsd = std::make_unique<Lsd>(lsd_interface);
+            lsd->set_ip_filter(options.ip_filter);
+            lsd->start();
+        }
+        // the predecessor's state must be adopted before our control socket
+        // replaces its one, so the hand-off happens ahead of everything else
+        int takeover_fd = -1;
+        HandoffSnapshot handoff;
+        if (!takeover_socket.empty()) {
+            takeover_fd = connect_control(takeover_socket);
+            handoff = receive_handoff(takeover_fd);
+        }
+        TorrentQueue queue(takeover_fd >= 0 ? handoff.peer_id : generate_peer_id(), 6881,
+                           16 * 1024, download_root, limits);
+        if (daemon) {
+            queue.set_alert_queue(&alerts);
+        }
+        queue.set_dht(dht.get());
+        queue.set_lsd(lsd.get());
+        if (takeover_fd >= 0) {
+            queue.import_handoff(handoff, options);
+            const char ack = 'k';
+            ssize_t n = ::send(takeover_fd, &ack, 1, MSG_NOSIGNAL);
+            (void)n;
+            ::close(takeover_fd);
+            std::cout << "Took over " << handoff.torrents.size() << " torrents\n";
+        }
+        for (const auto& path : torrent_paths) {
+            TorrentFile torrent = TorrentFile::load(path);
+            std::cout << "Loaded torrent: " << torrent.name << "\n";
+            std::cout << "Pieces: " << torrent.piece_count()
+                      << " piece length: " << torrent.piece_length << "\n";
+            queue.add(std::move(torrent), options);
+        }
+        for (const auto& uri : magnets) {
+            MagnetLink magnet = MagnetLink::parse(uri);
+            std::cout << "Loaded magnet: " << magnet.info_hash_hex() << "\n";
+            queue.add_magnet(std::move(magnet), options);
+        }
+
+        // a daemon runs until signalled; torrents come and go over RPC
+        std::unique_ptr<ControlServer> control;
+        if (daemon) {
+            std::signal(SIGINT, on_signal);
+            std::signal(SIGTERM, on_signal);
+            std::signal(SIGPIPE, SIG_IGN);
+            control = std::make_unique<ControlServer>(queue, options, &alerts);
+            control->set_handoff_handler(
+                [&queue, &options](int fd) { serve_handoff(queue, options, fd); });
+            if (!control_socket.empty()) {
+                control->listen(control_socket);
+            }
+            if (!watch_dir.empty()) {
+                control->watch_directory(watch_dir);
+            }
+            control->start();
+        }
+
+        while (!g_stop) {
+            queue.tick();
+            if (!daemon && !keep_seeding && queue.all_complete()) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        }
+        if (control) {
+            control->stop();
+        }
+        queue.stop_all();
     } catch (const std::exception& ex) {
         std::cerr << "Error: " << ex.what() << "\n";
         return 1;
@@ -0,0 +1,79 @@
+#include "memory_governor.h"
+
+namespace {
+
+const char* subsystem_name(MemorySubsystem sub) {
+    switch (sub) {
+        case MemorySubsystem::PeerBuffers:
+            return "peer_buffers";
+        case MemorySubsystem::PieceBuffers:
+            return "piece_buffers";
+        case MemorySubsystem::Logger:
+            return "logger";
+        case MemorySubsystem::Count:
+            break;
+    }
+    return "unknown";
+}
+
+} // namespace
+
+MemoryGovernor::MemoryGovernor() {
+    set_budget(MemorySubsystem::PeerBuffers, 64u << 20);
+    set_budget(MemorySubsystem::PieceBuffers, 128u << 20);
+    set_budget(MemorySubsystem::Logger, 0);
+    set_total_budget(256u << 20);
+}
+
+MemoryGovernor& memory_governor() {
+    // never destroyed: charges are released from other static destructors
+    static MemoryGovernor* governor = new MemoryGovernor();
+    return *governor;
+}
+
+void MemoryGovernor::set_budget(MemorySubsystem sub, std::size_t bytes) {
+    budget_[index(sub)].store(bytes, std::memory_order_relaxed);
+}
+
+std::size_t MemoryGovernor::usage(MemorySubsystem sub) const {
+    std::ptrdiff_t used = usage_[index(sub)].load(std::memory_order_relaxed);
+    return used > 0 ? static_cast<std::size_t>(used) : 0;
+}
+
+std::size_t MemoryGovernor::total_usage() const {
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < kCount; ++i) {
+        total += usage(static_cast<MemorySubsystem>(i));
+    }
+    return total;
+}
+
+bool MemoryGovernor::over_budget(MemorySubsystem sub) const {
+    std::size_t budget = budget_[index(sub)].load(std::memory_order_relaxed);
+    return budget != 0 && usage(sub) >= budget;
+}
+
+bool MemoryGovernor::over_total_budget() const {
+    std::size_t budget = total_budget_.load(std::memory_order_relaxed);
+    return budget != 0 && total_usage() >= budget;
+}
+
+bool MemoryGovernor::over_total_budget_for_reads() const {
+    std::size_t budget = total_budget_.load(std::memory_order_relaxed);
+    return budget != 0 &&
+           usage(MemorySubsystem::PeerBuffers) + usage(MemorySubsystem::PieceBuffers) >= budget;
+}
+
+std::string MemoryGovernor::report() const {
+    std::string out = "memory:";
+    for (std::size_t i = 0; i < kCount; ++i) {
+        auto sub = static_cast<MemorySubsystem>(i);
+        out += ' ';
+        out += subsystem_name(sub);
+        out += '=' + std::to_string(usage(sub) >> 10) + '/' +
+               std::to_string(budget_[i].load(std::memory_order_relaxed) >> 10);
+    }
+    out += " total=" + std::to_string(total_usage() >> 10) + '/' +
+           std::to_string(total_budget_.load(std::memory_order_relaxed) >> 10) + "KiB";
+    return out;
+}
@@ -0,0 +1,100 @@
+// MemoryGovernor tracks buffer memory per subsystem against fixed budgets.
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+enum class MemorySubsystem : uint8_t { PeerBuffers, PieceBuffers, Logger, Count };
+
+// Process-wide and thread-safe: every session charges the same governor.
+// Nothing is refused here; callers ask over_budget() and back off instead
+// (stop reading sockets, stop opening pieces, stop accepting).
+class MemoryGovernor {
+public:
+    MemoryGovernor();
+
+    // A budget of zero means unlimited.
+    void set_budget(MemorySubsystem sub, std::size_t bytes);
+    void set_total_budget(std::size_t bytes) { total_budget_.store(bytes, std::memory_order_relaxed); }
+    std::size_t total_budget() const { return total_budget_.load(std::memory_order_relaxed); }
+
+    void charge(MemorySubsystem sub, std::ptrdiff_t delta) {
+        usage_[index(sub)].fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    std::size_t usage(MemorySubsystem sub) const;
+    std::size_t total_usage() const;
+    bool over_budget(MemorySubsystem sub) const;
+    bool over_total_budget() const;
+
+    // Socket reads pause when peer buffers or the whole process are over.
+    // Peers we await blocks from only pause for peer buffers: their blocks
+    // finish pieces already in memory, which is how piece buffers drain.
+    // Logger queues are reserved up front, so they don't count here; no
+    // amount of not reading would shrink them.
+    bool reading_paused(bool awaiting_blocks = false) const {
+        return over_budget(MemorySubsystem::PeerBuffers) ||
+               (!awaiting_blocks && over_total_budget_for_reads());
+    }
+
+    // No new pieces open while this holds; pieces already open still fill.
+    // One piece may always open so a budget below fixed costs still moves.
+    bool piece_buffers_full() const {
+        return over_budget(MemorySubsystem::PieceBuffers) ||
+               (over_total_budget() && usage(MemorySubsystem::PieceBuffers) > 0);
+    }
+
+    // "memory: peer_buffers=used/budget KiB ..." for the stats log.
+    std::string report() const;
+
+private:
+    bool over_total_budget_for_reads() const;
+
+    static std::size_t index(MemorySubsystem sub) { return static_cast<std::size_t>(sub); }
+
+    static constexpr std::size_t kCount = static_cast<std::size_t>(MemorySubsystem::Count);
+    std::array<std::atomic<std::ptrdiff_t>, kCount> usage_{};
+    std::array<std::atomic<std::size_t>, kCount> budget_{};
+    std::atomic<std::size_t> total_budget_{0};
+};
+
+MemoryGovernor& memory_governor();
+
+// Owns a charge against one subsystem and releases it on destruction, so
+// buffers stay accounted for across moves and early returns.
+class MemoryCharge {
+public:
+    explicit MemoryCharge(MemorySubsystem sub, std::size_t bytes = 0) : sub_(sub) { set(bytes); }
+    ~MemoryCharge() { set(0); }
+
+    MemoryCharge(const MemoryCharge&) = delete;
+    MemoryCharge& operator=(const MemoryCharge&) = delete;
+    MemoryCharge(MemoryCharge&& other) noexcept : sub_(other.sub_), bytes_(other.bytes_) {
+        other.bytes_ = 0;
+    }
+    MemoryCharge& operator=(MemoryCharge&& other) noexcept {
+        if (this != &other) {
+            set(0);
+            sub_ = other.sub_;
+            bytes_ = other.bytes_;
+            other.bytes_ = 0;
+        }
+        return *this;
+    }
+
+    void set(std::size_t bytes) {
+        if (bytes != bytes_) {
+            memory_governor().charge(sub_, static_cast<std::ptrdiff_t>(bytes) -
+                                               static_cast<std::ptrdiff_t>(bytes_));
+            bytes_ = bytes;
+        }
+    }
+    std::size_t bytes() const { return bytes_; }
+
+private:
+    MemorySubsystem sub_;
+    std::size_t bytes_{0};
+};
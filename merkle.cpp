@@ -0,0 +1,71 @@
+#include "merkle.h"
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <cstring>
+
+Sha256Hash sha256(const uint8_t* data, std::size_t len) {
+    Sha256Hash out{};
+    SHA256(data, len, out.data());
+    return out;
+}
+
+Sha256Hash merkle_pair(const Sha256Hash& left, const Sha256Hash& right) {
+    uint8_t buf[64];
+    std::memcpy(buf, left.data(), 32);
+    std::memcpy(buf + 32, right.data(), 32);
+    return sha256(buf, sizeof(buf));
+}
+
+const Sha256Hash& merkle_pad_hash(unsigned layer) {
+    // deep enough for a 2^64-byte file
+    static const std::vector<Sha256Hash> pads = [] {
+        std::vector<Sha256Hash> v(64);
+        for (std::size_t i = 1; i < v.size(); ++i) {
+            v[i] = merkle_pair(v[i - 1], v[i - 1]);
+        }
+        return v;
+    }();
+    return pads[layer < pads.size() ? layer : pads.size() - 1];
+}
+
+std::size_t merkle_width(std::size_t count) {
+    std::size_t width = 1;
+    while (width < count) {
+        width <<= 1;
+    }
+    return width;
+}
+
+unsigned merkle_log2(std::size_t pow2) {
+    unsigned n = 0;
+    while ((std::size_t{1} << n) < pow2) {
+        ++n;
+    }
+    return n;
+}
+
+MerkleTree::MerkleTree(std::vector<Sha256Hash> leaves, std::size_t width, unsigned leaf_layer) {
+    width = merkle_width(std::max(width, leaves.size()));
+    leaves.resize(width, merkle_pad_hash(leaf_layer));
+    levels_.push_back(std::move(leaves));
+    while (levels_.back().size() > 1) {
+        const auto& below = levels_.back();
+        std::vector<Sha256Hash> up(below.size() / 2);
+        for (std::size_t i = 0; i < up.size(); ++i) {
+            up[i] = merkle_pair(below[2 * i], below[2 * i + 1]);
+        }
+        levels_.push_back(std::move(up));
+    }
+}
+
+std::vector<Sha256Hash> MerkleTree::uncles(unsigned level, std::size_t index,
+                                           unsigned count) const {
+    std::vector<Sha256Hash> out;
+    for (unsigned l = level; l < depth() && out.size() < count; ++l) {
+        out.push_back(levels_[l][index ^ 1]);
+        index >>= 1;
+    }
+    return out;
+}
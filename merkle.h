@@ -0,0 +1,39 @@
+// SHA-256 merkle trees for BitTorrent v2 (BEP 52).
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using Sha256Hash = std::array<uint8_t, 32>;
+
+// v2 hashes files in 16 KiB leaves whatever the piece size.
+constexpr std::size_t kMerkleBlockSize = 16 * 1024;
+
+// OpenSSL picks the SHA-NI (or AVX2) code path at runtime.
+Sha256Hash sha256(const uint8_t* data, std::size_t len);
+Sha256Hash merkle_pair(const Sha256Hash& left, const Sha256Hash& right);
+// Root of an all-zero subtree `layer` levels above the leaves; layer 0 is
+// the zero hash that stands in for leaves past the end of a file.
+const Sha256Hash& merkle_pad_hash(unsigned layer);
+std::size_t merkle_width(std::size_t count);
+unsigned merkle_log2(std::size_t pow2);
+
+// A complete tree over leaves sitting leaf_layer levels above the block
+// layer, padded to width with the matching pad hash.
+class MerkleTree {
+public:
+    MerkleTree(std::vector<Sha256Hash> leaves, std::size_t width, unsigned leaf_layer = 0);
+
+    const Sha256Hash& root() const { return levels_.back().front(); }
+    // levels above the leaves
+    unsigned depth() const { return static_cast<unsigned>(levels_.size() - 1); }
+    const std::vector<Sha256Hash>& level(unsigned n) const { return levels_[n]; }
+    // Siblings of node index on level, lowest first, for up to count levels
+    // (never the root itself).
+    std::vector<Sha256Hash> uncles(unsigned level, std::size_t index, unsigned count) const;
+
+private:
+    std::vector<std::vector<Sha256Hash>> levels_;
+};
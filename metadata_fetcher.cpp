@@ -0,0 +1,445 @@
+#include "metadata_fetcher.h"
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+
+MetadataFetcher::MetadataFetcher(MagnetLink magnet, std::string peer_id, uint16_t listen_port)
+    : magnet_(std::move(magnet)),
+      peer_id_(std::move(peer_id)),
+      listen_port_(listen_port),
+      tracker_client_(peer_id_, listen_port_),
+      event_loop_([this](Peer& peer, std::vector<Peer::Event>&& events) {
+          handle_peer_events(peer, std::move(events));
+      }) {
+    logger_.start();
+    stub_.info_hash = magnet_.info_hash;
+    stub_.name = magnet_.display_name;
+    TorrentFile::FileEntry stub_file;
+    stub_file.length = static_cast<int64_t>(Peer::kMetadataPieceSize);
+    stub_file.path = magnet_.info_hash_hex();
+    stub_.files.push_back(std::move(stub_file));
+    event_loop_.set_wake_callback([this]() { drain_candidates(); });
+    event_loop_.set_close_callback([this](int fd, const Peer&) {
+        auto it = peers_.find(fd);
+        if (it != peers_.end()) {
+            release_requests(it->second);
+            peers_.erase(it);
+        }
+    });
+}
+
+MetadataFetcher::~MetadataFetcher() {
+    stop();
+    logger_.stop();
+}
+
+void MetadataFetcher::start() {
+    if (done() || worker_.joinable()) {
+        return;
+    }
+    running_.store(true, std::memory_order_relaxed);
+    started_at_ = std::chrono::steady_clock::now();
+    for (const auto& address : magnet_.peers) {
+        post_candidate(address);
+    }
+
+    std::vector<std::string> tracker_urls;
+    for (const auto& url : magnet_.trackers) {
+        if (url.rfind("http://", 0) == 0 || url.rfind("https://", 0) == 0 ||
+            url.rfind("udp://", 0) == 0) {
+            tracker_urls.push_back(url);
+        }
+    }
+    if (!tracker_urls.empty()) {
+        tracker_stop_.store(false, std::memory_order_relaxed);
+        tracker_thread_ = std::thread([this, urls = std::move(tracker_urls)]() {
+            tracker_worker(urls);
+        });
+    }
+    auto on_peers = [this](const std::vector<PeerAddress>& peers) {
+        for (const auto& address : peers) {
+            post_candidate(address);
+        }
+        event_loop_.wake();
+    };
+    if (dht_) {
+        dht_->add_torrent(magnet_.info_hash, listen_port_, on_peers);
+    }
+    if (lsd_) {
+        lsd_->add_torrent(magnet_.info_hash, listen_port_, on_peers);
+    }
+    logger_.info("fetching metadata for " + magnet_.info_hash_hex() + " (" +
+                 std::to_string(magnet_.peers.size()) + " direct peers, " +
+                 std::to_string(magnet_.trackers.size()) + " trackers" +
+                 (dht_ ? ", dht" : "") + (lsd_ ? ", lsd)" : ")"));
+    worker_ = std::thread([this]() { run(); });
+}
+
+void MetadataFetcher::stop() {
+    running_.store(false, std::memory_order_relaxed);
+    event_loop_.wake();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+    tracker_stop_.store(true, std::memory_order_relaxed);
+    if (tracker_thread_.joinable()) {
+        tracker_thread_.join();
+    }
+    if (dht_) {
+        dht_->remove_torrent(magnet_.info_hash);
+    }
+    if (lsd_) {
+        lsd_->remove_torrent(magnet_.info_hash);
+    }
+
+    std::vector<int> fds;
+    event_loop_.for_each_peer([&fds](Peer& p) { fds.push_back(p.fd()); });
+    for (int fd : fds) {
+        drop_peer(fd);
+    }
+    while (posted_candidates_.dequeue()) {
+    }
+    pending_peers_.clear();
+    known_endpoints_.clear();
+    connected_peers_.store(0, std::memory_order_relaxed);
+}
+
+void MetadataFetcher::run() {
+    while (running_.load(std::memory_order_relaxed) && !done()) {
+        drain_candidates();
+        event_loop_.run_once(200);
+        maybe_expire(std::chrono::steady_clock::now());
+        maybe_connect();
+        connected_peers_.store(peers_.size(), std::memory_order_relaxed);
+    }
+}
+
+void MetadataFetcher::tracker_worker(std::vector<std::string> tracker_urls) {
+    for (const auto& url : tracker_urls) {
+        if (tracker_stop_.load(std::memory_order_relaxed)) {
+            break;
+        }
+        try {
+            auto res = tracker_client_.announce(url, stub_);
+            logger_.info("tracker " + url + " returned " +
+                         std::to_string(res.peers.size() + res.named_peers.size()) +
+                         " peers for metadata");
+            for (const auto& ep : res.peers) {
+                post_candidate(ep.to_address());
+            }
+            for (const auto& named : res.named_peers) {
+                post_candidate(PeerAddress{named.ip, named.port});
+            }
+            event_loop_.wake();
+        } catch (const std::exception& ex) {
+            logger_.warn(std::string("tracker failed: ") + ex.what());
+        }
+    }
+}
+
+// Any thread: hands a candidate to the fetcher thread without taking a lock.
+void MetadataFetcher::post_candidate(const PeerAddress& address) {
+    posted_candidates_.enqueue(address);
+}
+
+void MetadataFetcher::drain_candidates() {
+    while (auto address = posted_candidates_.dequeue()) {
+        auto ep = Endpoint::from_address(*address);
+        if (ep && (banned_.contains(*ep) || !known_endpoints_.insert(*ep))) {
+            continue;
+        }
+        if (ep && ip_filter_ && ip_filter_->current()->is_blocked(*ep)) {
+            continue;
+        }
+        pending_peers_.push_back(std::move(*address));
+    }
+}
+
+void MetadataFetcher::maybe_connect() {
+    while (peers_.size() < kMaxPeers && !pending_peers_.empty()) {
+        PeerAddress next = std::move(pending_peers_.front());
+        pending_peers_.pop_front();
+        try {
+            Peer peer = Peer::connect_outgoing(next, magnet_.info_hash, peer_id_);
+            int fd = peer.fd();
+            if (event_loop_.add_peer(std::move(peer))) {
+                peers_[fd].connected_at = std::chrono::steady_clock::now();
+            }
+        } catch (const std::exception&) {
+            logger_.warn("failed to connect to " + next.ip + " for metadata");
+        }
+    }
+}
+
+// Peers that never offer metadata, or sit on a request, make room for others.
+void MetadataFetcher::maybe_expire(std::chrono::steady_clock::time_point now) {
+    std::vector<int> drop_fds;
+    for (const auto& [fd, state] : peers_) {
+        if (state.metadata_size == 0 && now - state.connected_at > kIdleTimeout) {
+            drop_fds.push_back(fd);
+        } else if (!state.requested.empty() && now - state.requested_at > kRequestTimeout) {
+            drop_fds.push_back(fd);
+        }
+    }
+    for (int fd : drop_fds) {
+        drop_peer(fd);
+    }
+}
+
+void MetadataFetcher::handle_peer_events(Peer& peer, std::vector<Peer::Event>&& events) {
+    if (peer.is_closed()) {
+        return;
+    }
+    const int fd = peer.fd();
+    auto it = peers_.find(fd);
+    if (it == peers_.end()) {
+        return;
+    }
+    PeerState& state = it->second;
+
+    for (auto& ev : events) {
+        switch (ev.type) {
+        case Peer::EventType::Handshake:
+            // BEP 6 wants our piece state first; we hold nothing
+            if (peer.supports_fast()) {
+                peer.send_have_none();
+            }
+            peer.send_extended_handshake();
+            break;
+        case Peer::EventType::ExtendedHandshake:
+            if (!peer.supports_ut_metadata() || peer.remote_metadata_size() <= 0 ||
+                peer.remote_metadata_size() > kMaxMetadataSize) {
+                peer.disconnect();
+                break;
+            }
+            state.metadata_size = peer.remote_metadata_size();
+            choose_metadata_size();
+            break;
+        case Peer::EventType::Metadata:
+            if (ev.begin == Peer::kMetadataRequest) {
+                peer.send_metadata_reject(ev.piece_index);
+            } else if (ev.begin == Peer::kMetadataData) {
+                handle_data(peer, state, ev);
+            } else {
+                // a peer that rejects once has no metadata to give
+                peer.disconnect();
+            }
+            break;
+        default:
+            break;
+        }
+        if (peer.is_closed() || done()) {
+            break;
+        }
+    }
+
+    if (!peer.is_closed() && state.metadata_ready && !done()) {
+        maybe_request(peer, state);
+    }
+    if (peer.is_closed()) {
+        release_requests(state);
+        peers_.erase(fd);
+        choose_metadata_size();
+    }
+}
+
+// Pieces already fetched are kept while any connected peer still offers
+// their size. Once none does, the size most connected peers offer wins and
+// the buffer starts over; peers offering another size stay connected in
+// case theirs wins later.
+void MetadataFetcher::choose_metadata_size() {
+    std::unordered_map<int64_t, std::size_t> votes;
+    for (const auto& [fd, state] : peers_) {
+        if (state.metadata_size > 0) {
+            ++votes[state.metadata_size];
+        }
+    }
+    auto current = static_cast<int64_t>(metadata_.size());
+    if (!votes.empty() && votes.find(current) == votes.end()) {
+        auto best = std::max_element(votes.begin(), votes.end(), [](const auto& a, const auto& b) {
+            return a.second < b.second;
+        });
+        if (current != 0) {
+            logger_.info("no peer offers " + std::to_string(current) +
+                         " bytes of metadata any more; fetching " +
+                         std::to_string(best->first) + " bytes instead");
+        }
+        reset_metadata(static_cast<std::size_t>(best->first));
+    }
+
+    current = static_cast<int64_t>(metadata_.size());
+    for (auto& [fd, state] : peers_) {
+        state.metadata_ready = current != 0 && state.metadata_size == current;
+        if (!state.metadata_ready || !state.requested.empty()) {
+            continue;
+        }
+        if (Peer* peer = event_loop_.peer_by_fd(fd); peer && !peer->is_closed()) {
+            maybe_request(*peer, state);
+        }
+    }
+}
+
+void MetadataFetcher::reset_metadata(std::size_t size) {
+    metadata_.assign(size, '\0');
+    pieces_.assign((size + Peer::kMetadataPieceSize - 1) / Peer::kMetadataPieceSize, PieceSlot{});
+    pieces_have_ = 0;
+    // replies to these would land in the old layout
+    for (auto& [fd, state] : peers_) {
+        state.stale.insert(state.stale.end(), state.requested.begin(), state.requested.end());
+        state.requested.clear();
+    }
+}
+
+void MetadataFetcher::maybe_request(Peer& peer, PeerState& state) {
+    while (state.requested.size() < kRequestsPerPeer) {
+        auto piece = pick_piece(state);
+        if (!piece) {
+            break;
+        }
+        if (state.requested.empty()) {
+            state.requested_at = std::chrono::steady_clock::now();
+        }
+        state.requested.push_back(*piece);
+        ++pieces_[*piece].requests;
+        peer.send_metadata_request(*piece);
+    }
+}
+
+// Unrequested pieces first; once every piece is out, the least-requested one
+// this peer is not already fetching, so one slow peer cannot stall the end.
+std::optional<uint32_t> MetadataFetcher::pick_piece(const PeerState& state) const {
+    std::optional<uint32_t> best;
+    for (uint32_t i = 0; i < pieces_.size(); ++i) {
+        const PieceSlot& slot = pieces_[i];
+        if (slot.have ||
+            std::find(state.requested.begin(), state.requested.end(), i) !=
+                state.requested.end()) {
+            continue;
+        }
+        if (slot.requests == 0) {
+            return i;
+        }
+        if (!best || slot.requests < pieces_[*best].requests) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+void MetadataFetcher::handle_data(Peer& peer, PeerState& state, const Peer::Event& ev) {
+    auto it = std::find(state.requested.begin(), state.requested.end(), ev.piece_index);
+    if (it == state.requested.end() || ev.length != metadata_.size()) {
+        // an honest answer to a request made before a reset
+        auto old = std::find(state.stale.begin(), state.stale.end(), ev.piece_index);
+        if (old != state.stale.end()) {
+            state.stale.erase(old);
+            return;
+        }
+    }
+    if (it == state.requested.end() || ev.length != metadata_.size() ||
+        ev.payload.size() != piece_size(ev.piece_index)) {
+        logger_.warn("dropping peer " + peer.remote().ip + ": unexpected metadata piece");
+        peer.disconnect();
+        return;
+    }
+    state.requested.erase(it);
+    state.requested_at = std::chrono::steady_clock::now();
+    PieceSlot& slot = pieces_[ev.piece_index];
+    --slot.requests;
+    if (slot.have) {
+        return;
+    }
+    std::memcpy(metadata_.data() + std::size_t{ev.piece_index} * Peer::kMetadataPieceSize,
+                ev.payload.data(), ev.payload.size());
+    slot.have = true;
+    slot.source = Endpoint::from_address(peer.remote());
+    if (++pieces_have_ == pieces_.size()) {
+        verify();
+    }
+}
+
+void MetadataFetcher::release_requests(PeerState& state) {
+    for (uint32_t piece : state.requested) {
+        if (piece < pieces_.size() && pieces_[piece].requests > 0) {
+            --pieces_[piece].requests;
+        }
+    }
+    state.requested.clear();
+}
+
+void MetadataFetcher::drop_peer(int fd) {
+    if (Peer* peer = event_loop_.peer_by_fd(fd)) {
+        peer->handle_error();
+    }
+    event_loop_.remove_peer(fd);
+    auto it = peers_.find(fd);
+    if (it != peers_.end()) {
+        release_requests(it->second);
+        peers_.erase(it);
+        choose_metadata_size();
+    }
+}
+
+void MetadataFetcher::verify() {
+    std::array<uint8_t, 20> digest{};
+    SHA1(reinterpret_cast<const unsigned char*>(metadata_.data()), metadata_.size(),
+         digest.data());
+    if (digest != magnet_.info_hash) {
+        std::size_t banned = 0;
+        for (PieceSlot& slot : pieces_) {
+            if (slot.source && banned_.insert(*slot.source)) {
+                ++banned;
+            }
+        }
+        // the size itself may have been the lie; the peers left vote again
+        reset_metadata(0);
+        logger_.warn("metadata failed the info hash check; banned " + std::to_string(banned) +
+                     " peers and starting over");
+        std::vector<int> drop_fds;
+        event_loop_.for_each_peer([&](Peer& p) {
+            auto ep = Endpoint::from_address(p.remote());
+            if (ep && banned_.contains(*ep)) {
+                drop_fds.push_back(p.fd());
+            }
+        });
+        for (int fd : drop_fds) {
+            drop_peer(fd);
+        }
+        choose_metadata_size();
+        return;
+    }
+
+    try {
+        result_ = TorrentFile::from_info(metadata_);
+    } catch (const std::exception& ex) {
+        // the hash matched, so every peer would hand us the same bytes
+        logger_.error(std::string("fetched metadata does not parse: ") + ex.what());
+        running_.store(false, std::memory_order_relaxed);
+        return;
+    }
+    if (!magnet_.trackers.empty()) {
+        result_.announce_url = magnet_.trackers.front();
+        result_.announce_list = magnet_.trackers;
+    }
+    result_.web_seeds = magnet_.web_seeds;
+    swarm_peers_ = magnet_.peers;
+    event_loop_.for_each_peer([this](Peer& p) {
+        auto it = peers_.find(p.fd());
+        if (it != peers_.end() && it->second.metadata_ready) {
+            swarm_peers_.push_back(p.remote());
+        }
+    });
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started_at_);
+    logger_.info("metadata for " + result_.name + " (" + std::to_string(metadata_.size()) +
+                 " bytes) fetched in " + std::to_string(elapsed.count()) + " ms");
+    done_.store(true, std::memory_order_release);
+}
+
+uint32_t MetadataFetcher::piece_size(uint32_t piece) const {
+    std::size_t begin = std::size_t{piece} * Peer::kMetadataPieceSize;
+    return static_cast<uint32_t>(std::min(Peer::kMetadataPieceSize, metadata_.size() - begin));
+}
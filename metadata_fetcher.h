@@ -0,0 +1,134 @@
+// MetadataFetcher downloads a magnet link's info dictionary from peers (BEP 9).
+#pragma once
+
+#include "dht.h"
+#include "endpoint_set.h"
+#include "include/mpsc.h"
+#include "ip_filter.h"
+#include "logger.h"
+#include "lsd.h"
+#include "magnet.h"
+#include "peer_event_loop.h"
+#include "torrent_file.h"
+#include "tracker_client.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Finds peers through the magnet's x.pe hints, its trackers and the DHT,
+// then pulls the info dictionary 16 KiB at a time over ut_metadata from
+// every peer that offers it. The result is checked against the info hash;
+// a mismatch bans the peers that supplied pieces and starts over. Peers may
+// disagree on the size; the one fetched is kept while a connected peer
+// offers it and is otherwise replaced by the size most peers offer.
+class MetadataFetcher {
+public:
+    MetadataFetcher(MagnetLink magnet, std::string peer_id, uint16_t listen_port);
+    ~MetadataFetcher();
+
+    MetadataFetcher(const MetadataFetcher&) = delete;
+    MetadataFetcher& operator=(const MetadataFetcher&) = delete;
+
+    // Looks for peers on the DHT too; the node must outlive the fetcher.
+    void set_dht(Dht* dht) { dht_ = dht; }
+    // And on the local network; lsd must outlive the fetcher.
+    void set_lsd(Lsd* lsd) { lsd_ = lsd; }
+    // Candidates it blocks are never dialled.
+    void set_ip_filter(std::shared_ptr<SharedIpFilter> filter) { ip_filter_ = std::move(filter); }
+
+    // start() after stop() resumes with the pieces already fetched.
+    void start();
+    void stop();
+
+    bool done() const { return done_.load(std::memory_order_acquire); }
+    // Only once done(): the torrent with the magnet's trackers and web seeds.
+    const TorrentFile& result() const { return result_; }
+    // Only once done(): the x.pe hints plus every peer that offered metadata,
+    // for the session to dial before trackers and the DHT answer.
+    const std::vector<PeerAddress>& swarm_peers() const { return swarm_peers_; }
+    const MagnetLink& magnet() const { return magnet_; }
+    std::size_t connected_peers() const { return connected_peers_.load(std::memory_order_relaxed); }
+
+private:
+    struct PeerState {
+        std::vector<uint32_t> requested;
+        // asked for before the buffer was last reset; replies are dropped
+        std::vector<uint32_t> stale;
+        std::chrono::steady_clock::time_point requested_at{};
+        std::chrono::steady_clock::time_point connected_at{};
+        // the size the peer advertised, 0 until its extended handshake
+        int64_t metadata_size{0};
+        // it advertised the size being fetched, so it is asked for pieces
+        bool metadata_ready{false};
+    };
+
+    struct PieceSlot {
+        bool have{false};
+        uint32_t requests{0};
+        std::optional<Endpoint> source;
+    };
+
+    void run();
+    void tracker_worker(std::vector<std::string> tracker_urls);
+    void post_candidate(const PeerAddress& address);
+    void drain_candidates();
+    void maybe_connect();
+    void maybe_expire(std::chrono::steady_clock::time_point now);
+    void handle_peer_events(Peer& peer, std::vector<Peer::Event>&& events);
+    void choose_metadata_size();
+    void reset_metadata(std::size_t size);
+    void maybe_request(Peer& peer, PeerState& state);
+    std::optional<uint32_t> pick_piece(const PeerState& state) const;
+    void handle_data(Peer& peer, PeerState& state, const Peer::Event& ev);
+    void release_requests(PeerState& state);
+    void drop_peer(int fd);
+    void verify();
+    uint32_t piece_size(uint32_t piece) const;
+
+    // the info dictionary of a real torrent is well below this
+    static constexpr int64_t kMaxMetadataSize = 16 * 1024 * 1024;
+    static constexpr std::size_t kMaxPeers = 40;
+    static constexpr std::size_t kRequestsPerPeer = 2;
+    static constexpr std::chrono::seconds kRequestTimeout{10};
+    static constexpr std::chrono::seconds kIdleTimeout{15};
+
+    MagnetLink magnet_;
+    std::string peer_id_;
+    uint16_t listen_port_;
+    // announce stand-in: the info hash and a non-zero "left"
+    TorrentFile stub_;
+    TrackerClient tracker_client_;
+    PeerEventLoop event_loop_;
+    Dht* dht_{nullptr};
+    Lsd* lsd_{nullptr};
+    std::shared_ptr<SharedIpFilter> ip_filter_;
+
+    // owned by the fetcher thread
+    std::unordered_map<int, PeerState> peers_;
+    std::deque<PeerAddress> pending_peers_;
+    EndpointSet known_endpoints_{1u << 12};
+    EndpointSet banned_{1u << 10};
+    std::string metadata_;
+    std::vector<PieceSlot> pieces_;
+    std::size_t pieces_have_{0};
+    std::chrono::steady_clock::time_point started_at_{};
+
+    MpscQueue<PeerAddress, 1024> posted_candidates_;
+    TorrentFile result_;
+    std::vector<PeerAddress> swarm_peers_;
+    std::thread worker_;
+    std::thread tracker_thread_;
+    std::atomic<bool> tracker_stop_{false};
+    std::atomic<bool> running_{false};
+    std::atomic<bool> done_{false};
+    std::atomic<std::size_t> connected_peers_{0};
+    AsyncLogger logger_;
+};
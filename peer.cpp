@@ -5,6 +5,7 @@
 #include <cerrno>
 #include <fcntl.h>
 #include <iostream>
+#include <limits>
 #include <netdb.h>
 #include <ostream>
 #include <stdexcept>
@@ -65,6 +66,7 @@ Peer& Peer::operator=(Peer&& other) noexcept {
         fd_ = other.fd_;
         remote_ = std::move(other.remote_);
         state_ = other.state_;
+        initiated_ = other.initiated_;
         info_hash_ = other.info_hash_;
         self_peer_id_ = std::move(other.self_peer_id_);
         remote_peer_id_ = std::move(other.remote_peer_id_);
@@ -73,11 +75,30 @@ Peer& Peer::operator=(Peer&& other) noexcept {
         incoming_ = std::move(other.incoming_);
         outgoing_ = std::move(other.outgoing_);
         outgoing_offset_ = other.outgoing_offset_;
+        outgoing_bytes_ = other.outgoing_bytes_;
+        buffer_charge_ = std::move(other.buffer_charge_);
         events_ = std::move(other.events_);
+        extended_handshake_sent_ = other.extended_handshake_sent_;
+        remote_ut_pex_id_ = other.remote_ut_pex_id_;
+        remote_ut_metadata_id_ = other.remote_ut_metadata_id_;
+        remote_metadata_size_ = other.remote_metadata_size_;
+        metadata_size_ = other.metadata_size_;
+        remote_upload_only_ = other.remote_upload_only_;
+        request_queue_ = other.request_queue_;
+        listen_port_ = other.listen_port_;
+        remote_request_queue_ = other.remote_request_queue_;
+        remote_listen_port_ = other.remote_listen_port_;
+        remote_client_ = std::move(other.remote_client_);
+        reported_ip_ = std::move(other.reported_ip_);
+        remote_fast_ = other.remote_fast_;
+        local_v2_ = other.local_v2_;
+        remote_v2_ = other.remote_v2_;
+        bitfield_bytes_ = other.bitfield_bytes_;
 
         other.fd_ = -1;
         other.state_ = State::Closed;
         other.outgoing_offset_ = 0;
+        other.outgoing_bytes_ = 0;
         other.incoming_.clear();
         other.outgoing_.clear();
         other.events_.clear();
@@ -87,11 +108,14 @@ Peer& Peer::operator=(Peer&& other) noexcept {
 
 Peer Peer::connect_outgoing(const PeerAddress& addr,
                             const std::array<uint8_t, 20>& info_hash,
-                            std::string self_peer_id) {
+                            std::string self_peer_id,
+                            bool v2) {
     int fd = make_nonblocking_socket(addr);
     Peer p(fd, addr, info_hash, std::move(self_peer_id));
+    p.local_v2_ = v2;
     std::cout << "adding new peer with addr " << addr.ip << std::endl;
     p.state_ = State::Connecting;
+    p.initiated_ = true;
     p.ensure_handshake_sent();
     return p;
 }
@@ -99,13 +123,68 @@ Peer Peer::connect_outgoing(const PeerAddress& addr,
 Peer Peer::from_incoming(int fd,
                          const PeerAddress& addr,
                          const std::array<uint8_t, 20>& info_hash,
-                         std::string self_peer_id) {
+                         std::string self_peer_id,
+                         bool v2) {
     Peer p(fd, addr, info_hash, std::move(self_peer_id));
+    p.local_v2_ = v2;
     std::cout << "accepted incoming peer from addr " << addr.ip << std::endl;
     p.state_ = State::Handshaking;
     return p;
 }
 
+Peer Peer::adopt(Detached detached,
+                 const std::array<uint8_t, 20>& info_hash,
+                 std::string self_peer_id) {
+    Peer p(detached.fd, std::move(detached.remote), info_hash, std::move(self_peer_id));
+    p.state_ = State::Active;
+    p.initiated_ = detached.initiated;
+    p.remote_peer_id_ = std::move(detached.remote_peer_id);
+    p.handshake_received_ = true;
+    p.handshake_sent_ = true;
+    p.extended_handshake_sent_ = true;
+    p.remote_ut_pex_id_ = detached.remote_ut_pex_id;
+    p.remote_ut_metadata_id_ = detached.remote_ut_metadata_id;
+    p.remote_upload_only_ = detached.remote_upload_only;
+    p.remote_request_queue_ = detached.remote_request_queue;
+    p.remote_listen_port_ = detached.remote_listen_port;
+    p.remote_fast_ = detached.remote_fast;
+    // only a v2 torrent's session hands over a peer that negotiated the bit
+    p.local_v2_ = detached.remote_v2;
+    p.remote_v2_ = detached.remote_v2;
+    p.incoming_ = std::move(detached.incoming);
+    if (!detached.outgoing.empty()) {
+        p.queue_bytes(std::move(detached.outgoing));
+    }
+    p.account_buffers();
+    return p;
+}
+
+Peer::Detached Peer::detach() {
+    Detached d;
+    d.fd = fd_;
+    d.remote = remote_;
+    d.initiated = initiated_;
+    d.remote_peer_id = remote_peer_id_;
+    d.remote_ut_pex_id = remote_ut_pex_id_;
+    d.remote_ut_metadata_id = remote_ut_metadata_id_;
+    d.remote_upload_only = remote_upload_only_;
+    d.remote_request_queue = remote_request_queue_;
+    d.remote_listen_port = remote_listen_port_;
+    d.remote_fast = remote_fast_;
+    d.remote_v2 = supports_v2();
+    d.incoming = incoming_;
+    for (std::size_t i = 0; i < outgoing_.size(); ++i) {
+        std::size_t skip = i == 0 ? outgoing_offset_ : 0;
+        d.outgoing.insert(d.outgoing.end(),
+                          outgoing_[i].begin() + static_cast<std::ptrdiff_t>(skip),
+                          outgoing_[i].end());
+    }
+    // forget the fd so close() leaves the socket open for the new owner
+    fd_ = -1;
+    close();
+    return d;
+}
+
 void Peer::close() {
     if (fd_ >= 0) {
         std::cerr << "closing peer connection to " << remote_.ip << ":" << remote_.port
@@ -115,7 +194,9 @@ void Peer::close() {
     }
     state_ = State::Closed;
     outgoing_.clear();
-    incoming_.clear();
+    outgoing_bytes_ = 0;
+    std::vector<uint8_t>().swap(incoming_);
+    account_buffers();
 }
 
 void Peer::handle_error() {
@@ -141,6 +222,7 @@ void Peer::handle_writable() {
         std::vector<uint8_t>& front = outgoing_.front();
         std::size_t remaining = front.size() - outgoing_offset_;
         if (remaining == 0) {
+            outgoing_bytes_ -= front.size();
             outgoing_.pop_front();
             outgoing_offset_ = 0;
             continue;
@@ -155,10 +237,12 @@ void Peer::handle_writable() {
         }
         outgoing_offset_ += static_cast<std::size_t>(n);
         if (outgoing_offset_ == front.size()) {
+            outgoing_bytes_ -= front.size();
             outgoing_.pop_front();
             outgoing_offset_ = 0;
         }
     }
+    account_buffers();
 }
 
 void Peer::handle_readable() {
@@ -175,16 +259,20 @@ void Peer::handle_readable() {
             return;
         }
         incoming_.insert(incoming_.end(), buf, buf + n);
+        if (incoming_.size() >= kMaxIncomingBuffer ||
+            memory_governor().reading_paused(awaiting_blocks_)) {
+            // leave the rest in the socket; the loop stops polling for input
+            break;
+        }
     }
 
     if (!handshake_received_) {
-        if (!parse_handshake()) {
-            return;
-        }
+        parse_handshake();
     }
-    if (handshake_received_) {
+    if (handshake_received_ && !is_closed()) {
         parse_messages();
     }
+    account_buffers();
 }
 
 bool Peer::parse_handshake() {
@@ -205,7 +293,8 @@ bool Peer::parse_handshake() {
         return false;
     }
     const uint8_t* reserved = &incoming_[1 + kPstrlen];
-    (void)reserved;
+    remote_fast_ = (reserved[7] & 0x04) != 0;
+    remote_v2_ = (reserved[7] & 0x10) != 0;
 
     const uint8_t* info_hash = &incoming_[1 + kPstrlen + 8];
     if (!std::equal(info_hash, info_hash + 20, info_hash_.begin())) {
@@ -215,6 +304,8 @@ bool Peer::parse_handshake() {
     const uint8_t* peer_id = info_hash + 20;
     remote_peer_id_.assign(reinterpret_cast<const char*>(peer_id), 20);
 
+    // ours must precede anything the session queues in reply to theirs
+    ensure_handshake_sent();
     events_.push_back(Event{EventType::Handshake, remote_peer_id_, {}, 0, 0, 0});
 
     incoming_.erase(incoming_.begin(), incoming_.begin() + static_cast<std::ptrdiff_t>(kHandshakeSize));
@@ -236,10 +327,21 @@ void Peer::parse_messages() {
             incoming_.erase(incoming_.begin(), incoming_.begin() + 4);
             continue;
         }
-        if (incoming_.size() < 4 + msg_len) {
+        if (incoming_.size() < 5) {
             return;
         }
         uint8_t msg_id = incoming_[4];
+        // checked before the body is buffered, so a bogus length costs nothing
+        if (!message_length_ok(msg_id, msg_len)) {
+            std::cerr << "peer " << remote_.ip << ":" << remote_.port << " sent message id "
+                      << static_cast<int>(msg_id) << " with bad length " << msg_len
+                      << std::endl;
+            close();
+            return;
+        }
+        if (incoming_.size() < 4 + msg_len) {
+            return;
+        }
         const uint8_t* payload = incoming_.data() + 5;
         uint32_t payload_len = msg_len - 1;
 
@@ -305,30 +407,69 @@ void Peer::parse_messages() {
                         std::vector<uint8_t> data(ext_payload, ext_payload + ext_len);
                         events_.push_back(Event{EventType::ExtendedHandshake, {}, std::move(data),
                                                 0, 0, 0});
-                        try {
-                            std::string s(reinterpret_cast<const char*>(data.data()),
-                                          data.size());
-                            bencode::Parser parser(std::move(s));
-                            bencode::Value v = parser.parse();
-                            const auto& dict = bencode::as_dict(v);
-                            if (const auto* m = bencode::find_field(dict, "m")) {
-                                const auto& md = bencode::as_dict(*m);
-                                if (const auto* utpex = bencode::find_field(md, "ut_pex")) {
-                                    int64_t id = bencode::as_int(*utpex);
-                                    if (id > 0 && id < 256) {
-                                        remote_ut_pex_id_ = static_cast<uint8_t>(id);
-                                    }
-                                }
-                            }
-                        } catch (...) {
-                        }
-                    } else if (ext_id == remote_ut_pex_id_ && remote_ut_pex_id_ != 0) {
+                        // data was moved into the event; parse the wire bytes
+                        parse_extended_handshake(ext_payload, ext_len);
+                    } else if (ext_id == kLocalUtPexId_) {
                         std::vector<uint8_t> data(ext_payload, ext_payload + ext_len);
                         events_.push_back(Event{EventType::Pex, {}, std::move(data), 0, 0, 0});
+                    } else if (ext_id == kLocalUtMetadataId_) {
+                        // BEP 10: messages to us carry the id we advertised
+                        parse_metadata_message(ext_payload, ext_len);
                     }
                 }
                 break;
             }
+            case 13:
+            case 14:
+            case 15:
+            case 16:
+            case 17: {
+                // BEP 6: fast messages on a connection that never negotiated them
+                if (!remote_fast_) {
+                    close();
+                    return;
+                }
+                uint32_t piece = msg_id == 14 || msg_id == 15 ? 0 : read_be32(payload);
+                if (msg_id == 13) {
+                    events_.push_back(Event{EventType::Suggest, {}, {}, piece, 0, 0});
+                } else if (msg_id == 14) {
+                    events_.push_back(Event{EventType::HaveAll, {}, {}, 0, 0, 0});
+                } else if (msg_id == 15) {
+                    events_.push_back(Event{EventType::HaveNone, {}, {}, 0, 0, 0});
+                } else if (msg_id == 16) {
+                    uint32_t begin = read_be32(payload + 4);
+                    uint32_t len = read_be32(payload + 8);
+                    events_.push_back(Event{EventType::Reject, {}, {}, piece, begin, len});
+                } else {
+                    events_.push_back(Event{EventType::AllowedFast, {}, {}, piece, 0, 0});
+                }
+                break;
+            }
+            case 21:
+            case 22:
+            case 23: {
+                if (!supports_v2()) {
+                    break;
+                }
+                static constexpr EventType kTypes[] = {EventType::HashRequest,
+                                                       EventType::Hashes,
+                                                       EventType::HashReject};
+                Event ev{kTypes[msg_id - 21], {}, {}, 0, 0, 0};
+                // root, then for hashes (message_length_ok saw to the 48
+                // header bytes) the hash list
+                std::size_t hash_bytes = msg_id == 22 && payload_len > 48 ? payload_len - 48 : 0;
+                ev.payload.resize(32 + hash_bytes);
+                std::memcpy(ev.payload.data(), payload, 32);
+                if (hash_bytes > 0) {
+                    std::memcpy(ev.payload.data() + 32, payload + 48, hash_bytes);
+                }
+                ev.piece_index = read_be32(payload + 32);
+                ev.begin = read_be32(payload + 36);
+                ev.length = read_be32(payload + 40);
+                ev.proof_layers = read_be32(payload + 44);
+                events_.push_back(std::move(ev));
+                break;
+            }
             default:
                 break;
         }
@@ -338,6 +479,134 @@ void Peer::parse_messages() {
     }
 }
 
+bool Peer::message_length_ok(uint8_t msg_id, uint32_t msg_len) const {
+    switch (msg_id) {
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+            return msg_len == 1;
+        case 4:
+            return msg_len == 5;
+        case 5:
+            return bitfield_bytes_ != 0 ? msg_len == 1 + bitfield_bytes_
+                                        : msg_len <= 1 + kMaxExtendedLength;
+        case 6:
+        case 8:
+            return msg_len == 13;
+        case 7:
+            return msg_len >= 9 && msg_len <= 9 + kMaxBlockLength;
+        case 13:
+        case 17:
+            return msg_len == 5;
+        case 14:
+        case 15:
+            return msg_len == 1;
+        case 16:
+            return msg_len == 13;
+        case 21:
+        case 23:
+            return msg_len == 49;
+        case 22:
+            return msg_len >= 49 && msg_len <= kMaxHashesLength && (msg_len - 49) % 32 == 0;
+        default:
+            return msg_len <= 1 + kMaxExtendedLength;
+    }
+}
+
+// One pass over the dict, reading the keys we know in place; anything
+// malformed leaves what was read so far.
+void Peer::parse_extended_handshake(const uint8_t* data, uint32_t len) {
+    try {
+        bencode::Reader reader(std::string_view(reinterpret_cast<const char*>(data), len));
+        if (!reader.enter_dict()) {
+            return;
+        }
+        std::string_view key;
+        while (reader.next_key(key)) {
+            if (key == "m") {
+                if (!reader.enter_dict()) {
+                    continue;
+                }
+                std::string_view name;
+                while (reader.next_key(name)) {
+                    uint8_t* id_out = name == "ut_pex"        ? &remote_ut_pex_id_
+                                      : name == "ut_metadata" ? &remote_ut_metadata_id_
+                                                              : nullptr;
+                    if (!id_out) {
+                        reader.skip();
+                    } else if (auto id = reader.read_int(); id && *id > 0 && *id < 256) {
+                        *id_out = static_cast<uint8_t>(*id);
+                    }
+                }
+            } else if (key == "metadata_size") {
+                if (auto ms = reader.read_int()) {
+                    remote_metadata_size_ = std::max<int64_t>(*ms, 0);
+                }
+            } else if (key == "upload_only") {
+                if (auto uo = reader.read_int()) {
+                    remote_upload_only_ = *uo != 0;
+                }
+            } else if (key == "reqq") {
+                if (auto rq = reader.read_int()) {
+                    remote_request_queue_ = static_cast<uint32_t>(
+                        std::clamp<int64_t>(*rq, 1, kMaxRemoteRequestQueue));
+                }
+            } else if (key == "p") {
+                if (auto port = reader.read_int(); port && *port > 0 && *port < 65536) {
+                    remote_listen_port_ = static_cast<uint16_t>(*port);
+                }
+            } else if (key == "v") {
+                if (auto cv = reader.read_string()) {
+                    remote_client_ = std::string(cv->substr(0, kMaxClientNameLength));
+                }
+            } else if (key == "yourip") {
+                if (auto ip = reader.read_string(); ip && (ip->size() == 4 || ip->size() == 16)) {
+                    reported_ip_ = std::string(*ip);
+                }
+            } else {
+                reader.skip();
+            }
+        }
+    } catch (...) {
+    }
+}
+
+// The dict is followed by the piece itself; the reader stops where it ends.
+void Peer::parse_metadata_message(const uint8_t* data, uint32_t len) {
+    try {
+        bencode::Reader reader(std::string_view(reinterpret_cast<const char*>(data), len));
+        if (!reader.enter_dict()) {
+            return;
+        }
+        std::optional<int64_t> msg_type;
+        std::optional<int64_t> piece;
+        int64_t total_size = 0;
+        std::string_view key;
+        while (reader.next_key(key)) {
+            if (key == "msg_type") {
+                msg_type = reader.read_int();
+            } else if (key == "piece") {
+                piece = reader.read_int();
+            } else if (key == "total_size") {
+                total_size = reader.read_int().value_or(0);
+            } else {
+                reader.skip();
+            }
+        }
+        constexpr int64_t kMaxU32 = std::numeric_limits<uint32_t>::max();
+        if (!msg_type || !piece || *msg_type < kMetadataRequest || *msg_type > kMetadataReject ||
+            *piece < 0 || *piece > kMaxU32 || total_size < 0 || total_size > kMaxU32) {
+            return;
+        }
+        std::vector<uint8_t> trailer(data + reader.offset(), data + len);
+        events_.push_back(Event{EventType::Metadata, {}, std::move(trailer),
+                                static_cast<uint32_t>(*piece), static_cast<uint32_t>(*msg_type),
+                                static_cast<uint32_t>(total_size)});
+    } catch (...) {
+    }
+}
+
 std::vector<Peer::Event> Peer::drain_events() {
     std::vector<Event> out;
     out.swap(events_);
@@ -367,6 +636,81 @@ void Peer::send_request(uint32_t piece_index, uint32_t begin, uint32_t length) {
     queue_bytes(std::move(msg));
 }
 
+void Peer::send_suggest(uint32_t piece_index) {
+    std::vector<uint8_t> msg(9);
+    write_be32(msg.data(), 5);
+    msg[4] = 13;
+    write_be32(msg.data() + 5, piece_index);
+    queue_bytes(std::move(msg));
+}
+
+void Peer::send_have_all() {
+    std::vector<uint8_t> msg(5);
+    write_be32(msg.data(), 1);
+    msg[4] = 14;
+    queue_bytes(std::move(msg));
+}
+
+void Peer::send_have_none() {
+    std::vector<uint8_t> msg(5);
+    write_be32(msg.data(), 1);
+    msg[4] = 15;
+    queue_bytes(std::move(msg));
+}
+
+void Peer::send_reject(uint32_t piece_index, uint32_t begin, uint32_t length) {
+    std::vector<uint8_t> msg(17);
+    write_be32(msg.data(), 13);
+    msg[4] = 16;
+    write_be32(msg.data() + 5, piece_index);
+    write_be32(msg.data() + 9, begin);
+    write_be32(msg.data() + 13, length);
+    queue_bytes(std::move(msg));
+}
+
+void Peer::send_allowed_fast(uint32_t piece_index) {
+    std::vector<uint8_t> msg(9);
+    write_be32(msg.data(), 5);
+    msg[4] = 17;
+    write_be32(msg.data() + 5, piece_index);
+    queue_bytes(std::move(msg));
+}
+
+void Peer::send_hash_request(const Sha256Hash& root, uint32_t base_layer, uint32_t index,
+                             uint32_t length, uint32_t proof_layers) {
+    queue_hash_message(21, root, base_layer, index, length, proof_layers, nullptr);
+}
+
+void Peer::send_hashes(const Sha256Hash& root, uint32_t base_layer, uint32_t index,
+                       uint32_t length, uint32_t proof_layers,
+                       const std::vector<Sha256Hash>& hashes) {
+    queue_hash_message(22, root, base_layer, index, length, proof_layers, &hashes);
+}
+
+void Peer::send_hash_reject(const Sha256Hash& root, uint32_t base_layer, uint32_t index,
+                            uint32_t length, uint32_t proof_layers) {
+    queue_hash_message(23, root, base_layer, index, length, proof_layers, nullptr);
+}
+
+void Peer::queue_hash_message(uint8_t msg_id, const Sha256Hash& root, uint32_t base_layer,
+                              uint32_t index, uint32_t length, uint32_t proof_layers,
+                              const std::vector<Sha256Hash>* hashes) {
+    std::size_t count = hashes ? hashes->size() : 0;
+    std::vector<uint8_t> msg(4 + 49 + 32 * count);
+    write_be32(msg.data(), static_cast<uint32_t>(msg.size() - 4));
+    msg[4] = msg_id;
+    std::copy(root.begin(), root.end(), msg.begin() + 5);
+    write_be32(msg.data() + 37, base_layer);
+    write_be32(msg.data() + 41, index);
+    write_be32(msg.data() + 45, length);
+    write_be32(msg.data() + 49, proof_layers);
+    for (std::size_t i = 0; i < count; ++i) {
+        std::copy((*hashes)[i].begin(), (*hashes)[i].end(),
+                  msg.begin() + 53 + static_cast<std::ptrdiff_t>(32 * i));
+    }
+    queue_bytes(std::move(msg));
+}
+
 void Peer::send_cancel(uint32_t piece_index, uint32_t begin, uint32_t length) {
     std::vector<uint8_t> msg(17);
     write_be32(msg.data(), 13);
@@ -395,62 +739,114 @@ void Peer::send_piece(uint32_t piece_index, uint32_t begin, const std::vector<ui
     queue_bytes(std::move(msg));
 }
 
-void Peer::send_extended_handshake() {
+void Peer::send_extended_handshake(bool upload_only) {
     if (extended_handshake_sent_) {
         return;
     }
-    std::string payload = "d1:md6:ut_pexi";
-    payload += std::to_string(static_cast<int>(kLocalUtPexId_));
-    payload += "ee";
+    bencode::Dict m;
+    m["ut_metadata"] = bencode::Value{int64_t{kLocalUtMetadataId_}};
+    m["ut_pex"] = bencode::Value{int64_t{kLocalUtPexId_}};
+    bencode::Dict d;
+    d["m"] = bencode::Value{std::move(m)};
+    d["v"] = bencode::Value{std::string(kClientName)};
+    if (metadata_size_ > 0) {
+        d["metadata_size"] = bencode::Value{static_cast<int64_t>(metadata_size_)};
+    }
+    if (upload_only) {
+        d["upload_only"] = bencode::Value{int64_t{1}};
+    }
+    if (request_queue_ > 0) {
+        d["reqq"] = bencode::Value{static_cast<int64_t>(request_queue_)};
+    }
+    if (listen_port_ > 0) {
+        d["p"] = bencode::Value{static_cast<int64_t>(listen_port_)};
+    }
+    // tells the peer its address as we see it: 4 bytes for IPv4, mapped
+    // addresses off our dual-stack listener included, else 16
+    in6_addr v6{};
+    in_addr v4{};
+    if (inet_pton(AF_INET, remote_.ip.c_str(), &v4) == 1) {
+        d["yourip"] = bencode::Value{std::string(reinterpret_cast<const char*>(&v4), 4)};
+    } else if (inet_pton(AF_INET6, remote_.ip.c_str(), &v6) == 1) {
+        const char* bytes = reinterpret_cast<const char*>(&v6);
+        d["yourip"] = IN6_IS_ADDR_V4MAPPED(&v6) ? bencode::Value{std::string(bytes + 12, 4)}
+                                                : bencode::Value{std::string(bytes, 16)};
+    }
+    queue_extended_handshake(bencode::encode(bencode::Value{std::move(d)}));
+    extended_handshake_sent_ = true;
+}
+
+// BEP 10 lets a handshake be repeated to change only the keys it carries;
+// one that has not gone out yet will say upload_only itself.
+void Peer::send_upload_only() {
+    if (extended_handshake_sent_) {
+        queue_extended_handshake("d11:upload_onlyi1ee");
+    }
+}
 
-    uint32_t ext_len = static_cast<uint32_t>(1 + payload.size());
-    uint32_t msg_len = 1 + ext_len;
+void Peer::queue_extended_handshake(std::string_view payload) {
+    uint32_t msg_len = static_cast<uint32_t>(2 + payload.size());
     std::vector<uint8_t> msg(4 + msg_len);
     write_be32(msg.data(), msg_len);
     msg[4] = 20;
     msg[5] = 0;
     std::memcpy(msg.data() + 6, payload.data(), payload.size());
     queue_bytes(std::move(msg));
-    extended_handshake_sent_ = true;
 }
 
-void Peer::send_ut_pex(const std::vector<PeerAddress>& added) {
-    if (added.empty()) {
-        return;
-    }
-    std::string compact;
-    compact.reserve(6 * added.size());
-    for (const auto& a : added) {
-        in_addr addr{};
-        if (inet_pton(AF_INET, a.ip.c_str(), &addr) != 1) {
-            continue;
-        }
-        compact.append(reinterpret_cast<const char*>(&addr), sizeof(addr));
-        uint16_t port_be = htons(a.port);
-        compact.append(reinterpret_cast<const char*>(&port_be), sizeof(port_be));
-    }
-    if (compact.empty()) {
-        return;
-    }
+void Peer::send_ut_pex(std::string_view payload) {
+    queue_extended(remote_ut_pex_id_, payload);
+}
 
-    std::string payload = "d5:added";
-    payload += std::to_string(compact.size());
-    payload += ":";
-    payload += compact;
-    payload += "e";
+void Peer::send_metadata_request(uint32_t piece) {
+    bencode::Dict d;
+    d["msg_type"] = bencode::Value{int64_t{kMetadataRequest}};
+    d["piece"] = bencode::Value{static_cast<int64_t>(piece)};
+    queue_extended(remote_ut_metadata_id_, bencode::encode(bencode::Value{std::move(d)}));
+}
+
+void Peer::send_metadata_data(uint32_t piece, std::size_t total_size, std::string_view data) {
+    bencode::Dict d;
+    d["msg_type"] = bencode::Value{int64_t{kMetadataData}};
+    d["piece"] = bencode::Value{static_cast<int64_t>(piece)};
+    d["total_size"] = bencode::Value{static_cast<int64_t>(total_size)};
+    queue_extended(remote_ut_metadata_id_, bencode::encode(bencode::Value{std::move(d)}), data);
+}
 
-    uint32_t ext_len = static_cast<uint32_t>(1 + payload.size());
-    uint32_t msg_len = 1 + ext_len;
+void Peer::send_metadata_reject(uint32_t piece) {
+    bencode::Dict d;
+    d["msg_type"] = bencode::Value{int64_t{kMetadataReject}};
+    d["piece"] = bencode::Value{static_cast<int64_t>(piece)};
+    queue_extended(remote_ut_metadata_id_, bencode::encode(bencode::Value{std::move(d)}));
+}
+
+void Peer::queue_extended(uint8_t ext_id, std::string_view payload, std::string_view trailer) {
+    if (ext_id == 0) {
+        return;
+    }
+    uint32_t msg_len = static_cast<uint32_t>(2 + payload.size() + trailer.size());
     std::vector<uint8_t> msg(4 + msg_len);
     write_be32(msg.data(), msg_len);
     msg[4] = 20;
-    msg[5] = kLocalUtPexId_;
+    msg[5] = ext_id;
     std::memcpy(msg.data() + 6, payload.data(), payload.size());
+    std::memcpy(msg.data() + 6 + payload.size(), trailer.data(), trailer.size());
     queue_bytes(std::move(msg));
 }
 
 void Peer::queue_bytes(std::vector<uint8_t> bytes) {
+    outgoing_bytes_ += bytes.size();
     outgoing_.push_back(std::move(bytes));
+    account_buffers();
+}
+
+void Peer::account_buffers() {
+    // a drained buffer keeps its peak capacity; give it back under pressure
+    if (incoming_.empty() && incoming_.capacity() > 0 &&
+        memory_governor().reading_paused(awaiting_blocks_)) {
+        std::vector<uint8_t>().swap(incoming_);
+    }
+    buffer_charge_.set(incoming_.capacity() + outgoing_bytes_);
 }
 
 void Peer::ensure_handshake_sent() {
@@ -458,7 +854,7 @@ void Peer::ensure_handshake_sent() {
         return;
     }
     // std::cout << "sending handshake" << std::endl;
-    queue_bytes(make_handshake(info_hash_, self_peer_id_));
+    queue_bytes(make_handshake(info_hash_, self_peer_id_, local_v2_));
     handshake_sent_ = true;
 }
 
@@ -472,7 +868,7 @@ bool Peer::check_socket_connected() {
 }
 
 std::vector<uint8_t> Peer::make_handshake(const std::array<uint8_t, 20>& info_hash,
-                                          const std::string& peer_id) {
+                                          const std::string& peer_id, bool v2) {
     static constexpr uint8_t kPstrlen = 19;
     static constexpr std::string_view kPstr = "BitTorrent protocol";
     if (peer_id.size() != 20) {
@@ -481,6 +877,14 @@ std::vector<uint8_t> Peer::make_handshake(const std::array<uint8_t, 20>& info_ha
     std::vector<uint8_t> msg(1 + kPstrlen + 8 + 20 + 20, 0);
     msg[0] = kPstrlen;
     std::copy(kPstr.begin(), kPstr.end(), msg.begin() + 1);
+    // reserved bit 20: we speak the extension protocol (BEP 10)
+    msg[1 + kPstrlen + 5] |= 0x10;
+    // reserved bit 62: fast extension (BEP 6)
+    msg[1 + kPstrlen + 7] |= 0x04;
+    // reserved bit 60: BitTorrent v2 (BEP 52)
+    if (v2) {
+        msg[1 + kPstrlen + 7] |= 0x10;
+    }
     std::copy(info_hash.begin(), info_hash.end(), msg.begin() + 1 + kPstrlen + 8);
     std::copy(peer_id.begin(), peer_id.end(), msg.begin() + 1 + kPstrlen + 8 + 20);
     return msg;
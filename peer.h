@@ -1,14 +1,22 @@
 #pragma once
+#include "memory_governor.h"
+#include "merkle.h"
+
 #include <array>
 #include <cstdint>
 #include <deque>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 struct PeerAddress {
     std::string ip;
     uint16_t port{};
+    // seed or upload-only (BEP 21), as far as the source of this address knows
+    bool seed{false};
+    // same LAN/rack as us (topology rules, local discovery)
+    bool local{false};
 };
 
 class Peer {
@@ -29,6 +37,21 @@ public:
         Piece,
         Cancel,
         Pex,
+        // BEP 9: piece_index is the metadata piece, begin the msg_type
+        // (request, data, reject), length the total_size; payload is the data
+        Metadata,
+        // BEP 6, only once both sides set the fast bit
+        Suggest,
+        HaveAll,
+        HaveNone,
+        Reject,
+        AllowedFast,
+        // BEP 52: payload is the pieces root (for Hashes, followed by the
+        // hashes); piece_index is the base layer, begin the index, length
+        // the number of hashes
+        HashRequest,
+        Hashes,
+        HashReject,
     };
 
     struct Event {
@@ -38,15 +61,44 @@ public:
         uint32_t piece_index{0};
         uint32_t begin{0};
         uint32_t length{0};
+        // BEP 52 hash messages only
+        uint32_t proof_layers{0};
     };
 
+    // v2 sets the BEP 52 reserved bit for torrents with merkle hashes.
     static Peer connect_outgoing(const PeerAddress& addr,
                                  const std::array<uint8_t, 20>& info_hash,
-                                 std::string self_peer_id);
+                                 std::string self_peer_id,
+                                 bool v2 = false);
     static Peer from_incoming(int fd,
                               const PeerAddress& addr,
                               const std::array<uint8_t, 20>& info_hash,
-                              std::string self_peer_id);
+                              std::string self_peer_id,
+                              bool v2 = false);
+
+    // An established connection lifted out of one process and resumed in
+    // another (hot restart): the socket plus the bytes either side of it.
+    struct Detached {
+        int fd{-1};
+        PeerAddress remote;
+        bool initiated{false};
+        std::string remote_peer_id;
+        uint8_t remote_ut_pex_id{0};
+        uint8_t remote_ut_metadata_id{0};
+        bool remote_upload_only{false};
+        uint32_t remote_request_queue{0};
+        uint16_t remote_listen_port{0};
+        bool remote_fast{false};
+        bool remote_v2{false};
+        // received but not yet parsed, and queued but not yet sent
+        std::vector<uint8_t> incoming;
+        std::vector<uint8_t> outgoing;
+    };
+    static Peer adopt(Detached detached,
+                      const std::array<uint8_t, 20>& info_hash,
+                      std::string self_peer_id);
+    // Hands the socket over without closing it; the peer is closed after.
+    Detached detach();
 
     ~Peer();
     Peer(Peer&&) noexcept;
@@ -59,10 +111,15 @@ public:
     bool is_closed() const { return state_ == State::Closed; }
     bool wants_write() const { return !outgoing_.empty(); }
     const PeerAddress& remote() const { return remote_; }
+    bool initiated_by_us() const { return initiated_; }
+    // Set by the session while requests to this peer are in flight.
+    void set_awaiting_blocks(bool awaiting) { awaiting_blocks_ = awaiting; }
+    bool awaiting_blocks() const { return awaiting_blocks_; }
 
     void handle_readable();
     void handle_writable();
     void handle_error();
+    void disconnect() { close(); }
 
     std::vector<Event> drain_events();
 
@@ -75,29 +132,95 @@ public:
     void send_cancel(uint32_t piece_index, uint32_t begin, uint32_t length);
     void send_bitfield(const std::vector<uint8_t>& bitfield);
     void send_piece(uint32_t piece_index, uint32_t begin, const std::vector<uint8_t>& data);
-    void send_extended_handshake();
-    void send_ut_pex(const std::vector<PeerAddress>& added);
+    void send_extended_handshake(bool upload_only = false);
+    // Tells a peer we already shook hands with that we became a seed.
+    void send_upload_only();
+    // payload is the bencoded BEP 11 dictionary
+    void send_ut_pex(std::string_view payload);
+    void send_metadata_request(uint32_t piece);
+    void send_metadata_data(uint32_t piece, std::size_t total_size, std::string_view data);
+    void send_metadata_reject(uint32_t piece);
+    void send_suggest(uint32_t piece_index);
+    void send_have_all();
+    void send_have_none();
+    void send_reject(uint32_t piece_index, uint32_t begin, uint32_t length);
+    void send_allowed_fast(uint32_t piece_index);
+    void send_hash_request(const Sha256Hash& root, uint32_t base_layer, uint32_t index,
+                           uint32_t length, uint32_t proof_layers);
+    void send_hashes(const Sha256Hash& root, uint32_t base_layer, uint32_t index,
+                     uint32_t length, uint32_t proof_layers,
+                     const std::vector<Sha256Hash>& hashes);
+    void send_hash_reject(const Sha256Hash& root, uint32_t base_layer, uint32_t index,
+                          uint32_t length, uint32_t proof_layers);
 
     bool supports_ut_pex() const { return remote_ut_pex_id_ != 0; }
+    // BEP 6 is on for this connection; we always set the bit ourselves
+    bool supports_fast() const { return remote_fast_; }
+    bool supports_ut_metadata() const { return remote_ut_metadata_id_ != 0; }
+    // both sides set the BEP 52 bit, so hash requests may be sent
+    bool supports_v2() const { return local_v2_ && remote_v2_; }
+    // metadata_size from the peer's extended handshake, 0 if not sent
+    int64_t remote_metadata_size() const { return remote_metadata_size_; }
+    // Advertised in our extended handshake so peers can fetch the info
+    // dictionary from us; set before the handshake goes out.
+    void set_metadata_size(std::size_t bytes) { metadata_size_ = bytes; }
+    // Likewise: how many requests we queue from one peer (reqq) and the
+    // port we accept connections on (p); 0 leaves them out.
+    void set_request_queue(uint32_t requests) { request_queue_ = requests; }
+    void set_listen_port(uint16_t port) { listen_port_ = port; }
+    // From the peer's extended handshake: how many requests it queues from
+    // us (0 if not sent), where it accepts connections (0 if not sent), its
+    // client name, and our address as it sees it (4 or 16 bytes, or empty).
+    uint32_t remote_request_queue() const { return remote_request_queue_; }
+    uint16_t remote_listen_port() const { return remote_listen_port_; }
+    const std::string& remote_client() const { return remote_client_; }
+    const std::string& reported_ip() const { return reported_ip_; }
+
+    enum MetadataMessage : uint32_t {
+        kMetadataRequest = 0,
+        kMetadataData = 1,
+        kMetadataReject = 2,
+    };
+    static constexpr std::size_t kMetadataPieceSize = 16 * 1024;
+
+    // Bitfields must be exactly this long once set (ceil(pieces / 8)).
+    void set_bitfield_bytes(uint32_t bytes) { bitfield_bytes_ = bytes; }
+    // Bytes queued for sending, for callers that pace uploads.
+    std::size_t queued_bytes() const { return outgoing_bytes_; }
+
+    // Largest block we request or serve.
+    static constexpr uint32_t kMaxBlockLength = 128 * 1024;
+    bool remote_upload_only() const { return remote_upload_only_; }
 
 private:
     Peer(int fd, PeerAddress addr, std::array<uint8_t, 20> info_hash, std::string self_peer_id);
 
     void close();
     void queue_bytes(std::vector<uint8_t> bytes);
+    void account_buffers();
+    bool message_length_ok(uint8_t msg_id, uint32_t msg_len) const;
+    void parse_extended_handshake(const uint8_t* data, uint32_t len);
+    void parse_metadata_message(const uint8_t* data, uint32_t len);
+    void queue_extended_handshake(std::string_view payload);
+    void queue_extended(uint8_t ext_id, std::string_view payload, std::string_view trailer = {});
     void ensure_handshake_sent();
     bool parse_handshake();
     void parse_messages();
     bool check_socket_connected();
 
     static std::vector<uint8_t> make_handshake(const std::array<uint8_t, 20>& info_hash,
-                                               const std::string& peer_id);
+                                               const std::string& peer_id, bool v2);
+    void queue_hash_message(uint8_t msg_id, const Sha256Hash& root, uint32_t base_layer,
+                            uint32_t index, uint32_t length, uint32_t proof_layers,
+                            const std::vector<Sha256Hash>* hashes);
     static uint32_t read_be32(const uint8_t* p);
     static void write_be32(uint8_t* p, uint32_t v);
 
     int fd_{-1};
     PeerAddress remote_{};
     State state_{State::Connecting};
+    bool initiated_{false};
+    bool awaiting_blocks_{false};
     std::array<uint8_t, 20> info_hash_{};
     std::string self_peer_id_;
     std::string remote_peer_id_;
@@ -107,10 +230,38 @@ private:
     std::vector<uint8_t> incoming_;
     std::deque<std::vector<uint8_t>> outgoing_;
     std::size_t outgoing_offset_{0};
+    std::size_t outgoing_bytes_{0};
+    MemoryCharge buffer_charge_{MemorySubsystem::PeerBuffers};
 
     std::vector<Event> events_;
 
     bool extended_handshake_sent_{false};
     uint8_t remote_ut_pex_id_{0};
+    uint8_t remote_ut_metadata_id_{0};
+    int64_t remote_metadata_size_{0};
+    std::size_t metadata_size_{0};
+    bool remote_upload_only_{false};
+    uint32_t request_queue_{0};
+    uint16_t listen_port_{0};
+    uint32_t remote_request_queue_{0};
+    uint16_t remote_listen_port_{0};
+    std::string remote_client_;
+    std::string reported_ip_;
+    bool remote_fast_{false};
+    bool local_v2_{false};
+    bool remote_v2_{false};
+    uint32_t bitfield_bytes_{0};
+
+    // Largest extended (BEP 10) payload we accept.
+    static constexpr uint32_t kMaxExtendedLength = 256 * 1024;
+    // BEP 52 caps a hashes message at 512 hashes plus their proof
+    static constexpr uint32_t kMaxHashesLength = 49 + 32 * (512 + 64);
+    // Reads pause here until parse_messages catches up.
+    static constexpr std::size_t kMaxIncomingBuffer = 2 * (13 + kMaxBlockLength);
+    // Caps on what the peer's extended handshake may claim.
+    static constexpr int64_t kMaxRemoteRequestQueue = 2048;
+    static constexpr std::size_t kMaxClientNameLength = 64;
+    static constexpr std::string_view kClientName = "dj-torrent 0.1";
     static constexpr uint8_t kLocalUtPexId_ = 1;
+    static constexpr uint8_t kLocalUtMetadataId_ = 2;
 };
@@ -0,0 +1,113 @@
+#include "peer_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+
+namespace {
+constexpr std::size_t kMaxStoredPeers = 200;
+constexpr int64_t kMaxAgeSeconds = 7 * 24 * 3600;
+
+int64_t unix_now() {
+    using namespace std::chrono;
+    return duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+}
+}
+
+PeerCache::PeerCache(std::filesystem::path path) : path_(std::move(path)) {}
+
+// One peer per line: "<ip> <port> <seed> <downloaded> <last_seen>".
+bool PeerCache::load() {
+    std::ifstream in(path_);
+    if (!in) {
+        return false;
+    }
+    int64_t now = unix_now();
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream iss(line);
+        Entry e;
+        unsigned port = 0;
+        int seed = 0;
+        if (!(iss >> e.address.ip >> port >> seed >> e.downloaded >> e.last_seen)) {
+            continue;
+        }
+        if (port == 0 || port > 65535 || now - e.last_seen > kMaxAgeSeconds) {
+            continue;
+        }
+        e.address.port = static_cast<uint16_t>(port);
+        e.address.seed = seed != 0;
+        entries_[key_for(e.address)] = std::move(e);
+    }
+    return true;
+}
+
+bool PeerCache::save() const {
+    std::error_code ec;
+    std::filesystem::create_directories(path_.parent_path(), ec);
+    std::filesystem::path tmp = path_;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        auto list = ranked();
+        if (list.size() > kMaxStoredPeers) {
+            list.resize(kMaxStoredPeers);
+        }
+        for (const Entry* e : list) {
+            out << e->address.ip << ' ' << e->address.port << ' ' << (e->address.seed ? 1 : 0)
+                << ' ' << e->downloaded << ' ' << e->last_seen << '\n';
+        }
+        if (!out) {
+            return false;
+        }
+    }
+    std::filesystem::rename(tmp, path_, ec);
+    return !ec;
+}
+
+void PeerCache::record(const PeerAddress& address, std::uint64_t downloaded, bool seed) {
+    Entry& e = entries_[key_for(address)];
+    e.address.ip = address.ip;
+    e.address.port = address.port;
+    e.address.seed = seed;
+    e.downloaded = std::max(e.downloaded, downloaded);
+    e.last_seen = unix_now();
+}
+
+std::vector<PeerAddress> PeerCache::best(std::size_t limit) const {
+    std::vector<PeerAddress> out;
+    for (const Entry* e : ranked()) {
+        if (out.size() >= limit) {
+            break;
+        }
+        out.push_back(e->address);
+    }
+    return out;
+}
+
+std::string PeerCache::key_for(const PeerAddress& address) {
+    return address.ip + ":" + std::to_string(address.port);
+}
+
+std::vector<const PeerCache::Entry*> PeerCache::ranked() const {
+    std::vector<const Entry*> list;
+    list.reserve(entries_.size());
+    for (const auto& kv : entries_) {
+        list.push_back(&kv.second);
+    }
+    std::sort(list.begin(), list.end(), [](const Entry* a, const Entry* b) {
+        if (a->address.seed != b->address.seed) {
+            return a->address.seed;
+        }
+        if (a->downloaded != b->downloaded) {
+            return a->downloaded > b->downloaded;
+        }
+        return a->last_seen > b->last_seen;
+    });
+    return list;
+}
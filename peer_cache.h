@@ -0,0 +1,36 @@
+// PeerCache remembers the best peers of a torrent across restarts.
+#pragma once
+
+#include "peer.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class PeerCache {
+public:
+    struct Entry {
+        PeerAddress address;
+        std::uint64_t downloaded{0};
+        int64_t last_seen{0};
+    };
+
+    explicit PeerCache(std::filesystem::path path);
+
+    bool load();
+    bool save() const;
+
+    void record(const PeerAddress& address, std::uint64_t downloaded, bool seed);
+    // Best candidates first: seeds, then bytes received, then most recent.
+    std::vector<PeerAddress> best(std::size_t limit) const;
+    std::size_t size() const { return entries_.size(); }
+
+private:
+    static std::string key_for(const PeerAddress& address);
+    std::vector<const Entry*> ranked() const;
+
+    std::filesystem::path path_;
+    std::unordered_map<std::string, Entry> entries_;
+};
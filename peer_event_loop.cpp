@@ -1,6 +1,9 @@
 #include "peer_event_loop.h"
 
+#include "memory_governor.h"
+
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -12,6 +15,13 @@
 
 PeerEventLoop::PeerEventLoop(EventCallback cb) : callback_(std::move(cb)) {
     epfd_ = epoll_create1(0);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd_ >= 0 && wake_fd_ >= 0) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd_;
+        epoll_ctl(epfd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+    }
 }
 
 PeerEventLoop::~PeerEventLoop() {
@@ -19,6 +29,9 @@ PeerEventLoop::~PeerEventLoop() {
         ::close(listen_fd_);
         listen_fd_ = -1;
     }
+    if (wake_fd_ >= 0) {
+        ::close(wake_fd_);
+    }
     if (epfd_ >= 0) {
         ::close(epfd_);
     }
@@ -61,6 +74,37 @@ bool PeerEventLoop::set_listen_socket(int fd, AcceptCallback cb) {
     return true;
 }
 
+int PeerEventLoop::release_listen_socket() {
+    int fd = listen_fd_;
+    if (fd >= 0 && epfd_ >= 0) {
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    listen_fd_ = -1;
+    accept_callback_ = nullptr;
+    return fd;
+}
+
+bool PeerEventLoop::add_datagram_socket(int fd, DatagramCallback cb) {
+    if (epfd_ < 0) {
+        return false;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return false;
+    }
+    datagram_sockets_[fd] = std::move(cb);
+    return true;
+}
+
+void PeerEventLoop::remove_datagram_socket(int fd) {
+    if (epfd_ >= 0) {
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    datagram_sockets_.erase(fd);
+}
+
 void PeerEventLoop::remove_peer(int fd) {
     if (epfd_ >= 0) {
         epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
@@ -75,7 +119,19 @@ void PeerEventLoop::run(int timeout_ms) {
     }
 }
 
-void PeerEventLoop::stop() { running_ = false; }
+void PeerEventLoop::stop() {
+    running_ = false;
+    wake();
+}
+
+void PeerEventLoop::wake() {
+    if (wake_fd_ < 0) {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t n = ::write(wake_fd_, &one, sizeof(one));
+    (void)n;
+}
 
 Peer* PeerEventLoop::peer_by_fd(int fd) {
     auto it = peers_.find(fd);
@@ -96,6 +152,11 @@ void PeerEventLoop::run_once(int timeout_ms) {
         return;
     }
 
+    // pick up writes queued on peers that had no event of their own last round
+    for (auto& kv : peers_) {
+        update_interest(kv.first, kv.second);
+    }
+
     std::array<epoll_event, 64> events{};
     int n = epoll_wait(epfd_, events.data(), static_cast<int>(events.size()), timeout_ms);
 
@@ -105,6 +166,15 @@ void PeerEventLoop::run_once(int timeout_ms) {
 
     for (int i = 0; i < n; ++i) {
         int fd = events[i].data.fd;
+        if (fd == wake_fd_) {
+            uint64_t count = 0;
+            ssize_t r = ::read(wake_fd_, &count, sizeof(count));
+            (void)r;
+            if (wake_callback_) {
+                wake_callback_();
+            }
+            continue;
+        }
         if (fd == listen_fd_) {
             if ((events[i].events & EPOLLIN) && accept_callback_) {
                 for (;;) {
@@ -117,18 +187,27 @@ void PeerEventLoop::run_once(int timeout_ms) {
                         }
                         break;
                     }
+                    if (memory_governor().over_total_budget()) {
+                        ++refused_accepts_;
+                        ::close(cfd);
+                        continue;
+                    }
                     int flags = fcntl(cfd, F_GETFL, 0);
                     fcntl(cfd, F_SETFL, flags | O_NONBLOCK);
 
                     PeerAddress addr{};
+                    Endpoint ep;
                     if (ss.ss_family == AF_INET) {
                         auto* sin = reinterpret_cast<sockaddr_in*>(&ss);
+                        ep = Endpoint::from_v4(reinterpret_cast<const uint8_t*>(&sin->sin_addr),
+                                               ntohs(sin->sin_port));
                         char ipbuf[INET_ADDRSTRLEN]{};
                         inet_ntop(AF_INET, &sin->sin_addr, ipbuf, sizeof(ipbuf));
                         addr.ip = ipbuf;
                         addr.port = ntohs(sin->sin_port);
                     } else if (ss.ss_family == AF_INET6) {
                         auto* sin6 = reinterpret_cast<sockaddr_in6*>(&ss);
+                        ep = Endpoint::from_v6(sin6->sin6_addr.s6_addr, ntohs(sin6->sin6_port));
                         char ipbuf[INET6_ADDRSTRLEN]{};
                         inet_ntop(AF_INET6, &sin6->sin6_addr, ipbuf, sizeof(ipbuf));
                         addr.ip = ipbuf;
@@ -137,12 +216,23 @@ void PeerEventLoop::run_once(int timeout_ms) {
                         ::close(cfd);
                         continue;
                     }
+                    if (ip_filter_ && ip_filter_->is_blocked(ep)) {
+                        ++blocked_accepts_;
+                        ::close(cfd);
+                        continue;
+                    }
 
                     accept_callback_(cfd, addr);
                 }
             }
             continue;
         }
+        if (auto dg = datagram_sockets_.find(fd); dg != datagram_sockets_.end()) {
+            // the callback may remove the socket, so run a copy
+            DatagramCallback cb = dg->second;
+            drain_datagrams(fd, cb);
+            continue;
+        }
         auto it = peers_.find(fd);
         if (it == peers_.end()) {
             continue;
@@ -170,6 +260,9 @@ void PeerEventLoop::run_once(int timeout_ms) {
         }
 
         if (p.is_closed()) {
+            if (close_callback_) {
+                close_callback_(fd, p);
+            }
             remove_peer(fd);
             continue;
         }
@@ -177,8 +270,49 @@ void PeerEventLoop::run_once(int timeout_ms) {
     }
 }
 
+void PeerEventLoop::drain_datagrams(int fd, const DatagramCallback& cb) {
+    // the largest UDP payload, so nothing is ever truncated
+    datagram_buffer_.resize(65536);
+    for (;;) {
+        sockaddr_storage ss{};
+        socklen_t slen = sizeof(ss);
+        ssize_t n = ::recvfrom(fd, datagram_buffer_.data(), datagram_buffer_.size(), 0,
+                               reinterpret_cast<sockaddr*>(&ss), &slen);
+        if (n < 0) {
+            // an ICMP error from an earlier send surfaces here once
+            if (errno == EINTR || errno == ECONNREFUSED || errno == EHOSTUNREACH ||
+                errno == ENETUNREACH) {
+                continue;
+            }
+            break;
+        }
+        Endpoint from;
+        if (ss.ss_family == AF_INET) {
+            auto* sin = reinterpret_cast<sockaddr_in*>(&ss);
+            from = Endpoint::from_v4(reinterpret_cast<const uint8_t*>(&sin->sin_addr),
+                                     ntohs(sin->sin_port));
+        } else if (ss.ss_family == AF_INET6) {
+            auto* sin6 = reinterpret_cast<sockaddr_in6*>(&ss);
+            from = Endpoint::from_v6(sin6->sin6_addr.s6_addr, ntohs(sin6->sin6_port));
+        } else {
+            continue;
+        }
+        if (ip_filter_ && ip_filter_->is_blocked(from)) {
+            continue;
+        }
+        cb(datagram_buffer_.data(), static_cast<std::size_t>(n), from);
+        if (datagram_sockets_.find(fd) == datagram_sockets_.end()) {
+            break;
+        }
+    }
+}
+
 void PeerEventLoop::update_interest(int fd, Entry& entry) {
-    uint32_t want = EPOLLIN;
+    // over the memory budget, sockets fill their kernel buffers and TCP
+    // pushes back on the sender until we resume
+    uint32_t want = memory_governor().reading_paused(entry.peer.awaiting_blocks())
+        ? 0u
+        : static_cast<uint32_t>(EPOLLIN);
     if (entry.peer.wants_write()) {
         want |= EPOLLOUT;
     }
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "endpoint.h"
+#include "ip_filter.h"
 #include "peer.h"
+#include <atomic>
 #include <functional>
 #include <unordered_map>
 
@@ -8,6 +11,10 @@ class PeerEventLoop {
 public:
     using EventCallback = std::function<void(Peer&, std::vector<Peer::Event>&&)>;
     using AcceptCallback = std::function<void(int fd, const PeerAddress& addr)>;
+    using WakeCallback = std::function<void()>;
+    using CloseCallback = std::function<void(int fd, const Peer&)>;
+    using DatagramCallback =
+        std::function<void(const uint8_t* data, std::size_t len, const Endpoint& from)>;
 
     explicit PeerEventLoop(EventCallback cb);
     ~PeerEventLoop();
@@ -19,7 +26,26 @@ public:
 
     bool add_peer(Peer peer);
     bool set_listen_socket(int fd, AcceptCallback cb);
+    // Stops accepting and gives up ownership; -1 when there is no listener.
+    int release_listen_socket();
     void remove_peer(int fd);
+    // Drains every datagram waiting on a non-blocking UDP socket into cb.
+    // The loop does not own fd; remove it before closing.
+    bool add_datagram_socket(int fd, DatagramCallback cb);
+    void remove_datagram_socket(int fd);
+    // Runs cb on the loop thread whenever another thread calls wake().
+    void set_wake_callback(WakeCallback cb) { wake_callback_ = std::move(cb); }
+    // Runs before the loop drops a peer that closed during its own I/O; fd is
+    // the one the peer was registered under.
+    void set_close_callback(CloseCallback cb) { close_callback_ = std::move(cb); }
+    // Thread-safe: interrupts epoll_wait through the loop's eventfd.
+    void wake();
+    // Incoming connections from blocked addresses are closed before accept
+    // reaches the callback. The filter must outlive its installation.
+    void set_ip_filter(const IpFilter* filter) { ip_filter_ = filter; }
+    std::uint64_t blocked_accepts() const { return blocked_accepts_; }
+    // accepts closed because the process was over its memory budget
+    std::uint64_t refused_accepts() const { return refused_accepts_; }
     void run_once(int timeout_ms);
     void run(int timeout_ms);
     void stop();
@@ -35,11 +61,20 @@ private:
     };
 
     void update_interest(int fd, Entry& entry);
+    void drain_datagrams(int fd, const DatagramCallback& cb);
 
     int epfd_{-1};
     EventCallback callback_;
     std::unordered_map<int, Entry> peers_;
+    std::unordered_map<int, DatagramCallback> datagram_sockets_;
+    std::vector<uint8_t> datagram_buffer_;
     int listen_fd_{-1};
     AcceptCallback accept_callback_;
-    bool running_{false};
+    const IpFilter* ip_filter_{nullptr};
+    std::uint64_t blocked_accepts_{0};
+    std::uint64_t refused_accepts_{0};
+    int wake_fd_{-1};
+    WakeCallback wake_callback_;
+    CloseCallback close_callback_;
+    std::atomic<bool> running_{false};
 };
@@ -1,38 +1,224 @@
 #include "session.h"
 #include "bencode.h"
 
-#include <arpa/inet.h>
+#include <algorithm>
+#include <tuple>
 
-void Session::handle_pex(Peer& from_peer, const std::vector<uint8_t>& payload) {
-    try {
-        std::string s(reinterpret_cast<const char*>(payload.data()), payload.size());
-        bencode::Parser parser(std::move(s));
-        bencode::Value v = parser.parse();
-        const auto& dict = bencode::as_dict(v);
-        const auto* added_val = bencode::find_field(dict, "added");
-        if (!added_val) {
-            return;
+namespace {
+
+constexpr auto kPexInterval = std::chrono::seconds(60);
+// a peer that sends lists more often than this is ignored until later
+constexpr auto kMinPexGap = std::chrono::seconds(45);
+// BEP 11 caps each list at 50 entries per message
+constexpr std::size_t kMaxPexEntries = 50;
+
+// added.f bits
+constexpr uint8_t kPexSeed = 0x02;
+constexpr uint8_t kPexReachable = 0x10;
+
+using PexEntry = std::pair<Endpoint, uint8_t>;
+
+bool endpoint_less(const PexEntry& a, const PexEntry& b) {
+    return std::tie(a.first.addr, a.first.port) < std::tie(b.first.addr, b.first.port);
+}
+
+// Same order as endpoint_less, but an endpoint whose flags changed differs.
+bool entry_less(const PexEntry& a, const PexEntry& b) {
+    return std::tie(a.first.addr, a.first.port, a.second) <
+           std::tie(b.first.addr, b.first.port, b.second);
+}
+
+// Keeps the first kMaxPexEntries of each address family.
+void cap_per_family(std::vector<PexEntry>& list) {
+    std::size_t n4 = 0, n6 = 0;
+    std::erase_if(list, [&n4, &n6](const PexEntry& entry) {
+        return (entry.first.is_v4() ? n4++ : n6++) >= kMaxPexEntries;
+    });
+}
+
+void append_compact(std::string& out, const Endpoint& ep) {
+    const uint8_t* addr = ep.is_v4() ? ep.addr.data() + 12 : ep.addr.data();
+    out.append(reinterpret_cast<const char*>(addr), ep.is_v4() ? 4 : 16);
+    out.push_back(static_cast<char>(ep.port >> 8));
+    out.push_back(static_cast<char>(ep.port & 0xFF));
+}
+
+// Both lists already capped; empty when there is nothing to say.
+std::string encode_pex(const std::vector<PexEntry>& added, const std::vector<PexEntry>& dropped) {
+    if (added.empty() && dropped.empty()) {
+        return {};
+    }
+    std::string added4, flags4, added6, flags6, dropped4, dropped6;
+    for (const auto& [ep, flags] : added) {
+        append_compact(ep.is_v4() ? added4 : added6, ep);
+        (ep.is_v4() ? flags4 : flags6).push_back(static_cast<char>(flags));
+    }
+    for (const auto& entry : dropped) {
+        append_compact(entry.first.is_v4() ? dropped4 : dropped6, entry.first);
+    }
+
+    bencode::Dict d;
+    d["added"] = bencode::Value{std::move(added4)};
+    d["added.f"] = bencode::Value{std::move(flags4)};
+    d["dropped"] = bencode::Value{std::move(dropped4)};
+    if (!added6.empty()) {
+        d["added6"] = bencode::Value{std::move(added6)};
+        d["added6.f"] = bencode::Value{std::move(flags6)};
+    }
+    if (!dropped6.empty()) {
+        d["dropped6"] = bencode::Value{std::move(dropped6)};
+    }
+    return bencode::encode(bencode::Value{std::move(d)});
+}
+
+// What one peer has not heard yet: entries it was never told about or told
+// with other flags, and entries it was told about that are gone. Both are
+// sorted by entry_less. What fits in one message goes out and is folded
+// into sent; the rest waits for the next round.
+std::string encode_pex_update(const std::vector<PexEntry>& current, std::vector<PexEntry>& sent,
+                              const std::optional<Endpoint>& recipient) {
+    std::vector<PexEntry> added;
+    std::vector<PexEntry> dropped;
+    std::set_difference(current.begin(), current.end(), sent.begin(), sent.end(),
+                        std::back_inserter(added), entry_less);
+    std::set_difference(sent.begin(), sent.end(), current.begin(), current.end(),
+                        std::back_inserter(dropped), endpoint_less);
+    if (recipient) {
+        std::erase_if(added, [&recipient](const PexEntry& e) { return e.first == *recipient; });
+    }
+    cap_per_family(added);
+    cap_per_family(dropped);
+
+    std::vector<PexEntry> next;
+    next.reserve(sent.size() + added.size());
+    for (const auto& entry : sent) {
+        auto gone = [&entry](const std::vector<PexEntry>& list) {
+            return std::binary_search(list.begin(), list.end(), entry, endpoint_less);
+        };
+        if (!gone(dropped) && !gone(added)) {
+            next.push_back(entry);
         }
-        const std::string& added = bencode::as_string(*added_val);
-        if (added.size() % 6 != 0) {
+    }
+    next.insert(next.end(), added.begin(), added.end());
+    std::sort(next.begin(), next.end(), entry_less);
+    sent = std::move(next);
+    return encode_pex(added, dropped);
+}
+
+// Walks one compact list, at most kMaxPexEntries entries of width bytes.
+template <typename Fn>
+void for_each_compact(std::string_view list, std::size_t width, Fn&& fn) {
+    if (list.size() % width != 0) {
+        return;
+    }
+    const auto* data = reinterpret_cast<const uint8_t*>(list.data());
+    std::size_t count = std::min(list.size() / width, kMaxPexEntries);
+    for (std::size_t i = 0; i < count; ++i) {
+        const uint8_t* p = data + i * width;
+        uint16_t port = static_cast<uint16_t>(p[width - 2] << 8 | p[width - 1]);
+        fn(i, width == 6 ? Endpoint::from_v4(p, port) : Endpoint::from_v6(p, port));
+    }
+}
+
+} // namespace
+
+void Session::handle_pex(PeerState& from_state, const std::vector<uint8_t>& payload) {
+    // BEP 27: private torrents learn peers from their trackers only
+    if (torrent_.is_private) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (from_state.last_pex_in.time_since_epoch().count() != 0 &&
+        now - from_state.last_pex_in < kMinPexGap) {
+        return;
+    }
+    from_state.last_pex_in = now;
+
+    try {
+        // the lists are views into payload; nothing is copied
+        std::string_view added4, flags4, added6, flags6, dropped4, dropped6;
+        bencode::Reader reader(
+            std::string_view(reinterpret_cast<const char*>(payload.data()), payload.size()));
+        if (!reader.enter_dict()) {
             return;
         }
-        for (std::size_t i = 0; i + 6 <= added.size(); i += 6) {
-            const unsigned char* data =
-                reinterpret_cast<const unsigned char*>(added.data() + i);
-            char ip_str[INET_ADDRSTRLEN] = {0};
-            in_addr addr{};
-            std::memcpy(&addr, data, 4);
-            if (!inet_ntop(AF_INET, &addr, ip_str, sizeof(ip_str))) {
-                continue;
+        std::string_view key;
+        while (reader.next_key(key)) {
+            std::string_view* field = key == "added"      ? &added4
+                                      : key == "added.f"  ? &flags4
+                                      : key == "added6"   ? &added6
+                                      : key == "added6.f" ? &flags6
+                                      : key == "dropped"  ? &dropped4
+                                      : key == "dropped6" ? &dropped6
+                                                          : nullptr;
+            if (!field) {
+                reader.skip();
+            } else if (auto s = reader.read_string()) {
+                *field = *s;
             }
-            uint16_t port = static_cast<uint16_t>(data[4] << 8 | data[5]);
-            PeerAddress pa;
-            pa.ip = ip_str;
-            pa.port = port;
-            ++pex_peers_discovered_;
-            add_peer(pa);
+        }
+
+        auto add = [&](std::string_view list, std::string_view flags, std::size_t width) {
+            for_each_compact(list, width, [&](std::size_t i, const Endpoint& ep) {
+                uint8_t f = i < flags.size() ? static_cast<uint8_t>(flags[i]) : 0;
+                // no uTP transport here: peers flagged uTP are dialled over
+                // TCP like the rest, which nearly all of them also accept
+                if (enqueue_peer_candidate(ep, (f & kPexSeed) != 0)) {
+                    ++pex_peers_discovered_;
+                }
+            });
+        };
+        add(added4, flags4, 6);
+        add(added6, flags6, 18);
+
+        // peers that left the swarm are not worth a dial attempt
+        std::vector<Endpoint> dropped;
+        auto collect = [&dropped](std::size_t, const Endpoint& ep) { dropped.push_back(ep); };
+        for_each_compact(dropped4, 6, collect);
+        for_each_compact(dropped6, 18, collect);
+        if (!dropped.empty()) {
+            std::erase_if(pending_peers_, [&dropped](const PeerCandidate& c) {
+                return std::find(dropped.begin(), dropped.end(), c.endpoint) != dropped.end();
+            });
         }
     } catch (...) {
     }
 }
+
+// Once a minute each peer hears what changed since what it was last told;
+// for a peer new to PEX that is the whole list. Past the 50 entries a
+// message holds, the rest follows in later rounds.
+void Session::maybe_broadcast_pex() {
+    auto now = std::chrono::steady_clock::now();
+    if (torrent_.is_private || now - last_pex_broadcast_ < kPexInterval) {
+        return;
+    }
+    last_pex_broadcast_ = now;
+
+    std::vector<PexEntry> current;
+    std::size_t pieces = torrent_.piece_count();
+    for (const auto& [fd, state] : peers_) {
+        // an incoming peer's source port is not where it listens; without
+        // a p in its extended handshake it is left out
+        if (!state.handshake_received || !state.listen_endpoint) {
+            continue;
+        }
+        uint8_t flags = kPexReachable;
+        if (state.upload_only || bitfield_complete(state.bitfield, pieces)) {
+            flags |= kPexSeed;
+        }
+        current.emplace_back(*state.listen_endpoint, flags);
+    }
+    std::sort(current.begin(), current.end(), entry_less);
+
+    for (auto& [fd, state] : peers_) {
+        Peer* peer = event_loop_.peer_by_fd(fd);
+        if (!peer || !peer->supports_ut_pex() || !state.handshake_received) {
+            continue;
+        }
+        std::string update = encode_pex_update(current, state.pex_sent, state.listen_endpoint);
+        if (!update.empty()) {
+            peer->send_ut_pex(update);
+        }
+    }
+}
@@ -1,6 +1,8 @@
 // PieceBuffer manages a single piece buffer and its block completion bitmap.
 #pragma once
 
+#include "memory_governor.h"
+
 #include <cstdint>
 #include <stdexcept>
 #include <algorithm>
@@ -24,6 +26,18 @@ public:
         }
     }
 
+    void reset(std::size_t idx) {
+        if (idx >= total_) {
+            throw std::out_of_range("Block index out of range");
+        }
+        std::size_t byte = idx / 8;
+        uint8_t mask = static_cast<uint8_t>(1u << (7 - (idx % 8)));
+        if ((bits_[byte] & mask) != 0) {
+            bits_[byte] &= static_cast<uint8_t>(~mask);
+            --have_;
+        }
+    }
+
     bool test(std::size_t idx) const {
         if (idx >= total_) {
             throw std::out_of_range("Block index out of range");
@@ -51,7 +65,8 @@ public:
           block_size_(block_size),
           data_(piece_length),
           blocks_((piece_length + block_size - 1) / block_size),
-          bitmap_(blocks_) {
+          bitmap_(blocks_),
+          charge_(MemorySubsystem::PieceBuffers, piece_length) {
     }
 
     struct BlockWriteResult {
@@ -83,7 +98,12 @@ public:
         return {true, completed};
     }
 
+    // Forgets a block that failed its own hash so it can be fetched again.
+    void clear_block(std::size_t idx) { bitmap_.reset(idx); }
+
     bool complete() const { return bitmap_.full(); }
+    bool has_block(std::size_t idx) const { return bitmap_.test(idx); }
+    std::size_t block_count() const { return blocks_; }
     const std::vector<uint8_t>& data() const { return data_; }
     std::size_t piece_index() const { return index_; }
     std::size_t piece_length() const { return piece_length_; }
@@ -95,4 +115,5 @@ private:
     std::vector<uint8_t> data_;
     std::size_t blocks_;
     BlockBitmap bitmap_;
+    MemoryCharge charge_;
 };
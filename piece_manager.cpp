@@ -32,11 +32,15 @@ std::vector<uint8_t> make_bitfield(std::size_t pieces) {
     return std::vector<uint8_t>((pieces + 7) / 8, 0);
 }
 
+bool all_zero(const uint8_t* data, std::size_t len) {
+    return std::all_of(data, data + len, [](uint8_t b) { return b == 0; });
+}
+
 }
 
 PieceManager::PieceManager(const TorrentFile& torrent, std::size_t block_size)
     : torrent_(torrent), block_size_(block_size) {
-    std::size_t piece_count = torrent_.piece_hashes.size();
+    std::size_t piece_count = torrent_.piece_count();
     pieces_.resize(piece_count);
     for (std::size_t i = 0; i < piece_count; ++i) {
         std::size_t len = piece_length_for(static_cast<uint32_t>(i));
@@ -55,6 +59,10 @@ void PieceManager::set_piece_complete_callback(
     on_complete_ = std::move(cb);
 }
 
+void PieceManager::set_block_hashes_needed_callback(std::function<void(uint32_t)> cb) {
+    on_hashes_needed_ = std::move(cb);
+}
+
 std::optional<PieceManager::Request> PieceManager::next_request_for_peer_rarest(
     const std::vector<uint8_t>& peer_bitfield) {
     std::size_t piece_count = pieces_.size();
@@ -78,6 +86,10 @@ std::optional<PieceManager::Request> PieceManager::next_request_for_peer_rarest(
 
             PieceState& ps = pieces_[piece_index];
             if (!ps.buffer) {
+                if (memory_governor().piece_buffers_full()) {
+                    // finish pieces already in memory before opening more
+                    continue;
+                }
                 ps.buffer = std::make_unique<PieceBuffer>(
                     piece_index, piece_length_for(static_cast<uint32_t>(piece_index)),
                     block_size_);
@@ -117,6 +129,9 @@ std::optional<PieceManager::Request> PieceManager::next_request_for_peer(
 
         PieceState& ps = pieces_[idx];
         if (!ps.buffer) {
+            if (memory_governor().piece_buffers_full()) {
+                continue;
+            }
             ps.buffer = std::make_unique<PieceBuffer>(idx, piece_length_for(idx), block_size_);
         }
         for (std::size_t b = 0; b < ps.blocks; ++b) {
@@ -167,33 +182,52 @@ std::optional<std::size_t> PieceManager::lowest_nonempty_bucket() const {
 bool PieceManager::handle_block(uint32_t piece_index,
                                 uint32_t begin,
                                 const std::vector<uint8_t>& data) {
+    return handle_block(piece_index, begin, data.data(), data.size());
+}
+
+bool PieceManager::handle_block(uint32_t piece_index,
+                                uint32_t begin,
+                                const uint8_t* data,
+                                std::size_t len) {
     if (piece_index >= pieces_.size()) {
         return false;
     }
 
-    static int NUM_PIECES = torrent_.piece_hashes.size();
-
     if (have_piece(piece_index)) {
         return false;
     }
 
     PieceState& ps = pieces_[piece_index];
+    if (!ps.block_hashes.empty() &&
+        !block_matches(piece_index, begin / block_size_, data, len)) {
+        // a bad block costs one refetch, not the piece
+        std::size_t b = begin / block_size_;
+        if (b < ps.blocks && !(ps.buffer && ps.buffer->has_block(b))) {
+            ps.requested[b] = false;
+        }
+        return false;
+    }
     if (!ps.buffer) {
         ps.buffer = std::make_unique<PieceBuffer>(piece_index, piece_length_for(piece_index),
                                                   block_size_);
     }
 
-    auto res = ps.buffer->write_block(begin, data.data(), data.size());
+    auto res = ps.buffer->write_block(begin, data, len);
 
     if (!res.accepted) {
         return false;
     }
 
     if (res.complete_now) {
-        std::array<uint8_t, 20> digest{};
-        SHA1(ps.buffer->data().data(), ps.buffer->data().size(), digest.data());
-        if (!std::equal(digest.begin(), digest.end(), torrent_.piece_hashes[piece_index].begin())) {
-            reset_piece(piece_index);
+        if (!verify_piece(piece_index, ps.buffer->data())) {
+            bool provable = block_size_ == kMerkleBlockSize && ps.block_hashes.empty() &&
+                            torrent_.v2_piece(piece_index).has_value();
+            if (provable && on_hashes_needed_) {
+                ps.awaiting_hashes = true;
+                on_hashes_needed_(piece_index);
+            } else {
+                reset_piece(piece_index);
+            }
             return false;
         }
         set_have(piece_index);
@@ -203,15 +237,115 @@ bool PieceManager::handle_block(uint32_t piece_index,
             on_complete_(piece_index, ps.buffer->data());
         }
         ps.buffer.reset();
+    }
+    return true;
+}
 
+std::optional<uint32_t> PieceManager::claim_whole_piece() {
+    auto rarity_opt = lowest_nonempty_bucket();
+    if (!rarity_opt || memory_governor().piece_buffers_full()) {
+        return std::nullopt;
     }
-    if (piece_ct_ == NUM_PIECES) {
-        std::cout << "torrent download complete\n";
-        exit(1);
+    for (std::size_t rarity = *rarity_opt; rarity < piece_buckets_.size(); ++rarity) {
+        for (std::size_t piece_index : piece_buckets_[rarity]) {
+            if (piece_index >= pieces_.size()) {
+                continue;
+            }
+            PieceState& ps = pieces_[piece_index];
+            if (ps.have || ps.buffer ||
+                std::find(ps.requested.begin(), ps.requested.end(), true) !=
+                    ps.requested.end()) {
+                continue;
+            }
+            std::fill(ps.requested.begin(), ps.requested.end(), true);
+            return static_cast<uint32_t>(piece_index);
+        }
+    }
+    return std::nullopt;
+}
+
+void PieceManager::release_piece(uint32_t piece_index) {
+    if (piece_index >= pieces_.size() || have_piece(piece_index)) {
+        return;
+    }
+    PieceState& ps = pieces_[piece_index];
+    for (std::size_t b = 0; b < ps.blocks; ++b) {
+        if (!(ps.buffer && ps.buffer->has_block(b))) {
+            ps.requested[b] = false;
+        }
+    }
+}
+
+void PieceManager::release_request(const Request& req) {
+    if (req.piece_index >= pieces_.size() || have_piece(req.piece_index)) {
+        return;
     }
+    PieceState& ps = pieces_[req.piece_index];
+    std::size_t b = req.begin / block_size_;
+    if (b >= ps.blocks || (ps.buffer && ps.buffer->has_block(b))) {
+        return;
+    }
+    ps.requested[b] = false;
+}
+
+bool PieceManager::claim_request(const Request& req) {
+    if (req.piece_index >= pieces_.size() || have_piece(req.piece_index) ||
+        req.begin % block_size_ != 0) {
+        return false;
+    }
+    PieceState& ps = pieces_[req.piece_index];
+    std::size_t b = req.begin / block_size_;
+    if (b >= ps.blocks || ps.requested[b]) {
+        return false;
+    }
+    ps.requested[b] = true;
     return true;
 }
 
+bool PieceManager::add_block_hashes(uint32_t piece_index, std::vector<Sha256Hash> leaves) {
+    if (piece_index >= pieces_.size() || have_piece(piece_index)) {
+        return false;
+    }
+    auto info = torrent_.v2_piece(piece_index);
+    if (!info || leaves.size() != info->leaves ||
+        MerkleTree(leaves, info->leaves).root() != info->hash) {
+        return false;
+    }
+    PieceState& ps = pieces_[piece_index];
+    ps.block_hashes = std::move(leaves);
+    if (!ps.awaiting_hashes || !ps.buffer) {
+        return true;
+    }
+    ps.awaiting_hashes = false;
+    const auto& data = ps.buffer->data();
+    bool dropped = false;
+    for (std::size_t b = 0; b < ps.blocks; ++b) {
+        std::size_t begin = b * block_size_;
+        std::size_t len = std::min(block_size_, data.size() - begin);
+        if (!block_matches(piece_index, b, data.data() + begin, len)) {
+            ps.buffer->clear_block(b);
+            ps.requested[b] = false;
+            dropped = true;
+        }
+    }
+    if (!dropped) {
+        // the v1 hash disagrees with a v2 tree that checks out; nothing to
+        // single out, so start the piece over
+        reset_piece(piece_index);
+    }
+    return true;
+}
+
+bool PieceManager::awaiting_block_hashes(uint32_t piece_index) const {
+    return piece_index < pieces_.size() && pieces_[piece_index].awaiting_hashes;
+}
+
+void PieceManager::give_up_block_hashes(uint32_t piece_index) {
+    if (awaiting_block_hashes(piece_index)) {
+        reset_piece(piece_index);
+    }
+}
+
 bool PieceManager::have_piece(uint32_t piece_index) const {
     if (piece_index >= pieces_.size()) {
         return false;
@@ -219,15 +353,122 @@ bool PieceManager::have_piece(uint32_t piece_index) const {
     return pieces_[piece_index].have;
 }
 
+void PieceManager::mark_have(uint32_t piece_index) {
+    if (piece_index >= pieces_.size() || have_piece(piece_index)) {
+        return;
+    }
+    set_have(piece_index);
+    ++piece_ct_;
+}
+
+std::vector<PieceManager::PartialPiece> PieceManager::partial_pieces() const {
+    std::vector<PartialPiece> out;
+    for (std::size_t idx = 0; idx < pieces_.size(); ++idx) {
+        const PieceState& ps = pieces_[idx];
+        // a piece held for its leaf hashes is refetched rather than carried over
+        if (ps.have || !ps.buffer || ps.awaiting_hashes) {
+            continue;
+        }
+        PartialPiece partial;
+        partial.piece_index = static_cast<uint32_t>(idx);
+        for (std::size_t b = 0; b < ps.buffer->block_count(); ++b) {
+            if (ps.buffer->has_block(b)) {
+                partial.blocks.push_back(static_cast<uint32_t>(b));
+            }
+        }
+        if (partial.blocks.empty()) {
+            continue;
+        }
+        partial.data = ps.buffer->data();
+        out.push_back(std::move(partial));
+    }
+    return out;
+}
+
+void PieceManager::restore_partial_piece(const PartialPiece& partial) {
+    uint32_t idx = partial.piece_index;
+    if (idx >= pieces_.size() || have_piece(idx) ||
+        partial.data.size() != piece_length_for(idx)) {
+        return;
+    }
+    PieceState& ps = pieces_[idx];
+    if (!ps.buffer) {
+        ps.buffer = std::make_unique<PieceBuffer>(idx, piece_length_for(idx), block_size_);
+    }
+    for (uint32_t b : partial.blocks) {
+        if (b >= ps.blocks) {
+            continue;
+        }
+        std::size_t begin = static_cast<std::size_t>(b) * block_size_;
+        std::size_t len = std::min(block_size_, partial.data.size() - begin);
+        ps.buffer->write_block(begin, partial.data.data() + begin, len);
+        ps.requested[b] = true;
+    }
+}
+
+// Marks a piece as owned when data already on disk matches its hash.
+bool PieceManager::restore_piece(uint32_t piece_index, const std::vector<uint8_t>& data) {
+    if (piece_index >= pieces_.size() || have_piece(piece_index)) {
+        return false;
+    }
+    if (data.size() != piece_length_for(piece_index) || !verify_piece(piece_index, data)) {
+        return false;
+    }
+    set_have(piece_index);
+    ++piece_ct_;
+    return true;
+}
+
 std::size_t PieceManager::piece_length_for(uint32_t piece_index) const {
-    if (piece_index + 1 == torrent_.piece_hashes.size()) {
-        int64_t full = torrent_.piece_length * static_cast<int64_t>(torrent_.piece_hashes.size() - 1);
+    if (piece_index + 1 == torrent_.piece_count()) {
+        int64_t full = torrent_.piece_length * static_cast<int64_t>(torrent_.piece_count() - 1);
         int64_t tail = torrent_.total_length() - full;
         return static_cast<std::size_t>(tail);
     }
     return static_cast<std::size_t>(torrent_.piece_length);
 }
 
+// SHA-1 when the torrent has v1 hashes (hybrids included), otherwise the
+// piece's merkle subtree.
+bool PieceManager::verify_piece(uint32_t piece_index, const std::vector<uint8_t>& data) const {
+    if (torrent_.has_v1) {
+        std::array<uint8_t, 20> digest{};
+        SHA1(data.data(), data.size(), digest.data());
+        return std::equal(digest.begin(), digest.end(),
+                          torrent_.piece_hashes[piece_index].begin());
+    }
+    auto info = torrent_.v2_piece(piece_index);
+    if (!info || info->data_length > data.size()) {
+        return false;
+    }
+    std::vector<Sha256Hash> leaves;
+    for (std::size_t begin = 0; begin < info->data_length; begin += kMerkleBlockSize) {
+        std::size_t len = std::min(kMerkleBlockSize, info->data_length - begin);
+        leaves.push_back(sha256(data.data() + begin, len));
+    }
+    return MerkleTree(std::move(leaves), info->leaves).root() == info->hash &&
+           all_zero(data.data() + info->data_length, data.size() - info->data_length);
+}
+
+// Past the end of the file a block is padding and must be zeros.
+bool PieceManager::block_matches(uint32_t piece_index, std::size_t block, const uint8_t* data,
+                                 std::size_t len) const {
+    const PieceState& ps = pieces_[piece_index];
+    auto info = torrent_.v2_piece(piece_index);
+    if (!info) {
+        return true;
+    }
+    std::size_t begin = block * block_size_;
+    if (begin >= info->data_length) {
+        return all_zero(data, len);
+    }
+    std::size_t file_len = std::min(len, info->data_length - begin);
+    if (block >= ps.block_hashes.size() || sha256(data, file_len) != ps.block_hashes[block]) {
+        return false;
+    }
+    return all_zero(data + file_len, len - file_len);
+}
+
 void PieceManager::set_have(uint32_t piece_index) {
     pieces_[piece_index].have = true;
     bitfield_set(have_bitfield_, piece_index);
@@ -239,6 +480,7 @@ void PieceManager::reset_piece(uint32_t piece_index) {
     }
     PieceState& ps = pieces_[piece_index];
     ps.buffer.reset();
+    ps.awaiting_hashes = false;
     std::fill(ps.requested.begin(), ps.requested.end(), false);
 }
 
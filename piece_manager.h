@@ -1,4 +1,5 @@
 #pragma once
+#include "merkle.h"
 #include "piece_buffer.h"
 #include "torrent_file.h"
 
@@ -18,16 +19,55 @@ public:
         uint32_t length;
     };
 
+    // Blocks received so far for a piece still being downloaded.
+    struct PartialPiece {
+        uint32_t piece_index{0};
+        std::vector<uint32_t> blocks;
+        // the whole piece buffer; only the listed blocks are meaningful
+        std::vector<uint8_t> data;
+    };
+
     explicit PieceManager(const TorrentFile& torrent, std::size_t block_size);
 
     void set_piece_complete_callback(
         std::function<void(uint32_t, const std::vector<uint8_t>&)> cb);
+    // v2 (BEP 52): a piece that fails its hash keeps its blocks while cb asks
+    // a peer for the 16 KiB leaf hashes that single out the bad ones.
+    void set_block_hashes_needed_callback(std::function<void(uint32_t)> cb);
 
     std::optional<Request> next_request_for_peer(const std::vector<uint8_t>& peer_bitfield);
     std::optional<Request> next_request_for_peer_rarest(const std::vector<uint8_t>& peer_bitfield);
     bool handle_block(uint32_t piece_index, uint32_t begin, const std::vector<uint8_t>& data);
+    bool handle_block(uint32_t piece_index, uint32_t begin, const uint8_t* data,
+                      std::size_t len);
+    // For sources that fetch whole pieces (web seeds): claims every block of
+    // the rarest piece no one has started on.
+    std::optional<uint32_t> claim_whole_piece();
+    // Hands the blocks of a claimed piece that never arrived back to the picker.
+    void release_piece(uint32_t piece_index);
+    // Hands a block back to the picker when its request was rejected, lost
+    // to a choke, or went down with its peer.
+    void release_request(const Request& req);
+    // Hot restart: takes over a request the previous process sent. False
+    // when the block is no longer wanted or someone else has it.
+    bool claim_request(const Request& req);
+    // Leaf hashes for a piece, checked against its piece hash. Later blocks
+    // are verified as they arrive; held blocks that do not match are dropped
+    // and go back to the picker.
+    bool add_block_hashes(uint32_t piece_index, std::vector<Sha256Hash> leaves);
+    bool awaiting_block_hashes(uint32_t piece_index) const;
+    // Nobody could supply the leaves: fetch the whole piece again.
+    void give_up_block_hashes(uint32_t piece_index);
     const std::vector<uint8_t>& have_bitfield() const { return have_bitfield_; }
     bool have_piece(uint32_t piece_index) const;
+    bool restore_piece(uint32_t piece_index, const std::vector<uint8_t>& data);
+    // Trusted resume data: marks a piece as owned without hashing it.
+    void mark_have(uint32_t piece_index);
+    std::vector<PartialPiece> partial_pieces() const;
+    void restore_partial_piece(const PartialPiece& partial);
+    bool complete() const { return piece_ct_ == pieces_.size(); }
+    std::size_t pieces_have() const { return piece_ct_; }
+    std::size_t piece_count() const { return pieces_.size(); }
     std::vector<uint32_t> sum_peer_bitfield_ct_;
     void update_buckets();
 
@@ -38,10 +78,17 @@ private:
         std::vector<bool> requested;
         std::unique_ptr<PieceBuffer> buffer;
         std::size_t blocks{0};
+        // v2 leaf hashes once a peer has sent them, and whether a failed
+        // piece is held waiting for them
+        std::vector<Sha256Hash> block_hashes;
+        bool awaiting_hashes{false};
     };
     std::vector<std::vector<size_t>> piece_buckets_;
     std::optional<std::size_t> lowest_nonempty_bucket() const;
     std::size_t piece_length_for(uint32_t piece_index) const;
+    bool verify_piece(uint32_t piece_index, const std::vector<uint8_t>& data) const;
+    bool block_matches(uint32_t piece_index, std::size_t block, const uint8_t* data,
+                       std::size_t len) const;
     void set_have(uint32_t piece_index);
     void reset_piece(uint32_t piece_index);
     uint64_t piece_ct_ = 0;
@@ -50,6 +97,7 @@ private:
     std::vector<PieceState> pieces_;
     std::vector<uint8_t> have_bitfield_;
     std::function<void(uint32_t, const std::vector<uint8_t>&)> on_complete_;
+    std::function<void(uint32_t)> on_hashes_needed_;
     std::size_t next_piece_cursor_{0};
     void rarest_first();
 };
@@ -0,0 +1,84 @@
+// Token bucket over bytes; owned and used by a single thread.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+class RateLimiter {
+public:
+    // A rate of zero means unlimited.
+    explicit RateLimiter(uint64_t bytes_per_second = 0) { set_rate(bytes_per_second); }
+
+    void set_rate(uint64_t bytes_per_second) {
+        rate_ = bytes_per_second;
+        // allow up to a quarter second of burst, at least one 16 KiB block
+        burst_ = std::max<uint64_t>(rate_ / 4, 16 * 1024);
+        tokens_ = static_cast<double>(burst_);
+        last_ = std::chrono::steady_clock::now();
+    }
+
+    bool unlimited() const { return rate_ == 0; }
+    uint64_t rate() const { return rate_; }
+
+    bool try_consume(uint64_t bytes) {
+        if (unlimited()) {
+            return true;
+        }
+        refill();
+        if (tokens_ < static_cast<double>(bytes)) {
+            return false;
+        }
+        tokens_ -= static_cast<double>(bytes);
+        return true;
+    }
+
+    // Gives back bytes taken for something that was never sent.
+    void refund(uint64_t bytes) {
+        tokens_ = std::min(static_cast<double>(burst_), tokens_ + static_cast<double>(bytes));
+    }
+
+private:
+    void refill() {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - last_).count();
+        last_ = now;
+        tokens_ = std::min(static_cast<double>(burst_),
+                           tokens_ + elapsed * static_cast<double>(rate_));
+    }
+
+    uint64_t rate_{0};
+    uint64_t burst_{0};
+    double tokens_{0};
+    std::chrono::steady_clock::time_point last_{};
+};
+
+// One bucket drawn from by every session's loop thread, so a cap holds for
+// the process and not per torrent.
+class SharedRateLimiter {
+public:
+    explicit SharedRateLimiter(uint64_t bytes_per_second) : limiter_(bytes_per_second) {}
+
+    bool try_consume(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return limiter_.try_consume(bytes);
+    }
+
+    void refund(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        limiter_.refund(bytes);
+    }
+
+    // Another thread may retune the rate; an unchanged rate keeps the bucket.
+    void set_rate(uint64_t bytes_per_second) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (limiter_.rate() != bytes_per_second) {
+            limiter_.set_rate(bytes_per_second);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    RateLimiter limiter_;
+};
@@ -8,7 +8,6 @@
 #include <cstdio>
 #include <cstring>
 #include <limits>
-#include <sstream>
 #include <unordered_set>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -16,7 +15,8 @@
 #include <fcntl.h>
 #include <cerrno>
 
-#include "http_client.h"
+
+#include <openssl/sha.h>
 
 std::string format_peer_id_hex(const std::string& peer_id) {
     static constexpr char kHexDigits[] = "0123456789abcdef";
@@ -60,7 +60,42 @@ int make_listen_socket(uint16_t port) {
 
 
 static std::size_t piece_count(const TorrentFile& t) {
-    return t.piece_hashes.size();
+    return t.piece_count();
+}
+
+// BEP 6 canonical allowed-fast set: SHA1 chains seeded with the peer's /24
+// and the info hash. The spec only defines it for IPv4.
+static std::vector<uint32_t> allowed_fast_set(const Endpoint& ep,
+                                              const std::array<uint8_t, 20>& info_hash,
+                                              uint32_t pieces,
+                                              std::size_t k) {
+    std::vector<uint32_t> out;
+    if (!ep.is_v4() || pieces == 0) {
+        return out;
+    }
+    k = std::min<std::size_t>(k, pieces);
+    uint8_t seed[24]{};
+    std::memcpy(seed, ep.addr.data() + 12, 3);
+    std::memcpy(seed + 4, info_hash.data(), info_hash.size());
+    std::array<uint8_t, 20> x{};
+    SHA1(seed, sizeof(seed), x.data());
+    while (true) {
+        for (std::size_t i = 0; i < 5 && out.size() < k; ++i) {
+            const uint8_t* p = x.data() + 4 * i;
+            uint32_t y = (uint32_t{p[0]} << 24) | (uint32_t{p[1]} << 16) |
+                         (uint32_t{p[2]} << 8) | uint32_t{p[3]};
+            uint32_t index = y % pieces;
+            if (std::find(out.begin(), out.end(), index) == out.end()) {
+                out.push_back(index);
+            }
+        }
+        if (out.size() >= k) {
+            return out;
+        }
+        std::array<uint8_t, 20> next{};
+        SHA1(x.data(), x.size(), next.data());
+        x = next;
+    }
 }
 
 Session::Session(TorrentFile torrent,
@@ -77,8 +112,30 @@ Session::Session(TorrentFile torrent,
       event_loop_([this](Peer& peer, std::vector<Peer::Event>&& events) {
           handle_peer_events(peer, std::move(events));
       }),
-      storage_(torrent_, download_path) {
+      storage_(torrent_, download_path),
+      peer_cache_(download_path / ".dj-torrent" / (torrent_.info_hash_hex() + ".peers")) {
     logger_.start();
+    superseed_reveal_ct_.assign(piece_count(torrent_), 0);
+    int64_t file_offset = 0;
+    for (const auto& file : torrent_.files) {
+        int64_t first = file_offset / torrent_.piece_length;
+        int64_t last = (file_offset + std::max<int64_t>(file.length, 1) - 1) /
+                       torrent_.piece_length;
+        file_pieces_.emplace_back(static_cast<uint32_t>(first), static_cast<uint32_t>(last));
+        // empty and padding files have nothing to wait for
+        file_done_.push_back(file.length == 0 || file.pad);
+        file_offset += file.length;
+    }
+    event_loop_.set_wake_callback([this]() { drain_posted_candidates(); });
+    event_loop_.set_close_callback([this](int fd, const Peer& peer) {
+        auto it = peers_.find(fd);
+        if (it == peers_.end()) {
+            return;
+        }
+        logger_.info("peer " + peer.remote().ip + " closed connection");
+        remember_peer(peer, it->second);
+        erase_peer_state(fd);
+    });
     piece_manager_.set_piece_complete_callback(
         [this](uint32_t piece_index, const std::vector<uint8_t>& data) {
             if (!storage_.write_piece(piece_index, data)) {
@@ -86,43 +143,225 @@ Session::Session(TorrentFile torrent,
             }
             handle_piece_complete(piece_index);
         });
+    piece_manager_.set_block_hashes_needed_callback(
+        [this](uint32_t piece_index) { request_block_hashes(piece_index); });
 
+    // fails quietly while a previous process still holds the port; a hot
+    // restart hands its listener over through adopt_handoff()
     int listen_fd = make_listen_socket(listen_port_);
     if (listen_fd >= 0) {
-        event_loop_.set_listen_socket(
-            listen_fd,
-            [this](int fd, const PeerAddress& addr) {
-                try {
-                    Peer peer =
-                        Peer::from_incoming(fd, addr, torrent_.info_hash, self_peer_id_);
-                    int pfd = peer.fd();
-                    if (event_loop_.add_peer(std::move(peer))) {
-                        ensure_peer_state(pfd);
-                    } else {
-                        ::close(fd);
-                    }
-                } catch (...) {
+        install_listen_socket(listen_fd);
+    }
+}
+
+void Session::install_listen_socket(int listen_fd) {
+    event_loop_.set_listen_socket(
+        listen_fd,
+        [this](int fd, const PeerAddress& addr) {
+            try {
+                Peer peer =
+                    Peer::from_incoming(fd, addr, torrent_.info_hash, self_peer_id_,
+                                        torrent_.has_v2);
+                peer.set_bitfield_bytes(
+                    static_cast<uint32_t>(piece_manager_.have_bitfield().size()));
+                peer.set_metadata_size(torrent_.info_bencoded.size());
+                peer.set_request_queue(static_cast<uint32_t>(kMaxUploadQueue));
+                peer.set_listen_port(listen_port_);
+                int pfd = peer.fd();
+                if (event_loop_.add_peer(std::move(peer))) {
+                    ensure_peer_state(pfd);
+                } else {
                     ::close(fd);
                 }
-            });
+            } catch (...) {
+                ::close(fd);
+            }
+        });
+}
+
+void Session::export_handoff(HandoffTorrent& out, std::vector<int>& fds) {
+    save_peer_cache();
+    out.has_session = true;
+    out.have = piece_manager_.have_bitfield();
+    out.partials = piece_manager_.partial_pieces();
+    out.downloaded = bytes_downloaded();
+    out.uploaded = bytes_uploaded();
+
+    int listen_fd = event_loop_.release_listen_socket();
+    if (listen_fd >= 0) {
+        out.listen_fd = static_cast<int>(fds.size());
+        fds.push_back(listen_fd);
+    }
+
+    std::vector<int> peer_fds;
+    event_loop_.for_each_peer([&peer_fds](Peer& p) { peer_fds.push_back(p.fd()); });
+    for (int fd : peer_fds) {
+        Peer* peer = event_loop_.peer_by_fd(fd);
+        auto it = peers_.find(fd);
+        // half-open connections are cheaper to redo than to carry over
+        if (peer && !peer->is_closed() && peer->state() == Peer::State::Active &&
+            it != peers_.end() && it->second.handshake_received) {
+            const PeerState& state = it->second;
+            HandoffPeer hp;
+            hp.peer = peer->detach();
+            hp.peer.fd = static_cast<int>(fds.size());
+            fds.push_back(fd);
+            hp.bitfield = state.bitfield;
+            hp.choked = state.choked;
+            hp.interested = state.interested;
+            hp.am_choking = state.am_choking;
+            hp.peer_interested = state.peer_interested;
+            hp.upload_only = state.upload_only;
+            hp.bytes_from_peer = state.bytes_from_peer;
+            hp.outstanding.assign(state.outstanding.begin(), state.outstanding.end());
+            hp.upload_queue.assign(state.upload_queue.begin(), state.upload_queue.end());
+            out.peers.push_back(std::move(hp));
+        } else if (peer) {
+            peer->disconnect();
+        }
+        event_loop_.remove_peer(fd);
     }
+    peers_.clear();
+    upload_round_.clear();
+}
+
+void Session::adopt_handoff(HandoffTorrent& in) {
+    const auto& have = in.have;
+    for (uint32_t idx = 0; idx < piece_count(torrent_); ++idx) {
+        if (bitfield_test(have, idx)) {
+            piece_manager_.mark_have(idx);
+        }
+    }
+    for (const auto& partial : in.partials) {
+        piece_manager_.restore_partial_piece(partial);
+    }
+    pieces_done_.store(piece_manager_.pieces_have(), std::memory_order_relaxed);
+    complete_.store(piece_manager_.complete(), std::memory_order_release);
+    update_completed_files(false);
+    bytes_downloaded_.store(in.downloaded, std::memory_order_relaxed);
+    bytes_uploaded_.store(in.uploaded, std::memory_order_relaxed);
+
+    if (in.listen_fd >= 0) {
+        int own = event_loop_.release_listen_socket();
+        if (own >= 0) {
+            ::close(own);
+        }
+        install_listen_socket(in.listen_fd);
+        in.listen_fd = -1;
+    }
+
+    auto& counts = piece_manager_.sum_peer_bitfield_ct_;
+    for (auto& hp : in.peers) {
+        if (hp.peer.fd < 0) {
+            continue;
+        }
+        PeerAddress remote = hp.peer.remote;
+        std::string remote_id = hp.peer.remote_peer_id;
+        Peer peer = Peer::adopt(std::move(hp.peer), torrent_.info_hash, self_peer_id_);
+        peer.set_bitfield_bytes(static_cast<uint32_t>(piece_manager_.have_bitfield().size()));
+        peer.set_metadata_size(torrent_.info_bencoded.size());
+        int fd = peer.fd();
+        if (!event_loop_.add_peer(std::move(peer))) {
+            continue;
+        }
+        PeerState& state = ensure_peer_state(fd);
+        state.remote_id = std::move(remote_id);
+        state.handshake_received = true;
+        state.bitfield_received = true;
+        state.bitfield = std::move(hp.bitfield);
+        state.bitfield.resize(piece_manager_.have_bitfield().size());
+        state.choked = hp.choked;
+        state.interested = hp.interested;
+        state.am_choking = hp.am_choking;
+        state.peer_interested = hp.peer_interested;
+        state.upload_only = hp.upload_only;
+        state.bytes_from_peer = hp.bytes_from_peer;
+        // blocks already on their way arrive here; the peer never notices
+        for (const auto& req : hp.outstanding) {
+            if (piece_manager_.claim_request(req)) {
+                state.outstanding.push_back(req);
+            }
+        }
+        state.upload_queue.assign(hp.upload_queue.begin(), hp.upload_queue.end());
+        if (!state.upload_queue.empty()) {
+            state.in_upload_round = true;
+            upload_round_.push_back(fd);
+        }
+        state.locality = classify(remote);
+        state.endpoint = Endpoint::from_address(remote);
+        if (state.endpoint) {
+            known_endpoints_.insert(*state.endpoint);
+        }
+        if (Peer* adopted = event_loop_.peer_by_fd(fd)) {
+            note_listen_endpoint(*adopted, state);
+            // already granted by the previous process
+            grant_allowed_fast(*adopted, state, false);
+        }
+        for (uint32_t idx = 0; idx < counts.size(); ++idx) {
+            if (bitfield_test(state.bitfield, idx)) {
+                ++counts[idx];
+            }
+        }
+    }
+    piece_manager_.update_buckets();
+    in.peers.clear();
+    logger_.info("adopted " + std::to_string(peers_.size()) + " peers from previous process");
 }
 
 Session::~Session() {
     stop();
+    save_peer_cache();
     logger_.stop();
 }
 
 
 void Session::start() {
-    if (start_from_tracker()) {
+    running_.store(true, std::memory_order_relaxed);
+    // cached peers are dialled right away, trackers answer in the background
+    std::size_t cached = enqueue_cached_peers();
+    bool from_tracker = start_from_tracker();
+    bool from_dht = start_from_dht();
+    bool from_lsd = start_from_lsd();
+    bool from_web_seeds = start_from_web_seeds();
+    if (from_tracker || from_dht || from_lsd || from_web_seeds) {
         return;
     }
-    if (start_from_web_seeds()) {
+    if (cached > 0 || !pending_peers_.empty() || !pending_hostnames_.empty() ||
+        event_loop_.peer_count() > 0) {
         return;
     }
     throw std::runtime_error(
-        "torrent does not include a usable HTTP(S)/UDP tracker or any web seeds (url-list)");
+        "torrent has no usable HTTP(S)/UDP tracker, DHT, LSD or web seeds (url-list)");
+}
+
+bool Session::start_from_lsd() {
+    if (!lsd_ || torrent_.is_private) {
+        return false;
+    }
+    lsd_->add_torrent(torrent_.info_hash, listen_port_,
+                      [this](const std::vector<PeerAddress>& peers) {
+                          for (const auto& address : peers) {
+                              post_peer_candidate(address);
+                          }
+                          event_loop_.wake();
+                      });
+    logger_.info("announcing on local service discovery");
+    return true;
+}
+
+bool Session::start_from_dht() {
+    if (!dht_ || torrent_.is_private) {
+        return false;
+    }
+    dht_->add_torrent(torrent_.info_hash, listen_port_,
+                      [this](const std::vector<PeerAddress>& peers) {
+                          for (const auto& address : peers) {
+                              post_peer_candidate(address);
+                          }
+                          event_loop_.wake();
+                      });
+    logger_.info("announcing on the dht (" + std::to_string(dht_->node_count()) + " nodes)");
+    return true;
 }
 
 bool Session::start_from_tracker() {
@@ -153,76 +392,82 @@ bool Session::start_from_tracker() {
     return true;
 }
 
+// Web seeds join the swarm as seeds that fetch whole pieces; the picker
+// hands them the rarest piece nobody has started on.
 bool Session::start_from_web_seeds() {
-    for (const auto& base : torrent_.web_seeds) {
-        if (try_download_from_web_seed(base)) {
-            return true;
+    if (web_seeds_.empty() && !torrent_.web_seeds.empty()) {
+        for (const auto& url : torrent_.web_seeds) {
+            try {
+                web_seeds_.push_back(std::make_unique<WebSeed>(
+                    torrent_, url, [this]() { event_loop_.wake(); }));
+                logger_.info("using web seed: " + url);
+            } catch (const std::exception& ex) {
+                logger_.warn("skipping web seed " + url + ": " + ex.what());
+            }
         }
+        for (auto& count : piece_manager_.sum_peer_bitfield_ct_) {
+            count += static_cast<uint32_t>(web_seeds_.size());
+        }
+        piece_manager_.update_buckets();
     }
-    return false;
+    for (auto& seed : web_seeds_) {
+        seed->start();
+    }
+    return !web_seeds_.empty();
 }
 
-bool Session::try_download_from_web_seed(const std::string& base_url) {
-    try {
-        std::string file_url = build_web_seed_url(base_url);
-        logger_.info(std::string("using web seed: ") + file_url);
-
-        HttpUrl parsed = parse_http_url(file_url);
-        std::size_t pieces = torrent_.piece_hashes.size();
-        for (uint32_t idx = 0; idx < pieces; ++idx) {
-            uint32_t len = piece_length(idx);
-            uint64_t offset =
-                static_cast<uint64_t>(idx) * static_cast<uint64_t>(torrent_.piece_length);
-            std::string range_value = "bytes=" + std::to_string(offset) + "-" +
-                std::to_string(offset + static_cast<uint64_t>(len) - 1);
-
-            HttpResponse resp = http_get(parsed,
-                                         parsed.path,
-                                         {{"Range", range_value}},
-                                         static_cast<std::size_t>(len) + 16 * 1024);
-            if (resp.status_code != 206 && resp.status_code != 200) {
-                std::ostringstream oss;
-                oss << "unexpected status for piece " << idx << ": " << resp.status_line;
-                throw std::runtime_error(oss.str());
-            }
-            if (resp.body.size() < len) {
-                throw std::runtime_error("short body from web seed");
-            }
-            if (resp.body.size() > len) {
-                throw std::runtime_error("web seed returned larger body than expected");
-            }
-
-            for (uint32_t begin = 0; begin < len; begin += static_cast<uint32_t>(block_size_)) {
-                uint32_t take = static_cast<uint32_t>(
-                    std::min<std::size_t>(block_size_, static_cast<std::size_t>(len - begin)));
-                std::vector<uint8_t> chunk(resp.body.begin() + begin,
-                                           resp.body.begin() + begin + take);
-                if (!piece_manager_.handle_block(idx, begin, chunk)) {
-                    throw std::runtime_error("failed to accept block from web seed");
-                }
+void Session::maybe_feed_web_seeds() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto& seed : web_seeds_) {
+        while (auto result = seed->poll(now)) {
+            handle_web_seed_result(*seed, std::move(*result));
+        }
+        if (complete_.load(std::memory_order_relaxed) || memory_governor().reading_paused()) {
+            continue;
+        }
+        while (seed->wants_piece(now)) {
+            auto piece_index = piece_manager_.claim_whole_piece();
+            if (!piece_index) {
+                break;
             }
+            seed->assign(*piece_index);
         }
-        return true;
-    }
-    catch (const std::exception& ex) {
-        logger_.error(std::string("web seed failed: ") + ex.what());
-        return false;
     }
 }
 
-std::string Session::build_web_seed_url(const std::string& base) const {
-    if (base.empty()) {
-        return base;
+void Session::handle_web_seed_result(WebSeed& seed, WebSeed::Result&& result) {
+    if (result.data.empty()) {
+        logger_.warn("web seed " + seed.url() + " failed piece " +
+                     std::to_string(result.piece_index) + ": " + result.error);
+        piece_manager_.release_piece(result.piece_index);
+        return;
     }
-    if (base.size() >= torrent_.name.size() &&
-        base.compare(base.size() - torrent_.name.size(), torrent_.name.size(), torrent_.name) ==
-        0) {
-        return base;
+    // handle_block copies each block out of the one buffer the body was
+    // read into
+    for (std::size_t begin = 0; begin < result.data.size(); begin += block_size_) {
+        std::size_t len = std::min(block_size_, result.data.size() - begin);
+        if (piece_manager_.handle_block(result.piece_index, static_cast<uint32_t>(begin),
+                                        result.data.data() + begin, len)) {
+            bytes_downloaded_.fetch_add(len, std::memory_order_relaxed);
+        }
     }
-    if (base.back() == '/') {
-        return base + torrent_.name;
+    // a piece that failed its hash is back in the picker; one held for
+    // its leaf hashes waits for a peer to send them
+    piece_manager_.release_piece(result.piece_index);
+}
+
+// After stop(): takes in what the workers finished and hands back the rest.
+void Session::release_web_seed_pieces() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto& seed : web_seeds_) {
+        while (auto result = seed->poll(now)) {
+            handle_web_seed_result(*seed, std::move(*result));
+        }
+        for (uint32_t piece_index : seed->assigned()) {
+            piece_manager_.release_piece(piece_index);
+        }
+        seed->clear_assigned();
     }
-    return base + "/" + torrent_.name;
 }
 
 std::vector<std::string> Session::collect_tracker_urls() const {
@@ -252,17 +497,45 @@ void Session::add_peer(const PeerAddress& address) {
     enqueue_peer_candidate(address);
 }
 
+std::size_t Session::recheck_existing_data() {
+    std::size_t restored = 0;
+    std::size_t pieces = piece_count(torrent_);
+    for (uint32_t idx = 0; idx < pieces; ++idx) {
+        auto data = storage_.read_block(idx, 0, piece_length(idx));
+        if (data && piece_manager_.restore_piece(idx, *data)) {
+            ++restored;
+        }
+    }
+    pieces_done_.store(piece_manager_.pieces_have(), std::memory_order_relaxed);
+    complete_.store(piece_manager_.complete(), std::memory_order_release);
+    update_completed_files(false);
+    logger_.info("recheck: " + std::to_string(restored) + "/" + std::to_string(pieces) +
+                 " pieces already on disk");
+    return restored;
+}
+
 void Session::run_once(int timeout_ms) {
-    maybe_connect_pending_peers();
+    refresh_ip_filter();
+    drain_posted_candidates();
+    mark_awaiting_blocks();
     event_loop_.run_once(timeout_ms);
+    connected_peers_.store(peers_.size(), std::memory_order_relaxed);
 
     maybe_connect_pending_peers();
     maybe_drop_handshake_timeouts();
+    maybe_drop_redundant_peers();
+    maybe_save_peer_cache();
+    maybe_age_recently_tried();
+    maybe_rechoke();
+    maybe_broadcast_pex();
+    maybe_expire_block_hash_requests();
+    maybe_feed_web_seeds();
+    retry_starved_requests();
+    serve_upload_queue();
     maybe_log_stats();
 }
 
 void Session::run(int timeout_ms) {
-    running_.store(true, std::memory_order_relaxed);
     while (running_.load(std::memory_order_relaxed)) {
         run_once(timeout_ms);
     }
@@ -272,13 +545,60 @@ void Session::stop() {
     running_.store(false, std::memory_order_relaxed);
     event_loop_.stop();
     stop_tracker_thread();
+    if (dht_) {
+        dht_->remove_torrent(torrent_.info_hash);
+    }
+    if (lsd_) {
+        lsd_->remove_torrent(torrent_.info_hash);
+    }
+    for (auto& seed : web_seeds_) {
+        seed->stop();
+    }
 }
 
 std::size_t Session::peer_count() const { return event_loop_.peer_count(); }
 
+void Session::pause() {
+    stop();
+    save_peer_cache();
+    std::vector<int> fds;
+    event_loop_.for_each_peer([&fds](Peer& p) { fds.push_back(p.fd()); });
+    for (int fd : fds) {
+        event_loop_.remove_peer(fd);
+    }
+    for (auto& [fd, state] : peers_) {
+        release_outstanding(state);
+    }
+    peers_.clear();
+    upload_round_.clear();
+    release_web_seed_pieces();
+    for (const auto& [piece_index, request] : block_hash_requests_) {
+        piece_manager_.give_up_block_hashes(piece_index);
+    }
+    block_hash_requests_.clear();
+    while (posted_candidates_.dequeue()) {
+    }
+    while (posted_endpoints_.dequeue()) {
+    }
+    pending_peers_.clear();
+    pending_hostnames_.clear();
+    deferred_peers_.clear();
+    known_endpoints_.clear();
+    recently_tried_.clear();
+}
+
 void Session::connect_peer_now(const PeerAddress& address) {
+    if (is_blocked(address)) {
+        ++blocked_candidates_;
+        return;
+    }
     try {
-        Peer peer = Peer::connect_outgoing(address, torrent_.info_hash, self_peer_id_);
+        Peer peer = Peer::connect_outgoing(address, torrent_.info_hash, self_peer_id_,
+                                           torrent_.has_v2);
+        peer.set_bitfield_bytes(static_cast<uint32_t>(piece_manager_.have_bitfield().size()));
+        peer.set_metadata_size(torrent_.info_bencoded.size());
+        peer.set_request_queue(static_cast<uint32_t>(kMaxUploadQueue));
+        peer.set_listen_port(listen_port_);
         int fd = peer.fd();
         if (event_loop_.add_peer(std::move(peer))) {
             ensure_peer_state(fd);
@@ -292,16 +612,34 @@ void Session::connect_peer_now(const PeerAddress& address) {
 void Session::maybe_connect_pending_peers() {
     static constexpr std::size_t kMaxActivePeers = 50;
     while (peer_count() < kMaxActivePeers) {
-        PeerAddress next;
-        {
-            std::lock_guard<std::mutex> lock(pending_mutex_);
-            if (pending_peers_.empty()) {
-                break;
+        if (!pending_hostnames_.empty()) {
+            PeerAddress next = std::move(pending_hostnames_.front());
+            pending_hostnames_.pop_front();
+            connect_peer_now(next);
+            continue;
+        }
+        if (pending_peers_.empty()) {
+            break;
+        }
+        PeerCandidate next = pending_peers_.front();
+        pending_peers_.pop_front();
+        if (next.seed && piece_manager_.complete()) {
+            continue;
+        }
+        if (recently_tried_.maybe_contains(next.endpoint)) {
+            // known_endpoints_ already holds it, so no source will offer
+            // it again; dropping it would lose a false positive for good
+            if (deferred_peers_.size() >= kMaxDeferredPeers) {
+                deferred_peers_.pop_front();
             }
-            next = pending_peers_.front();
-            pending_peers_.pop_front();
+            deferred_peers_.push_back(next);
+            continue;
         }
-        connect_peer_now(next);
+        recently_tried_.add(next.endpoint);
+        PeerAddress address = next.endpoint.to_address();
+        address.seed = next.seed;
+        address.local = next.local;
+        connect_peer_now(address);
     }
 }
 
@@ -316,15 +654,18 @@ void Session::maybe_log_stats() {
         return;
     }
     last_stats_log_ = now;
-    std::size_t pending = 0;
-    {
-        std::lock_guard<std::mutex> lock(pending_mutex_);
-        pending = pending_peers_.size();
-    }
     std::string msg = "stats: active_peers=" + std::to_string(peer_count()) +
-        " pending_peers=" + std::to_string(pending) +
-        " pex_peers_discovered=" + std::to_string(pex_peers_discovered_);
+        " pending_peers=" + std::to_string(pending_peers_.size() + pending_hostnames_.size()) +
+        " deferred_peers=" + std::to_string(deferred_peers_.size()) +
+        " known_endpoints=" + std::to_string(known_endpoints_.size()) +
+        " blocked=" + std::to_string(blocked_candidates_ + event_loop_.blocked_accepts()) +
+        " pex_peers_discovered=" + std::to_string(pex_peers_discovered_) +
+        " uploaded=" + std::to_string(bytes_uploaded()) +
+        " candidates_dropped=" +
+        std::to_string(posted_candidates_dropped_.load(std::memory_order_relaxed));
     logger_.info(msg);
+    logger_.info(memory_governor().report() +
+                 " refused_accepts=" + std::to_string(event_loop_.refused_accepts()));
 }
 
 void Session::maybe_drop_handshake_timeouts() {
@@ -350,20 +691,251 @@ void Session::maybe_drop_handshake_timeouts() {
             peer->handle_error();
         }
         event_loop_.remove_peer(fd);
-        peers_.erase(fd);
+        erase_peer_state(fd);
+    }
+}
+
+std::size_t Session::enqueue_cached_peers() {
+    static constexpr std::size_t kMaxCachedCandidates = 50;
+    if (!peer_cache_loaded_) {
+        peer_cache_.load();
+        peer_cache_loaded_ = true;
+    }
+    std::size_t added = 0;
+    for (const auto& address : peer_cache_.best(kMaxCachedCandidates)) {
+        if (enqueue_peer_candidate(address)) {
+            ++added;
+        }
     }
+    if (added > 0) {
+        logger_.info("queued " + std::to_string(added) + " peers from peer cache");
+    }
+    return added;
 }
 
+// Only peers we dialled are worth keeping: an incoming peer's source port is
+// not the one it listens on.
+void Session::remember_peer(const Peer& peer, const PeerState& state) {
+    if (!peer.initiated_by_us() || !state.handshake_received) {
+        return;
+    }
+    bool seed = state.upload_only || bitfield_complete(state.bitfield, piece_count(torrent_));
+    peer_cache_.record(peer.remote(), state.bytes_from_peer, seed);
+}
+
+void Session::save_peer_cache() {
+    event_loop_.for_each_peer([this](Peer& p) {
+        auto it = peers_.find(p.fd());
+        if (it != peers_.end()) {
+            remember_peer(p, it->second);
+        }
+    });
+    if (peer_cache_.size() > 0 && !peer_cache_.save()) {
+        logger_.warn("failed to save peer cache");
+    }
+}
+
+void Session::maybe_save_peer_cache() {
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    if (last_peer_cache_save_.time_since_epoch().count() == 0) {
+        last_peer_cache_save_ = now;
+        return;
+    }
+    if (now - last_peer_cache_save_ < minutes(5)) {
+        return;
+    }
+    last_peer_cache_save_ = now;
+    save_peer_cache();
+}
+
+// hostnames from non-compact tracker replies cannot be keyed; let them through
 bool Session::enqueue_peer_candidate(const PeerAddress& address) {
-    std::string key = address.ip + ":" + std::to_string(address.port);
-    std::lock_guard<std::mutex> lock(pending_mutex_);
-    if (!known_endpoints_.insert(std::move(key)).second) {
+    auto ep = Endpoint::from_address(address);
+    if (ep) {
+        return enqueue_peer_candidate(*ep, address.seed, address.local);
+    }
+    if (pending_hostnames_.size() >= kMaxPendingHostnames) {
         return false;
     }
-    pending_peers_.push_back(address);
+    pending_hostnames_.push_back(address);
     return true;
 }
 
+// The queue holds binary endpoints and is capped, so a huge swarm costs no
+// more memory than a small one. A full queue turns ordinary candidates away
+// before they are marked known, so a later source may offer them again;
+// seeds and nearby peers push out the newest ordinary one instead.
+bool Session::enqueue_peer_candidate(const Endpoint& endpoint, bool seed, bool local) {
+    if (ip_filter_ && ip_filter_->is_blocked(endpoint)) {
+        ++blocked_candidates_;
+        return false;
+    }
+    local = local || (topology_ && topology_->is_local(endpoint));
+    bool first = seed || local;
+    if (!first && pending_peers_.size() >= kMaxPendingPeers) {
+        return false;
+    }
+    if (!known_endpoints_.insert(endpoint)) {
+        return false;
+    }
+    if (pending_peers_.size() >= kMaxPendingPeers) {
+        pending_peers_.pop_back();
+    }
+    if (first) {
+        // seeds are dialled first while leeching and skipped once we seed;
+        // nearby peers always go first
+        pending_peers_.push_front(PeerCandidate{endpoint, seed, local});
+    } else {
+        pending_peers_.push_back(PeerCandidate{endpoint, seed, local});
+    }
+    return true;
+}
+
+// Peers we dialled listen where we reached them; one that dialled us says
+// where in its extended handshake.
+void Session::note_listen_endpoint(const Peer& peer, PeerState& state) {
+    if (!state.endpoint) {
+        return;
+    }
+    if (peer.initiated_by_us()) {
+        state.listen_endpoint = state.endpoint;
+        return;
+    }
+    if (peer.remote_listen_port() == 0) {
+        return;
+    }
+    Endpoint listen = *state.endpoint;
+    listen.port = peer.remote_listen_port();
+    state.listen_endpoint = listen;
+    // connected already; a peer list naming it is not worth a dial
+    known_endpoints_.insert(listen);
+}
+
+// yourip plus our listen port is us: peer lists that carry it, trackers'
+// above all, are not dialled. Any one peer can say anything, so an address
+// only counts once peers at several distinct addresses agree on it.
+void Session::note_reported_ip(const Peer& peer) {
+    constexpr std::size_t kMinReporters = 3;
+    constexpr std::size_t kMaxCandidates = 16;
+    const std::string& ip = peer.reported_ip();
+    auto reporter = Endpoint::from_address(peer.remote());
+    if (ip.empty() || !reporter) {
+        return;
+    }
+    const auto* bytes = reinterpret_cast<const uint8_t*>(ip.data());
+    Endpoint self = ip.size() == 4 ? Endpoint::from_v4(bytes, listen_port_)
+                                   : Endpoint::from_v6(bytes, listen_port_);
+    if (external_endpoint_ && *external_endpoint_ == self) {
+        return;
+    }
+
+    auto it = std::find_if(reported_ips_.begin(), reported_ips_.end(),
+                           [&self](const auto& entry) { return entry.first == self; });
+    if (it == reported_ips_.end()) {
+        if (reported_ips_.size() >= kMaxCandidates) {
+            reported_ips_.erase(reported_ips_.begin());
+        }
+        reported_ips_.emplace_back(self, std::vector<IpBytes>{});
+        it = std::prev(reported_ips_.end());
+    }
+    auto& reporters = it->second;
+    if (std::find(reporters.begin(), reporters.end(), reporter->addr) != reporters.end()) {
+        return;
+    }
+    reporters.push_back(reporter->addr);
+    if (reporters.size() < kMinReporters) {
+        return;
+    }
+
+    logger_.info("peers see us as " + self.ip_string());
+    external_endpoint_ = self;
+    known_endpoints_.insert(self);
+    reported_ips_.erase(it);
+}
+
+// A dial attempt stays in the filter for one to several aging rounds,
+// depending on how often it was retried.
+void Session::maybe_age_recently_tried() {
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    if (last_tried_aging_.time_since_epoch().count() == 0) {
+        last_tried_aging_ = now;
+        return;
+    }
+    if (now - last_tried_aging_ < minutes(10)) {
+        return;
+    }
+    last_tried_aging_ = now;
+    recently_tried_.age();
+    // checked again on the way out; real retries wait another round
+    while (!deferred_peers_.empty() && pending_peers_.size() < kMaxPendingPeers) {
+        pending_peers_.push_back(deferred_peers_.front());
+        deferred_peers_.pop_front();
+    }
+}
+
+void Session::set_ip_filter(std::shared_ptr<SharedIpFilter> filter) {
+    shared_ip_filter_ = std::move(filter);
+    refresh_ip_filter();
+}
+
+// Picks up a reload of the shared table and drops peers it now blocks.
+void Session::refresh_ip_filter() {
+    if (!shared_ip_filter_ || shared_ip_filter_->generation() == ip_filter_generation_) {
+        return;
+    }
+    ip_filter_generation_ = shared_ip_filter_->generation();
+    ip_filter_ = shared_ip_filter_->current();
+    event_loop_.set_ip_filter(ip_filter_.get());
+
+    std::vector<int> drop_fds;
+    event_loop_.for_each_peer([this, &drop_fds](Peer& p) {
+        if (is_blocked(p.remote())) {
+            drop_fds.push_back(p.fd());
+        }
+    });
+    for (int fd : drop_fds) {
+        if (Peer* peer = event_loop_.peer_by_fd(fd)) {
+            logger_.info("dropping blocked peer " + peer->remote().ip);
+            peer->disconnect();
+        }
+        event_loop_.remove_peer(fd);
+        erase_peer_state(fd);
+    }
+}
+
+bool Session::is_blocked(const PeerAddress& address) const {
+    if (!ip_filter_) {
+        return false;
+    }
+    auto ep = Endpoint::from_address(address);
+    return ep && ip_filter_->is_blocked(*ep);
+}
+
+// Any thread: hands a candidate to the loop thread without taking a lock.
+void Session::post_peer_candidate(const PeerAddress& address) {
+    if (!posted_candidates_.enqueue(address)) {
+        posted_candidates_dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Session::post_peer_candidate(const Endpoint& endpoint) {
+    if (!posted_endpoints_.enqueue(endpoint)) {
+        posted_candidates_dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Session::drain_posted_candidates() {
+    while (auto address = posted_candidates_.dequeue()) {
+        enqueue_peer_candidate(*address);
+    }
+    while (auto endpoint = posted_endpoints_.dequeue()) {
+        enqueue_peer_candidate(*endpoint);
+    }
+    maybe_connect_pending_peers();
+}
+
 void Session::tracker_worker(std::vector<std::string> tracker_urls) {
     bool any_success = false;
     for (const auto& url : tracker_urls) {
@@ -373,19 +945,35 @@ void Session::tracker_worker(std::vector<std::string> tracker_urls) {
         try {
             logger_.info(std::string("contacting tracker: ") + url);
             auto res = tracker_client_.announce(url, torrent_);
-            if (res.peers.empty()) {
+            swarm_seeds_.store(res.complete, std::memory_order_relaxed);
+            Alert alert{};
+            alert.type = AlertType::TrackerReply;
+            std::size_t found = res.peers.size() + res.named_peers.size();
+            alert.count = static_cast<int64_t>(found);
+            alert.seeds = res.complete;
+            alert.set_message(url);
+            post_alert(alert);
+            if (found == 0) {
                 logger_.warn(std::string("tracker returned zero peers: ") + url);
                 continue;
             }
             logger_.info(std::string("tracker ") + url + " returned " +
-                         std::to_string(res.peers.size()) + " peers");
+                         std::to_string(found) + " peers");
             any_success = true;
             for (const auto& ep : res.peers) {
-                enqueue_peer_candidate(PeerAddress{ep.ip, ep.port});
+                post_peer_candidate(ep);
+            }
+            for (const auto& named : res.named_peers) {
+                post_peer_candidate(PeerAddress{named.ip, named.port});
             }
+            event_loop_.wake();
         }
         catch (const std::exception& ex) {
             logger_.warn(std::string("tracker failed: ") + ex.what());
+            Alert alert{};
+            alert.type = AlertType::TrackerError;
+            alert.set_message(ex.what());
+            post_alert(alert);
         }
     }
     if (!any_success) {
@@ -401,26 +989,54 @@ void Session::stop_tracker_thread() {
 }
 
 void Session::handle_peer_events(Peer& peer, std::vector<Peer::Event>&& events) {
-    PeerState& state = ensure_peer_state(peer.fd());
+    if (peer.is_closed()) {
+        // closed mid-read; state is released by the close callback
+        return;
+    }
+    // the fd is gone from peer once it closes
+    const int fd = peer.fd();
+    PeerState& state = ensure_peer_state(fd);
 
     for (auto& ev : events) {
         switch (ev.type) {
         case Peer::EventType::Handshake:
             state.remote_id = ev.peer_id;
             state.handshake_received = true;
+            state.locality = classify(peer.remote());
+            state.endpoint = Endpoint::from_address(peer.remote());
+            note_listen_endpoint(peer, state);
+            if (state.endpoint) {
+                Alert alert{};
+                alert.type = AlertType::PeerConnected;
+                alert.peer = *state.endpoint;
+                post_alert(alert);
+            }
             {
                 std::string msg = "received handshake from peer " + peer.remote().ip +
                     ", sending our bitfield";
                 logger_.info(msg);
             }
-            peer.send_bitfield(piece_manager_.have_bitfield());
-            peer.send_extended_handshake();
+            if (super_seeding_active()) {
+                // an empty bitfield; pieces are revealed one at a time via have
+                if (peer.supports_fast()) {
+                    peer.send_have_none();
+                } else {
+                    peer.send_bitfield(make_bitfield(piece_count(torrent_)));
+                }
+                peer.send_extended_handshake();
+                superseed_reveal(peer, state);
+            } else {
+                send_have_state(peer);
+                peer.send_extended_handshake(piece_manager_.complete());
+                grant_allowed_fast(peer, state, true);
+            }
             break;
         case Peer::EventType::Bitfield:
             {
                 std::string msg = "received bitfield from peer " + peer.remote().ip;
                 logger_.info(msg);
                 state.bitfield = ev.payload;
+                state.bitfield_received = true;
                 size_t n = piece_count(torrent_);
                 for (size_t i = 0; i < n; i++) {
                     if (bitfield_test(state.bitfield, i)) {
@@ -429,22 +1045,45 @@ void Session::handle_peer_events(Peer& peer, std::vector<Peer::Event>&& events)
                 }
                 piece_manager_.update_buckets();
                 state.bitfield.resize(piece_manager_.have_bitfield().size());
+                if (super_seeding_active() &&
+                    (!state.superseed_piece ||
+                     bitfield_test(state.bitfield, *state.superseed_piece))) {
+                    superseed_reveal(peer, state);
+                }
             }
             break;
         case Peer::EventType::ExtendedHandshake:
+            state.upload_only = peer.remote_upload_only();
+            note_listen_endpoint(peer, state);
+            note_reported_ip(peer);
+            if (!peer.remote_client().empty()) {
+                logger_.info("peer " + peer.remote().ip + " runs " + peer.remote_client());
+            }
             break;
         case Peer::EventType::Have:
             {
                 std::string msg = "received have for piece " +
                     std::to_string(ev.piece_index) + " from peer " + peer.remote().ip;
                 logger_.info(msg);
+                if (ev.piece_index >= piece_count(torrent_)) {
+                    logger_.warn("dropping peer " + peer.remote().ip + ": have out of range");
+                    peer.disconnect();
+                    break;
+                }
                 if (ev.piece_index / 8 >= state.bitfield.size()) {
                     state.bitfield.resize(piece_manager_.have_bitfield().size());
                 }
+                state.bitfield_received = true;
+                if (bitfield_test(state.bitfield, ev.piece_index)) {
+                    break;
+                }
                 piece_manager_.sum_peer_bitfield_ct_[ev.piece_index]++;
                 // todo o(n) prolly not needed here
                 piece_manager_.update_buckets();
                 bitfield_set(state.bitfield, ev.piece_index);
+                if (super_seeding_active()) {
+                    superseed_on_have(peer, state, ev.piece_index);
+                }
             }
             break;
         case Peer::EventType::Choke:
@@ -452,8 +1091,25 @@ void Session::handle_peer_events(Peer& peer, std::vector<Peer::Event>&& events)
                 std::string msg = "peer " + peer.remote().ip + " choking us";
                 logger_.info(msg);
                 state.choked = true;
+                // without BEP 6 a choke silently drops what we asked for;
+                // with it every dropped request comes back as a reject
+                if (!peer.supports_fast()) {
+                    release_outstanding(state);
+                }
+            }
+            break;
+        case Peer::EventType::Interested:
+            state.peer_interested = true;
+            if (state.am_choking &&
+                (!is_cross_rack(state) || unchoked_remote_count() < kUnchokeSlots)) {
+                peer.send_unchoke();
+                state.am_choking = false;
+                send_suggestions(peer, state);
             }
             break;
+        case Peer::EventType::NotInterested:
+            state.peer_interested = false;
+            break;
         case Peer::EventType::Unchoke:
             {
                 std::string msg = "peer " + peer.remote().ip + " unchoking us";
@@ -473,10 +1129,20 @@ void Session::handle_peer_events(Peer& peer, std::vector<Peer::Event>&& events)
                 std::string msg = "peer " + peer.remote().ip + " " + std::string(buf);
                 logger_.info(msg);
             }
-            if (state.inflight_requests > 0) {
-                --state.inflight_requests;
+            {
+                auto it = std::find_if(state.outstanding.begin(), state.outstanding.end(),
+                                       [&ev](const PieceManager::Request& r) {
+                                           return r.piece_index == ev.piece_index &&
+                                                  r.begin == ev.begin;
+                                       });
+                if (it != state.outstanding.end()) {
+                    state.outstanding.erase(it);
+                }
+            }
+            if (piece_manager_.handle_block(ev.piece_index, ev.begin, ev.payload)) {
+                bytes_downloaded_.fetch_add(ev.payload.size(), std::memory_order_relaxed);
+                state.bytes_from_peer += ev.payload.size();
             }
-            (void)piece_manager_.handle_block(ev.piece_index, ev.begin, ev.payload);
             break;
         case Peer::EventType::Request:
             {
@@ -489,44 +1155,216 @@ void Session::handle_peer_events(Peer& peer, std::vector<Peer::Event>&& events)
                               ev.length);
                 std::string msg = "peer " + peer.remote().ip + " " + std::string(buf);
                 logger_.info(msg);
-                if (!piece_manager_.have_piece(ev.piece_index)) {
+                if (ev.length == 0 || ev.length > Peer::kMaxBlockLength) {
+                    logger_.warn("dropping peer " + peer.remote().ip + ": bad request length");
+                    peer.disconnect();
                     break;
                 }
-                if (ev.begin + ev.length > piece_length(ev.piece_index)) {
+                if (state.am_choking) {
+                    if (!peer.supports_fast()) {
+                        break;
+                    }
+                    const auto& allowed = state.allowed_fast_out;
+                    if (std::find(allowed.begin(), allowed.end(), ev.piece_index) ==
+                        allowed.end()) {
+                        peer.send_reject(ev.piece_index, ev.begin, ev.length);
+                        break;
+                    }
+                }
+                // served by serve_upload_queue at the end of this loop pass
+                if (state.upload_queue.size() >= kMaxUploadQueue) {
+                    logger_.warn("dropping peer " + peer.remote().ip +
+                                 ": too many outstanding requests");
+                    peer.disconnect();
                     break;
                 }
-                auto block = storage_.read_block(ev.piece_index, ev.begin, ev.length);
-                if (block) {
-                    std::snprintf(buf,
-                                  sizeof(buf),
-                                  "fulfilling request piece=%u begin=%u len=%u",
-                                  ev.piece_index,
-                                  ev.begin,
-                                  ev.length);
-                    logger_.info(std::string_view(buf, std::strlen(buf)));
-                    peer.send_piece(ev.piece_index, ev.begin, *block);
+                state.upload_queue.push_back({ev.piece_index, ev.begin, ev.length});
+                if (!state.in_upload_round) {
+                    state.in_upload_round = true;
+                    upload_round_.push_back(fd);
+                }
+                break;
+            }
+        case Peer::EventType::Cancel:
+            {
+                auto& queue = state.upload_queue;
+                auto it = std::find_if(queue.begin(), queue.end(),
+                                       [&ev](const PieceManager::Request& r) {
+                                           return r.piece_index == ev.piece_index &&
+                                                  r.begin == ev.begin && r.length == ev.length;
+                                       });
+                if (it == queue.end()) {
+                    break;
+                }
+                queue.erase(it);
+                // BEP 6: a request is answered even when cancelled
+                if (peer.supports_fast()) {
+                    peer.send_reject(ev.piece_index, ev.begin, ev.length);
                 }
                 break;
             }
         case Peer::EventType::Pex:
-            handle_pex(peer, ev.payload);
+            handle_pex(state, ev.payload);
+            break;
+        case Peer::EventType::HashRequest:
+            serve_hash_request(peer, state, ev);
+            break;
+        case Peer::EventType::Hashes:
+            handle_hashes(peer, ev);
+            break;
+        case Peer::EventType::HashReject:
+            handle_hash_reject(peer, ev);
+            break;
+        case Peer::EventType::HaveAll:
+            {
+                // a seed: every bit set, no per-piece tests on the way in
+                if (state.bitfield_received) {
+                    break;
+                }
+                std::size_t n = piece_count(torrent_);
+                state.bitfield.assign((n + 7) / 8, 0xFF);
+                if (n % 8 != 0) {
+                    state.bitfield.back() = static_cast<uint8_t>(0xFF << (8 - n % 8));
+                }
+                state.bitfield_received = true;
+                for (auto& count : piece_manager_.sum_peer_bitfield_ct_) {
+                    ++count;
+                }
+                piece_manager_.update_buckets();
+            }
+            break;
+        case Peer::EventType::HaveNone:
+            state.bitfield = make_bitfield(piece_count(torrent_));
+            state.bitfield_received = true;
+            break;
+        case Peer::EventType::Reject:
+            {
+                auto it = std::find_if(state.outstanding.begin(), state.outstanding.end(),
+                                       [&ev](const PieceManager::Request& r) {
+                                           return r.piece_index == ev.piece_index &&
+                                                  r.begin == ev.begin && r.length == ev.length;
+                                       });
+                if (it == state.outstanding.end()) {
+                    break;
+                }
+                piece_manager_.release_request(*it);
+                state.outstanding.erase(it);
+                // a refused allowed-fast grant is gone; the peer still has the
+                // piece, so its bitfield stays and the block is picked again
+                auto& allowed = state.allowed_fast_in;
+                allowed.erase(std::remove(allowed.begin(), allowed.end(), ev.piece_index),
+                              allowed.end());
+            }
+            break;
+        case Peer::EventType::AllowedFast:
+            {
+                auto& allowed = state.allowed_fast_in;
+                if (ev.piece_index < piece_count(torrent_) &&
+                    allowed.size() < kMaxAllowedFastIn &&
+                    std::find(allowed.begin(), allowed.end(), ev.piece_index) == allowed.end()) {
+                    allowed.push_back(ev.piece_index);
+                }
+            }
+            break;
+        case Peer::EventType::Suggest:
+            if (ev.piece_index < piece_count(torrent_) &&
+                !piece_manager_.have_piece(ev.piece_index)) {
+                auto& suggested = state.suggested;
+                suggested.erase(std::remove(suggested.begin(), suggested.end(), ev.piece_index),
+                                suggested.end());
+                suggested.push_back(ev.piece_index);
+                if (suggested.size() > kMaxSuggestedPieces) {
+                    suggested.erase(suggested.begin());
+                }
+            }
+            break;
+        case Peer::EventType::Metadata:
+            // BEP 9: serve our info dictionary to peers that joined by magnet
+            if (ev.begin == Peer::kMetadataRequest) {
+                const std::string& info = torrent_.info_bencoded;
+                std::size_t offset = std::size_t{ev.piece_index} * Peer::kMetadataPieceSize;
+                if (offset < info.size()) {
+                    std::size_t len = std::min(Peer::kMetadataPieceSize, info.size() - offset);
+                    peer.send_metadata_data(ev.piece_index, info.size(),
+                                            std::string_view(info).substr(offset, len));
+                } else {
+                    peer.send_metadata_reject(ev.piece_index);
+                }
+            }
             break;
         default:
             break;
         }
     }
 
-    maybe_request(peer, state);
+    if (!peer.is_closed() && is_redundant_peer(state)) {
+        logger_.info("dropping peer " + peer.remote().ip + ": no data to exchange");
+        peer.disconnect();
+    }
+    if (!peer.is_closed()) {
+        maybe_request(peer, state);
+    }
 
     if (peer.is_closed()) {
         std::string msg = "peer " + peer.remote().ip + " closed connection";
         logger_.info(msg);
-        peers_.erase(peer.fd());
+        remember_peer(peer, state);
+        erase_peer_state(fd);
     }
 }
 
 void Session::handle_piece_complete(uint32_t piece_index) {
+    mark_hot(piece_index);
     event_loop_.for_each_peer([piece_index](Peer& p) { p.send_have(piece_index); });
+    pieces_done_.store(piece_manager_.pieces_have(), std::memory_order_relaxed);
+    Alert alert{};
+    alert.type = AlertType::PieceFinished;
+    alert.index = piece_index;
+    post_alert(alert);
+    update_completed_files(true);
+    if (piece_manager_.complete() && !complete_.exchange(true, std::memory_order_acq_rel)) {
+        logger_.info("torrent download complete");
+        // peers that stay learn it now, not only from our bitfield count
+        event_loop_.for_each_peer([](Peer& p) { p.send_upload_only(); });
+        redundant_check_pending_ = true;
+        Alert finished{};
+        finished.type = AlertType::TorrentFinished;
+        post_alert(finished);
+    }
+}
+
+// Seed-to-seed links and upload-only peers holding nothing we need only
+// occupy a connection slot.
+bool Session::is_redundant_peer(const PeerState& state) const {
+    if (!state.handshake_received) {
+        return false;
+    }
+    if (piece_manager_.complete()) {
+        return state.upload_only || bitfield_complete(state.bitfield, piece_count(torrent_));
+    }
+    return state.upload_only && state.bitfield_received && !peer_has_interesting(state);
+}
+
+void Session::maybe_drop_redundant_peers() {
+    if (!redundant_check_pending_) {
+        return;
+    }
+    redundant_check_pending_ = false;
+    std::vector<int> drop_fds;
+    for (const auto& kv : peers_) {
+        if (is_redundant_peer(kv.second)) {
+            drop_fds.push_back(kv.first);
+        }
+    }
+    for (int fd : drop_fds) {
+        if (Peer* peer = event_loop_.peer_by_fd(fd)) {
+            remember_peer(*peer, peers_[fd]);
+            logger_.info("dropping peer " + peer->remote().ip + ": both sides are seeds");
+            peer->disconnect();
+        }
+        event_loop_.remove_peer(fd);
+        erase_peer_state(fd);
+    }
 }
 
 void Session::maybe_request(Peer& peer, PeerState& state) {
@@ -544,24 +1382,512 @@ void Session::maybe_request(Peer& peer, PeerState& state) {
         logger_.info(msg);
     }
 
-    if (state.choked) {
+    // choked, only allowed-fast pieces may be asked for (BEP 6)
+    if (state.choked && (!peer.supports_fast() || state.allowed_fast_in.empty())) {
+        return;
+    }
+    // replies would land in buffers we are already short on; over the total
+    // budget the picker still fills pieces that are already open
+    if (memory_governor().reading_paused(true)) {
         return;
     }
 
     constexpr uint32_t kMaxInflightRequestsPerPeer = 32;
+    // nearby peers get a deeper pipeline so they take the bulk of the blocks
+    uint32_t max_inflight = state.locality >= Locality::SameRack
+        ? 2 * kMaxInflightRequestsPerPeer
+        : kMaxInflightRequestsPerPeer;
+    // never more than it said it queues (BEP 10 reqq); past that a peer may
+    // drop requests without a word
+    if (peer.remote_request_queue() != 0) {
+        max_inflight = std::min(max_inflight, peer.remote_request_queue());
+    }
 
-    while (state.inflight_requests < kMaxInflightRequestsPerPeer) {
-        auto req = piece_manager_.next_request_for_peer_rarest(state.bitfield);
+    // suggested pieces go first while unchoked
+    std::vector<uint8_t> preferred =
+        piece_mask(state, state.choked ? state.allowed_fast_in : state.suggested);
+    while (state.outstanding.size() < max_inflight) {
+        std::optional<PieceManager::Request> req;
+        if (!preferred.empty()) {
+            req = piece_manager_.next_request_for_peer_rarest(preferred);
+            if (!req) {
+                preferred.clear();
+            }
+        }
+        if (!req && !state.choked) {
+            req = piece_manager_.next_request_for_peer_rarest(state.bitfield);
+        }
         if (!req) {
             break;
         }
+        // the caps are charged for requests that go out, at their real size
+        if (!take_bandwidth(download_share_.get(), state, req->length)) {
+            piece_manager_.release_request(*req);
+            requests_starved_ = true;
+            break;
+        }
         std::string msg = "sending request to peer " + peer.remote().ip +
             " piece=" + std::to_string(req->piece_index) +
             " begin=" + std::to_string(req->begin) +
             " len=" + std::to_string(req->length);
         logger_.info(msg);
         peer.send_request(req->piece_index, req->begin, req->length);
-        ++state.inflight_requests;
+        state.outstanding.push_back(*req);
+    }
+}
+
+// Requests are otherwise only sent in reply to a peer's messages, and a peer
+// waiting for our requests sends none.
+void Session::retry_starved_requests() {
+    if (!requests_starved_) {
+        return;
+    }
+    requests_starved_ = false;
+    for (auto& [fd, state] : peers_) {
+        Peer* peer = event_loop_.peer_by_fd(fd);
+        if (peer && !peer->is_closed() && state.handshake_received) {
+            maybe_request(*peer, state);
+        }
+    }
+}
+
+// The peer's bitfield restricted to the listed pieces we still need; empty
+// when none qualify.
+std::vector<uint8_t> Session::piece_mask(const PeerState& state,
+                                         const std::vector<uint32_t>& pieces) const {
+    std::vector<uint8_t> mask;
+    for (uint32_t idx : pieces) {
+        if (piece_manager_.have_piece(idx) || !bitfield_test(state.bitfield, idx)) {
+            continue;
+        }
+        if (mask.empty()) {
+            mask = make_bitfield(piece_count(torrent_));
+        }
+        bitfield_set(mask, idx);
+    }
+    return mask;
+}
+
+// Tells each peer whether we still await blocks from it, for the governor.
+void Session::mark_awaiting_blocks() {
+    for (const auto& [fd, state] : peers_) {
+        if (Peer* peer = event_loop_.peer_by_fd(fd)) {
+            peer->set_awaiting_blocks(!state.outstanding.empty());
+        }
+    }
+}
+
+// Hands every unanswered request back to the picker.
+void Session::release_outstanding(PeerState& state) {
+    for (const auto& req : state.outstanding) {
+        piece_manager_.release_request(req);
+    }
+    state.outstanding.clear();
+}
+
+// BEP 6 peers get the one-byte forms when we hold everything or nothing.
+void Session::send_have_state(Peer& peer) {
+    if (peer.supports_fast() && piece_manager_.complete()) {
+        peer.send_have_all();
+    } else if (peer.supports_fast() && piece_manager_.pieces_have() == 0) {
+        peer.send_have_none();
+    } else {
+        peer.send_bitfield(piece_manager_.have_bitfield());
+    }
+}
+
+// Lets a newly connected peer fetch a few pieces from us while choked, so
+// it has something to trade before it wins an unchoke slot.
+void Session::grant_allowed_fast(Peer& peer, PeerState& state, bool announce) {
+    if (!peer.supports_fast() || !state.endpoint) {
+        return;
+    }
+    state.allowed_fast_out = allowed_fast_set(*state.endpoint, torrent_.info_hash,
+                                              static_cast<uint32_t>(piece_count(torrent_)),
+                                              kAllowedFastSetSize);
+    if (!announce) {
+        return;
+    }
+    for (uint32_t idx : state.allowed_fast_out) {
+        if (piece_manager_.have_piece(idx)) {
+            peer.send_allowed_fast(idx);
+        }
+    }
+}
+
+// BEP 6: choking a peer rejects its queued requests, except allowed-fast
+// ones, which it may still have served.
+void Session::reject_choked_uploads(Peer& peer, PeerState& state) {
+    if (!peer.supports_fast()) {
+        state.upload_queue.clear();
+        return;
+    }
+    const auto& allowed = state.allowed_fast_out;
+    std::deque<PieceManager::Request> kept;
+    for (const auto& req : state.upload_queue) {
+        if (std::find(allowed.begin(), allowed.end(), req.piece_index) != allowed.end()) {
+            kept.push_back(req);
+        } else {
+            peer.send_reject(req.piece_index, req.begin, req.length);
+        }
+    }
+    state.upload_queue = std::move(kept);
+}
+
+// Points a newly unchoked peer at pieces we touched last, which are still
+// in the page cache, instead of ones that would need a disk read.
+void Session::send_suggestions(Peer& peer, const PeerState& state) {
+    if (!peer.supports_fast() || super_seeding_active()) {
+        return;
+    }
+    std::size_t sent = 0;
+    for (auto it = hot_pieces_.rbegin();
+         it != hot_pieces_.rend() && sent < kSuggestionsPerUnchoke; ++it) {
+        if (!bitfield_test(state.bitfield, *it)) {
+            peer.send_suggest(*it);
+            ++sent;
+        }
+    }
+}
+
+void Session::mark_hot(uint32_t piece_index) {
+    auto it = std::find(hot_pieces_.begin(), hot_pieces_.end(), piece_index);
+    if (it != hot_pieces_.end()) {
+        hot_pieces_.erase(it);
+    }
+    hot_pieces_.push_back(piece_index);
+    if (hot_pieces_.size() > kMaxHotPieces) {
+        hot_pieces_.pop_front();
+    }
+}
+
+// Forgets a peer and the availability its bitfield contributed.
+void Session::erase_peer_state(int fd) {
+    auto it = peers_.find(fd);
+    if (it == peers_.end()) {
+        return;
+    }
+    release_outstanding(it->second);
+    if (it->second.in_upload_round) {
+        std::erase(upload_round_, fd);
+    }
+    const auto& bf = it->second.bitfield;
+    auto& counts = piece_manager_.sum_peer_bitfield_ct_;
+    bool changed = false;
+    for (uint32_t i = 0; i < counts.size(); ++i) {
+        if (bitfield_test(bf, i) && counts[i] > 0) {
+            --counts[i];
+            changed = true;
+        }
+    }
+    if (changed) {
+        piece_manager_.update_buckets();
+    }
+    if (it->second.endpoint) {
+        Alert alert{};
+        alert.type = AlertType::PeerDisconnected;
+        alert.peer = *it->second.endpoint;
+        post_alert(alert);
+    }
+    peers_.erase(it);
+}
+
+void Session::post_alert(Alert alert) {
+    if (!alerts_ || !alerts_->wants(alert.type)) {
+        return;
+    }
+    alert.info_hash = torrent_.info_hash;
+    alerts_->post(alert);
+}
+
+// Files whose pieces are all present; posts FileCompleted for new ones.
+void Session::update_completed_files(bool post) {
+    for (std::size_t i = 0; i < file_pieces_.size(); ++i) {
+        if (file_done_[i]) {
+            continue;
+        }
+        auto [first, last] = file_pieces_[i];
+        bool done = true;
+        for (uint32_t p = first; p <= last && done; ++p) {
+            done = piece_manager_.have_piece(p);
+        }
+        if (!done) {
+            continue;
+        }
+        file_done_[i] = true;
+        if (post) {
+            Alert alert{};
+            alert.type = AlertType::FileCompleted;
+            alert.index = static_cast<uint32_t>(i);
+            post_alert(alert);
+        }
+    }
+}
+
+void Session::set_topology(std::shared_ptr<const Topology> topology,
+                           std::shared_ptr<SharedRateLimiter> cross_rack_limiter) {
+    topology_ = std::move(topology);
+    cross_rack_limiter_ = std::move(cross_rack_limiter);
+}
+
+Locality Session::classify(const PeerAddress& address) const {
+    if (!topology_) {
+        return Locality::Remote;
+    }
+    auto ep = Endpoint::from_address(address);
+    return ep ? topology_->classify(*ep) : Locality::Remote;
+}
+
+bool Session::is_cross_rack(const PeerState& state) const {
+    return topology_ && state.locality < Locality::SameRack;
+}
+
+bool Session::cross_rack_allowed(const PeerState& state, uint32_t length) {
+    return !cross_rack_limiter_ || !is_cross_rack(state) ||
+           cross_rack_limiter_->try_consume(length);
+}
+
+void Session::set_rate_shares(std::shared_ptr<SharedRateLimiter> download,
+                              std::shared_ptr<SharedRateLimiter> upload) {
+    download_share_ = std::move(download);
+    upload_share_ = std::move(upload);
+}
+
+// Charges a block to this torrent's share and, for peers outside our rack,
+// to the cross-rack cap; either both take it or neither does.
+bool Session::take_bandwidth(SharedRateLimiter* share, const PeerState& state,
+                             uint32_t length) {
+    if (share && !share->try_consume(length)) {
+        return false;
+    }
+    if (!cross_rack_allowed(state, length)) {
+        if (share) {
+            share->refund(length);
+        }
+        return false;
+    }
+    return true;
+}
+
+void Session::refund_bandwidth(SharedRateLimiter* share, const PeerState& state,
+                               uint32_t length) {
+    if (share) {
+        share->refund(length);
+    }
+    if (cross_rack_limiter_ && is_cross_rack(state)) {
+        cross_rack_limiter_->refund(length);
+    }
+}
+
+bool Session::serve_request(Peer& peer, const PieceManager::Request& req) {
+    std::optional<std::vector<uint8_t>> block;
+    if (piece_manager_.have_piece(req.piece_index) &&
+        static_cast<uint64_t>(req.begin) + req.length <= piece_length(req.piece_index)) {
+        block = storage_.read_block(req.piece_index, req.begin, req.length);
+    }
+    if (!block) {
+        // BEP 6: every request is answered, with data or a reject
+        if (peer.supports_fast()) {
+            peer.send_reject(req.piece_index, req.begin, req.length);
+        }
+        return false;
+    }
+    mark_hot(req.piece_index);
+    char buf[128];
+    std::snprintf(buf,
+                  sizeof(buf),
+                  "fulfilling request piece=%u begin=%u len=%u",
+                  req.piece_index,
+                  req.begin,
+                  req.length);
+    logger_.info(std::string_view(buf, std::strlen(buf)));
+    peer.send_piece(req.piece_index, req.begin, *block);
+    bytes_uploaded_.fetch_add(block->size(), std::memory_order_relaxed);
+    return true;
+}
+
+// Deficit round robin over peers with queued requests: each turn a peer
+// earns kUploadQuantum bytes of credit and is served while its oldest
+// request fits, so large blocks buy no extra share and one peer's backlog
+// holds the others up by a quantum at most. A peer whose socket is full or
+// that is over the cross-rack cap yields its turn and keeps its place.
+void Session::serve_upload_queue() {
+    std::size_t budget = kMaxUploadBytesPerPass;
+    // turns in a row that ended blocked; a full round of them ends the pass
+    std::size_t blocked_turns = 0;
+    while (!upload_round_.empty() && budget > 0 && blocked_turns < upload_round_.size()) {
+        int fd = upload_round_.front();
+        upload_round_.pop_front();
+        auto it = peers_.find(fd);
+        if (it == peers_.end()) {
+            continue;
+        }
+        PeerState& state = it->second;
+        Peer* peer = event_loop_.peer_by_fd(fd);
+        // a choked BEP 6 peer only has allowed-fast requests left queued
+        if (!peer || (state.am_choking && !peer->supports_fast())) {
+            state.upload_queue.clear();
+        }
+        if (state.upload_queue.empty()) {
+            state.in_upload_round = false;
+            state.upload_deficit = 0;
+            continue;
+        }
+        // never more banked than the largest block a peer may ask for
+        state.upload_deficit = std::min<uint32_t>(state.upload_deficit + kUploadQuantum,
+                                                  Peer::kMaxBlockLength);
+        bool blocked = false;
+        while (!state.upload_queue.empty() &&
+               state.upload_queue.front().length <= state.upload_deficit) {
+            const PieceManager::Request req = state.upload_queue.front();
+            if (peer->queued_bytes() >= kMaxQueuedUploadBytes ||
+                !take_bandwidth(upload_share_.get(), state, req.length)) {
+                blocked = true;
+                break;
+            }
+            state.upload_queue.pop_front();
+            state.upload_deficit -= req.length;
+            budget -= std::min<std::size_t>(budget, req.length);
+            if (!serve_request(*peer, req)) {
+                refund_bandwidth(upload_share_.get(), state, req.length);
+            }
+        }
+        if (state.upload_queue.empty()) {
+            state.in_upload_round = false;
+            state.upload_deficit = 0;
+        } else {
+            upload_round_.push_back(fd);
+        }
+        blocked_turns = blocked ? blocked_turns + 1 : 0;
+    }
+}
+
+std::size_t Session::unchoked_remote_count() const {
+    std::size_t n = 0;
+    for (const auto& kv : peers_) {
+        if (!kv.second.am_choking && kv.second.peer_interested && is_cross_rack(kv.second)) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+// Every 10 s: nearby peers are always unchoked; the rest compete for
+// kUnchokeSlots by what they gave us, plus one rotating optimistic slot.
+void Session::maybe_rechoke() {
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    if (now - last_rechoke_ < seconds(10)) {
+        return;
+    }
+    last_rechoke_ = now;
+
+    std::vector<std::pair<int, PeerState*>> remote;
+    std::vector<std::pair<int, PeerState*>> unchoke;
+    for (auto& [fd, state] : peers_) {
+        if (!state.handshake_received || !state.peer_interested) {
+            continue;
+        }
+        if (is_cross_rack(state)) {
+            remote.emplace_back(fd, &state);
+        } else {
+            unchoke.emplace_back(fd, &state);
+        }
+    }
+    std::stable_sort(remote.begin(), remote.end(), [](const auto& a, const auto& b) {
+        if (a.second->locality != b.second->locality) {
+            return a.second->locality > b.second->locality;
+        }
+        return a.second->bytes_from_peer > b.second->bytes_from_peer;
+    });
+    std::size_t regular = std::min(remote.size(), kUnchokeSlots);
+    unchoke.insert(unchoke.end(), remote.begin(), remote.begin() + regular);
+    std::vector<std::pair<int, PeerState*>> choke(remote.begin() + regular, remote.end());
+    if (!choke.empty()) {
+        std::size_t pick = optimistic_round_++ % choke.size();
+        unchoke.push_back(choke[pick]);
+        choke.erase(choke.begin() + static_cast<std::ptrdiff_t>(pick));
+    }
+
+    for (auto& [fd, state] : unchoke) {
+        Peer* peer = event_loop_.peer_by_fd(fd);
+        if (peer && state->am_choking) {
+            peer->send_unchoke();
+            state->am_choking = false;
+            send_suggestions(*peer, *state);
+        }
+    }
+    for (auto& [fd, state] : choke) {
+        Peer* peer = event_loop_.peer_by_fd(fd);
+        if (peer && !state->am_choking) {
+            peer->send_choke();
+            state->am_choking = true;
+            reject_choked_uploads(*peer, *state);
+        }
+    }
+}
+
+bool Session::super_seeding_active() const {
+    return super_seeding_ && piece_manager_.complete();
+}
+
+// Picks the piece the swarm has seen least of that this peer still lacks.
+std::optional<uint32_t> Session::pick_superseed_piece(const PeerState& state) const {
+    std::optional<uint32_t> best;
+    uint64_t best_score = std::numeric_limits<uint64_t>::max();
+    std::size_t total = piece_count(torrent_);
+    for (uint32_t i = 0; i < total; ++i) {
+        if (bitfield_test(state.bitfield, i) || state.superseed_piece == i) {
+            continue;
+        }
+        uint64_t score = static_cast<uint64_t>(superseed_reveal_ct_[i]) +
+            piece_manager_.sum_peer_bitfield_ct_[i];
+        if (score < best_score) {
+            best_score = score;
+            best = i;
+        }
+    }
+    return best;
+}
+
+void Session::superseed_reveal(Peer& peer, PeerState& state) {
+    auto next = pick_superseed_piece(state);
+    if (!next) {
+        return;
+    }
+    state.superseed_piece = *next;
+    ++superseed_reveal_ct_[*next];
+    peer.send_have(*next);
+    logger_.info("super-seed: revealing piece " + std::to_string(*next) + " to peer " +
+                 peer.remote().ip);
+}
+
+// A have for a piece we revealed to someone else means that peer passed it on,
+// so it has earned its next piece.
+void Session::superseed_on_have(Peer& from_peer, PeerState& from_state, uint32_t piece_index) {
+    for (auto& [fd, other] : peers_) {
+        if (fd == from_peer.fd() || other.superseed_piece != piece_index) {
+            continue;
+        }
+        if (Peer* p = event_loop_.peer_by_fd(fd)) {
+            superseed_reveal(*p, other);
+        }
+    }
+
+    if (from_state.superseed_piece != piece_index) {
+        return;
+    }
+    // nobody left who could receive it from this peer; do not stall it
+    bool others_need_it = false;
+    for (const auto& [fd, other] : peers_) {
+        if (fd != from_peer.fd() && other.handshake_received &&
+            !bitfield_test(other.bitfield, piece_index)) {
+            others_need_it = true;
+            break;
+        }
+    }
+    if (!others_need_it) {
+        superseed_reveal(from_peer, from_state);
     }
 }
 
@@ -591,9 +1917,9 @@ Session::PeerState& Session::ensure_peer_state(int fd) {
 }
 
 uint32_t Session::piece_length(uint32_t piece_index) const {
-    if (piece_index + 1 == torrent_.piece_hashes.size()) {
+    if (piece_index + 1 == piece_count(torrent_)) {
         int64_t full =
-            torrent_.piece_length * static_cast<int64_t>(torrent_.piece_hashes.size() - 1);
+            torrent_.piece_length * static_cast<int64_t>(piece_count(torrent_) - 1);
         return static_cast<uint32_t>(torrent_.total_length() - full);
     }
     return static_cast<uint32_t>(torrent_.piece_length);
@@ -612,6 +1938,15 @@ void Session::bitfield_set(std::vector<uint8_t>& bf, uint32_t idx) {
     bf[byte] |= static_cast<uint8_t>(1u << bit);
 }
 
+bool Session::bitfield_complete(const std::vector<uint8_t>& bf, std::size_t pieces) {
+    for (uint32_t i = 0; i < pieces; ++i) {
+        if (!bitfield_test(bf, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool Session::bitfield_test(const std::vector<uint8_t>& bf, uint32_t idx) {
     uint32_t byte = idx / 8;
     uint32_t bit = 7 - (idx % 8);
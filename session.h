@@ -2,21 +2,33 @@
 
 #include "peer_event_loop.h"
 #include "piece_manager.h"
+#include "alerts.h"
+#include "dht.h"
+#include "endpoint_set.h"
+#include "handoff.h"
+#include "include/mpsc.h"
+#include "ip_filter.h"
 #include "logger.h"
+#include "lsd.h"
+#include "memory_governor.h"
+#include "peer_cache.h"
+#include "rate_limiter.h"
 #include "storage.h"
+#include "topology.h"
 #include "torrent_file.h"
 #include "tracker_client.h"
+#include "web_seed.h"
 
 #include <cstdint>
 #include <filesystem>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 #include <deque>
+#include <memory>
 #include <chrono>
 #include <thread>
-#include <mutex>
+#include <optional>
 #include <atomic>
 
 class Session {
@@ -30,50 +42,202 @@ public:
 
     void start();
     bool start_from_tracker();
+    bool start_from_dht();
+    bool start_from_lsd();
     bool start_from_web_seeds();
 
     void add_peer(const PeerAddress& address);
 
+    // Hashes whatever is already on disk and marks matching pieces as owned.
+    std::size_t recheck_existing_data();
+    // BEP 16: while we are a full seed, reveal pieces one at a time per peer.
+    void set_super_seeding(bool enabled) { super_seeding_ = enabled; }
+    // Takes the shared filter's current table now, before any dial, and
+    // follows its reloads from the loop.
+    void set_ip_filter(std::shared_ptr<SharedIpFilter> filter);
+    // Prefers peers close to us when dialling, unchoking and requesting, and
+    // caps traffic with peers outside our rack through a limiter shared by
+    // every torrent (null = no cap).
+    void set_topology(std::shared_ptr<const Topology> topology,
+                      std::shared_ptr<SharedRateLimiter> cross_rack_limiter);
+    // This torrent's share of the process-wide download and upload rates;
+    // the queue retunes them as torrents start and stop (null = no cap).
+    void set_rate_shares(std::shared_ptr<SharedRateLimiter> download,
+                         std::shared_ptr<SharedRateLimiter> upload);
+    // Posts typed alerts for this torrent; the queue must outlive the session
+    // and be set before start().
+    void set_alert_queue(AlertQueue* alerts) { alerts_ = alerts; }
+    // Finds and announces peers through the shared DHT node as well as the
+    // trackers (never for private torrents); the node must outlive the session.
+    void set_dht(Dht* dht) { dht_ = dht; }
+    // Finds peers on the local network through multicast announces (never
+    // for private torrents); lsd must outlive the session.
+    void set_lsd(Lsd* lsd) { lsd_ = lsd; }
+
+    // Hot restart, with the loop stopped: export moves the listener and
+    // every established peer into out (fds appended to fds), adopt resumes
+    // them in a fresh session for the same torrent.
+    void export_handoff(HandoffTorrent& out, std::vector<int>& fds);
+    void adopt_handoff(HandoffTorrent& in);
+
     void run_once(int timeout_ms);
     void run(int timeout_ms);
     void stop();
 
     std::size_t peer_count() const;
 
+    // Stops the loop and trackers and drops every connection; start() resumes.
+    void pause();
+
+    // Progress counters, safe to read from other threads.
+    bool is_complete() const { return complete_.load(std::memory_order_acquire); }
+    std::uint64_t bytes_downloaded() const {
+        return bytes_downloaded_.load(std::memory_order_relaxed);
+    }
+    std::uint64_t bytes_uploaded() const { return bytes_uploaded_.load(std::memory_order_relaxed); }
+    // seeds reported by the last tracker reply, -1 if unknown
+    int64_t swarm_seeds() const { return swarm_seeds_.load(std::memory_order_relaxed); }
+    std::size_t pieces_done() const { return pieces_done_.load(std::memory_order_relaxed); }
+    std::size_t connected_peers() const { return connected_peers_.load(std::memory_order_relaxed); }
+    const TorrentFile& torrent() const { return torrent_; }
+
 private:
+    // a dial candidate, kept binary until it is dialled
+    struct PeerCandidate {
+        Endpoint endpoint;
+        // seed or upload-only, and same LAN/rack, as in PeerAddress
+        bool seed{false};
+        bool local{false};
+    };
+
     struct PeerState {
         std::string remote_id;
         std::vector<uint8_t> bitfield;
         bool choked{true};
         bool interested{false};
-        uint32_t inflight_requests{0};
+        // requests we sent and have not seen answered, oldest first
+        std::deque<PieceManager::Request> outstanding;
+        std::uint64_t bytes_from_peer{0};
         bool handshake_received{false};
+        bool bitfield_received{false};
+        bool upload_only{false};
+        bool peer_interested{false};
+        bool am_choking{true};
+        Locality locality{Locality::Remote};
+        std::optional<Endpoint> endpoint;
+        // where it accepts connections: endpoint for peers we dialled, the
+        // p of its extended handshake for those that dialled us
+        std::optional<Endpoint> listen_endpoint;
+        // requests waiting for the upload scheduler, oldest first, and the
+        // bytes of deficit-round-robin credit it has banked
+        std::deque<PieceManager::Request> upload_queue;
+        uint32_t upload_deficit{0};
+        bool in_upload_round{false};
+        std::optional<uint32_t> superseed_piece;
         std::chrono::steady_clock::time_point connected_at{};
+        // BEP 6: pieces we may request while it chokes us, pieces it
+        // suggested, and pieces it may request while we choke it
+        std::vector<uint32_t> allowed_fast_in;
+        std::vector<uint32_t> suggested;
+        std::vector<uint32_t> allowed_fast_out;
+        // BEP 11: the entries and flags it has been told about, sorted, and
+        // when it last sent us a list
+        std::vector<std::pair<Endpoint, uint8_t>> pex_sent;
+        std::chrono::steady_clock::time_point last_pex_in{};
+        // BEP 52: when we last rebuilt a piece's leaf hashes from disk for it
+        std::chrono::steady_clock::time_point last_leaf_rebuild{};
     };
 
     void handle_peer_events(Peer& peer, std::vector<Peer::Event>&& events);
     void handle_piece_complete(uint32_t piece_index);
     void maybe_request(Peer& peer, PeerState& state);
+    void retry_starved_requests();
+    std::vector<uint8_t> piece_mask(const PeerState& state,
+                                    const std::vector<uint32_t>& pieces) const;
+    void release_outstanding(PeerState& state);
+    // Lets the event loop keep reading from peers that owe us blocks.
+    void mark_awaiting_blocks();
+    void send_have_state(Peer& peer);
+    void grant_allowed_fast(Peer& peer, PeerState& state, bool announce);
+    void reject_choked_uploads(Peer& peer, PeerState& state);
+    void send_suggestions(Peer& peer, const PeerState& state);
+    void mark_hot(uint32_t piece_index);
     bool peer_has_interesting(const PeerState& state) const;
+    bool is_redundant_peer(const PeerState& state) const;
+    void maybe_drop_redundant_peers();
     PeerState& ensure_peer_state(int fd);
     void connect_peer_now(const PeerAddress& address);
     void maybe_connect_pending_peers();
     void maybe_log_stats();
     void maybe_drop_handshake_timeouts();
-    void handle_pex(Peer& from_peer, const std::vector<uint8_t>& payload);
+    std::size_t enqueue_cached_peers();
+    void remember_peer(const Peer& peer, const PeerState& state);
+    void save_peer_cache();
+    void maybe_save_peer_cache();
+    void maybe_age_recently_tried();
+    void refresh_ip_filter();
+    bool is_blocked(const PeerAddress& address) const;
+    Locality classify(const PeerAddress& address) const;
+    bool is_cross_rack(const PeerState& state) const;
+    bool cross_rack_allowed(const PeerState& state, uint32_t length);
+    bool take_bandwidth(SharedRateLimiter* share, const PeerState& state, uint32_t length);
+    void refund_bandwidth(SharedRateLimiter* share, const PeerState& state, uint32_t length);
+    // False when the block could not be sent and was rejected, if at all.
+    bool serve_request(Peer& peer, const PieceManager::Request& req);
+    void serve_upload_queue();
+    void erase_peer_state(int fd);
+    void install_listen_socket(int listen_fd);
+    void post_alert(Alert alert);
+    void update_completed_files(bool post);
+    std::size_t unchoked_remote_count() const;
+    void maybe_rechoke();
+    bool super_seeding_active() const;
+    std::optional<uint32_t> pick_superseed_piece(const PeerState& state) const;
+    void superseed_reveal(Peer& peer, PeerState& state);
+    void superseed_on_have(Peer& from_peer, PeerState& from_state, uint32_t piece_index);
+    void note_listen_endpoint(const Peer& peer, PeerState& state);
+    void note_reported_ip(const Peer& peer);
+    void handle_pex(PeerState& from_state, const std::vector<uint8_t>& payload);
+    void maybe_broadcast_pex();
+    void request_block_hashes(uint32_t piece_index);
+    void maybe_expire_block_hash_requests();
+    void handle_hashes(Peer& peer, const Peer::Event& ev);
+    void handle_hash_reject(Peer& peer, const Peer::Event& ev);
+    void serve_hash_request(Peer& peer, PeerState& state, const Peer::Event& ev);
     uint32_t piece_length(uint32_t piece_index) const;
-    bool try_download_from_web_seed(const std::string& base_url);
-    std::string build_web_seed_url(const std::string& base) const;
+    void maybe_feed_web_seeds();
+    void handle_web_seed_result(WebSeed& seed, WebSeed::Result&& result);
+    void release_web_seed_pieces();
     std::vector<std::string> collect_tracker_urls() const;
     static bool is_http_tracker(const std::string& url);
     static bool is_udp_tracker(const std::string& url);
     void tracker_worker(std::vector<std::string> tracker_urls);
     bool enqueue_peer_candidate(const PeerAddress& address);
+    bool enqueue_peer_candidate(const Endpoint& endpoint, bool seed = false, bool local = false);
+    void post_peer_candidate(const PeerAddress& address);
+    void post_peer_candidate(const Endpoint& endpoint);
+    void drain_posted_candidates();
     void stop_tracker_thread();
 
+    static constexpr std::size_t kUnchokeSlots = 8;
+    static constexpr std::size_t kMaxUploadQueue = 256;
+    static constexpr std::size_t kMaxPendingPeers = 4096;
+    static constexpr std::size_t kMaxDeferredPeers = 4096;
+    static constexpr std::size_t kMaxPendingHostnames = 64;
+    // credit a peer earns per scheduler turn, and disk reads per loop pass
+    static constexpr uint32_t kUploadQuantum = 32 * 1024;
+    static constexpr std::size_t kMaxUploadBytesPerPass = 4 * 1024 * 1024;
+    static constexpr std::size_t kMaxQueuedUploadBytes = 1024 * 1024;
+    static constexpr std::size_t kAllowedFastSetSize = 10;
+    static constexpr std::size_t kMaxAllowedFastIn = 32;
+    static constexpr std::size_t kMaxSuggestedPieces = 16;
+    static constexpr std::size_t kMaxHotPieces = 8;
+    static constexpr std::size_t kSuggestionsPerUnchoke = 4;
+
     static std::vector<uint8_t> make_bitfield(std::size_t pieces);
     static void bitfield_set(std::vector<uint8_t>& bf, uint32_t idx);
     static bool bitfield_test(const std::vector<uint8_t>& bf, uint32_t idx);
+    static bool bitfield_complete(const std::vector<uint8_t>& bf, std::size_t pieces);
 
 
     TorrentFile torrent_;
@@ -84,15 +248,80 @@ private:
     PieceManager piece_manager_;
     PeerEventLoop event_loop_;
     Storage storage_;
+    PeerCache peer_cache_;
+    bool peer_cache_loaded_{false};
+    std::chrono::steady_clock::time_point last_peer_cache_save_{};
     std::unordered_map<int, PeerState> peers_;
-    std::deque<PeerAddress> pending_peers_;
-    std::unordered_set<std::string> known_endpoints_;
-    std::mutex pending_mutex_;
+    // peers with queued requests, in upload round-robin order
+    std::deque<int> upload_round_;
+    // owned by the loop thread; other threads hand candidates over through
+    // posted_candidates_ (tracker replies: posted_endpoints_) and wake the loop
+    std::deque<PeerCandidate> pending_peers_;
+    // hostnames from non-compact tracker replies, which have no endpoint
+    // until they are resolved at dial time
+    std::deque<PeerAddress> pending_hostnames_;
+    EndpointSet known_endpoints_{1u << 16};
+    CountingBloomFilter recently_tried_{1u << 16};
+    // candidates the filter says were tried lately, which may be false
+    // positives; they go back to pending_peers_ on the next aging round
+    std::deque<PeerCandidate> deferred_peers_;
+    std::chrono::steady_clock::time_point last_tried_aging_{};
+    MpscQueue<PeerAddress, 4096> posted_candidates_;
+    MpscQueue<Endpoint, 4096> posted_endpoints_;
+    std::atomic<std::uint64_t> posted_candidates_dropped_{0};
+    std::shared_ptr<SharedIpFilter> shared_ip_filter_;
+    uint64_t ip_filter_generation_{0};
+    std::shared_ptr<const IpFilter> ip_filter_;
+    std::uint64_t blocked_candidates_{0};
+    AlertQueue* alerts_{nullptr};
+    Dht* dht_{nullptr};
+    Lsd* lsd_{nullptr};
+    // our address as peers report it (yourip), with our listen port
+    std::optional<Endpoint> external_endpoint_;
+    // yourip answers not yet agreed on, each with the distinct peer
+    // addresses that gave it
+    std::vector<std::pair<Endpoint, std::vector<IpBytes>>> reported_ips_;
+    // BEP 19 url-list entries, each counted as a seed in piece availability
+    std::vector<std::unique_ptr<WebSeed>> web_seeds_;
+    // first and last piece of each file, and whether it is complete
+    std::vector<std::pair<uint32_t, uint32_t>> file_pieces_;
+    std::vector<bool> file_done_;
+    std::shared_ptr<const Topology> topology_;
+    std::shared_ptr<SharedRateLimiter> cross_rack_limiter_;
+    std::shared_ptr<SharedRateLimiter> download_share_;
+    std::shared_ptr<SharedRateLimiter> upload_share_;
+    // a rate cap held requests back; retried on the next loop pass
+    bool requests_starved_{false};
+    std::chrono::steady_clock::time_point last_rechoke_{};
+    std::size_t optimistic_round_{0};
     std::thread tracker_thread_;
     std::atomic<bool> tracker_stop_{false};
     std::atomic<bool> running_{true};
     std::chrono::steady_clock::time_point last_stats_log_{};
     std::chrono::steady_clock::time_point last_pex_broadcast_{};
     std::uint64_t pex_peers_discovered_{0};
+    // BEP 52: v2 pieces held after a failed hash check, keyed by piece,
+    // with the peer currently asked for their leaf hashes and those tried
+    struct BlockHashRequest {
+        int fd{-1};
+        std::chrono::steady_clock::time_point sent_at{};
+        std::vector<int> tried;
+    };
+    std::unordered_map<uint32_t, BlockHashRequest> block_hash_requests_;
+    // BEP 52: piece-layer trees we serve proofs from, built on first request
+    // and keyed by file index
+    std::unordered_map<std::size_t, MerkleTree> piece_layer_trees_;
+    std::atomic<std::uint64_t> bytes_uploaded_{0};
+    std::atomic<std::uint64_t> bytes_downloaded_{0};
+    std::atomic<int64_t> swarm_seeds_{-1};
+    std::atomic<bool> complete_{false};
+    std::atomic<std::size_t> pieces_done_{0};
+    std::atomic<std::size_t> connected_peers_{0};
+    bool super_seeding_{false};
+    bool redundant_check_pending_{false};
+    std::vector<uint32_t> superseed_reveal_ct_;
+    // pieces written or served most recently, newest last; still in the
+    // page cache, so they are what we suggest (BEP 6)
+    std::deque<uint32_t> hot_pieces_;
     AsyncLogger logger_;
 };
@@ -55,6 +55,11 @@ bool Storage::write_piece(uint32_t piece_index, const std::vector<uint8_t>& data
         if (written + span.length > data.size()) {
             return false;
         }
+        if (span.fd < 0) {
+            // padding; verified as part of the piece, never stored
+            written += span.length;
+            continue;
+        }
         ssize_t n = ::pwrite(span.fd,
                              data.data() + static_cast<std::ptrdiff_t>(written),
                              span.length,
@@ -80,13 +85,14 @@ std::optional<std::vector<uint8_t>> Storage::read_block(uint32_t piece_index,
 
     uint32_t piece_len = static_cast<uint32_t>(torrent_.piece_length);
 
-    if (piece_index + 1 == torrent_.piece_hashes.size()) {
+    if (piece_index + 1 == torrent_.piece_count()) {
         int64_t full =
-            torrent_.piece_length * static_cast<int64_t>(torrent_.piece_hashes.size() - 1);
+            torrent_.piece_length * static_cast<int64_t>(torrent_.piece_count() - 1);
         piece_len = static_cast<uint32_t>(torrent_.total_length() - full);
     }
 
-    if (begin + length > piece_len) {
+    // checked in 64 bits: begin + length wraps for begins near 4 GiB
+    if (static_cast<uint64_t>(begin) + length > piece_len) {
         return std::nullopt;
     }
 
@@ -94,6 +100,11 @@ std::optional<std::vector<uint8_t>> Storage::read_block(uint32_t piece_index,
     std::size_t filled = 0;
     auto spans = spans_for(piece_index, begin, length);
     for (const auto& span : spans) {
+        if (span.fd < 0) {
+            // padding reads as the zeros it stands for
+            filled += span.length;
+            continue;
+        }
         ssize_t n = ::pread(span.fd,
                             out.data() + static_cast<std::ptrdiff_t>(filled),
                             span.length,
@@ -160,6 +171,10 @@ void Storage::open_files(const std::filesystem::path& base_path) {
     files_.reserve(files_meta_.size());
     for (const auto& entry : files_meta_) {
         auto full_path = build_path(base_path, entry, torrent_.name);
+        if (entry.pad) {
+            files_.push_back(FileHandle{-1, full_path, entry.length});
+            continue;
+        }
         ensure_parent_exists(full_path);
         int fd = open_file_rw(full_path, entry.length);
         if (fd < 0) {
@@ -173,10 +188,11 @@ void Storage::build_piece_spans() {
     std::size_t file_idx = 0;
     int64_t file_offset = 0;
 
-    piece_spans_.resize(torrent_.piece_hashes.size());
+    std::size_t pieces = torrent_.piece_count();
+    piece_spans_.resize(pieces);
 
-    for (std::size_t piece = 0; piece < torrent_.piece_hashes.size(); ++piece) {
-        int64_t remaining = (piece + 1 == torrent_.piece_hashes.size())
+    for (std::size_t piece = 0; piece < pieces; ++piece) {
+        int64_t remaining = (piece + 1 == pieces)
                                 ? (torrent_.total_length() - static_cast<int64_t>(piece) *
                                                                torrent_.piece_length)
                                 : torrent_.piece_length;
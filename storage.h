@@ -9,6 +9,7 @@
 
 class Storage {
 public:
+    // fd is -1 over padding files
     struct Span {
         int fd{-1};
         std::size_t length{0};
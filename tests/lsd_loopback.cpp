@@ -0,0 +1,128 @@
+// Two Lsd instances on one host must find each other through multicast loopback.
+//
+//   lsd_loopback
+//
+// Both announce the same info hash on different listen ports and each must
+// hear the other's port. Two more instances whose IP filters block every
+// real source, one with "default block" alone and one with it after an
+// allow rule, must hear nobody. Exits 0 when all of that holds.
+
+#include "ip_filter.h"
+#include "lsd.h"
+
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr auto kTimeout = std::chrono::seconds(10);
+
+// Records whether a peer on the wanted port was handed over.
+struct Listener {
+    uint16_t want;
+    std::atomic<bool> heard{false};
+    std::atomic<bool> heard_anyone{false};
+
+    Lsd::PeersCallback callback() {
+        return [this](const std::vector<PeerAddress>& peers) {
+            for (const auto& peer : peers) {
+                heard_anyone.store(true);
+                if (peer.port == want) {
+                    heard.store(true);
+                }
+            }
+        };
+    }
+};
+
+} // namespace
+
+int main() {
+    auto dir = std::filesystem::temp_directory_path() /
+               ("dj-lsd-loopback-" + std::to_string(::getpid()));
+    std::filesystem::create_directories(dir);
+    auto filter_path = dir / "block-all.txt";
+    std::ofstream(filter_path) << "default block\n";
+    auto filter = std::make_shared<SharedIpFilter>(filter_path);
+    // 0.0.0.0/8 never sends, so this too must block every announce
+    auto allowlist_path = dir / "allowlist.txt";
+    std::ofstream(allowlist_path) << "allow 0.0.0.0/8\ndefault block\n";
+    auto allowlist = std::make_shared<SharedIpFilter>(allowlist_path);
+
+    bool default_holds = true;
+    for (const char* outside : {"11.0.0.1", "127.0.0.1", "255.255.255.255", "::1", "2001:db8::1"}) {
+        IpRange probe;
+        parse_ip_range(outside, probe);
+        if (!allowlist->current()->is_blocked(probe.first)) {
+            std::cout << "allowlist let through " << outside << "\n";
+            default_holds = false;
+        }
+    }
+
+    Lsd a;
+    Lsd b;
+    Lsd blocked;
+    Lsd allowlisted;
+    blocked.set_ip_filter(filter);
+    allowlisted.set_ip_filter(allowlist);
+    a.start();
+    b.start();
+    blocked.start();
+    allowlisted.start();
+    // announces go out when a torrent is added; let every socket join first
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    std::array<uint8_t, 20> info_hash{};
+    for (std::size_t i = 0; i < info_hash.size(); ++i) {
+        info_hash[i] = static_cast<uint8_t>(0x5A ^ i);
+    }
+    Listener hears_b{41002};
+    Listener hears_a{41001};
+    Listener hears_none{0};
+    Listener allowlist_hears_none{0};
+    blocked.add_torrent(info_hash, 41003, hears_none.callback());
+    allowlisted.add_torrent(info_hash, 41004, allowlist_hears_none.callback());
+    a.add_torrent(info_hash, 41001, hears_b.callback());
+    b.add_torrent(info_hash, 41002, hears_a.callback());
+
+    auto deadline = std::chrono::steady_clock::now() + kTimeout;
+    while (std::chrono::steady_clock::now() < deadline &&
+           !(hears_a.heard.load() && hears_b.heard.load())) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    // give a wrongly delivered announce to the filtered instances time to land
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    bool found = hears_a.heard.load() && hears_b.heard.load();
+    bool isolated = !hears_none.heard_anyone.load();
+    bool allowlist_isolated = !allowlist_hears_none.heard_anyone.load() && default_holds;
+    std::cout << "instances found each other: " << (found ? "yes" : "no") << "\n";
+    std::cout << "filtered instance heard nobody: " << (isolated ? "yes" : "no") << "\n";
+    std::cout << "allowlisted instance heard nobody: " << (allowlist_isolated ? "yes" : "no")
+              << "\n";
+
+    a.remove_torrent(info_hash);
+    b.remove_torrent(info_hash);
+    blocked.remove_torrent(info_hash);
+    allowlisted.remove_torrent(info_hash);
+    a.stop();
+    b.stop();
+    blocked.stop();
+    allowlisted.stop();
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    bool ok = found && isolated && allowlist_isolated;
+    std::cout << (ok ? "PASS" : "FAIL") << "\n";
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+#include "topology.h"
+
+#include <ifaddrs.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// Leading bits shared by both ends; larger means a narrower range.
+int common_prefix_bits(const IpRange& r) {
+    int bits = 0;
+    for (std::size_t i = 0; i < 16; ++i) {
+        uint8_t diff = r.first[i] ^ r.last[i];
+        if (diff == 0) {
+            bits += 8;
+            continue;
+        }
+        while ((diff & 0x80) == 0) {
+            ++bits;
+            diff = static_cast<uint8_t>(diff << 1);
+        }
+        break;
+    }
+    return bits;
+}
+
+bool contains(const IpRange& r, const IpBytes& addr) {
+    return r.first <= addr && addr <= r.last;
+}
+
+} // namespace
+
+Topology Topology::load(const std::filesystem::path& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Failed to open topology config: " + path.string());
+    }
+    Topology topo;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream iss(line);
+        std::string first;
+        if (!(iss >> first) || first.front() == '#') {
+            continue;
+        }
+        Label label;
+        if (!(iss >> label.site)) {
+            continue;
+        }
+        iss >> label.rack;
+        if (first == "self") {
+            topo.self_ = std::move(label);
+            topo.has_self_ = true;
+            continue;
+        }
+        Rule rule;
+        if (!parse_ip_range(first, rule.range)) {
+            continue;
+        }
+        rule.label = std::move(label);
+        rule.prefix_bits = common_prefix_bits(rule.range);
+        topo.rules_.push_back(std::move(rule));
+    }
+    std::stable_sort(topo.rules_.begin(), topo.rules_.end(),
+                     [](const Rule& a, const Rule& b) { return a.prefix_bits > b.prefix_bits; });
+    return topo;
+}
+
+void Topology::detect_local_subnets() {
+    ifaddrs* list = nullptr;
+    if (::getifaddrs(&list) != 0) {
+        return;
+    }
+    for (ifaddrs* ifa = list; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || !ifa->ifa_netmask) {
+            continue;
+        }
+        IpBytes addr{};
+        IpBytes mask{};
+        if (ifa->ifa_addr->sa_family == AF_INET) {
+            auto* a = reinterpret_cast<sockaddr_in*>(ifa->ifa_addr);
+            auto* m = reinterpret_cast<sockaddr_in*>(ifa->ifa_netmask);
+            addr = Endpoint::from_v4(reinterpret_cast<const uint8_t*>(&a->sin_addr), 0).addr;
+            mask.fill(0xFF);
+            std::memcpy(mask.data() + 12, &m->sin_addr, 4);
+        } else if (ifa->ifa_addr->sa_family == AF_INET6) {
+            auto* a = reinterpret_cast<sockaddr_in6*>(ifa->ifa_addr);
+            auto* m = reinterpret_cast<sockaddr_in6*>(ifa->ifa_netmask);
+            addr = Endpoint::from_v6(a->sin6_addr.s6_addr, 0).addr;
+            std::memcpy(mask.data(), m->sin6_addr.s6_addr, 16);
+        } else {
+            continue;
+        }
+        IpRange subnet;
+        for (std::size_t i = 0; i < 16; ++i) {
+            subnet.first[i] = addr[i] & mask[i];
+            subnet.last[i] = static_cast<uint8_t>(addr[i] | ~mask[i]);
+        }
+        local_subnets_.push_back(subnet);
+        if (!has_self_) {
+            if (const Rule* r = match(addr)) {
+                self_ = r->label;
+                has_self_ = true;
+            }
+        }
+    }
+    ::freeifaddrs(list);
+}
+
+Locality Topology::classify(const Endpoint& ep) const {
+    for (const auto& subnet : local_subnets_) {
+        if (contains(subnet, ep.addr)) {
+            return Locality::SameSubnet;
+        }
+    }
+    if (!has_self_) {
+        return Locality::Remote;
+    }
+    const Rule* r = match(ep.addr);
+    if (!r || r->label.site != self_.site) {
+        return Locality::Remote;
+    }
+    if (!self_.rack.empty() && r->label.rack == self_.rack) {
+        return Locality::SameRack;
+    }
+    return Locality::SameSite;
+}
+
+const Topology::Rule* Topology::match(const IpBytes& addr) const {
+    for (const auto& rule : rules_) {
+        if (contains(rule.range, addr)) {
+            return &rule;
+        }
+    }
+    return nullptr;
+}
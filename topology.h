@@ -0,0 +1,49 @@
+// Topology maps peer addresses to how close they sit to us in the network.
+#pragma once
+
+#include "endpoint.h"
+#include "ip_filter.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+enum class Locality : uint8_t { Remote = 0, SameSite = 1, SameRack = 2, SameSubnet = 3 };
+
+class Topology {
+public:
+    // One rule per line:
+    //   <range> <site> [rack]   addresses in range live in that site/rack
+    //   self <site> [rack]      where we live, when our own addresses are not
+    //                           covered by any rule
+    // Ranges use parse_ip_range syntax; the most specific rule wins.
+    static Topology load(const std::filesystem::path& path);
+
+    // Adds the subnets of every configured interface, loopback included.
+    void detect_local_subnets();
+
+    Locality classify(const Endpoint& ep) const;
+    bool is_local(const Endpoint& ep) const { return classify(ep) >= Locality::SameRack; }
+
+    std::size_t rule_count() const { return rules_.size(); }
+    std::size_t local_subnet_count() const { return local_subnets_.size(); }
+
+private:
+    struct Label {
+        std::string site;
+        std::string rack;
+    };
+    struct Rule {
+        IpRange range;
+        Label label;
+        int prefix_bits{0};
+    };
+
+    const Rule* match(const IpBytes& addr) const;
+
+    std::vector<Rule> rules_;
+    std::vector<IpRange> local_subnets_;
+    Label self_;
+    bool has_self_{false};
+};
@@ -30,92 +30,245 @@ namespace {
         return out;
     }
 
-    std::filesystem::path join_path(const bencode::List& components) {
+    std::filesystem::path join_path(bencode::View components) {
         std::filesystem::path p;
-        for (const auto& v : components) {
-            const auto& part = bencode::as_string(v);
-            p /= part;
+        for (size_t i = 0; i < components.size(); ++i) {
+            p /= components.at(i).as_string();
         }
         return p;
     }
+
+    // BEP 52 file tree: directories are dicts keyed by name, a file is the
+    // dict under the empty key. Keys come out sorted, which is file order.
+    void walk_file_tree(bencode::View dir, const std::filesystem::path& prefix,
+                        std::vector<TorrentFile::FileEntry>& out) {
+        for (size_t i = 0; i < dir.size(); ++i) {
+            std::string_view name = dir.key_at(i);
+            bencode::View node = dir.value_at(i);
+            if (name.empty()) {
+                TorrentFile::FileEntry f;
+                f.length = node.require("length").as_int();
+                f.path = prefix;
+                if (bencode::View root = node.find("pieces root")) {
+                    std::string_view bytes = root.as_string();
+                    if (bytes.size() != 32) {
+                        throw std::runtime_error("pieces root is not 32 bytes");
+                    }
+                    std::copy_n(bytes.begin(), 32, f.pieces_root.begin());
+                } else if (f.length > 0) {
+                    throw std::runtime_error("file tree entry without pieces root");
+                }
+                out.push_back(std::move(f));
+            } else {
+                walk_file_tree(node, prefix / name, out);
+            }
+        }
+    }
+
+    bool is_pad_entry(bencode::View f_dict, const std::filesystem::path& path) {
+        if (bencode::View attr = f_dict.find("attr")) {
+            if (attr.as_string().find('p') != std::string_view::npos) {
+                return true;
+            }
+        }
+        // BitComet's padding files predate the attr key
+        return path.filename().string().rfind("_____padding_file", 0) == 0;
+    }
 } // namespace
 
 TorrentFile TorrentFile::load(const std::filesystem::path& path) {
     std::string raw = read_file_to_string(path);
 
-    bencode::Parser parser(raw, "info");
-    bencode::Value root_v = parser.parse();
-    auto span = parser.tracked_span();
-    if (!span) {
+    // views into raw; the only copy made is the info dict the torrent keeps
+    bencode::Document doc(raw);
+    bencode::View root = doc.root();
+    bencode::View info = root.find("info");
+    if (!info) {
         throw std::runtime_error(
             "Failed to locate bencoded info dictionary for hashing");
     }
-    TorrentFile t;
-    t.info_bencoded = raw.substr(span->first, span->second);
+    TorrentFile t = from_info(std::string(info.raw()));
+
+    if (bencode::View announce = root.find("announce")) {
+        t.announce_url = std::string(announce.as_string());
+    }
+
+    if (bencode::View tiers = root.find("announce-list")) {
+        for (size_t i = 0; i < tiers.size(); ++i) {
+            bencode::View tier = tiers.at(i);
+            for (size_t j = 0; j < tier.size(); ++j) {
+                t.announce_list.emplace_back(tier.at(j).as_string());
+            }
+        }
+    }
 
-    const auto& root = bencode::as_dict(root_v);
-    if (const auto* announce = bencode::find_field(root, "announce")) {
-        t.announce_url = bencode::as_string(*announce);
+    // BEP 52: piece layers sit outside the info dict, keyed by pieces root
+    if (bencode::View layers = root.find("piece layers")) {
+        for (auto& file : t.files) {
+            if (file.pad || file.length <= t.piece_length) {
+                continue;
+            }
+            std::string_view key(reinterpret_cast<const char*>(file.pieces_root.data()), 32);
+            bencode::View layer_v = layers.find(key);
+            if (!layer_v) {
+                continue;
+            }
+            std::string_view blob = layer_v.as_string();
+            std::size_t count = static_cast<std::size_t>(
+                (file.length + t.piece_length - 1) / t.piece_length);
+            if (blob.size() != count * 32) {
+                throw std::runtime_error("piece layer has the wrong length for " +
+                                         file.path.string());
+            }
+            std::vector<Sha256Hash> layer(count);
+            for (std::size_t i = 0; i < count; ++i) {
+                std::copy_n(blob.begin() + static_cast<std::ptrdiff_t>(i * 32), 32,
+                            layer[i].begin());
+            }
+            unsigned piece_layer = merkle_log2(static_cast<std::size_t>(t.piece_length) /
+                                               kMerkleBlockSize);
+            MerkleTree tree(layer, count, piece_layer);
+            if (tree.root() != file.pieces_root) {
+                throw std::runtime_error("piece layer does not match pieces root for " +
+                                         file.path.string());
+            }
+            file.piece_layer = std::move(layer);
+        }
     }
 
-    if (const auto* list_field = bencode::find_field(root, "announce-list")) {
-        const auto& tiers = bencode::as_list(*list_field);
-        for (const auto& tier_v : tiers) {
-            const auto& tier_list = bencode::as_list(tier_v);
-            for (const auto& url_v : tier_list) {
-                t.announce_list.push_back(bencode::as_string(url_v));
+    if (!t.has_v1) {
+        // a v2-only torrent has nothing else to check pieces against
+        for (const auto& file : t.files) {
+            if (!file.pad && file.length > t.piece_length && file.piece_layer.empty()) {
+                throw std::runtime_error("v2 torrent is missing the piece layer for " +
+                                         file.path.string());
             }
         }
     }
 
-    if (const auto* url_list_field = bencode::find_field(root, "url-list")) {
-        if (std::holds_alternative<std::string>(url_list_field->data)) {
-            t.web_seeds.push_back(bencode::as_string(*url_list_field));
+    if (bencode::View url_list = root.find("url-list")) {
+        if (url_list.is_string()) {
+            t.web_seeds.emplace_back(url_list.as_string());
         }
         else {
-            const auto& seeds = bencode::as_list(*url_list_field);
-            for (const auto& seed_v : seeds) {
-                t.web_seeds.push_back(bencode::as_string(seed_v));
+            for (size_t i = 0; i < url_list.size(); ++i) {
+                t.web_seeds.emplace_back(url_list.at(i).as_string());
             }
         }
     }
 
-    const auto& info = bencode::as_dict(bencode::require_field(root, "info"));
-    t.name = bencode::as_string(bencode::require_field(info, "name"));
-    t.piece_length =
-        bencode::as_int(bencode::require_field(info, "piece length"));
-    const auto& pieces_blob =
-        bencode::as_string(bencode::require_field(info, "pieces"));
-    if (pieces_blob.size() % 20 != 0) {
-        throw std::runtime_error("Pieces field size is not a multiple of 20 bytes");
+    return t;
+}
+
+TorrentFile TorrentFile::from_info(std::string info_bencoded) {
+    TorrentFile t;
+    t.info_bencoded = std::move(info_bencoded);
+    bencode::Document doc(t.info_bencoded);
+    bencode::View info = doc.root();
+    t.name = std::string(info.require("name").as_string());
+    t.piece_length = info.require("piece length").as_int();
+    if (t.piece_length <= 0) {
+        throw std::runtime_error("piece length must be positive");
     }
-    size_t piece_count = pieces_blob.size() / 20;
-    t.piece_hashes.reserve(piece_count);
-    for (size_t i = 0; i < piece_count; ++i) {
-        std::array<uint8_t, 20> hash{};
-        std::copy_n(reinterpret_cast<const uint8_t*>(pieces_blob.data()) + i * 20,
-                    20, hash.data());
-        t.piece_hashes.push_back(hash);
+    bencode::View meta_version = info.find("meta version");
+    t.has_v2 = meta_version && meta_version.as_int() == 2;
+    bencode::View pieces_field = info.find("pieces");
+    t.has_v1 = static_cast<bool>(pieces_field);
+    if (!t.has_v1 && !t.has_v2) {
+        throw std::runtime_error("Missing required field: pieces");
+    }
+    if (t.has_v1) {
+        std::string_view pieces_blob = pieces_field.as_string();
+        if (pieces_blob.size() % 20 != 0) {
+            throw std::runtime_error("Pieces field size is not a multiple of 20 bytes");
+        }
+        size_t piece_count = pieces_blob.size() / 20;
+        t.piece_hashes.reserve(piece_count);
+        for (size_t i = 0; i < piece_count; ++i) {
+            std::array<uint8_t, 20> hash{};
+            std::copy_n(reinterpret_cast<const uint8_t*>(pieces_blob.data()) + i * 20,
+                        20, hash.data());
+            t.piece_hashes.push_back(hash);
+        }
+    }
+    if (bencode::View private_field = info.find("private")) {
+        t.is_private = private_field.is_int() && private_field.as_int() == 1;
     }
 
-    if (const auto* files_field = bencode::find_field(info, "files")) {
-        const auto& files_list = bencode::as_list(*files_field);
-        for (const auto& f_v : files_list) {
-            const auto& f_dict = bencode::as_dict(f_v);
-            int64_t length =
-                bencode::as_int(bencode::require_field(f_dict, "length"));
-            const auto& path_list =
-                bencode::as_list(bencode::require_field(f_dict, "path"));
-            t.files.push_back(FileEntry{length, join_path(path_list)});
+    if (t.has_v1) {
+        if (bencode::View files_list = info.find("files")) {
+            for (size_t i = 0; i < files_list.size(); ++i) {
+                bencode::View f_dict = files_list.at(i);
+                int64_t length = f_dict.require("length").as_int();
+                bencode::View path_list = f_dict.require("path");
+                FileEntry f;
+                f.length = length;
+                f.path = join_path(path_list);
+                f.pad = is_pad_entry(f_dict, f.path);
+                t.files.push_back(std::move(f));
+            }
+        }
+        else {
+            FileEntry f;
+            f.length = info.require("length").as_int();
+            f.path = t.name;
+            t.files.push_back(std::move(f));
         }
     }
-    else {
-        int64_t length = bencode::as_int(bencode::require_field(info, "length"));
-        t.files.push_back(FileEntry{length, std::filesystem::path(t.name)});
+
+    if (t.has_v2) {
+        if (t.piece_length < static_cast<int64_t>(kMerkleBlockSize) ||
+            (t.piece_length & (t.piece_length - 1)) != 0) {
+            throw std::runtime_error("v2 piece length must be a power of two >= 16 KiB");
+        }
+        std::vector<FileEntry> tree_files;
+        walk_file_tree(info.require("file tree"), {}, tree_files);
+        if (t.has_v1) {
+            // hybrid: the v1 list is authoritative for layout and already
+            // padded; take the roots from the tree by path
+            for (auto& f : t.files) {
+                if (f.pad) {
+                    continue;
+                }
+                auto it = std::find_if(tree_files.begin(), tree_files.end(),
+                                       [&f](const FileEntry& e) { return e.path == f.path; });
+                if (it == tree_files.end() || it->length != f.length) {
+                    throw std::runtime_error("hybrid torrent: v1 and v2 file lists differ at " +
+                                             f.path.string());
+                }
+                f.pieces_root = it->pieces_root;
+            }
+        } else {
+            // v2 pieces never span files; pad between them so piece indices
+            // match the v1 layout a hybrid would have
+            for (std::size_t i = 0; i < tree_files.size(); ++i) {
+                int64_t tail = tree_files[i].length % t.piece_length;
+                t.files.push_back(std::move(tree_files[i]));
+                if (tail != 0 && i + 1 < tree_files.size()) {
+                    FileEntry pad;
+                    pad.length = t.piece_length - tail;
+                    pad.path = std::filesystem::path(".pad") / std::to_string(i);
+                    pad.pad = true;
+                    t.files.push_back(std::move(pad));
+                }
+            }
+        }
+        SHA256(reinterpret_cast<const unsigned char*>(t.info_bencoded.data()),
+               t.info_bencoded.size(), t.info_hash_v2.data());
     }
 
-    SHA1(reinterpret_cast<const unsigned char*>(t.info_bencoded.data()),
-         t.info_bencoded.size(), t.info_hash.data());
+    int64_t offset = 0;
+    for (const auto& f : t.files) {
+        t.file_offsets.push_back(offset);
+        offset += f.length;
+    }
+
+    if (t.has_v1) {
+        SHA1(reinterpret_cast<const unsigned char*>(t.info_bencoded.data()),
+             t.info_bencoded.size(), t.info_hash.data());
+    } else {
+        std::copy_n(t.info_hash_v2.begin(), t.info_hash.size(), t.info_hash.begin());
+    }
 
     return t;
 }
@@ -126,4 +279,46 @@ int64_t TorrentFile::total_length() const {
         [](int64_t acc, const FileEntry& f) { return acc + f.length; });
 }
 
+std::size_t TorrentFile::piece_count() const {
+    if (has_v1) {
+        return piece_hashes.size();
+    }
+    return static_cast<std::size_t>((total_length() + piece_length - 1) / piece_length);
+}
+
 std::string TorrentFile::info_hash_hex() const { return to_hex(info_hash); }
+
+std::optional<TorrentFile::V2Piece> TorrentFile::v2_piece(uint32_t piece_index) const {
+    if (!has_v2) {
+        return std::nullopt;
+    }
+    int64_t start = static_cast<int64_t>(piece_index) * piece_length;
+    // the last file starting at or before the piece; empty files share
+    // their offset with the next one
+    auto it = std::upper_bound(file_offsets.begin(), file_offsets.end(), start);
+    if (it == file_offsets.begin()) {
+        return std::nullopt;
+    }
+    std::size_t idx = static_cast<std::size_t>(it - file_offsets.begin()) - 1;
+    const FileEntry& file = files[idx];
+    if (file.pad || file.length == 0 || (start - file_offsets[idx]) % piece_length != 0) {
+        return std::nullopt;
+    }
+    V2Piece out;
+    out.file = idx;
+    out.index_in_file = static_cast<uint32_t>((start - file_offsets[idx]) / piece_length);
+    out.data_length = static_cast<std::size_t>(
+        std::min<int64_t>(piece_length, file.length - (start - file_offsets[idx])));
+    if (file.length <= piece_length) {
+        // the whole file is one piece: its root is the piece hash
+        out.leaves = merkle_width((out.data_length + kMerkleBlockSize - 1) / kMerkleBlockSize);
+        out.hash = file.pieces_root;
+        return out;
+    }
+    if (out.index_in_file >= file.piece_layer.size()) {
+        return std::nullopt;
+    }
+    out.leaves = static_cast<std::size_t>(piece_length) / kMerkleBlockSize;
+    out.hash = file.piece_layer[out.index_in_file];
+    return out;
+}
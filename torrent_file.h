@@ -1,7 +1,10 @@
 // TorrentFile parses .torrent metadata and exposes key fields.
 #pragma once
 
+#include "merkle.h"
+
 #include <array>
+#include <cstdint>
 #include <filesystem>
 #include <optional>
 #include <string>
@@ -12,12 +15,38 @@ public:
     struct FileEntry {
         int64_t length{};
         std::filesystem::path path;
+        // BEP 47 padding: zeros that keep the next file piece-aligned, never
+        // stored on disk
+        bool pad{false};
+        // BEP 52: root of the file's merkle tree (zero when v1-only or empty)
+        // and, for files longer than a piece, one hash per piece
+        Sha256Hash pieces_root{};
+        std::vector<Sha256Hash> piece_layer;
+    };
+
+    // Where a v2 piece sits in its file and what its subtree must hash to.
+    struct V2Piece {
+        std::size_t file{0};
+        uint32_t index_in_file{0};
+        // file bytes in the piece; the rest is padding
+        std::size_t data_length{0};
+        // 16 KiB leaves under the piece hash
+        std::size_t leaves{0};
+        Sha256Hash hash{};
     };
 
     static TorrentFile load(const std::filesystem::path& path);
+    // Builds the info-derived fields (name, pieces, files, info hash) from a
+    // bencoded info dictionary; trackers and web seeds are left empty.
+    static TorrentFile from_info(std::string info_bencoded);
 
+    // Includes padding files: the byte space pieces are cut from.
     int64_t total_length() const;
+    std::size_t piece_count() const;
     std::string info_hash_hex() const;
+    // nullopt for v1-only torrents and for pieces whose file has no piece
+    // layer (a hybrid fetched over ut_metadata)
+    std::optional<V2Piece> v2_piece(uint32_t piece_index) const;
 
     std::optional<std::string> announce_url;
     std::vector<std::string> announce_list;
@@ -26,6 +55,16 @@ public:
     int64_t piece_length{};
     std::vector<std::array<uint8_t, 20>> piece_hashes;
     std::vector<FileEntry> files;
+    // byte offset of each file in the piece space
+    std::vector<int64_t> file_offsets;
+    // v1 SHA-1 of the info dictionary, or for v2-only torrents the SHA-256
+    // truncated to 20 bytes, as used on the wire, trackers and the DHT
     std::array<uint8_t, 20> info_hash{};
+    // BEP 52: meta version 2, alone or as a hybrid with the v1 fields
+    bool has_v1{true};
+    bool has_v2{false};
+    Sha256Hash info_hash_v2{};
+    // BEP 27: peers come from the trackers only, never the DHT
+    bool is_private{false};
     std::string info_bencoded;
 };
@@ -0,0 +1,526 @@
+#include "torrent_queue.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <exception>
+
+namespace {
+constexpr auto kRetryDelay = std::chrono::seconds(60);
+constexpr int kSessionTimeoutMs = 500;
+}
+
+TorrentQueue::TorrentQueue(std::string peer_id,
+                           uint16_t base_port,
+                           std::size_t block_size,
+                           std::filesystem::path download_path,
+                           Limits limits)
+    : peer_id_(std::move(peer_id)),
+      base_port_(base_port),
+      block_size_(block_size),
+      download_path_(std::move(download_path)),
+      limits_(limits) {
+    logger_.start();
+}
+
+TorrentQueue::~TorrentQueue() {
+    stop_all();
+    logger_.stop();
+}
+
+std::size_t TorrentQueue::add(TorrentFile torrent, AddOptions options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto e = std::make_unique<Entry>();
+    e->id = next_id_++;
+    e->torrent = std::move(torrent);
+    e->options = options;
+    e->port = static_cast<uint16_t>(base_port_ + e->id);
+    logger_.info("queued torrent " + std::to_string(e->id) + ": " + e->torrent.name);
+    entries_.push_back(std::move(e));
+    publish_snapshot(std::chrono::steady_clock::now());
+    return entries_.back()->id;
+}
+
+std::size_t TorrentQueue::add_magnet(MagnetLink magnet, AddOptions options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto e = std::make_unique<Entry>();
+    e->id = next_id_++;
+    e->options = options;
+    e->port = static_cast<uint16_t>(base_port_ + e->id);
+    attach_fetcher(*e, std::move(magnet));
+    logger_.info("queued magnet " + std::to_string(e->id) + ": " + e->torrent.name);
+    entries_.push_back(std::move(e));
+    publish_snapshot(std::chrono::steady_clock::now());
+    return entries_.back()->id;
+}
+
+bool TorrentQueue::remove(std::size_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(entries_.begin(), entries_.end(),
+                           [id](const auto& e) { return e->id == id; });
+    if (it == entries_.end()) {
+        return false;
+    }
+    stop_entry(**it);
+    entries_.erase(it);
+    publish_snapshot(std::chrono::steady_clock::now());
+    return true;
+}
+
+bool TorrentQueue::set_queue_position(std::size_t id, std::size_t position) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(entries_.begin(), entries_.end(),
+                           [id](const auto& e) { return e->id == id; });
+    if (it == entries_.end()) {
+        return false;
+    }
+    auto e = std::move(*it);
+    entries_.erase(it);
+    position = std::min(position, entries_.size());
+    entries_.insert(entries_.begin() + static_cast<std::ptrdiff_t>(position), std::move(e));
+    publish_snapshot(std::chrono::steady_clock::now());
+    return true;
+}
+
+bool TorrentQueue::pause(std::size_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry* e = find(id);
+    if (!e) {
+        return false;
+    }
+    e->paused = true;
+    stop_entry(*e);
+    publish_snapshot(std::chrono::steady_clock::now());
+    return true;
+}
+
+bool TorrentQueue::resume(std::size_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry* e = find(id);
+    if (!e) {
+        return false;
+    }
+    e->paused = false;
+    e->retry_after = {};
+    publish_snapshot(std::chrono::steady_clock::now());
+    return true;
+}
+
+void TorrentQueue::set_limits(const Limits& limits) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    limits_ = limits;
+}
+
+TorrentQueue::Limits TorrentQueue::limits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return limits_;
+}
+
+void TorrentQueue::tick() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = std::chrono::steady_clock::now();
+    for (auto& e : entries_) {
+        refresh(*e, now);
+    }
+    schedule_downloads(now);
+    schedule_seeds(now);
+    split_bandwidth();
+    publish_snapshot(now);
+}
+
+void TorrentQueue::stop_all() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& e : entries_) {
+        stop_entry(*e);
+    }
+}
+
+std::size_t TorrentQueue::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+bool TorrentQueue::all_complete() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::all_of(entries_.begin(), entries_.end(),
+                       [this](const auto& e) { return is_complete(*e); });
+}
+
+TorrentQueue::Entry* TorrentQueue::find(std::size_t id) {
+    auto it = std::find_if(entries_.begin(), entries_.end(),
+                           [id](const auto& e) { return e->id == id; });
+    return it == entries_.end() ? nullptr : it->get();
+}
+
+void TorrentQueue::publish_snapshot(std::chrono::steady_clock::time_point now) {
+    auto snap = std::make_shared<Snapshot>();
+    snap->reserve(entries_.size());
+    for (std::size_t i = 0; i < entries_.size(); ++i) {
+        const Entry& e = *entries_[i];
+        TorrentStatus st;
+        st.id = e.id;
+        st.position = i;
+        st.name = e.torrent.name;
+        st.info_hash = e.torrent.info_hash_hex();
+        st.pieces_total = e.torrent.piece_count();
+        st.size = e.torrent.total_length();
+        // the runner thread owns last_error until it has exited
+        if (!e.active || e.exited.load(std::memory_order_acquire)) {
+            st.error = e.last_error;
+        }
+        if (e.fetcher) {
+            st.peers = e.active ? e.fetcher->connected_peers() : 0;
+        }
+        if (e.session) {
+            st.pieces_done = e.session->pieces_done();
+            st.downloaded = e.session->bytes_downloaded();
+            st.uploaded = e.session->bytes_uploaded();
+            st.peers = e.active ? e.session->connected_peers() : 0;
+            st.swarm_seeds = e.session->swarm_seeds();
+        }
+        if (e.paused) {
+            st.state = "paused";
+        } else if (!e.active) {
+            st.state = e.last_error.empty() ? "queued" : "error";
+        } else if (e.fetcher) {
+            st.state = "metadata";
+        } else if (is_complete(e)) {
+            st.state = "seeding";
+        } else if (is_stalled(e, now)) {
+            st.state = "stalled";
+        } else {
+            st.state = "downloading";
+        }
+        snap->push_back(std::move(st));
+    }
+    std::atomic_store_explicit(&snapshot_, std::shared_ptr<const Snapshot>(std::move(snap)),
+                               std::memory_order_release);
+}
+
+bool TorrentQueue::is_complete(const Entry& e) const {
+    return e.session && e.session->is_complete();
+}
+
+bool TorrentQueue::is_stalled(const Entry& e, std::chrono::steady_clock::time_point now) const {
+    auto since = std::max(e.started_at, e.last_progress);
+    return now - since > limits_.stall_timeout;
+}
+
+double TorrentQueue::share_ratio(const Entry& e) const {
+    int64_t size = e.torrent.total_length();
+    if (!e.session || size <= 0) {
+        return 0.0;
+    }
+    return static_cast<double>(e.session->bytes_uploaded()) / static_cast<double>(size);
+}
+
+void TorrentQueue::refresh(Entry& e, std::chrono::steady_clock::time_point now) {
+    if (e.fetcher && e.fetcher->done()) {
+        finish_metadata(e, now);
+    }
+    if (!e.session) {
+        return;
+    }
+    std::uint64_t downloaded = e.session->bytes_downloaded();
+    if (downloaded != e.last_downloaded) {
+        e.last_downloaded = downloaded;
+        e.last_progress = now;
+    }
+    if (e.active && e.exited.load(std::memory_order_acquire)) {
+        stop_entry(e);
+        e.retry_after = now + kRetryDelay;
+        logger_.warn("torrent " + std::to_string(e.id) + " stopped: " + e.last_error);
+    }
+}
+
+// Downloads run in queue order. A stalled download keeps running but stops
+// holding a slot, and is parked once another torrent is waiting for one.
+void TorrentQueue::schedule_downloads(std::chrono::steady_clock::time_point now) {
+    std::size_t counted = 0;
+    for (auto& e : entries_) {
+        if (is_complete(*e) || !e->active || is_stalled(*e, now)) {
+            continue;
+        }
+        if (counted < limits_.active_downloads) {
+            ++counted;
+        } else {
+            stop_entry(*e);
+        }
+    }
+
+    for (auto& e : entries_) {
+        if (counted >= limits_.active_downloads) {
+            break;
+        }
+        if (is_complete(*e) || e->active || e->paused || now < e->retry_after) {
+            continue;
+        }
+        for (auto& other : entries_) {
+            if (other->active && !is_complete(*other) && is_stalled(*other, now)) {
+                logger_.info("parking stalled torrent " + std::to_string(other->id));
+                stop_entry(*other);
+                other->retry_after = now + limits_.stall_timeout;
+                break;
+            }
+        }
+        if (start_entry(*e)) {
+            ++counted;
+        }
+    }
+}
+
+// Seeds that the swarm needs most run first: lowest share ratio, then the
+// fewest seeds reported by the tracker.
+void TorrentQueue::schedule_seeds(std::chrono::steady_clock::time_point now) {
+    std::vector<Entry*> seeds;
+    for (auto& e : entries_) {
+        if (is_complete(*e) && !e->paused) {
+            seeds.push_back(e.get());
+        }
+    }
+    std::stable_sort(seeds.begin(), seeds.end(), [this](const Entry* a, const Entry* b) {
+        double ra = share_ratio(*a);
+        double rb = share_ratio(*b);
+        if (ra != rb) {
+            return ra < rb;
+        }
+        int64_t sa = std::max<int64_t>(a->session->swarm_seeds(), 0);
+        int64_t sb = std::max<int64_t>(b->session->swarm_seeds(), 0);
+        return sa < sb;
+    });
+
+    for (std::size_t i = 0; i < seeds.size(); ++i) {
+        Entry& e = *seeds[i];
+        if (i >= limits_.active_seeds) {
+            stop_entry(e);
+        } else if (!e.active && now >= e.retry_after) {
+            start_entry(e);
+        }
+    }
+}
+
+// Every running torrent gets an equal share of each process-wide rate, so
+// none starves the others; seeds take no download share.
+void TorrentQueue::split_bandwidth() {
+    uint64_t downloading = 0;
+    uint64_t running = 0;
+    for (const auto& e : entries_) {
+        if (e->active && e->session) {
+            ++running;
+            if (!is_complete(*e)) {
+                ++downloading;
+            }
+        }
+    }
+    // a share must not round down to zero, which would lift the cap
+    auto share = [](uint64_t rate, uint64_t n) {
+        return rate == 0 || n == 0 ? rate : std::max<uint64_t>(rate / n, 1);
+    };
+    for (auto& e : entries_) {
+        e->download_share->set_rate(share(limits_.download_rate, downloading));
+        e->upload_share->set_rate(share(limits_.upload_rate, running));
+    }
+}
+
+bool TorrentQueue::ensure_session(Entry& e) {
+    if (e.session) {
+        return true;
+    }
+    try {
+        e.session = std::make_unique<Session>(e.torrent, peer_id_, e.port, block_size_,
+                                              download_path_);
+        e.session->set_super_seeding(e.options.super_seed);
+        e.session->set_alert_queue(alerts_);
+        e.session->set_dht(dht_);
+        e.session->set_lsd(lsd_);
+        if (e.options.ip_filter) {
+            e.session->set_ip_filter(e.options.ip_filter);
+        }
+        if (e.options.topology) {
+            e.session->set_topology(e.options.topology, e.options.cross_rack_limiter);
+        }
+        e.session->set_rate_shares(e.download_share, e.upload_share);
+        for (const auto& address : e.initial_peers) {
+            e.session->add_peer(address);
+        }
+        e.initial_peers.clear();
+    } catch (const std::exception& ex) {
+        logger_.error("failed to create session for torrent " + std::to_string(e.id) + ": " +
+                      ex.what());
+        e.retry_after = std::chrono::steady_clock::now() + kRetryDelay;
+        return false;
+    }
+    return true;
+}
+
+void TorrentQueue::attach_fetcher(Entry& e, MagnetLink magnet) {
+    e.torrent = TorrentFile{};
+    e.torrent.info_hash = magnet.info_hash;
+    e.torrent.name = magnet.display_name.empty() ? magnet.info_hash_hex() : magnet.display_name;
+    e.fetcher = std::make_unique<MetadataFetcher>(std::move(magnet), peer_id_, e.port);
+}
+
+// Swaps the stand-in for the fetched torrent; a fetch that held a slot goes
+// straight on to download.
+void TorrentQueue::finish_metadata(Entry& e, std::chrono::steady_clock::time_point now) {
+    bool was_active = e.active;
+    e.fetcher->stop();
+    e.torrent = e.fetcher->result();
+    e.initial_peers = e.fetcher->swarm_peers();
+    e.fetcher.reset();
+    e.active = false;
+    e.last_progress = now;
+    logger_.info("got metadata for torrent " + std::to_string(e.id) + ": " + e.torrent.name);
+    if (was_active) {
+        start_entry(e);
+    }
+}
+
+void TorrentQueue::export_handoff(HandoffSnapshot& out, std::vector<int>& fds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out.peer_id = peer_id_;
+    for (auto& e : entries_) {
+        HandoffTorrent t;
+        t.id = e->id;
+        t.port = e->port;
+        t.active = e->active;
+        t.paused = e->paused;
+        t.super_seed = e->options.super_seed;
+        t.info_bencoded = e->torrent.info_bencoded;
+        t.announce_url = e->torrent.announce_url;
+        t.announce_list = e->torrent.announce_list;
+        t.web_seeds = e->torrent.web_seeds;
+        if (e->fetcher) {
+            // the successor starts the fetch over from the link
+            t.magnet = e->fetcher->magnet().uri;
+            stop_entry(*e);
+        }
+        if (e->active) {
+            // like stop_entry, minus the pause that would drop every peer
+            e->stop_requested.store(true);
+            e->session->stop();
+            if (e->runner.joinable()) {
+                e->runner.join();
+            }
+            e->active = false;
+        }
+        if (e->session) {
+            e->session->export_handoff(t, fds);
+        }
+        out.torrents.push_back(std::move(t));
+    }
+    entries_.clear();
+    publish_snapshot(std::chrono::steady_clock::now());
+    logger_.info("exported " + std::to_string(out.torrents.size()) + " torrents and " +
+                 std::to_string(fds.size()) + " sockets for hot restart");
+}
+
+void TorrentQueue::import_handoff(HandoffSnapshot& in, const AddOptions& options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& t : in.torrents) {
+        auto e = std::make_unique<Entry>();
+        e->id = static_cast<std::size_t>(t.id);
+        e->port = t.port;
+        if (!t.magnet.empty()) {
+            attach_fetcher(*e, MagnetLink::parse(t.magnet));
+        } else {
+            e->torrent = TorrentFile::from_info(std::move(t.info_bencoded));
+            e->torrent.announce_url = std::move(t.announce_url);
+            e->torrent.announce_list = std::move(t.announce_list);
+            e->torrent.web_seeds = std::move(t.web_seeds);
+        }
+        e->options = options;
+        e->options.super_seed = t.super_seed;
+        e->paused = t.paused;
+        // resume data replaces a recheck
+        e->rechecked = true;
+        next_id_ = std::max(next_id_, e->id + 1);
+        if (t.has_session && ensure_session(*e)) {
+            e->session->adopt_handoff(t);
+        }
+        if (t.active && (e->session || e->fetcher)) {
+            start_entry(*e);
+        }
+        // sockets nobody adopted (session creation failed) must not leak
+        if (t.listen_fd >= 0) {
+            ::close(t.listen_fd);
+        }
+        for (const auto& hp : t.peers) {
+            if (hp.peer.fd >= 0) {
+                ::close(hp.peer.fd);
+            }
+        }
+        logger_.info("took over torrent " + std::to_string(e->id) + ": " + e->torrent.name);
+        entries_.push_back(std::move(e));
+    }
+    publish_snapshot(std::chrono::steady_clock::now());
+}
+
+bool TorrentQueue::start_entry(Entry& e) {
+    if (e.active) {
+        return true;
+    }
+    if (e.fetcher) {
+        e.fetcher->set_dht(dht_);
+        e.fetcher->set_lsd(lsd_);
+        e.fetcher->set_ip_filter(e.options.ip_filter);
+        e.fetcher->start();
+        e.exited.store(false);
+        e.last_error.clear();
+        e.active = true;
+        e.started_at = std::chrono::steady_clock::now();
+        logger_.info("fetching metadata for torrent " + std::to_string(e.id) + ": " +
+                     e.torrent.name);
+        return true;
+    }
+    if (!ensure_session(e)) {
+        return false;
+    }
+
+    bool recheck = e.options.recheck && !e.rechecked;
+    e.rechecked = true;
+    e.stop_requested.store(false);
+    e.exited.store(false);
+    e.last_error.clear();
+    e.active = true;
+    e.started_at = std::chrono::steady_clock::now();
+    Session* session = e.session.get();
+    Entry* entry = &e;
+    e.runner = std::thread([session, entry, recheck] {
+        try {
+            if (recheck) {
+                session->recheck_existing_data();
+            }
+            session->start();
+            // stop() may have landed before start() re-armed the session
+            if (!entry->stop_requested.load()) {
+                session->run(kSessionTimeoutMs);
+            }
+        } catch (const std::exception& ex) {
+            entry->last_error = ex.what();
+        }
+        entry->exited.store(true, std::memory_order_release);
+    });
+    logger_.info("started torrent " + std::to_string(e.id) + ": " + e.torrent.name);
+    return true;
+}
+
+void TorrentQueue::stop_entry(Entry& e) {
+    if (!e.active) {
+        return;
+    }
+    if (e.fetcher) {
+        e.fetcher->stop();
+        e.active = false;
+        logger_.info("stopped metadata fetch for torrent " + std::to_string(e.id));
+        return;
+    }
+    e.stop_requested.store(true);
+    e.session->stop();
+    if (e.runner.joinable()) {
+        e.runner.join();
+    }
+    e.session->pause();
+    e.active = false;
+    logger_.info("stopped torrent " + std::to_string(e.id) + ": " + e.torrent.name);
+}
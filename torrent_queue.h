@@ -0,0 +1,169 @@
+// TorrentQueue holds many torrents and only runs a bounded number at a time.
+#pragma once
+
+#include "handoff.h"
+#include "logger.h"
+#include "magnet.h"
+#include "metadata_fetcher.h"
+#include "session.h"
+#include "torrent_file.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TorrentQueue {
+public:
+    struct Limits {
+        std::size_t active_downloads{3};
+        std::size_t active_seeds{5};
+        // a download without progress for this long no longer holds a slot
+        std::chrono::seconds stall_timeout{120};
+        // bytes per second for the whole process, 0 for no cap; each tick
+        // splits them evenly over the torrents that can use them
+        uint64_t download_rate{0};
+        uint64_t upload_rate{0};
+    };
+
+    struct AddOptions {
+        bool recheck{false};
+        bool super_seed{false};
+        std::shared_ptr<SharedIpFilter> ip_filter;
+        std::shared_ptr<const Topology> topology;
+        // one bucket for every torrent; null means no cap
+        std::shared_ptr<SharedRateLimiter> cross_rack_limiter;
+    };
+
+    // Point-in-time view of one torrent, for RPC and status output.
+    struct TorrentStatus {
+        std::size_t id{};
+        std::size_t position{};
+        std::string name;
+        std::string info_hash;
+        // queued, metadata, downloading, seeding, paused, stalled or error
+        std::string state;
+        std::size_t pieces_done{0};
+        std::size_t pieces_total{0};
+        int64_t size{0};
+        std::uint64_t downloaded{0};
+        std::uint64_t uploaded{0};
+        std::size_t peers{0};
+        int64_t swarm_seeds{-1};
+        std::string error;
+    };
+    using Snapshot = std::vector<TorrentStatus>;
+
+    TorrentQueue(std::string peer_id,
+                 uint16_t base_port,
+                 std::size_t block_size,
+                 std::filesystem::path download_path,
+                 Limits limits);
+    ~TorrentQueue();
+
+    TorrentQueue(const TorrentQueue&) = delete;
+    TorrentQueue& operator=(const TorrentQueue&) = delete;
+
+    std::size_t add(TorrentFile torrent, AddOptions options);
+    // Queues a magnet link like a download; while it holds a slot its info
+    // dictionary is fetched from peers, then it runs as a normal torrent.
+    std::size_t add_magnet(MagnetLink magnet, AddOptions options);
+    bool remove(std::size_t id);
+    bool set_queue_position(std::size_t id, std::size_t position);
+    // Paused torrents keep their queue position but are never scheduled.
+    bool pause(std::size_t id);
+    bool resume(std::size_t id);
+    void set_limits(const Limits& limits);
+    Limits limits() const;
+    // Sessions created after this post alerts here; must outlive the queue.
+    void set_alert_queue(AlertQueue* alerts) { alerts_ = alerts; }
+    // Sessions created after this use the DHT node; must outlive the queue.
+    void set_dht(Dht* dht) { dht_ = dht; }
+    // Likewise for local service discovery.
+    void set_lsd(Lsd* lsd) { lsd_ = lsd; }
+
+    // Hot restart. Export stops every session without dropping its peers,
+    // moves them into the snapshot and leaves the queue empty. Import
+    // rebuilds the queue from a snapshot (ids and ports kept) and resumes
+    // torrents that were running; options fill in what the snapshot lacks.
+    void export_handoff(HandoffSnapshot& out, std::vector<int>& fds);
+    void import_handoff(HandoffSnapshot& in, const AddOptions& options);
+
+    const std::string& peer_id() const { return peer_id_; }
+
+    // Re-evaluates which torrents should run and starts/stops them.
+    void tick();
+    void stop_all();
+
+    std::size_t size() const;
+    bool all_complete() const;
+
+    // The view published by the last tick or queue change. Never takes the
+    // queue lock, so it stays cheap while a tick is starting or joining
+    // sessions.
+    std::shared_ptr<const Snapshot> snapshot() const {
+        return std::atomic_load_explicit(&snapshot_, std::memory_order_acquire);
+    }
+
+private:
+    struct Entry {
+        std::size_t id{};
+        TorrentFile torrent;
+        AddOptions options;
+        uint16_t port{};
+        std::unique_ptr<Session> session;
+        // set until a magnet's metadata arrives; torrent is a stand-in then
+        std::unique_ptr<MetadataFetcher> fetcher;
+        // handed to the session when it is created
+        std::vector<PeerAddress> initial_peers;
+        std::thread runner;
+        std::atomic<bool> stop_requested{false};
+        std::atomic<bool> exited{false};
+        std::string last_error;
+        bool active{false};
+        bool paused{false};
+        bool rechecked{false};
+        std::chrono::steady_clock::time_point started_at{};
+        std::chrono::steady_clock::time_point last_progress{};
+        std::chrono::steady_clock::time_point retry_after{};
+        std::uint64_t last_downloaded{0};
+        // this torrent's share of Limits::download_rate and upload_rate
+        std::shared_ptr<SharedRateLimiter> download_share =
+            std::make_shared<SharedRateLimiter>(0);
+        std::shared_ptr<SharedRateLimiter> upload_share = std::make_shared<SharedRateLimiter>(0);
+    };
+
+    bool is_complete(const Entry& e) const;
+    bool is_stalled(const Entry& e, std::chrono::steady_clock::time_point now) const;
+    double share_ratio(const Entry& e) const;
+    void refresh(Entry& e, std::chrono::steady_clock::time_point now);
+    void schedule_downloads(std::chrono::steady_clock::time_point now);
+    void schedule_seeds(std::chrono::steady_clock::time_point now);
+    void split_bandwidth();
+    bool ensure_session(Entry& e);
+    void attach_fetcher(Entry& e, MagnetLink magnet);
+    void finish_metadata(Entry& e, std::chrono::steady_clock::time_point now);
+    bool start_entry(Entry& e);
+    void stop_entry(Entry& e);
+    Entry* find(std::size_t id);
+    void publish_snapshot(std::chrono::steady_clock::time_point now);
+
+    std::string peer_id_;
+    uint16_t base_port_;
+    std::size_t block_size_;
+    std::filesystem::path download_path_;
+    Limits limits_;
+    AlertQueue* alerts_{nullptr};
+    Dht* dht_{nullptr};
+    Lsd* lsd_{nullptr};
+    std::vector<std::unique_ptr<Entry>> entries_;
+    std::size_t next_id_{0};
+    mutable std::mutex mutex_;
+    std::shared_ptr<const Snapshot> snapshot_ = std::make_shared<const Snapshot>();
+    AsyncLogger logger_;
+};
@@ -12,6 +12,7 @@
 #include <cstring>
 #include <limits>
 #include <memory>
+#include <optional>
 #include <netdb.h>
 #include <poll.h>
 #include <random>
@@ -20,7 +21,6 @@
 #include <string_view>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <variant>
 
 static std::string url_encode(std::string_view data) {
     static const char hex[] = "0123456789ABCDEF";
@@ -62,28 +62,24 @@ static std::string build_query(const TorrentFile& torrent,
     return oss.str();
 }
 
-static std::vector<PeerEndpoint> parse_compact_peers_bytes(const char* raw, std::size_t len) {
-    if (len % 6 != 0) {
+// 6-byte IPv4 or 18-byte IPv6 entries, address then port, both big-endian.
+static void parse_compact_peers_bytes(const uint8_t* raw, std::size_t len, std::size_t width,
+                                      std::vector<Endpoint>& out) {
+    if (len % width != 0) {
         throw std::runtime_error("Invalid peers compact string length");
     }
-    std::vector<PeerEndpoint> peers;
-    peers.reserve(len / 6);
-    for (std::size_t i = 0; i < len; i += 6) {
-        PeerEndpoint p{};
-        char ip_str[INET_ADDRSTRLEN] = {0};
-        const unsigned char* data = reinterpret_cast<const unsigned char*>(raw + i);
-        if (!inet_ntop(AF_INET, data, ip_str, sizeof(ip_str))) {
-            throw std::runtime_error("failed to parse IPv4 in tracker response");
-        }
-        p.ip = ip_str;
-        p.port = static_cast<uint16_t>(data[4] << 8 | data[5]);
-        peers.push_back(std::move(p));
+    out.reserve(out.size() + len / width);
+    for (std::size_t i = 0; i < len; i += width) {
+        const uint8_t* data = raw + i;
+        uint16_t port = static_cast<uint16_t>(data[width - 2] << 8 | data[width - 1]);
+        out.push_back(width == 6 ? Endpoint::from_v4(data, port) : Endpoint::from_v6(data, port));
     }
-    return peers;
 }
 
-static std::vector<PeerEndpoint> parse_compact_peers(const std::string& peers_blob) {
-    return parse_compact_peers_bytes(peers_blob.data(), peers_blob.size());
+static void parse_compact_peers(std::string_view peers_blob, std::size_t width,
+                                std::vector<Endpoint>& out) {
+    parse_compact_peers_bytes(reinterpret_cast<const uint8_t*>(peers_blob.data()),
+                              peers_blob.size(), width, out);
 }
 
 static std::string lowercase_copy(const std::string& value) {
@@ -272,7 +268,10 @@ static uint64_t udp_tracker_connect(int sock) {
     throw std::runtime_error("UDP tracker connect timed out");
 }
 
+// BEP 15: the peer list is 18-byte IPv6 entries when the tracker was
+// reached over IPv6, 6-byte IPv4 entries otherwise.
 static AnnounceResponse udp_tracker_announce(int sock,
+                                             int family,
                                              uint64_t connection_id,
                                              const TorrentFile& torrent,
                                              const std::string& peer_id,
@@ -345,8 +344,8 @@ static AnnounceResponse udp_tracker_announce(int sock,
         out.incomplete = static_cast<int64_t>(read_be32(resp.data() + 12));
         out.complete = static_cast<int64_t>(read_be32(resp.data() + 16));
         size_t peers_len = static_cast<size_t>(n - 20);
-        out.peers = parse_compact_peers_bytes(
-            reinterpret_cast<const char*>(resp.data() + 20), peers_len);
+        parse_compact_peers_bytes(resp.data() + 20, peers_len, family == AF_INET6 ? 18 : 6,
+                                  out.peers);
         return out;
     }
     throw std::runtime_error("UDP tracker announce timed out");
@@ -392,35 +391,80 @@ AnnounceResponse TrackerClient::announce_http(const std::string& announce_url,
         throw std::runtime_error("Tracker returned non-200 status: " + http_resp.status_line);
     }
 
-    bencode::Parser parser(http_resp.body);
-    bencode::Value root_v = parser.parse();
-    const auto& dict = bencode::as_dict(root_v);
-    if (const auto* failure = bencode::find_field(dict, "failure reason")) {
-        throw std::runtime_error("Tracker failure: " + bencode::as_string(*failure));
-    }
-
+    // one pass over the body, reading the keys we use in place
     AnnounceResponse resp;
-    resp.interval = static_cast<int>(bencode::as_int(bencode::require_field(dict, "interval")));
-    if (const auto* c = bencode::find_field(dict, "complete")) {
-        resp.complete = bencode::as_int(*c);
+    std::optional<int64_t> interval;
+    bool have_peers = false;
+    bencode::Reader reader(http_resp.body);
+    if (!reader.enter_dict()) {
+        throw std::runtime_error("Value is not a dict");
     }
-    if (const auto* inc = bencode::find_field(dict, "incomplete")) {
-        resp.incomplete = bencode::as_int(*inc);
-    }
-
-    const bencode::Value& peers_v = bencode::require_field(dict, "peers");
-    if (std::holds_alternative<std::string>(peers_v.data)) {
-        resp.peers = parse_compact_peers(std::get<std::string>(peers_v.data));
-    } else {
-        const auto& peer_list = bencode::as_list(peers_v);
-        for (const auto& v : peer_list) {
-            const auto& d = bencode::as_dict(v);
-            PeerEndpoint p;
-            p.ip = bencode::as_string(bencode::require_field(d, "ip"));
-            p.port = static_cast<uint16_t>(bencode::as_int(bencode::require_field(d, "port")));
-            resp.peers.push_back(std::move(p));
+    std::string_view key;
+    while (reader.next_key(key)) {
+        if (key == "failure reason") {
+            auto failure = reader.read_string();
+            throw std::runtime_error("Tracker failure: " + std::string(failure.value_or("")));
+        } else if (key == "interval") {
+            interval = reader.read_int();
+        } else if (key == "complete") {
+            resp.complete = reader.read_int().value_or(resp.complete);
+        } else if (key == "incomplete") {
+            resp.incomplete = reader.read_int().value_or(resp.incomplete);
+        } else if (key == "peers6") {
+            if (auto blob = reader.read_string()) {
+                parse_compact_peers(*blob, 18, resp.peers);
+                have_peers = true;
+            }
+        } else if (key == "peers") {
+            auto t = reader.next_value();
+            if (t == bencode::Reader::Token::String) {
+                parse_compact_peers(reader.string(), 6, resp.peers);
+                have_peers = true;
+            } else if (t == bencode::Reader::Token::List) {
+                // BEP 3 dictionary form: ip is an IPv4/IPv6 literal or a hostname
+                have_peers = true;
+                while (reader.next_item()) {
+                    if (!reader.enter_dict()) {
+                        continue;
+                    }
+                    std::optional<std::string_view> ip;
+                    std::optional<int64_t> port;
+                    std::string_view peer_key;
+                    while (reader.next_key(peer_key)) {
+                        if (peer_key == "ip") {
+                            ip = reader.read_string();
+                        } else if (peer_key == "port") {
+                            port = reader.read_int();
+                        } else {
+                            reader.skip();
+                        }
+                    }
+                    if (!ip || !port) {
+                        throw std::runtime_error("Missing required field: " +
+                                                 std::string(ip ? "port" : "ip"));
+                    }
+                    std::string host(*ip);
+                    auto peer_port = static_cast<uint16_t>(*port);
+                    if (auto ep = Endpoint::parse(host.c_str(), peer_port)) {
+                        resp.peers.push_back(*ep);
+                    } else {
+                        resp.named_peers.push_back(PeerEndpoint{std::move(host), peer_port});
+                    }
+                }
+            } else {
+                reader.skip(t);
+            }
+        } else {
+            reader.skip();
         }
     }
+    if (!interval) {
+        throw std::runtime_error("Missing required field: interval");
+    }
+    resp.interval = static_cast<int>(*interval);
+    if (!have_peers) {
+        throw std::runtime_error("Tracker response has neither peers nor peers6");
+    }
 
     return resp;
 }
@@ -458,6 +502,7 @@ AnnounceResponse TrackerClient::announce_udp(const std::string& announce_url,
         try {
             uint64_t connection_id = udp_tracker_connect(sock);
             AnnounceResponse resp = udp_tracker_announce(sock,
+                                                         ai->ai_family,
                                                          connection_id,
                                                          torrent,
                                                          peer_id_,
@@ -1,12 +1,14 @@
 // Minimal HTTP tracker client for BitTorrent announce requests.
 #pragma once
 
+#include "endpoint.h"
 #include "torrent_file.h"
 
 #include <cstdint>
 #include <string>
 #include <vector>
 
+// A non-compact peer entry whose "ip" is a hostname rather than an address.
 struct PeerEndpoint {
     std::string ip;
     uint16_t port{};
@@ -16,7 +18,9 @@ struct AnnounceResponse {
     int interval{};
     int64_t complete{};
     int64_t incomplete{};
-    std::vector<PeerEndpoint> peers;
+    // peers and peers6 (BEP 7), or the UDP reply for the tracker's family
+    std::vector<Endpoint> peers;
+    std::vector<PeerEndpoint> named_peers;
 };
 
 class TrackerClient {
@@ -0,0 +1,184 @@
+#include "web_seed.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+std::string percent_encode(const std::string& s) {
+    static constexpr char kHexDigits[] = "0123456789ABCDEF";
+    std::string out;
+    for (unsigned char c : s) {
+        if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            out.push_back(static_cast<char>(c));
+        } else {
+            out.push_back('%');
+            out.push_back(kHexDigits[c >> 4]);
+            out.push_back(kHexDigits[c & 0x0F]);
+        }
+    }
+    return out;
+}
+
+} // namespace
+
+// BEP 19: a single-file URL not ending in '/' names the file itself;
+// otherwise the torrent name, and for multi-file torrents each path, are
+// appended.
+WebSeed::WebSeed(const TorrentFile& torrent, std::string url, std::function<void()> wake)
+    : torrent_(torrent), url_(std::move(url)), base_(parse_http_url(url_)),
+      wake_(std::move(wake)) {
+    bool single = torrent_.files.size() == 1 && torrent_.files[0].path == torrent_.name;
+    std::string dir = base_.path;
+    if (dir.empty() || dir.back() != '/') {
+        dir += '/';
+    }
+    for (const auto& file : torrent_.files) {
+        if (file.pad) {
+            paths_.emplace_back();
+        } else if (single) {
+            paths_.push_back(base_.path.back() == '/' ? dir + percent_encode(torrent_.name)
+                                                      : base_.path);
+        } else {
+            std::string path = dir + percent_encode(torrent_.name);
+            for (const auto& part : file.path) {
+                path += '/' + percent_encode(part.string());
+            }
+            paths_.push_back(std::move(path));
+        }
+    }
+}
+
+WebSeed::~WebSeed() { stop(); }
+
+void WebSeed::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = true;
+}
+
+// May run on another thread than the loop; what the workers finished is
+// still there to poll.
+void WebSeed::stop() {
+    std::vector<std::thread> workers;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+        jobs_.clear();
+        workers.swap(workers_);
+    }
+    cv_.notify_all();
+    for (auto& t : workers) {
+        t.join();
+    }
+}
+
+bool WebSeed::wants_piece(Clock::time_point now) const {
+    return assigned_.size() < concurrency_ && now >= retry_at_;
+}
+
+void WebSeed::assign(uint32_t piece_index) {
+    assigned_.push_back(piece_index);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(piece_index);
+        // one connection per piece in flight, opened as the window grows
+        if (running_ && workers_.size() < assigned_.size()) {
+            workers_.emplace_back([this]() { worker(); });
+        }
+    }
+    cv_.notify_one();
+}
+
+std::optional<WebSeed::Result> WebSeed::poll(Clock::time_point now) {
+    auto result = results_.dequeue();
+    if (result) {
+        auto it = std::find(assigned_.begin(), assigned_.end(), result->piece_index);
+        if (it != assigned_.end()) {
+            assigned_.erase(it);
+        }
+        if (result->data.empty()) {
+            // back off, and come back with half the connections
+            concurrency_ = std::max<std::size_t>(1, concurrency_ / 2);
+            auto backoff = kMinBackoff * (1 << std::min<std::size_t>(failures_, 6));
+            retry_at_ = now + std::min<Clock::duration>(backoff, kMaxBackoff);
+            ++failures_;
+        } else {
+            failures_ = 0;
+            window_bytes_ += result->data.size();
+        }
+    }
+    adapt(now);
+    return result;
+}
+
+// Additive steps each window: one more connection while the last one paid
+// off, one fewer once the rate falls.
+void WebSeed::adapt(Clock::time_point now) {
+    if (window_start_.time_since_epoch().count() == 0) {
+        window_start_ = now;
+        return;
+    }
+    if (now - window_start_ < kAdaptWindow) {
+        return;
+    }
+    double secs = std::chrono::duration<double>(now - window_start_).count();
+    double rate = static_cast<double>(window_bytes_) / secs;
+    if (rate > last_rate_ * 1.1 && concurrency_ < kMaxConnections) {
+        ++concurrency_;
+    } else if (rate < last_rate_ * 0.8 && concurrency_ > 1) {
+        --concurrency_;
+    }
+    last_rate_ = rate;
+    window_start_ = now;
+    window_bytes_ = 0;
+}
+
+void WebSeed::worker() {
+    HttpConnection conn(base_, kTimeoutMs);
+    for (;;) {
+        uint32_t piece_index = 0;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return !running_ || !jobs_.empty(); });
+            if (!running_) {
+                return;
+            }
+            piece_index = jobs_.front();
+            jobs_.pop_front();
+        }
+        Result result;
+        result.piece_index = piece_index;
+        try {
+            result.data = fetch(conn, piece_index);
+        } catch (const std::exception& ex) {
+            result.error = ex.what();
+        }
+        results_.enqueue(std::move(result));
+        wake_();
+    }
+}
+
+// One ranged GET per file the piece touches; padding stays zero.
+std::vector<uint8_t> WebSeed::fetch(HttpConnection& conn, uint32_t piece_index) {
+    int64_t start = static_cast<int64_t>(piece_index) * torrent_.piece_length;
+    int64_t end = std::min(start + torrent_.piece_length, torrent_.total_length());
+    std::vector<uint8_t> data(static_cast<std::size_t>(end - start));
+    auto it = std::upper_bound(torrent_.file_offsets.begin(), torrent_.file_offsets.end(), start);
+    std::size_t file = static_cast<std::size_t>(it - torrent_.file_offsets.begin()) - 1;
+    for (int64_t pos = start; pos < end; ++file) {
+        int64_t file_start = torrent_.file_offsets[file];
+        int64_t file_end = file_start + torrent_.files[file].length;
+        int64_t take = std::min(end, file_end) - pos;
+        if (take <= 0) {
+            continue;
+        }
+        if (!paths_[file].empty()) {
+            conn.get_range(paths_[file], static_cast<uint64_t>(pos - file_start),
+                           static_cast<std::size_t>(take), data.data() + (pos - start));
+        }
+        pos += take;
+    }
+    return data;
+}
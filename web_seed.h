@@ -0,0 +1,93 @@
+// WebSeed downloads whole pieces from one BEP 19 url-list entry over HTTP ranges.
+#pragma once
+
+#include "http_client.h"
+#include "include/mpsc.h"
+#include "torrent_file.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The session hands pieces out through the picker like it does to peers;
+// worker threads, each with its own kept-alive connection, fetch them and
+// post the bytes back, then wake the loop. The pieces in flight, and so
+// the connections, grow while that raises throughput and shrink when it
+// stops doing so or the server fails. All but the workers runs on the
+// session's loop thread.
+class WebSeed {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Result {
+        uint32_t piece_index{0};
+        // the whole piece, padding zero-filled; empty when the fetch failed
+        std::vector<uint8_t> data;
+        std::string error;
+    };
+
+    // Throws when url is not an http(s) URL.
+    WebSeed(const TorrentFile& torrent, std::string url, std::function<void()> wake);
+    ~WebSeed();
+
+    WebSeed(const WebSeed&) = delete;
+    WebSeed& operator=(const WebSeed&) = delete;
+
+    const std::string& url() const { return url_; }
+    void start();
+    // Joins the workers. Pieces they never got to stay in assigned() for
+    // the caller to hand back.
+    void stop();
+
+    // Room for another piece, and not backing off after an error.
+    bool wants_piece(Clock::time_point now) const;
+    void assign(uint32_t piece_index);
+    std::optional<Result> poll(Clock::time_point now);
+    const std::vector<uint32_t>& assigned() const { return assigned_; }
+    void clear_assigned() { assigned_.clear(); }
+    std::size_t concurrency() const { return concurrency_; }
+
+    static constexpr std::size_t kMaxConnections = 8;
+
+private:
+    void worker();
+    std::vector<uint8_t> fetch(HttpConnection& conn, uint32_t piece_index);
+    void adapt(Clock::time_point now);
+
+    static constexpr int kTimeoutMs = 15000;
+    static constexpr std::chrono::seconds kAdaptWindow{4};
+    static constexpr std::chrono::seconds kMinBackoff{5};
+    static constexpr std::chrono::seconds kMaxBackoff{300};
+
+    const TorrentFile& torrent_;
+    std::string url_;
+    HttpUrl base_;
+    // request path of each file; empty for padding
+    std::vector<std::string> paths_;
+    std::function<void()> wake_;
+
+    // loop thread
+    std::vector<uint32_t> assigned_;
+    std::size_t concurrency_{1};
+    std::size_t failures_{0};
+    Clock::time_point retry_at_{};
+    Clock::time_point window_start_{};
+    uint64_t window_bytes_{0};
+    double last_rate_{0};
+
+    // shared with the workers
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<uint32_t> jobs_;
+    bool running_{false};
+    std::vector<std::thread> workers_;
+    // never fuller than the pieces in flight
+    MpscQueue<Result, 16> results_;
+};